@@ -0,0 +1,635 @@
+// (c) Electronic Arts. All Rights Reserved.
+
+#include "EACopyClient.h"
+#include <atomic>
+#include <memory>
+#include <new>
+#include <stdarg.h>
+#include <stdlib.h>
+#if defined(_WIN32)
+#include "EACopyServer.h"
+#else
+#include <algorithm>
+#endif
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Allocation tracking. Every allocation in the process is counted so a hot path that starts allocating shows up
+
+static std::atomic<unsigned long long> g_allocationCount;
+static std::atomic<unsigned long long> g_allocationBytes;
+
+void* operator new(size_t size)
+{
+	g_allocationCount.fetch_add(1, std::memory_order_relaxed);
+	g_allocationBytes.fetch_add(size, std::memory_order_relaxed);
+	if (void* p = malloc(size ? size : 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+void* operator new[](size_t size) { return operator new(size); }
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+
+namespace eacopy
+{
+
+inline int wtoi(const wchar_t *str) { return (int)wcstol(str, 0, 10); }
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Local directory where source trees are generated
+WString g_benchSourceDir;
+
+// Local directory used as destination for local copy benchmarks
+WString g_benchDestDir;
+
+// Destination used for server benchmarks. Should be a network share on the local machine. No server benchmarks if empty
+WString g_benchServerDestDir;
+
+// Number of timed runs per benchmark. Fastest run is reported together with all run times
+uint g_benchRunCount = 3;
+
+// Only benchmarks with names containing this are run
+WString g_benchFilter;
+
+// Free text written to the json (commit hash, machine name etc)
+WString g_benchLabel;
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// BenchServer
+// Runs the Server on another thread so the Client can run on main thread
+
+#if defined(_WIN32)
+class BenchServer
+{
+public:
+	BenchServer(const ServerSettings& settings, Log& log)
+	:	m_settings(settings)
+	,	m_log(log)
+	,	m_serverThread([this]() { m_server.start(m_settings, m_log, false, [this](uint state, uint exitCode, uint waitHint) { m_isServerReady = state == SERVICE_RUNNING; m_failed = exitCode != NO_ERROR; return true; }); m_threadExited = true; return 0; })
+	{
+	}
+
+	~BenchServer()
+	{
+		m_server.stop();
+	}
+
+	bool waitReady()
+	{
+		while (!m_isServerReady)
+		{
+			if (m_threadExited || m_failed)
+				return false;
+			Sleep(1);
+		}
+		return true;
+	}
+
+private:
+	const ServerSettings& m_settings;
+	Log& m_log;
+	Server m_server;
+	volatile bool m_isServerReady = false;
+	volatile bool m_threadExited = false;
+	volatile bool m_failed = false;
+	Thread m_serverThread;
+};
+#endif
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Bench - Generates source trees and measures client runs. Data is generated from seeds so every run on every
+// commit copies exactly the same bytes
+
+struct BenchRun
+{
+	u64					time = 0;
+	u64					allocationCount = 0;
+	u64					allocationBytes = 0;
+	ClientStats			stats;
+};
+
+struct BenchResult
+{
+	WString				name;
+	u64					fileCount = 0;
+	u64					byteCount = 0;
+	bool				failed = false;
+	List<BenchRun>		runs;
+	const BenchRun*		best = nullptr;
+};
+
+class Bench
+{
+public:
+	Bench(const wchar_t* name, bool useServer)
+	:	m_useServer(useServer)
+	{
+		result.name = name;
+		sourceDir = g_benchSourceDir + name + L'\\';
+		destDir = (useServer ? g_benchServerDestDir : g_benchDestDir) + name + L'\\';
+		deleteDirectory(sourceDir.c_str(), m_ioStats, false);
+		deleteDirectory(destDir.c_str(), m_ioStats, false);
+		ensureDirectory(sourceDir.c_str(), 0, m_ioStats, false, false);
+	}
+
+	~Bench()
+	{
+		deleteDirectory(sourceDir.c_str(), m_ioStats, false);
+		deleteDirectory(destDir.c_str(), m_ioStats, false);
+	}
+
+	// Creates file with a mix of text and random bytes (compresses roughly 3:1). mutationSeed changes a few small regions
+	bool createFile(const wchar_t* relativePath, u64 size, uint seed, uint mutationSeed = 0)
+	{
+		WString fullPath = sourceDir + relativePath;
+		const wchar_t* lastSlash = wcsrchr(fullPath.c_str(), L'\\');
+		if (!ensureDirectory(WString(fullPath.c_str(), lastSlash).c_str(), 0, m_ioStats, false, false))
+			return false;
+
+		if (m_data.size() < size)
+			m_data.resize(size);
+		u8* data = m_data.data();
+
+		static const char* words[] = { "copy ", "file ", "server ", "client ", "hash ", "link ", "delta ", "chunk ", "network ", "buffer " };
+		uint rnd = seed*2654435761u + 1;
+		auto next = [&]() { rnd ^= rnd << 13; rnd ^= rnd >> 17; rnd ^= rnd << 5; return rnd; };
+		for (u64 pos = 0; pos < size;)
+		{
+			u64 blockEnd = min(pos + 64, size);
+			if (next() % 4 == 0)
+				while (pos != blockEnd)
+					data[pos++] = u8(next());
+			else
+				while (pos != blockEnd)
+					for (const char* word = words[next() % eacopy_sizeof_array(words)]; *word && pos != blockEnd; ++word)
+						data[pos++] = u8(*word);
+		}
+
+		if (mutationSeed)
+		{
+			rnd = mutationSeed*2246822519u + 1;
+			for (uint i=0; i!=16; ++i)
+			{
+				u64 offset = (u64(next()) << 32 | next()) % size;
+				for (u64 end = min(offset + 1024, size); offset != end; ++offset)
+					data[offset] = u8(next());
+			}
+		}
+
+		FileInfo fileInfo;
+		fileInfo.fileSize = size;
+		if (!eacopy::createFile(fullPath.c_str(), fileInfo, data, m_ioStats, true))
+			return false;
+		result.fileCount += 1;
+		result.byteCount += size;
+		return true;
+	}
+
+	bool createFiles(const wchar_t* dir, uint count, u64 minSize, u64 maxSize, uint seed)
+	{
+		for (uint i=0; i!=count; ++i)
+		{
+			wchar_t name[MaxPath];
+			swprintf(name, eacopy_sizeof_array(name), L"%ls\\File%u.dat", dir, i);
+			u64 size = minSize + (u64(seed + i)*2654435761u) % (maxSize - minSize + 1);
+			if (!createFile(name, size, seed + i))
+				return false;
+		}
+		return true;
+	}
+
+	ClientSettings getClientSettings(const wchar_t* destSubDir)
+	{
+		ClientSettings settings;
+		settings.sourceDirectory = sourceDir;
+		settings.destDirectory = destDir + destSubDir + L'\\';
+		settings.filesOrWildcards.push_back(L"*.*");
+		settings.copySubdirDepth = 10000;
+		settings.useServer = m_useServer ? UseServer_Required : UseServer_Disabled;
+		settings.retryCount = 0;
+		settings.logProgress = false;
+		return settings;
+	}
+
+	// Times one client run. Source tree is counted as the files of the run even if client skips or links them
+	bool measure(const ClientSettings& settings)
+	{
+		Client client(settings);
+		result.runs.emplace_back();
+		BenchRun& run = result.runs.back();
+		u64 allocationCount = g_allocationCount.load();
+		u64 allocationBytes = g_allocationBytes.load();
+		u64 startTime = getTime();
+		int res = client.process(clientLog, run.stats);
+		run.time = getTime() - startTime;
+		run.allocationCount = g_allocationCount.load() - allocationCount;
+		run.allocationBytes = g_allocationBytes.load() - allocationBytes;
+		if (res != 0 || run.stats.failCount)
+		{
+			result.failed = true;
+			return false;
+		}
+		if (!result.best || run.time < result.best->time)
+			result.best = &run;
+		return true;
+	}
+
+	// Untimed client run used to put destination or server in the state a benchmark needs
+	bool prepare(const ClientSettings& settings)
+	{
+		Client client(settings);
+		ClientStats stats;
+		if (client.process(clientLog, stats) == 0 && !stats.failCount)
+			return true;
+		result.failed = true;
+		return false;
+	}
+
+	WString				sourceDir;
+	WString				destDir;
+	BenchResult			result;
+	Log					clientLog;
+	Log					serverLog;
+
+private:
+	bool				m_useServer;
+	IOStats				m_ioStats;
+	Vector<u8>			m_data;
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Benchmarks
+
+using BenchFunc = Function<void(Bench& bench)>;
+struct BenchDesc { const wchar_t* name; bool useServer; BenchFunc func; };
+
+// Each timed run copies in to a new destination directory so nothing is skipped unless benchmark wants it
+void runCopies(Bench& bench, const Function<void(ClientSettings&)>& configure = Function<void(ClientSettings&)>())
+{
+	for (uint i=0; i!=g_benchRunCount; ++i)
+	{
+		ClientSettings settings(bench.getClientSettings((L"Run" + std::to_wstring(i)).c_str()));
+		if (configure)
+			configure(settings);
+		if (!bench.measure(settings))
+			return;
+	}
+}
+
+void runSkips(Bench& bench, const Function<void(ClientSettings&)>& configure = Function<void(ClientSettings&)>())
+{
+	ClientSettings settings(bench.getClientSettings(L"Skip"));
+	if (configure)
+		configure(settings);
+	if (!bench.prepare(settings))
+		return;
+	for (uint i=0; i!=g_benchRunCount; ++i)
+		if (!bench.measure(settings))
+			return;
+}
+
+void createSmallFiles(Bench& bench)
+{
+	for (uint i=0; i!=50; ++i)
+		bench.createFiles((L"Dir" + std::to_wstring(i)).c_str(), 100, 1, 16*1024, i*100);
+}
+
+void createLargeFiles(Bench& bench)
+{
+	for (uint i=0; i!=4; ++i)
+		bench.createFile((L"Large" + std::to_wstring(i) + L".dat").c_str(), 64*1024*1024 + i*12345, 1000000 + i);
+}
+
+void createDeepTree(Bench& bench)
+{
+	for (uint i=0; i!=8; ++i)
+	{
+		WString dir = L"Tree" + std::to_wstring(i);
+		for (uint depth=0; depth!=16; ++depth)
+		{
+			dir += L"\\Level" + std::to_wstring(depth);
+			bench.createFiles(dir.c_str(), 4, 1, 4*1024, i*1000 + depth*10);
+		}
+	}
+}
+
+#if defined(_WIN32)
+ServerSettings getServerSettings()
+{
+	ServerSettings settings;
+	settings.useSecurityFile = false;
+	settings.useLinksThreshold = ~u64(0); // Copies are measured as copies, links have their own benchmark
+	return settings;
+}
+
+bool startServer(Bench& bench, std::unique_ptr<BenchServer>& outServer, const ServerSettings& settings)
+{
+	outServer.reset(new BenchServer(settings, bench.serverLog));
+	if (outServer->waitReady())
+		return true;
+	bench.result.failed = true;
+	return false;
+}
+#endif
+
+List<BenchDesc> getBenchmarks()
+{
+	List<BenchDesc> benchmarks;
+
+	benchmarks.push_back({ L"LocalSmallFiles", false, [](Bench& bench) { createSmallFiles(bench); runCopies(bench); } });
+	benchmarks.push_back({ L"LocalLargeFiles", false, [](Bench& bench) { createLargeFiles(bench); runCopies(bench); } });
+	benchmarks.push_back({ L"LocalDeepTree", false, [](Bench& bench) { createDeepTree(bench); runCopies(bench); } });
+	benchmarks.push_back({ L"LocalSkipUnchanged", false, [](Bench& bench) { createSmallFiles(bench); runSkips(bench); } });
+	benchmarks.push_back({ L"LocalExcludeWildcards", false, [](Bench& bench)
+		{
+			createSmallFiles(bench);
+			createDeepTree(bench);
+			runCopies(bench, [](ClientSettings& s) { s.excludeWildcards = { L"File1*.dat", L"*7.dat", L"File?5.dat" }; s.excludeWildcardDirectories = { L"Level1?", L"Dir4*" }; });
+		} });
+
+	#if defined(_WIN32)
+	benchmarks.push_back({ L"ServerSmallFiles", true, [](Bench& bench)
+		{
+			createSmallFiles(bench);
+			std::unique_ptr<BenchServer> server;
+			if (startServer(bench, server, getServerSettings()))
+				runCopies(bench);
+		} });
+	benchmarks.push_back({ L"ServerLargeFiles", true, [](Bench& bench)
+		{
+			createLargeFiles(bench);
+			std::unique_ptr<BenchServer> server;
+			if (startServer(bench, server, getServerSettings()))
+				runCopies(bench);
+		} });
+	benchmarks.push_back({ L"ServerLargeFilesCompressed", true, [](Bench& bench)
+		{
+			createLargeFiles(bench);
+			std::unique_ptr<BenchServer> server;
+			if (startServer(bench, server, getServerSettings()))
+				runCopies(bench, [](ClientSettings& s) { s.compressionLevel = 255; });
+		} });
+	benchmarks.push_back({ L"ServerSkipUnchanged", true, [](Bench& bench)
+		{
+			createSmallFiles(bench);
+			std::unique_ptr<BenchServer> server;
+			if (startServer(bench, server, getServerSettings()))
+				runSkips(bench);
+		} });
+	benchmarks.push_back({ L"ServerLinks", true, [](Bench& bench)
+		{
+			createSmallFiles(bench);
+			ServerSettings serverSettings(getServerSettings());
+			serverSettings.useLinksThreshold = 0;
+			std::unique_ptr<BenchServer> server;
+			if (startServer(bench, server, serverSettings) && bench.prepare(bench.getClientSettings(L"Base")))
+				runCopies(bench);
+		} });
+	benchmarks.push_back({ L"ServerChunkDelta", true, [](Bench& bench)
+		{
+			// Every run copies a new version of the files where a few regions changed. Only changed chunks travel
+			ServerSettings serverSettings(getServerSettings());
+			serverSettings.useChunks = true;
+			std::unique_ptr<BenchServer> server;
+			if (!startServer(bench, server, serverSettings))
+				return;
+			createLargeFiles(bench);
+			if (!bench.prepare(bench.getClientSettings(L"Base")))
+				return;
+			for (uint i=0; i!=g_benchRunCount; ++i)
+			{
+				bench.result.fileCount = bench.result.byteCount = 0;
+				for (uint j=0; j!=4; ++j)
+					bench.createFile((L"Large" + std::to_wstring(j) + L".dat").c_str(), 64*1024*1024 + j*12345, 1000000 + j, i + 1);
+				if (!bench.measure(bench.getClientSettings((L"Run" + std::to_wstring(i)).c_str())))
+					return;
+			}
+		} });
+	#endif
+
+	return benchmarks;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Json output
+
+void appendJson(String& out, const char* fmt, ...)
+{
+	char buffer[1024];
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(buffer, sizeof(buffer), fmt, args);
+	va_end(args);
+	out += buffer;
+}
+
+void appendJsonOp(String& out, bool& first, const char* name, u64 time, u64 count)
+{
+	if (!count)
+		return;
+	appendJson(out, "%s\n        \"%s\": { \"count\": %llu, \"totalMs\": %.3f, \"avgMs\": %.4f }", first ? "" : ",", name, count, double(time)/10000.0, double(time)/10000.0/double(count));
+	first = false;
+}
+
+void appendJsonResult(String& out, const BenchResult& result)
+{
+	appendJson(out, "    {\n      \"name\": \"%ls\",\n      \"failed\": %s,\n      \"files\": %llu,\n      \"bytes\": %llu,\n      \"runMs\": [", result.name.c_str(), result.failed ? "true" : "false", result.fileCount, result.byteCount);
+	const char* separator = "";
+	for (auto& run : result.runs)
+	{
+		appendJson(out, "%s%.3f", separator, double(run.time)/10000.0);
+		separator = ", ";
+	}
+	out += "]";
+
+	if (const BenchRun* best = result.best)
+	{
+		double seconds = max(double(best->time)/10000000.0, 0.000001);
+		const ClientStats& s = best->stats;
+		appendJson(out, ",\n      \"bestMs\": %.3f,\n      \"filesPerSecond\": %.1f,\n      \"mbPerSecond\": %.2f,\n      \"allocations\": %llu,\n      \"allocatedBytes\": %llu", double(best->time)/10000.0, double(result.fileCount)/seconds, double(result.byteCount)/(1024.0*1024.0)/seconds, best->allocationCount, best->allocationBytes);
+		appendJson(out, ",\n      \"copied\": %llu,\n      \"skipped\": %llu,\n      \"linked\": %llu,\n      \"sentBytes\": %llu,\n      \"receivedBytes\": %llu,\n      \"compressionLevel\": %.2f,\n      \"compressionSkipFiles\": %llu,\n      \"compressionSkipBytes\": %llu,\n      \"compressionLevelChanges\": %llu", s.copyCount, s.skipCount, s.linkCount, s.sendSize, s.recvSize, s.compressionAverageLevel, s.compressionSkipCount, s.compressionSkipSize, s.compressionLevelChanges);
+
+		out += ",\n      \"commands\": {";
+		bool first = true;
+		appendJsonOp(out, first, "Connect", s.connectTime, s.connectTime ? 1 : 0);
+		appendJsonOp(out, first, "FindFiles", s.netFindFilesTime, s.netFindFilesCount);
+		appendJsonOp(out, first, "CreateDir", s.netCreateDirTime, s.netCreateDirCount);
+		appendJsonOp(out, first, "FileInfo", s.netFileInfoTime, s.netFileInfoCount);
+		appendJsonOp(out, first, "DeletePaths", s.netDeletePathsTime, s.netDeletePathsCount);
+		appendJsonOp(out, first, "WriteFiles", s.netWriteFilesTime, s.netWriteFilesCount);
+		appendJsonOp(out, first, "WritePackedFiles", s.netWritePackedFilesTime, s.netWritePackedFilesCount);
+		static const char* writeResponseNames[] = { "WriteCopy", "WriteCopyDelta", "WriteCopySmb", "WriteLink", "WriteOdx", "WriteSkip", "WriteHash", "WriteChunks" };
+		static_assert(eacopy_sizeof_array(writeResponseNames) == WriteResponseCount, "Missing write response names");
+		for (uint i=0; i!=WriteResponseCount; ++i)
+			appendJsonOp(out, first, writeResponseNames[i], s.netWriteResponseTime[i], s.netWriteResponseCount[i]);
+		out += "\n      },\n      \"cpu\": {";
+		first = true;
+		appendJsonOp(out, first, "Compress", s.compressTime, s.compressTime ? 1 : 0);
+		appendJsonOp(out, first, "Decompress", s.decompressTime, s.decompressTime ? 1 : 0);
+		appendJsonOp(out, first, "Hash", s.hashTime, s.hashCount);
+		appendJsonOp(out, first, "Purge", s.purgeTime, s.purgeCount);
+
+		const IOStats& io = s.ioStats;
+		out += "\n      },\n      \"io\": {";
+		first = true;
+		appendJsonOp(out, first, "FindFile", io.findFileTime, io.findFileCount);
+		appendJsonOp(out, first, "CreateRead", io.createReadTime, io.createReadCount);
+		appendJsonOp(out, first, "Read", io.readTime, io.readCount);
+		appendJsonOp(out, first, "CloseRead", io.closeReadTime, io.closeReadCount);
+		appendJsonOp(out, first, "CreateWrite", io.createWriteTime, io.createWriteCount);
+		appendJsonOp(out, first, "Write", io.writeTime, io.writeCount);
+		appendJsonOp(out, first, "CloseWrite", io.closeWriteTime, io.closeWriteCount);
+		appendJsonOp(out, first, "CreateLink", io.createLinkTime, io.createLinkCount);
+		appendJsonOp(out, first, "DeleteFile", io.deleteFileTime, io.deleteFileCount);
+		appendJsonOp(out, first, "MoveFile", io.moveFileTime, io.moveFileCount);
+		appendJsonOp(out, first, "RemoveDir", io.removeDirTime, io.removeDirCount);
+		appendJsonOp(out, first, "SetLastWriteTime", io.setLastWriteTime, io.setLastWriteTimeCount);
+		appendJsonOp(out, first, "FileInfo", io.fileInfoTime, io.fileInfoCount);
+		appendJsonOp(out, first, "CreateDir", io.createDirTime, io.createDirCount);
+		appendJsonOp(out, first, "CopyFile", io.copyFileTime, io.copyFileCount);
+		out += "\n      }";
+	}
+	out += "\n    }";
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void printHelp()
+{
+	logInfoLinef(L"-------------------------------------------------------------------------------");
+	logInfoLinef(L"  EACopyBench (Client v%ls) (c) Electronic Arts.  All Rights Reserved.", getClientVersionString().c_str());
+	logInfoLinef(L"-------------------------------------------------------------------------------");
+	logInfoLinef();
+	logInfoLinef(L"             Usage :: EACopyBench source destination [options]");
+	logInfoLinef();
+	logInfoLinef(L"            source :: Local directory where source trees are generated.");
+	logInfoLinef(L"       destination :: Local directory used as destination for local benchmarks.");
+	logInfoLinef();
+	logInfoLinef(L"    /SERVER:dir :: Destination for server benchmarks (\\\\localhost\\share\\path). Must be local host.");
+	logInfoLinef(L"        /RUNS:n :: Number of timed runs per benchmark (defaults to 3).");
+	logInfoLinef(L"   /FILTER:text :: Only run benchmarks with names containing text.");
+	logInfoLinef(L"    /LABEL:text :: Text stored in json so results can be matched with commit.");
+	logInfoLinef(L"     /JSON:file :: Write results to file instead of stdout.");
+	logInfoLinef();
+}
+
+int runBenchmarks(const wchar_t* jsonFile)
+{
+	String json;
+	appendJson(json, "{\n  \"clientVersion\": \"%ls\",\n  \"protocolVersion\": %u,\n  \"label\": \"%ls\",\n  \"runCount\": %u,\n  \"benchmarks\": [\n", getClientVersionString().c_str(), uint(ProtocolVersion), g_benchLabel.c_str(), g_benchRunCount);
+
+	uint failCount = 0;
+	const char* separator = "";
+	for (auto& desc : getBenchmarks())
+	{
+		if (desc.useServer && g_benchServerDestDir.empty())
+			continue;
+		if (!g_benchFilter.empty() && !wcsstr(desc.name, g_benchFilter.c_str()))
+			continue;
+
+		fwprintf(stderr, L"Running benchmark '%ls'...", desc.name);
+		fflush(stderr);
+		Bench bench(desc.name, desc.useServer);
+		desc.func(bench);
+		if (bench.result.failed)
+		{
+			fwprintf(stderr, L"FAILED\n");
+			++failCount;
+		}
+		else if (bench.result.best)
+			fwprintf(stderr, L"%.1f ms\n", double(bench.result.best->time)/10000.0);
+
+		json += separator;
+		appendJsonResult(json, bench.result);
+		separator = ",\n";
+	}
+	json += "\n  ]\n}\n";
+
+	if (!jsonFile)
+	{
+		fputs(json.c_str(), stdout);
+	}
+	else
+	{
+		IOStats ioStats;
+		FileHandle file;
+		if (!openFileWrite(jsonFile, file, ioStats, true))
+			return -1;
+		bool success = writeFile(jsonFile, file, json.data(), json.size(), ioStats);
+		if (!closeFile(jsonFile, file, AccessType_Write, ioStats) || !success)
+			return -1;
+	}
+	return failCount ? -1 : 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+} // namespace eacopy
+
+
+#if defined(_WIN32)
+int wmain(int argc, wchar_t* argv[])
+{
+	using namespace eacopy;
+#else
+int main(int argc, char* argv_[])
+{
+	using namespace eacopy;
+	wchar_t* argv[64];
+	WString temp[64];
+	argc = min(argc, 64);
+	for (int i=0; i!=argc; ++i)
+	{
+		temp[i] = WString(argv_[i], argv_[i] + strlen(argv_[i]));
+		argv[i] = const_cast<wchar_t*>(temp[i].c_str());
+	}
+#endif
+
+	if (argc < 3 || equalsIgnoreCase(argv[1], L"/?"))
+	{
+		printHelp();
+		return argc < 3 ? -1 : 0;
+	}
+
+	auto asDir = [](const wchar_t* str)
+	{
+		WString dir(str);
+		#if !defined(_WIN32)
+		std::replace(dir.begin(), dir.end(), L'/', L'\\');
+		#endif
+		if (!dir.empty() && dir.back() != L'\\')
+			dir += L'\\';
+		return dir;
+	};
+	g_benchSourceDir = asDir(argv[1]);
+	g_benchDestDir = asDir(argv[2]);
+
+	const wchar_t* jsonFile = nullptr;
+	for (int i=3; i!=argc; ++i)
+	{
+		const wchar_t* arg = argv[i];
+		if (startsWithIgnoreCase(arg, L"/SERVER:"))
+			g_benchServerDestDir = asDir(arg + 8);
+		else if (startsWithIgnoreCase(arg, L"/RUNS:"))
+			g_benchRunCount = max(wtoi(arg + 6), 1);
+		else if (startsWithIgnoreCase(arg, L"/FILTER:"))
+			g_benchFilter = arg + 8;
+		else if (startsWithIgnoreCase(arg, L"/LABEL:"))
+			g_benchLabel = arg + 7;
+		else if (startsWithIgnoreCase(arg, L"/JSON:"))
+			jsonFile = arg + 6;
+		else
+		{
+			logErrorf(L"Unknown option %ls. /? for help", arg);
+			return -1;
+		}
+	}
+
+	return runBenchmarks(jsonFile);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
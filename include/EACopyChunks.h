@@ -0,0 +1,86 @@
+// (c) Electronic Arts. All Rights Reserved.
+
+#pragma once
+
+#include "EACopyNetwork.h"
+
+namespace eacopy
+{
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Content defined chunking. Chunk boundaries are found with a rolling gear hash (FastCDC) so inserting or removing
+// bytes only changes the chunks around the edit. Chunks are identified by hash and can be shared between any files
+
+enum : uint
+{
+	ChunkMinSize			= 16*1024,
+	ChunkAvgSize			= 64*1024,
+	ChunkMaxSize			= 256*1024,
+	ChunkMinFileSize		= 1024*1024, // Smaller files are always sent in full
+	DefaultMaxChunkCount	= 4*1024*1024, // Number of chunks in server chunk store (~256gb of data with average chunk size)
+};
+
+struct ChunkInfo
+{
+	Hash			hash;
+	uint			size = 0;
+	uint			padding = 0;
+};
+
+static_assert(sizeof(ChunkInfo) == 24, "ChunkInfo is sent over network and stored on disk");
+
+// Returns size of first chunk in data. Data must be at least ChunkMaxSize long unless it is the end of the file
+uint				findChunkBoundary(const u8* data, uint size);
+
+// Reads file and calls func for each chunk. If knownChunks is provided those sizes are used instead of finding boundaries.
+// Chunk data points in to copyContext.buffers[0] and is only valid during the call
+using				ChunkFunc = Function<bool(uint index, const u8* data, uint size)>;
+bool				traverseFileChunks(const wchar_t* fullPath, u64 fileSize, const Vector<ChunkInfo>* knownChunks, CopyContext& copyContext, IOStats& ioStats, const ChunkFunc& func);
+
+// Splits file in to chunks and hash each one of them
+bool				getFileChunks(Vector<ChunkInfo>& outChunks, const wchar_t* fullPath, u64 fileSize, CopyContext& copyContext, HashContext& hashContext, IOStats& ioStats);
+
+// Sends/receives one chunk. Compressed chunks are prefixed with compressed size. Both use copyContext.buffers[1] as scratch
+bool				sendChunk(Socket& socket, const u8* data, uint size, WriteFileType writeType, int compressionLevel, NetworkCopyContext& copyContext, SendFileStats& sendStats);
+bool				receiveChunk(Socket& socket, u8* dest, uint size, WriteFileType writeType, NetworkCopyContext& copyContext, RecvFileStats& recvStats);
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// ChunkStore - Server side index of chunks in files it has written. Files are kicked out oldest first when store is full
+
+class ChunkStore
+{
+public:
+	struct			Location { WString fileName; FileInfo fileInfo; u64 offset; };
+
+	bool			findChunk(Location& outLocation, const ChunkInfo& chunk);
+	void			addFile(const WString& fullPath, const FileInfo& fileInfo, const Vector<ChunkInfo>& chunks);
+	void			removeFile(const WString& fullPath);
+	uint			getChunkCount();
+
+	bool			readFile(const wchar_t* fullPath, IOStats& ioStats);
+	bool			writeFile(const wchar_t* fullPath, IOStats& ioStats);
+
+	uint			m_maxChunkCount = DefaultMaxChunkCount;
+	HashAlgorithm	m_hashAlgorithm = DefaultHashAlgorithm; // Store is dropped on read if it was created with a different algorithm
+
+private:
+	using			History = List<WString>;
+	struct			FileRec { FileInfo fileInfo; Vector<ChunkInfo> chunks; History::iterator historyIt; };
+	using			Files = Map<WString, FileRec>;
+	struct			ChunkRec { Files::iterator file; u64 offset; uint size; };
+	using			Chunks = Map<Hash, ChunkRec>;
+
+	void			addFileNoLock(const WString& fullPath, const FileInfo& fileInfo, const Vector<ChunkInfo>& chunks);
+	void			removeFileNoLock(Files::iterator it);
+
+	CriticalSection	m_cs;
+	Files			m_files;
+	Chunks			m_chunks;
+	History			m_history; // Oldest first
+	uint			m_chunkCount = 0;
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+} // namespace eacopy
@@ -1,7 +1,8 @@
 // (c) Electronic Arts. All Rights Reserved.
 
 #pragma once
-#include "EACopyNetwork.h"
+#include "EACopyChunks.h"
+#include "EACopyDictionary.h"
 
 namespace eacopy
 {
@@ -18,6 +19,8 @@ enum : uint {
 enum FileFlags { FileFlags_Data = 1, FileFlags_Attributes = 2, FileFlags_Timestamps = 4 };
 enum UseServer { UseServer_Automatic, UseServer_Required, UseServer_Disabled };
 
+class ConnectionPool;
+
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
@@ -60,8 +63,15 @@ struct ClientSettings
 	bool				useLinksRelativePath		= true;
 	bool				useOdx						= false;
 	bool				useSystemCopy				= false;
+	u64					stripeThreshold				= ~u64(0); // Files of this size or bigger are split in ranges written in parallel over all connections when copying to server
+	u64					stripeSize					= 128*1024*1024; // Size of each range when striping. Rounded to a multiple of network transfer chunk size
+	u64					packedFileThreshold			= DefaultPackedFileThreshold; // Files smaller than this that server needs content for are sent packed together. 0 disables
 	StringList			additionalLinkDirectories;
 	WString				linkDatabaseFile;
+	WString				destinationCacheFile; // Remembers size and time of files written to destination so next run can skip them without checking destination
+	StringList			fanOutDirectories; // More destinations. Source is traversed and read once and written to all of them and destDirectory
+	ConnectionPool*		connectionPool				= nullptr; // Keeps server connections open between process calls. Owned by application, can be shared by clients
+	uint				destSnapshotThreadCount		= 2; // Threads listing destination directories ahead of workers when no server is used so files are not checked one by one. 0 disables
 };
 
 
@@ -84,14 +94,20 @@ struct ClientStats
 	u64					retryCount					= 0;
 	u64					retryTime					= 0;
 	u64					connectTime					= 0;
+	u64					connectReuseCount			= 0; // Connections taken from connection pool
+	u64					reconnectCount				= 0; // Dropped connections connected again in to same server session
 	u64					sendTime					= 0;
 	u64					sendSize					= 0;
 	u64					recvTime					= 0;
 	u64					recvSize					= 0;
 	u64					purgeTime					= 0;
+	u64					purgeCount					= 0; // Files and directories deleted by purge
 	u64					compressTime				= 0;
 	u64					compressionLevelSum			= 0;
 	float				compressionAverageLevel		= 0;
+	u64					compressionSkipCount		= 0; // Files where no chunk ended up compressed, because of high sampled entropy or no size gain
+	u64					compressionSkipSize			= 0; // Bytes sent uncompressed in compressed transfers
+	u64					compressionLevelChanges		= 0; // Adjustments made by adaptive compression (/C without level)
 	u64					decompressTime				= 0;
 	u64					deltaCompressionTime		= 0;
 	u64					hashTime					= 0;
@@ -99,18 +115,33 @@ struct ClientStats
 	u64					netSecretGuid				= 0;
 	u64					netWriteResponseTime[WriteResponseCount] = { 0 };
 	u64					netWriteResponseCount[WriteResponseCount] = { 0 };
+	u64					netWriteFilesTime			= 0;
+	u64					netWriteFilesCount			= 0;
+	u64					netWritePackedFilesTime		= 0;
+	u64					netWritePackedFilesCount	= 0;
+	u64					dictionaryCount				= 0; // Compression dictionaries fetched from server
 	u64					netFindFilesTime			= 0;
 	u64					netFindFilesCount			= 0;
 	u64					netCreateDirTime			= 0;
 	u64					netCreateDirCount			= 0;
 	u64					netFileInfoTime				= 0;
 	u64					netFileInfoCount			= 0;
+	u64					netDeletePathsTime			= 0;
+	u64					netDeletePathsCount			= 0;
 	u64					processedByServerCount		= 0;
 
 	u64					readLinkDbTime				= 0;
 	u64					readLinkDbEntries			= 0;
 	u64					writeLinkDbTime				= 0;
 	u64					writeLinkDbEntries			= 0;
+	u64					readDestCacheTime			= 0;
+	u64					readDestCacheEntries		= 0;
+	u64					writeDestCacheTime			= 0;
+	u64					writeDestCacheEntries		= 0;
+	u64					destCacheSkipCount			= 0; // Files skipped without touching destination
+	u64					destSnapshotTime			= 0; // Time spent listing destination directories ahead of workers
+	u64					destSnapshotCount			= 0; // Destination directories listed ahead of workers
+	u64					destSnapshotHitCount		= 0; // Files copied or skipped based on a listing instead of checking the destination file
 
 	IOStats				ioStats;
 
@@ -123,6 +154,52 @@ struct ClientStats
 
 
 
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// ConnectionPool - Keeps server connections open between Client::process calls. Connections are kept per server, share
+// and session. A client gets back connections that are past version and environment commands and the server still knows
+// the directories of the session. Clients using the same pool can run at the same time, each uses its own session
+
+class ConnectionPool
+{
+public:
+						ConnectionPool();
+						~ConnectionPool(); // Closes all idle connections
+
+	void				clear(); // Closes all idle connections and forgets resolved server addresses
+	uint				getIdleCount();
+
+	uint				m_maxIdleCount = 64; // Per server and share. Connections released above this are closed
+	uint				m_idleTimeoutMs = 5*60*1000; // Idle connections older than this are closed instead of reused
+	uint				m_addressTimeoutMs = 10*60*1000; // Server name is resolved again after this
+
+private:
+	friend class		Client;
+	struct				SessionInfo { Guid secretGuid = {0}; HashAlgorithm hashAlgorithm = DefaultHashAlgorithm; bool useDictionaries = false; WString serverInfo; };
+	struct				IdleConnection { Socket socket; int compressionLevel; u64 releaseTime; };
+	struct				Session { SessionInfo info; bool inUse = false; List<IdleConnection> idle; }; // In use while a client takes connections from it
+	struct				Address { AddrInfo* addrInfo = nullptr; u64 resolveTime = 0; };
+	using				Sessions = std::map<WString, List<Session>, NoCaseWStringLess>; // Key is server, port and net directory
+	using				Addresses = std::map<WString, Address, NoCaseWStringLess>; // Key is server and port
+
+	AddrInfo*			getAddress(const WString& serverAndPort);
+	AddrInfo*			setAddress(const WString& serverAndPort, AddrInfo* addrInfo); // Takes ownership, returns what should be used
+	bool				acquire(const WString& key, SessionInfo& inOutInfo, IdleConnection& outConnection); // Takes any unused session if guid is zero
+	void				release(const WString& key, const SessionInfo& info, const IdleConnection& connection);
+	void				endSession(const WString& key, const Guid& secretGuid);
+	void				closeIdle(Vector<IdleConnection>& connections);
+
+	CriticalSection		m_cs;
+	Sessions			m_sessions;
+	Addresses			m_addresses;
+	Vector<AddrInfo*>	m_oldAddresses; // Replaced addresses might still be walked by a connecting client
+	bool				m_wsaInitDone = false;
+
+						ConnectionPool(const ConnectionPool&) = delete;
+	void				operator=(const ConnectionPool&) = delete;
+};
+
+
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 class Client
@@ -141,20 +218,91 @@ public:
 private:
 
 	// Types
-	struct				CopyEntry { WString src; WString dst; FileInfo srcInfo; uint attributes = 0u; };
-	struct				DirEntry { 	WString sourceDir; WString destDir; WString wildcard; int depthLeft = 0; };
+	struct				StripedFile { Atomic<uint> rangesLeft; Atomic<bool> failed; u64 startTime; };
+	using				Path = PathArena::Path;
+	struct				CopyEntry // Paths are split in interned directory and name, both living in m_paths
+	{
+		const Path*		srcDir = nullptr;
+		const wchar_t*	srcName = nullptr;
+		const Path*		dstDir = nullptr; // Relative destination root
+		const wchar_t*	dstName = nullptr;
+		FileInfo		srcInfo;
+		uint			attributes = 0u;
+		StripedFile*	stripe = nullptr;
+		u64				stripeOffset = 0;
+		u64				stripeSize = 0;
+		uint			stripeRetryCount = 0; // Times file has been striped again after a range failed
+		bool			batched = false; // Pushed back after a WriteFiles batch, not batched again
+		WriteResponse	batchResponse = WriteResponseCount; // Answer from WriteFiles that WriteFile continues from
+
+		WString			src() const { WString s; s.reserve(srcDir->length + wcslen(srcName)); return s.append(srcDir->str, srcDir->length).append(srcName); }
+		WString			dst() const { WString s; s.reserve(dstDir->length + wcslen(dstName)); return s.append(dstDir->str, dstDir->length).append(dstName); }
+	};
+	struct				DirEntry { const Path* sourceDir = nullptr; const Path* destDir = nullptr; const Path* wildcard = nullptr; int depthLeft = 0; };
 	using				HandleFileOrWildcardFunc = Function<bool(char*)>;
-	using				CopyEntries = List<CopyEntry>;
-	using				DirEntries = List<DirEntry>;
+	struct				PurgeEntry { Client* dest = nullptr; const Path* destDir = nullptr; int depthLeft = 0; }; // Destination directory to clean out after all files are copied. dest is this or a fan-out client
+	using				CopyEntries = Deque<CopyEntry>;
+	using				DirEntries = Deque<DirEntry>;
+	using				PurgeEntries = Deque<PurgeEntry>;
+	struct				WorkQueue { CriticalSection cs; CopyEntries copyEntries; DirEntries dirEntries; PurgeEntries purgeEntries; Atomic<uint> copyEntryCount { 0 }; Atomic<uint> dirEntryCount { 0 }; Atomic<uint> purgeEntryCount { 0 }; };
 	using				CachedFindFileEntries = std::map<WString, Set<WString, NoCaseWStringLess>, NoCaseWStringLess>;
 	class				Connection;
 	struct				NameAndFileInfo { WString name; FileInfo info; uint attributes = 0u; };
+	struct				DictionaryCache { CriticalSection cs; bool listed = false; Map<WString, uint> ids; DictionaryStore store; }; // Compression dictionaries of destination server
+	struct				DestCacheEntry { FileTime lastWriteTime; u64 fileSize; }; // Directories use ~0 as size
+	using				DestCacheEntries = std::map<WString, DestCacheEntry, NoCaseWStringLess>;
+	struct				DestinationCache { bool valid = false; DestCacheEntries known; CriticalSection cs; DestCacheEntries written; }; // Keys are relative destination like m_handledFiles
+	enum : uint			{ DestSnapshotMaxFileCount = 1024*1024 }; // Listed destination files kept in memory. No more directories are listed above this
+	enum				DestSnapshotResult { DestSnapshot_Unknown, DestSnapshot_Missing, DestSnapshot_Found };
+	struct				DestSnapshotFile { FileInfo info; uint attributes = 0u; };
+	using				DestSnapshotFiles = std::map<WString, DestSnapshotFile, NoCaseWStringLess>;
+	struct				DestSnapshotDir { bool listed = false; bool exists = false; DestSnapshotFiles files; }; // Files are removed when looked up since each is only handled once
+	struct				DestinationSnapshots // Listings of destination directories made by prefetch threads before workers get to the files. Keys are relative destination directories
+	{
+		bool			enabled = false;
+		bool			stop = false;
+		CriticalSection	cs;
+		std::map<WString, DestSnapshotDir, NoCaseWStringLess> dirs;
+		Deque<WString>	queue;
+		Event			queueAvailable { false };
+		uint			fileCount = 0;
+		u64				time = 0;
+		u64				count = 0;
+		u64				findFileTime = 0;
+		u64				findFileCount = 0;
+	};
+	struct				SourceFileCache // What a thread produced from the last file it sent. Fan-out destinations reuse it instead of reading the file again
+	{
+		WString			path;
+		FileInfo		info;
+		HashAlgorithm	hashAlgorithm = DefaultHashAlgorithm; // Algorithm of hash and chunks
+		Hash			hash;
+		bool			hasHash = false;
+		Vector<ChunkInfo> chunks;
+		bool			hasChunks = false;
+		Vector<u8>		compressed; // Whole compressed stream, only kept for files without dictionary and up to SendRecordMaxSize
+		bool			hasCompressed = false;
+
+		void			setFile(const wchar_t* file, const FileInfo& fileInfo); // Content is kept if it is the same file as last time
+		void			setHashAlgorithm(HashAlgorithm algorithm); // Hash and chunks are dropped if destinations use different algorithms
+	};
 
 	// Methods
 	void				resetWorkState(Log& log);
 	bool				processDir(LogContext& logContext, Connection* sourceConnection, Connection* destConnection, NetworkCopyContext& copyContext, ClientStats& stats);
 	bool				processFile(LogContext& logContext, Connection* sourceConnection, Connection* destConnection, NetworkCopyContext& copyContext, ClientStats& stats);
+	bool				processPurgeDir(Connection* destConnection, NetworkCopyContext& copyContext, ClientStats& stats);
+	bool				processFileBatch(LogContext& logContext, Connection* sourceConnection, Connection* destConnection, NetworkCopyContext& copyContext, CopyEntry& firstEntry, ClientStats& stats);
+	bool				processCopyEntry(LogContext& logContext, Connection* sourceConnection, Connection* destConnection, NetworkCopyContext& copyContext, CopyEntry& entry, ClientStats& stats, WriteResponse batchResponse = WriteResponseCount);
+	bool				processStripedFile(LogContext& logContext, Connection* destConnection, NetworkCopyContext& copyContext, CopyEntry& entry, ClientStats& stats);
+	bool				processFileRange(LogContext& logContext, Connection* destConnection, NetworkCopyContext& copyContext, CopyEntry& entry, ClientStats& stats);
+	bool				reportServerWriteResponse(const CopyEntry& entry, WriteResponse writeResponse, u64 time, ClientStats& stats);
+	bool				useWriteFilesBatch(const CopyEntry& entry);
+	bool				useStripes(const CopyEntry& entry);
 	bool				processQueues(LogContext& logContext, Connection* sourceConnection, Connection* destConnection, NetworkCopyContext& copyContext, ClientStats& stats, bool isMainThread);
+	template<class Entry> void pushEntry(Entry&& entry, Deque<Entry> WorkQueue::* entries, Atomic<uint> WorkQueue::* entryCount);
+	template<class Entry> bool popEntry(Entry& outEntry, Deque<Entry> WorkQueue::* entries, Atomic<uint> WorkQueue::* entryCount);
+	void				finishEntry();
 	bool				connectToServer(const wchar_t* networkPath, uint connectionIndex, Connection*& outConnection, bool& failedToConnect, ClientStats& stats);
 	int					workerThread(uint connectionIndex, ClientStats& stats);
 	bool				traverseFilesInDirectory(LogContext& logContext, Connection* sourceConnection, Connection* destConnection, NetworkCopyContext& copyContext, const WString& sourcePath, const WString& destPath, const WString& wildcard, int depthLeft, ClientStats& stats);
@@ -169,11 +317,29 @@ private:
 	bool				excludeFilesFromFile(LogContext& logContext, ClientStats& stats, const WString& sourcePath, const WString& fileName, const WString& destPath);
 	bool				gatherFilesOrWildcardsFromFile(LogContext& logContext, ClientStats& stats, CachedFindFileEntries& findFileCache, const WString& sourcePath, const WString& fileName, const WString& destPath);
 	bool				processQueuedWildcardFileEntries(LogContext& logContext, ClientStats& stats, CachedFindFileEntries& findFileCache, const WString& rootSourcePath, const WString& rootDestPath);
-	bool				purgeFilesInDirectory(const WString& destPath, uint destPathAttributes, int depthLeft, ClientStats& stats);
+	void				queuePurgeDirectory(Client& dest, const WString& destPath, uint destPathAttributes, int depthLeft);
+	bool				queuePurgeRoots(Client& dest, ClientStats& stats);
+	bool				purgeFilesInDirectory(Client& dest, Connection* destConnection, NetworkCopyContext& copyContext, const WString& destPath, int depthLeft, ClientStats& stats);
+	bool				createDeferredDirectories(ClientStats& stats);
+	void				startFanOut(Log& log);
+	void				stopFanOut();
+	bool				connectFanOut(uint connectionIndex, SourceFileCache* sourceCache, ClientStats& stats);
+	void				disconnectFanOut(uint connectionIndex);
+	Connection*			getFanOutConnection() const;
 	bool				ensureDirectory(Connection* destConnection, const WString& directory, uint attributes, IOStats& ioStats);
+	bool				getDestinationStamp(FileTime& outTime, const WString& destDir, Connection* destConnection, ClientStats& stats);
+	void				readDestinationCache(Connection* destConnection, ClientStats& stats);
+	bool				writeDestinationCache(Connection* destConnection, ClientStats& stats);
+	bool				findInDestinationCache(const WString& destFile, const FileInfo& fileInfo);
+	void				addToDestinationCache(const WString& destFile, const FileTime& lastWriteTime, u64 fileSize);
+	void				requestDestinationSnapshot(const WString& destPath);
+	void				destinationSnapshotThread();
+	DestSnapshotResult	findInDestinationSnapshot(const CopyEntry& entry, FileInfo& outInfo, uint& outAttributes);
 	const wchar_t*		getRelativeSourceFile(const WString& sourcePath) const;
 	const wchar_t*		getFileKeyPath(const WString& relativePath) const;
 	Connection*			createConnection(const wchar_t* networkPath, uint connectionIndex, ClientStats& stats, bool& failedToConnect, bool doProtocolCheck);
+	bool				reconnect(Connection& connection, ClientStats& stats);
+	void				endPoolSession();
 	bool				isIgnoredDirectory(const wchar_t* directory);
 	bool				isValid(Connection* connection);
 	bool				isFileWithAttributeAllowed(uint fileAttributes);
@@ -191,27 +357,39 @@ private:
 	NetworkCopyContext	m_copyContext;
 	Connection*			m_sourceConnection;
 	Connection*			m_destConnection;
-	CriticalSection		m_copyEntriesCs;
-	CopyEntries			m_copyEntries;
-	CriticalSection		m_dirEntriesCs;
-	DirEntries			m_dirEntries;
-	uint				m_processDirActive;
-	FilesSet			m_handledFiles;
+	Vector<WorkQueue>	m_workQueues;		// One queue per thread (main thread is index 0). Owner pops from back, other threads steal from front
+	Atomic<uint>		m_queuedEntryCount;	// Entries sitting in any of the work queues
+	Atomic<uint>		m_pendingEntryCount;// Entries queued or being processed. When zero no more entries can be added
+	Event				m_workAvailable;	// Auto reset event signaled when entries are pushed or when all work is done
+	PathArena			m_paths;			// Storage for paths of queued entries
+	PathSet				m_handledFiles;
 	CriticalSection		m_handledFilesCs;
-	FilesSet			m_createdDirs;
+	PathSet				m_createdDirs;
 	CriticalSection		m_createdDirsCs;
-	FilesSet			m_purgeDirs;
+	bool				m_deferCreateDirs;	// Server creates directories of files it writes. Others are sent together when all files are written
+	FilesSet			m_deferredDirs;		// Protected by m_createdDirsCs
+	PathSet				m_purgeDirs;
+	WildcardMatcher		m_excludeWildcards;	// Compiled from settings at start of each process call
+	WildcardMatcher		m_excludeWildcardDirectories;
+	WildcardMatcher		m_optionalWildcards;
 	CriticalSection		m_networkInitCs;
 	bool				m_networkWsaInitDone;
 	bool				m_networkInitDone;
 	WString				m_networkServerName;
 	WString				m_networkServerNetDirectory;
-	AddrInfo*			m_serverAddrInfo;
+	AddrInfo*			m_serverAddrInfo;	// Owned by connection pool if there is one
+	WString				m_poolKey;
 	Guid				m_secretGuid;
 	CriticalSection		m_secretGuidCs;
 	FileDatabase		m_fileDatabase;
+	DictionaryCache		m_dictionaries;
+	DestinationCache	m_destCache;
+	DestinationSnapshots m_destSnapshots;
 
-	CompressionStats	m_compressionStats;
+	List<ClientSettings> m_fanOutSettings;	// Settings of fan-out clients. List keeps them at stable addresses
+	Vector<Client*>		m_fanOut;			// One client per fan-out destination. They never traverse, this client feeds them
+	Vector<Connection*>	m_fanOutConnections;// Used by fan-out clients. Destination connection of each thread, indexed like m_workQueues
+	Vector<SourceFileCache> m_sourceCaches;	// One per thread, indexed like m_workQueues
 
 						Client(const Client&) = delete;
 	void				operator=(const Client&) = delete;
@@ -224,19 +402,26 @@ private:
 class Client::Connection
 {
 public:
-						Connection(const ClientSettings& settings, ClientStats& stats, Socket s, CompressionStats& compressionStats);
+						Connection(const ClientSettings& settings, ClientStats& stats, Socket s, HashAlgorithm hashAlgorithm);
 						~Connection();
 	bool				sendCommand(const Command& cmd);
 	bool				sendTextCommand(const wchar_t* text);
-	bool				sendWriteFileCommand(const wchar_t* src, const wchar_t* dst, const FileInfo& srcInfo, uint srcAttributes, u64& outSize, u64& outWritten, bool& outLinked, NetworkCopyContext& copyContext, bool &processedByServer);
+	bool				sendWriteFileCommand(const wchar_t* src, const wchar_t* dst, const FileInfo& srcInfo, uint srcAttributes, u64& outSize, u64& outWritten, bool& outLinked, NetworkCopyContext& copyContext, bool &processedByServer, WriteResponse batchResponse = WriteResponseCount);
+	bool				sendWriteFilesCommand(const Vector<CopyEntry*>& entries, Vector<WriteResponse>& outResponses);
+	bool				sendWriteFileRangeCommand(const CopyEntry& entry, NetworkCopyContext& copyContext);
+	bool				sendWritePackedFilesCommand(const Vector<CopyEntry*>& entries, NetworkCopyContext& copyContext, Vector<u8>& outResults);
+	CompressionDictionary* getDictionary(const wchar_t* fileName); // Null if server has no dictionary for extension of file
 
 	enum				ReadFileResult { ReadFileResult_Error, ReadFileResult_Success, ReadFileResult_ServerBusy };
 	ReadFileResult		sendReadFileCommand(const wchar_t* src, const wchar_t* dst, const FileInfo& srcInfo, uint srcAttributes, u64& outSize, u64& outRead, NetworkCopyContext& copyContext, bool& processedByServer);
 
 
 	bool				sendCreateDirectoryCommand(const wchar_t* directory, FilesSet& outCreatedDirs);
+	bool				sendCreateDirectoriesCommand(const FilesSet& directories, FilesSet& outCreatedDirs);
 	bool				sendDeleteAllFiles(const wchar_t* dir);
+	bool				sendDeletePathsCommand(const Vector<NameAndFileInfo>& paths); // Names are relative to destination
 	bool				sendFindFiles(const wchar_t* dirAndWildcard, Vector<NameAndFileInfo>& outFiles, CopyContext& copyContext);
+	bool				sendFindFilesRecursive(const wchar_t* dirAndWildcard, int depthLeft, CopyContext& copyContext, const Function<bool(NameAndFileInfo&)>& entryFunc);
 	bool				sendGetFileAttributes(const wchar_t* file, FileInfo& outInfo, uint& outAttributes, uint& outError);
 
 	bool				destroy();
@@ -247,7 +432,16 @@ public:
 	HashContext			m_hashContext;
 
 	Socket				m_socket;
-	CompressionStats&	m_compressionStats;
+	CompressionStats	m_compressionStats; // Per connection so threads don't share one level
+	DictionaryCache*	m_dictionaries = nullptr; // Set if server trains dictionaries
+	SourceFileCache*	m_sourceCache = nullptr; // Set when fanning out, shared by all connections of a thread
+
+	WString				m_networkPath; // What connection was created with, used when connecting again
+	uint				m_connectionIndex = 0;
+	u64					m_reconnectTime = 0;
+	ConnectionPool*		m_pool = nullptr; // Connection goes back to pool when done
+	WString				m_poolKey;
+	ConnectionPool::SessionInfo m_poolInfo;
 
 						Connection(const Connection&) = delete;
 	void				operator=(const Connection&) = delete;
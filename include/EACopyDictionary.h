@@ -0,0 +1,88 @@
+// (c) Electronic Arts. All Rights Reserved.
+
+#pragma once
+
+#include "EACopyNetwork.h"
+
+namespace eacopy
+{
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Compression dictionaries. Server trains one zstd dictionary per file extension from small files it has written and
+// clients fetch them by id. Small files compress much better when the window starts out filled with typical content
+
+enum : uint
+{
+	DictionaryMaxSize				= 112*1024, // Size zstd recommends
+	DictionaryMaxFileSize			= 1024*1024, // Bigger files have enough content of their own
+	DictionarySampleMaxSize			= 32*1024, // Only beginning of files is sampled
+	DictionaryTrainSampleCount		= 256, // Number of samples of an extension needed to (re)train its dictionary
+	DictionaryMaxCount				= 64, // Dictionaries are never freed while store is alive so stop training at some point
+	DictionaryMaxExtensionLength	= 16, // Including terminator
+	DictionarySeedFileCount			= 16*1024, // Max number of files from database history sampled when server starts
+};
+
+// Sent in response to GetDictionaries
+struct DictionaryInfo
+{
+	uint			id;
+	uint			size;
+	wchar_t			extension[DictionaryMaxExtensionLength];
+};
+
+class CompressionDictionary
+{
+public:
+					CompressionDictionary(uint id, const WString& extension, Vector<u8>&& data);
+					~CompressionDictionary();
+
+	void*			getCDict(int level); // ZSTD_CDict for level, created on first use
+	void*			getDDict();
+
+	const uint		id;
+	const WString	extension;
+	const Vector<u8> data;
+
+private:
+	CriticalSection	m_cs;
+	void*			m_cdicts[23] = {};
+	void*			m_ddict = nullptr;
+};
+
+// Returns lower case extension of file without dot. Returns false if extension is too long to have a dictionary
+bool				getDictionaryExtension(WString& outExtension, const wchar_t* fileName);
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// DictionaryStore - Owns dictionaries. Server adds samples and trains, client adds dictionaries fetched from server
+
+class DictionaryStore
+{
+public:
+					~DictionaryStore();
+
+	void			addSample(const wchar_t* fileName, const u8* data, u64 size);
+	bool			addSampleFile(const wchar_t* fullPath, IOStats& ioStats);
+	bool			needsSamples(const wchar_t* fileName);
+	uint			train(); // Trains extensions with enough samples. Returns number of new dictionaries
+
+	void			addDictionary(uint id, const WString& extension, Vector<u8>&& data);
+	CompressionDictionary* getDictionary(uint id);
+	CompressionDictionary* findDictionary(const wchar_t* fileName); // Latest dictionary for extension of file
+	void			getDictionaryInfos(Vector<DictionaryInfo>& outInfos);
+	uint			getDictionaryCount();
+	void			clear();
+
+private:
+	struct			Samples { Vector<u8> data; Vector<size_t> sizes; };
+
+	CriticalSection	m_cs;
+	Map<WString, Samples> m_samples;
+	Map<uint, CompressionDictionary*> m_dictionaries;
+	Map<WString, CompressionDictionary*> m_latest;
+	uint			m_nextId = 1;
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+} // namespace eacopy
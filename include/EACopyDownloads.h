@@ -0,0 +1,156 @@
+// (c) Electronic Arts. All Rights Reserved.
+
+#pragma once
+
+#include "EACopyNetwork.h"
+
+namespace eacopy
+{
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Server side scheduling of ReadFile downloads. Downloads wait in a queue instead of being sent back busy and are
+// handed out fair between clients. Number of active downloads follows the measured throughput of the server
+
+enum : uint
+{
+	DownloadMinCost					= 64*1024, // Cost of a download in fair queue is its size but never less than this
+	DownloadMinActiveCount			= 4, // Admission never goes below this number of active downloads
+	DownloadQueueTimeoutMs			= 30*1000, // Download waiting longer than this gets a busy response and client retries
+	DownloadRateWindowMs			= 1000, // Throughput is measured over windows of at least this length
+	SharedSendWaitMs				= 10*1000, // Download waiting for another one to produce stream gives up after this and reads file itself
+	SharedSendCacheMaxSize			= 256*1024*1024, // Compressed streams kept around for other clients asking for same file
+};
+
+class DownloadScheduler
+{
+public:
+					DownloadScheduler() {}
+
+	void			reset(uint maxActiveCount); // Called when server starts
+
+					// Blocks until download can start. Clients are served in the order of how many bytes they got compared
+					// to other clients (start time fair queueing). Returns false if it timed out or scheduler is stopped
+	bool			acquire(const WString& clientKey, u64 fileSize, uint timeoutMs);
+
+					// Must be called once for every successful acquire when download is done
+	void			release(const WString& clientKey, u64 bytesSent);
+
+					// Wakes up all waiting downloads and makes all future acquires fail
+	void			stop();
+
+	struct			Stats { uint activeCount; uint waitingCount; uint admitLimit; u64 bytesPerSecond; u64 queuedCount; u64 timedOutCount; u64 queueTime; };
+	Stats			getStats();
+
+private:
+	struct			Client { u64 virtualTime = 0; uint activeCount = 0; uint waitingCount = 0; };
+	struct			Waiter { Client* client; u64 cost; Event granted; bool isGranted = false; };
+	using			Clients = Map<WString, Client>;
+
+	bool			canAdmitNoLock() const;
+	void			admitNoLock(Client& client, u64 cost);
+	void			dispatchNoLock();
+	void			updateRateNoLock(u64 bytesSent, bool isQueued);
+	void			removeClientIfIdleNoLock(const WString& clientKey);
+
+	CriticalSection	m_cs;
+	Clients			m_clients;
+	List<Waiter*>	m_waiters; // Arrival order, ties in virtual time are served oldest first
+	u64				m_virtualTime = 0; // Start tag of the latest admitted download
+	uint			m_activeCount = 0;
+	uint			m_maxActiveCount = 100;
+	uint			m_admitLimit = 100; // Adjusted by measured throughput, never above m_maxActiveCount
+	int				m_admitDirection = -1; // Direction limit is moved in while throughput doesn't get worse
+	bool			m_stopped = false;
+
+	// Throughput of all downloads together, measured when downloads finish. Includes both disk and network time
+	u64				m_windowStart = 0;
+	u64				m_windowBytes = 0;
+	u64				m_bytesPerSecond = 0;
+
+	// Stats
+	u64				m_queuedCount = 0;
+	u64				m_timedOutCount = 0;
+	u64				m_queueTime = 0;
+
+					DownloadScheduler(const DownloadScheduler&) = delete;
+	void			operator=(const DownloadScheduler&) = delete;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// SharedSendCache - Bounded cache of compressed streams sent for ReadFile. Downloads of the same version of a file with the
+// same compression share one read and compression. First download records the stream while sending it, downloads
+// arriving meanwhile wait for it and later ones replay it. Streams pushed out of memory can be spilled to disk
+
+struct SendCacheKey
+{
+	FileKey			file; // Name is full server path
+	u8				compressionLevel; // As requested by client, 255 is adaptive
+	uint			dictionaryId;
+
+	bool operator<(const SendCacheKey& o) const;
+};
+
+class SharedSendCache
+{
+public:
+	struct			Entry;
+
+					~SharedSendCache();
+
+					// Spilled streams are written to a sub directory which is emptied here. Empty directory disables spilling
+	void			setSpillDirectory(const wchar_t* directory, u64 maxSize, IOStats& ioStats);
+
+					// Returns entry for stream. If outIsProducer is true caller must record stream in to entry->data and call
+					// produced, otherwise it should call wait and if that returns true send entry->data as is
+	Entry*			acquire(const SendCacheKey& key, bool& outIsProducer, IOStats& ioStats);
+	void			produced(Entry* entry, bool success, IOStats& ioStats);
+	bool			wait(Entry* entry, uint timeoutMs); // Returns false if producer failed or is too slow, caller sends file itself
+	void			release(Entry* entry, IOStats& ioStats);
+
+					// Drops all streams of other versions of file. Called by file database when a file is added
+	void			invalidate(const WString& fullPath, const FileTime& lastWriteTime, u64 fileSize);
+
+	struct			Stats { uint entryCount; u64 size; uint spillCount; u64 spillSize; u64 hitCount; u64 spillHitCount; u64 missCount; };
+	Stats			getStats();
+
+	u64				m_maxSize = SharedSendCacheMaxSize;
+
+	struct			Entry
+	{
+		SendCacheKey key;
+		Vector<u8>	data;
+		Event		done;
+		bool		valid = false; // Set when data holds the whole stream
+		bool		removed = false; // Not in cache anymore, deleted when last user releases it
+		uint		refCount = 0;
+		u64			lastUseTime = 0;
+	};
+
+private:
+	struct			SpillEntry { WString fileName; u64 size; u64 lastUseTime; };
+	using			Entries = Map<SendCacheKey, Entry*>;
+	using			SpillEntries = Map<SendCacheKey, SpillEntry>;
+
+	void			removeNoLock(Entries::iterator it);
+	void			evictNoLock(Vector<Entry*>& outSpill);
+	void			evictSpillNoLock(IOStats& ioStats);
+	void			spill(Vector<Entry*>& entries, IOStats& ioStats);
+	bool			readSpill(Entry& entry, const SpillEntry& spillEntry, IOStats& ioStats);
+
+	CriticalSection	m_cs;
+	Entries			m_entries;
+	u64				m_size = 0;
+	SpillEntries	m_spillEntries;
+	WString			m_spillDirectory;
+	u64				m_spillMaxSize = 0;
+	u64				m_spillSize = 0;
+	uint			m_spillFileIndex = 0;
+	u64				m_hitCount = 0;
+	u64				m_spillHitCount = 0;
+	u64				m_missCount = 0;
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+} // namespace eacopy
@@ -26,7 +26,7 @@ namespace eacopy
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-enum : uint { ProtocolVersion = 20 };	// Network protocol version.. must match EACopy and EACopyService otherwise it will fallback to non-server copy behavior
+enum : uint { ProtocolVersion = 29 };	// Network protocol version.. must match EACopy and EACopyService otherwise it will fallback to non-server copy behavior
 enum : uint { DefaultPort = 18099 };	// Default port for client and server to connect. Can be overridden with command line
 
 
@@ -46,6 +46,14 @@ enum : uint { DefaultPort = 18099 };	// Default port for client and server to co
 	EACOPY_COMMAND(Done) 			/* Tell server that connection is done copying and can close */ \
 	EACOPY_COMMAND(RequestReport) 	/* Ask server for a status report */ \
 	EACOPY_COMMAND(GetFileInfo) 	/* Get file info for file/directory on server side */ \
+	EACOPY_COMMAND(FindFilesRecursive) /* Return list of files/directories for entire tree. Paths are relative to searched directory */ \
+	EACOPY_COMMAND(WriteFiles) 		/* Negotiate write of multiple files in one round trip. Files that need content are written with WriteFile */ \
+	EACOPY_COMMAND(WriteFileRange) 	/* Write one range of a file striped over multiple connections in the same session */ \
+	EACOPY_COMMAND(WritePackedFiles) /* Write multiple small files with content in one command */ \
+	EACOPY_COMMAND(GetDictionaries) /* Return id and extension of latest compression dictionaries trained by server */ \
+	EACOPY_COMMAND(GetDictionary) 	/* Return content of compression dictionary */ \
+	EACOPY_COMMAND(CreateDirs) 		/* Create multiple directories and optionally return all directories created by session */ \
+	EACOPY_COMMAND(DeletePaths) 	/* Delete multiple files and directories in one command */ \
 
 #define EACOPY_COMMAND(x) CommandType_##x,
 
@@ -66,6 +74,8 @@ struct Command
 enum ProtocolFlags : u8
 {
 	UseSecurityFile = 1,
+	UseHashXxh3 = 2, // Hashes are xxh3-128. If not set hashes are md5
+	UseDictionaries = 4, // Server trains compression dictionaries, see GetDictionaries
 };
 
 struct VersionCommand : Command
@@ -100,14 +110,6 @@ enum WriteFileType : u8
 	WriteFileType_Compressed
 };
 
-// TODO: write file attributes?
-struct WriteFileCommand : Command
-{
-	WriteFileType writeType;
-	FileInfo info;
-	wchar_t path[1];
-};
-
 enum WriteResponse : u8
 {
 	WriteResponse_Copy,
@@ -117,10 +119,60 @@ enum WriteResponse : u8
 	WriteResponse_Odx,
 	WriteResponse_Skip,
 	WriteResponse_Hash,
+	WriteResponse_CopyChunks, // Followed by chunk exchange, see Server::receiveChunkedFile
 	WriteResponse_BadDestination, // Must be last!
 	WriteResponseCount = WriteResponse_BadDestination
 };
 
+// TODO: write file attributes?
+struct WriteFileCommand : Command
+{
+	WriteFileType writeType;
+	WriteResponse batchResponse; // Copy, Hash or CopyChunks from WriteFiles. Server does not answer again and client continues right away. Otherwise WriteResponseCount
+	uint dictionaryId; // Compressed content uses this dictionary (from GetDictionary). 0 means none
+	FileInfo info;
+	wchar_t path[1];
+};
+
+// Followed by fileCount entries of FileInfo + null terminated path. Server responds with fileCount WriteResponses and
+// handles Skip, Link and Odx directly. Copy, Hash and CopyChunks is what WriteFile would have answered first and are passed
+// back in WriteFileCommand::batchResponse. Other responses means client should fall back to a normal WriteFile for that file
+struct WriteFilesCommand : Command
+{
+	WriteFileType writeType;
+	uint fileCount;
+	u8 files[1];
+};
+
+enum { WriteFilesMaxCount = 64 };
+
+// Followed by size bytes of content in the same format as WriteFile. Server responds with u8 success after range is written.
+// Ranges are tied together by the session (secretGuid) so they can be sent over any connection. First range to arrive creates
+// the file and last range to land sets last write time and adds the file to history
+struct WriteFileRangeCommand : Command
+{
+	WriteFileType writeType;
+	FileInfo info;
+	u64 offset;
+	u64 size;
+	wchar_t path[1];
+};
+
+// Sent for small files that server answered Copy for in WriteFiles. data holds fileCount entries of FileInfo, null terminated
+// path and fileSize bytes of content. With WriteFileType_Compressed data is one zstd frame of packedSize bytes instead.
+// Whole command must fit in server receive buffer. Server responds with fileCount u8 success
+struct WritePackedFilesCommand : Command
+{
+	WriteFileType writeType;
+	uint fileCount;
+	uint packedSize;
+	uint dictionaryId; // Same as WriteFileCommand
+	u8 data[1];
+};
+
+enum { WritePackedFilesMaxSize = 256*1024 }; // Max size of packed data
+enum { DefaultPackedFileThreshold = 16*1024 }; // Files smaller than this are packed by default
+
 struct ReadFileCommand : Command
 {
 	u8 compressionLevel; // 0 means no compression, 255 means dynamic compression
@@ -154,6 +206,18 @@ enum CreateDirResponse : u8
 	// DO NOT ADD HERE, add above SuccessCreated.. "value - CreateDirResponse_SuccessExisted" is used to figure out how many directories up created
 };
 
+// Server creates parent directories of files written so client only sends directories that might be empty.
+// Paths are null terminated after each other. Response is CreateDirResponse and, if asked for, uint size followed by
+// null terminated paths relative to destination of all directories created by session
+struct CreateDirsCommand : Command
+{
+	uint dirCount;
+	u8 returnCreatedDirs;
+	wchar_t paths[1];
+};
+
+enum { CreateDirsMaxSize = 256*1024 }; // Max size of paths in one command
+
 struct DeleteFilesCommand : Command
 {
 	wchar_t path[1];
@@ -166,13 +230,34 @@ enum DeleteFilesResponse : u8
 	DeleteFilesResponse_BadDestination,
 };
 
+// Used by purge to delete everything in a destination directory that is not part of source. Each path is relative to
+// destination, prefixed with its uint attributes and null terminated. Directories are deleted with all content.
+// Response is DeleteFilesResponse
+struct DeletePathsCommand : Command
+{
+	uint pathCount;
+	u8 paths[1];
+};
+
+enum { DeletePathsMaxSize = 256*1024 }; // Max size of paths in one command
+
 struct FindFilesCommand : Command
 {
 	wchar_t pathAndWildcard[1];
 };
 
+// Response is streamed the same way as FindFiles. Each directory is sent in its own block(s) and always after the block containing the directory itself
+struct FindFilesRecursiveCommand : Command
+{
+	int depthLeft;
+	wchar_t pathAndWildcard[1];
+};
+
+// Server responds with compression level sum. Connections kept open go in to client's connection pool and the server keeps
+// their environment. Older clients send command without keepOpen
 struct DoneCommand : Command
 {
+	bool keepOpen;
 };
 
 
@@ -185,6 +270,17 @@ struct GetFileInfoCommand : Command
 	wchar_t path[1];
 };
 
+// Server responds with uint count followed by count DictionaryInfo
+struct GetDictionariesCommand : Command
+{
+};
+
+// Server responds with uint size followed by dictionary content. Size is 0 if id is unknown
+struct GetDictionaryCommand : Command
+{
+	uint id;
+};
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Network utils
 
@@ -197,39 +293,53 @@ struct Socket
 const wchar_t*	optimizeUncPath(const wchar_t* uncPath, WString& temp, bool allowLocal = true);
 bool			sendData(Socket& socket, const void* buffer, uint size);
 bool			receiveData(Socket& socket, void* buffer, uint size, bool closeIsError = true);
+bool			receiveBufferedData(Socket& socket, void* buffer, uint size, const char* recvBuffer, uint recvPos, uint& commandSize); // Takes bytes after commandSize in recvBuffer first, commandSize grows with what was taken
 bool			setBlocking(Socket& socket, bool blocking);
 bool			disableNagle(Socket& socket);
 bool			setSendBufferSize(Socket& socket, uint sendBufferSize);
 bool			setRecvBufferSize(Socket& socket, uint recvBufferSize);
 void			closeSocket(Socket& socket);
 bool			isValidSocket(Socket& socket);
+bool			isSocketIdle(Socket& socket); // False if peer closed connection or sent something nobody asked for
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-struct CompressionStats
-{
-	CriticalSection		lock;
-	u64					sendTime[8] = { 0 };
-	uint				sendBytes[8] = { 0 };
-	u64					activeSendTime = 0;
-	u64					activeSendBytes = 0;
-
-	u64					currentSendTime = 0;
-	u64					currentSendBytes = 0;
-	uint				currentIndex = 0;
+// Compression level controller of one connection. Only the thread owning the connection updates it so there is no lock,
+// the helper thread compressing ahead in sendFile only reads currentLevel. When level is adaptive it is moved one step at
+// a time in the direction that gives more uncompressed bytes per second through compression and send together
 
-	u64					lastTimeUnitPerBytes = 0;
+enum : uint
+{
+	CompressionWindowTime		= 100000, // Throughput is measured over windows of compression and send time of at least this length
+	CompressionMaxAdaptiveLevel	= 14,
+	CompressionSampleSize		= 64*1024, // Bytes sampled per chunk, in 16 slices spread over it, to estimate its entropy
+};
 
+struct CompressionStats
+{
+	Atomic<int>			currentLevel { 1 };
 	bool				fixedLevel = false;
-	int					currentLevel = 0;
+	int					direction = 1;
+	u64					windowSize = 0;				// Uncompressed bytes of current window
+	u64					windowTime = 0;
+	u64					lastBytesPerSecond = 0;		// Throughput of previous window
+
+	void				init(u8 compressionLevel);	// 255 is adaptive
+	bool				update(u64 size, u64 time);	// Adds one sent chunk. Returns true if level changed
 };
 
 enum { NetworkTransferChunkSize = CopyContextBufferSize };
 
+class CompressionDictionary;
+
+enum : uint { SendRecordMaxSize = 32*1024*1024 };
+
 struct NetworkCopyContext : CopyContext
 {
 	void* compContext = nullptr;
 	void* decompContext = nullptr;
+	CompressionDictionary* dictionary = nullptr; // Set by caller around transfers that use a dictionary
+	Vector<u8>*			sendRecord = nullptr; // Set by caller to get a copy of the compressed stream sent by sendFile. Only used for files up to SendRecordMaxSize
 
 	~NetworkCopyContext();
 };
@@ -242,9 +352,13 @@ struct SendFileStats
 	u64			sendSize = 0;
 	u64			compressTime = 0;
 	u64			compressionLevelSum = 0;
+	u64			compressionSkipCount = 0;		// Files where no chunk ended up compressed (high entropy or no gain)
+	u64			compressionSkipSize = 0;		// Bytes sent uncompressed, includes chunks that didn't get smaller
+	u64			compressionLevelChanges = 0;
 };
 
-bool sendFile(Socket& socket, const wchar_t* src, size_t fileSize, WriteFileType writeType, NetworkCopyContext& copyContext, CompressionStats& compressionStats, bool useBufferedIO, IOStats& ioStats, SendFileStats& sendStats);
+// Sends fileSize bytes of src starting at offset
+bool sendFile(Socket& socket, const wchar_t* src, size_t fileSize, WriteFileType writeType, NetworkCopyContext& copyContext, CompressionStats& compressionStats, bool useBufferedIO, IOStats& ioStats, SendFileStats& sendStats, u64 offset = 0);
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
@@ -255,8 +369,19 @@ struct RecvFileStats
 	u64			decompressTime = 0;
 };
 
+// Receives size bytes in to already open file at offset. Offset ~0 means append. If file is opened for overlapped io writes are overlapped with receive of next chunk
+bool receiveFileData(bool& outSuccess, Socket& socket, const wchar_t* fullPath, FileHandle& file, u64 offset, u64 size, WriteFileType writeType, NetworkCopyContext& copyContext, char* recvBuffer, uint recvPos, uint& commandSize, IOStats& ioStats, RecvFileStats& recvStats);
 bool receiveFile(bool& outSuccess, Socket& socket, const wchar_t* fullPath, size_t fileSize, FileTime lastWriteTime, WriteFileType writeType, bool useUnbufferedIO, NetworkCopyContext& copyContext, char* recvBuffer, uint recvPos, uint& commandSize, IOStats& ioStats, RecvFileStats& recvStats);
 
+// Checks if all content of a file sent with writeType is in the first available bytes of data. outSize is set to the bytes the
+// content uses when complete. Partial means more is needed and it still fits in capacity, Unknown that it doesn't or can't be told
+enum BufferedFileData { BufferedFileData_Complete, BufferedFileData_Partial, BufferedFileData_Unknown };
+BufferedFileData getBufferedFileData(uint& outSize, const char* data, uint available, uint capacity, u64 fileSize, WriteFileType writeType);
+
+// Compresses/decompresses whole buffer as one zstd frame using the contexts (and dictionary if set) of copyContext
+bool compressData(uint& outSize, void* dest, uint destCapacity, const void* source, uint sourceSize, int level, NetworkCopyContext& copyContext);
+bool decompressData(uint& outSize, void* dest, uint destCapacity, const void* source, uint sourceSize, NetworkCopyContext& copyContext);
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 }
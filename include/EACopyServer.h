@@ -2,7 +2,9 @@
 
 #pragma once
 
-#include "EACopyNetwork.h"
+#include "EACopyChunks.h"
+#include "EACopyDictionary.h"
+#include "EACopyDownloads.h"
 
 namespace eacopy
 {
@@ -15,6 +17,8 @@ enum : uint {
 };
 
 enum : uint { DefaultHistorySize = 500000 }; // Number of files 
+enum : uint { SessionResumeTimeMs = 60*1000 }; // Session is kept this long after its last connection closed so reconnecting clients keep their state
+enum : uint { HandoffIdleTimeoutMs = 30*1000 }; // Handoff thread that has had nothing to do this long exits
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
@@ -31,15 +35,33 @@ struct ServerSettings
 	uint			maxHistory					= DefaultHistorySize;
 	bool			useSecurityFile				= true;
 	bool			useHash						= false;
+	HashAlgorithm	hashAlgorithm				= DefaultHashAlgorithm; // Sent to clients in version command so both sides produce comparable hashes
 	u64				useLinksThreshold			= 0;
 	bool			useLinksRelativePath		= true;
 	bool			useCompression				= true;
 	bool			useDeltaCompression			= true;
+	bool			useChunks					= false; // Split large files in to content defined chunks and only receive chunks not found in chunk store
+	uint			maxChunkCount				= DefaultMaxChunkCount;
+	bool			useDictionaries				= false; // Train zstd dictionaries per file extension from small files written and let clients compress with them
 	bool			useOdx						= false;
 	bool			logDebug					= false;
 	UseBufferedIO	useBufferedIO				= UseBufferedIO_Auto;
 	WString			primingDirectory;
-	uint			maxConcurrentDownloadCount	= 100;
+	uint			primeThreadCount			= 4; // Number of threads scanning priming directories in the background
+	bool			primeUseHash				= false; // Hash primed files once they are scanned so they can be linked by content
+	u64				primeHashBytesPerSecond		= 0; // Throttle for priming hashes. Zero means no throttle
+	WString			linkDatabaseFile; // File database is read from here at start and written back at stop. Records added while running are journaled
+	uint			maxConcurrentDownloadCount	= 100; // Upper limit of active ReadFile downloads. Actual limit follows measured throughput
+	u64				sendCacheMaxSize			= SharedSendCacheMaxSize; // Memory used for compressed streams of files sent. Zero disables cache
+	WString			sendCacheDirectory; // Streams pushed out of memory are spilled here. Empty means no spilling
+	u64				sendCacheSpillMaxSize		= 4ull*1024*1024*1024;
+	uint			findFilesThreadCount		= 4; // Number of threads used per connection to traverse directories for recursive find
+	uint			packedFilesThreadCount		= 4; // Number of threads used per connection to create files received packed
+	bool			useCompletionPort			= false; // Serve all connections from a fixed pool of workers instead of one thread per connection
+	uint			completionPortThreadCount	= 0; // Number of workers when using completion port. 0 means two per logical core
+	uint			handoffThreadCount			= 0; // Max threads completion port workers hand blocking commands to. 0 means four per logical core
+	uint			metricsPort					= 0; // Serves latency histograms and counters as prometheus text over http on this port. 0 means disabled
+	WString			traceFileName; // Timeline of commands, file io and waits is written here as chrome trace json when server stops
 	WString			user;
 	WString			password;
 	StringList		additionalLinkDirectories;
@@ -60,17 +82,35 @@ public:
 					// Stops the server. This call will return before the server is fully stopped. When start() returns server is stopped
 	void			stop();
 
-					// Will parse provided directory and add all found files to history
-	bool			primeDirectory(const wchar_t* directory, bool useLinksRelativePath);
+					// Will parse provided directory and add all found files to history. Without flush directory is only queued
+	bool			primeDirectory(const wchar_t* directory, bool useLinksRelativePath, bool flush = true);
 
 private:
 	struct			ConnectionInfo;
 
+	bool			connectionBegin(ConnectionInfo& info);
+	void			connectionEnd(ConnectionInfo& info);
+	void			removeExpiredSessionsNoLock();
+	bool			processCommands(ConnectionInfo& info, NetworkCopyContext& copyContext);
 	uint			connectionThread(ConnectionInfo& info);
+	bool			postReceive(ConnectionInfo& info);
+	uint			completionPortThread(Log& log, HANDLE completionPort);
+	void			completionPortProcess(ConnectionInfo& info, NetworkCopyContext& copyContext);
+	enum			CompletionAction { CompletionAction_Process, CompletionAction_Receive, CompletionAction_Handoff };
+	CompletionAction getCompletionAction(ConnectionInfo& info);
+	void			handoffConnection(ConnectionInfo& info);
+	uint			handoffThread(Log& log, List<Thread>::iterator self);
+	bool			findFilesRecursive(ConnectionInfo& info, const WString& rootDir, const wchar_t* wildcard, int depthLeft, IOStats& ioStats);
 	bool			getLocalFromNet(WString& outServerDirectory, bool& outIsExternalDirectory, const wchar_t* netDirectory);
+	bool			receiveChunkedFile(bool& outSuccess, ConnectionInfo& info, uint& commandSize, const wchar_t* fullPath, const FileInfo& fileInfo, WriteFileType writeType, uint chunkCount, NetworkCopyContext& copyContext, RecvFileStats& recvStats);
+	uint			metricsThread(Log& log, SOCKET listenSocket, Event& stopEvent);
+	void			populateMetrics(String& out);
+	void			addCommandLatency(const WString& serverPath, CommandType type, u64 time);
 
 	uint			m_protocolVersion;
 	FileDatabase	m_database;
+	ChunkStore		m_chunkStore;
+	DictionaryStore	m_dictionaries;
 
 	struct			GuidLess { bool operator()(const Guid& a, const Guid& b) const { return memcmp(&a, &b, sizeof(Guid)) < 0; } };
 	struct			ActiveSession;
@@ -92,12 +132,26 @@ private:
 	uint			m_activeConnectionCount = 0;
 	uint			m_handledConnectionCount = 0;
 
-	// Working state for priority
-	using			Queue = std::vector<void*>;
-	enum			{ MaxPriorityQueueCount = 32 };
-	Queue			m_queues[MaxPriorityQueueCount];
-	CriticalSection	m_queuesCs;
-
+	// Latency histograms, shared by all connections
+	LatencyHistogram m_commandHistograms[CommandType_Bad];
+	LatencyHistogram m_writeResponseHistograms[WriteResponseCount];
+	LatencyHistogram m_volumeHistograms[26]; // Command latency per drive letter of the path the command targets
+	IOHistograms	m_ioHistograms;
+
+	// ReadFile downloads wait for their turn in scheduler and share streams of files many clients ask for at the same time
+	DownloadScheduler m_downloads;
+	SharedSendCache	m_sharedSends;
+
+	// Completion port workers hand connections to these threads when buffered commands wait on client or other connections.
+	// Threads are created when all are busy, up to max count. Past that connections wait in queue. Idle threads retire after a while
+	CriticalSection	m_handoffCs;
+	List<ConnectionInfo*> m_handoffQueue;
+	Event			m_handoffAvailable { false };
+	List<Thread>	m_handoffThreads;
+	List<Thread>	m_handoffRetired; // Threads that have exited, joined by next handoff or when server stops
+	uint			m_handoffIdleCount = 0;
+	uint			m_handoffMaxCount = 0;
+	bool			m_handoffStop = false;
 
 					Server(const Server&) = delete;
 	void			operator=(const Server&) = delete;
@@ -108,20 +162,58 @@ private:
 struct Server::ConnectionInfo
 {
 	ConnectionInfo(Log& l, const ServerSettings& s, Socket so) : log(l), settings(s), socket(so) {}
-	~ConnectionInfo() { delete thread; }
+	~ConnectionInfo() { delete thread; delete[] recvBuffer1; delete[] recvBuffer2; }
+
+	enum { RecvBufferSize = 512*1024 };
 
 	Log& log;
 	const ServerSettings& settings;
-	Thread* thread = nullptr;
+	Thread* thread = nullptr; // Null when connection is served by completion port
 	Socket socket;
 	WString remoteIp;
+	Atomic<bool> finished { false };
+	CriticalSection ioCs; // Held when posting receive or closing socket so shutdown can cancel io of completion port connections
+	HelperThreads helperThreads; // Used by commands that spread work over multiple threads
+
+	// State kept between received commands
+	char* recvBuffer1 = nullptr;
+	char* recvBuffer2 = nullptr;
+	char* recvBuffer = nullptr;
+	uint recvPos = 0;
+	uint commands[CommandType_Bad] = { 0 };
+	u64 commandTimes[CommandType_Bad] = { 0 };
+	uint readEntries[ReadResponse_BadSource] = { 0 };
+	uint readEntryCount = 0;
+	uint writeEntries[WriteResponse_BadDestination] = { 0 };
+	uint writeEntryCount = 0;
+	IOStats ioStats;
+	SendFileStats sendStats;
+	CompressionStats compressionStats;
+	WString serverPath;
+	bool isValidEnvironment = false;
+	bool isServerPathExternal = false; // Tells whether "local" directory is external or not (it could be pointing to a network share)
+	bool isDone = false;
+	uint clientConnectionIndex = ~0u; // Note that this is the connection index from the same client where 0 is the controlling connection and the rest are worker connections
+	bool isParked = false; // Sent Done with keepOpen and is waiting in client connection pool
+	ActiveSession* activeSession = nullptr;
+	Guid secretGuid = {0};
+
+	// Outstanding receive when served by completion port
+	WSAOVERLAPPED overlapped;
 };
 
 struct Server::ActiveSession
 {
+	struct StripedFile { FileHandle handle = InvalidFileHandle; u64 bytesLeft = 0; bool success = false; };
+
 	uint connectionCount = 0;
+	u64 idleTime = 0; // When connection count went to zero
+	uint parkedCount = 0; // Connections waiting in client connection pool. When all of them are, the job using session is done
 	CriticalSection createdDirsCs;
 	FilesSet createdDirs;
+	FilesSet knownDirs; // Directories known to exist, whether created by session or not. Shares lock with createdDirs
+	CriticalSection stripedFilesCs;
+	Map<WString, StripedFile> stripedFiles;
 };
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -5,6 +5,8 @@
 #define WIN32_LEAN_AND_MEAN
 #define _HAS_EXCEPTIONS 0
 
+#include <atomic>
+#include <deque>
 #include <functional>
 #include <list>
 #include <map>
@@ -39,10 +41,12 @@ using								u64			= unsigned long long;
 using								String		= std::string;
 using								WString		= std::wstring;
 template<class T> using				List		= std::list<T>;
+template<class T> using				Deque		= std::deque<T>;
 template<class K, class V> using	Map			= std::map<K, V>;
 template<class K, class L> using	Set			= std::set<K, L>;
 template<class T> using				Vector		= std::vector<T>;
 template<class T> using				Function	= std::function<T>;
+template<class T> using				Atomic		= std::atomic<T>;
 using								FileHandle  = void*;
 #define								InvalidFileHandle ((FileHandle)-1)
 using								FindFileHandle  = void*;
@@ -108,7 +112,7 @@ private:
 class Event
 {
 public:
-						Event();
+						Event(bool manualReset = true); // Auto reset events are reset when a waiting isSet call returns true
 						~Event();
 	void				set();
 	void				reset();
@@ -117,6 +121,7 @@ public:
 private:
 	#if !defined(_WIN32)
 	CriticalSection		cs;
+	bool				manualReset;
 	#endif
 
 	void*				ev;
@@ -160,11 +165,27 @@ struct Hash
 
 inline bool isValid(const Hash& hash) { return hash.first != 0 || hash.second != 0; }
 
+enum HashAlgorithm : u8
+{
+	HashAlgorithm_Md5,
+	HashAlgorithm_Xxh3,
+};
+
+#if defined(EACOPY_USE_XXHASH)
+constexpr HashAlgorithm DefaultHashAlgorithm = HashAlgorithm_Xxh3;
+#else
+constexpr HashAlgorithm DefaultHashAlgorithm = HashAlgorithm_Md5;
+#endif
+
+bool					isHashAlgorithmSupported(HashAlgorithm algorithm);
+const wchar_t*			getHashAlgorithmName(HashAlgorithm algorithm);
+
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Misc
 
 u64						getTime();
+u64						getPreciseTime(); // Same clock and units as getTime but with sub microsecond resolution. Used for latencies and trace spans
 inline u64				getTimeMs() { return getTime() / 10000; }
 inline u64				timeToMs(u64 time) { return time / 10000; }
 bool					equalsIgnoreCase(const wchar_t* a, const wchar_t* b);
@@ -194,6 +215,200 @@ struct TimerScope
 	u64 start;
 };
 
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Trace - Optional timeline of what every thread did and when (/TRACE:file). Spans are recorded into a buffer per thread
+// and written as Chrome trace json (chrome://tracing, ui.perfetto.dev) when trace ends. Buffers of exited threads are reused
+
+enum : u64 { TraceMaxMemory = 256*1024*1024 }; // Spans of all threads together. Spans after this are dropped and counted
+
+extern Atomic<bool>		g_traceActive;
+bool					traceBegin(const wchar_t* fileName, const wchar_t* processName);
+bool					traceEnd(); // Writes file. Threads still recording at this point might be cut off
+void					traceSpan(const wchar_t* name, const wchar_t* detail, u64 startTime, u64 endTime); // Name must be a literal, detail is copied
+void					traceThreadName(const wchar_t* name); // Name must be a literal
+
+struct TraceScope
+{
+	TraceScope(const wchar_t* n, const wchar_t* d = nullptr) : name(g_traceActive ? n : nullptr), detail(d), start(name ? getPreciseTime() : 0) {}
+	~TraceScope() { if (name) traceSpan(name, detail, start, getPreciseTime()); }
+	const wchar_t* name;
+	const wchar_t* detail; // Must stay valid during scope
+	u64 start;
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Wildcards
+
+// Case insensitive match of whole string. '*' matches any sequence (including slashes) and '?' matches one character
+bool					matchWildcard(const wchar_t* str, const wchar_t* wildcard);
+
+// Set of wildcards compiled once and matched against a path in one pass. Pure literals and wildcards that are a literal with
+// a single '*' at start or end (like *.obj) are looked up in sets per literal length, only the rest are matched one by one
+class WildcardMatcher
+{
+public:
+	void				add(const wchar_t* wildcard); // Multiple wildcards can be separated with ';'
+	void				add(const List<WString>& wildcards);
+	void				clear();
+	bool				match(const wchar_t* str) const;
+	bool				empty() const { return !m_matchAll && m_exact.empty() && m_prefixes.empty() && m_suffixes.empty() && m_others.empty(); }
+
+private:
+	using				Literals = Set<WString, std::less<WString>>;
+	bool				m_matchAll = false;
+	Literals			m_exact;
+	Map<uint, Literals>	m_prefixes; // Key is literal length
+	Map<uint, Literals>	m_suffixes; // Key is literal length
+	Vector<WString>		m_others;
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Paths
+
+// Append only block storage for strings. Strings are null terminated and stay valid until clear(). Not thread safe
+class StringArena
+{
+public:
+						StringArena() = default;
+						~StringArena() { clear(); }
+	const wchar_t*		add(const wchar_t* str, uint length);
+	void				clear();
+	u64					getMemoryUsage() const { return m_memoryUsage; }
+
+private:
+	enum : uint			{ BlockCharCount = 64*1024 };
+	Vector<wchar_t*>	m_blocks; // Last block is the one being filled
+	uint				m_blockPos = BlockCharCount;
+	u64					m_memoryUsage = 0;
+
+						StringArena(const StringArena&) = delete;
+	void				operator=(const StringArena&) = delete;
+};
+
+// Interns paths so directories shared by many entries are stored once. Same string always returns same Path. Thread safe
+class PathArena
+{
+public:
+	struct				Path { const wchar_t* str; uint length; uint hash; };
+
+	const Path*			intern(const wchar_t* str, uint length);
+	const Path*			intern(const WString& str) { return intern(str.c_str(), uint(str.size())); }
+	const wchar_t*		add(const wchar_t* str, uint length); // Not interned, use for strings that are unique anyway
+	void				clear();
+	u64					getMemoryUsage();
+
+private:
+	void				grow();
+
+	CriticalSection		m_cs;
+	StringArena			m_strings;
+	Deque<Path>			m_paths; // Deque keeps addresses stable
+	Vector<Path*>		m_table; // Open addressing, size is power of two
+};
+
+// Set of paths compared case insensitive. Hash of case folded path is calculated once on insert and kept with the entry
+// in an open addressing table, strings live in an arena owned by the set. Not thread safe
+class PathSet
+{
+public:
+	struct				Slot { const wchar_t* str; uint length; uint hash; };
+
+	class				Iterator
+	{
+	public:
+						Iterator(const Slot* it, const Slot* end) : m_it(it), m_end(end) { skipEmpty(); }
+		const wchar_t*	operator*() const { return m_it->str; }
+		Iterator&		operator++() { ++m_it; skipEmpty(); return *this; }
+		bool			operator!=(const Iterator& o) const { return m_it != o.m_it; }
+	private:
+		void			skipEmpty() { while (m_it != m_end && !m_it->str) ++m_it; }
+		const Slot*		m_it;
+		const Slot*		m_end;
+	};
+
+	bool				insert(const wchar_t* str, uint length); // Returns false if already in set
+	bool				insert(const WString& str) { return insert(str.c_str(), uint(str.size())); }
+	bool				insert(const wchar_t* str) { return insert(str, uint(wcslen(str))); }
+	bool				contains(const wchar_t* str, uint length) const;
+	bool				contains(const WString& str) const { return contains(str.c_str(), uint(str.size())); }
+	bool				contains(const wchar_t* str) const { return contains(str, uint(wcslen(str))); }
+	bool				empty() const { return m_count == 0; }
+	uint				size() const { return m_count; }
+	void				clear();
+	u64					getMemoryUsage() const { return m_strings.getMemoryUsage() + m_slots.capacity()*sizeof(Slot); }
+	Iterator			begin() const { return Iterator(m_slots.data(), m_slots.data() + m_slots.size()); }
+	Iterator			end() const { return Iterator(m_slots.data() + m_slots.size(), m_slots.data() + m_slots.size()); }
+
+	static uint			getHash(const wchar_t* str, uint length); // Case insensitive
+
+private:
+	void				grow();
+
+	Vector<Slot>		m_slots;
+	uint				m_count = 0;
+	StringArena			m_strings;
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Latency histograms
+
+// Log-linear histogram (HDR style) of durations. Each power of two microseconds is split in 8 buckets so any value is
+// within 12.5% of its bucket. add() is lock free and can be called from any number of threads
+class LatencyHistogram
+{
+public:
+	enum : uint { SubBucketBits = 3, SubBucketCount = 1 << SubBucketBits, MaxExponent = 40, BucketCount = (MaxExponent - SubBucketBits + 1)*SubBucketCount };
+
+	void				add(u64 time); // Time in getTime() units
+	u64					getCount() const { return m_count.load(std::memory_order_relaxed); }
+	u64					getSum() const { return m_sum.load(std::memory_order_relaxed); } // In getTime() units
+	u64					getMax() const { return m_max.load(std::memory_order_relaxed); } // In getTime() units
+	u64					getPercentile(double fraction) const; // Upper bound of bucket containing fraction (0-1) of values. In getTime() units
+
+	static uint			getBucketIndex(u64 microseconds);
+	static u64			getBucketUpperBound(uint index); // In microseconds, exclusive
+
+private:
+	Atomic<u64>			m_buckets[BucketCount] = {};
+	Atomic<u64>			m_count { 0 };
+	Atomic<u64>			m_sum { 0 };
+	Atomic<u64>			m_max { 0 };
+};
+
+// IO primitives tracked in IOStats
+enum IOOp : u8
+{
+	IOOp_CreateRead,
+	IOOp_Read,
+	IOOp_CloseRead,
+	IOOp_CreateWrite,
+	IOOp_Write,
+	IOOp_CloseWrite,
+	IOOp_CreateLink,
+	IOOp_DeleteFile,
+	IOOp_MoveFile,
+	IOOp_RemoveDir,
+	IOOp_SetLastWriteTime,
+	IOOp_FindFile,
+	IOOp_FileInfo,
+	IOOp_CreateDir,
+	IOOp_CopyFile,
+	IOOp_Count,
+};
+
+const wchar_t*			getIOOpName(IOOp op);
+
+struct IOHistograms
+{
+	LatencyHistogram	ops[IOOp_Count];
+};
+
+// Formats "name  count  p50  p90  p99  max" line for a histogram, returns false if histogram is empty
+bool					formatLatency(wchar_t* buffer, uint bufferCapacity, const wchar_t* name, const LatencyHistogram& histogram);
+
+// Appends histogram as prometheus summary with quantiles. labels are written inside {} and can be empty
+void					appendPrometheusSummary(String& out, const char* metric, const char* labels, const LatencyHistogram& histogram);
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // IO
 
@@ -252,6 +467,21 @@ struct IOStats
 	uint				fileInfoCount = 0;
 	uint				createDirCount = 0;
 	uint				copyFileCount = 0;
+
+	IOHistograms*		histograms = nullptr; // Shared between threads. Times are also added here if set
+};
+
+void					addIOStats(IOStats& out, const IOStats& in); // Adds times and counts, histograms are shared and not touched
+
+// Adds elapsed time to one of the times in IOStats and its histogram
+struct IOTimerScope
+{
+	IOTimerScope(IOStats& s, u64& t, IOOp o) : stats(s), timer(t), op(o), start(getPreciseTime()) {}
+	~IOTimerScope() { u64 time = getPreciseTime() - start; timer += time; if (stats.histograms) stats.histograms->ops[op].add(time); if (g_traceActive) traceSpan(getIOOpName(op), nullptr, start, start + time); }
+	IOStats& stats;
+	u64& timer;
+	IOOp op;
+	u64 start;
 };
 
 
@@ -273,6 +503,7 @@ bool					equals(const FileInfo& a, const FileInfo& b);
 bool					ensureDirectory(const wchar_t* directory, uint attributes, IOStats& ioStats, bool replaceIfSymlink = false, bool expectCreationAndParentExists = true, FilesSet* outCreatedDirs = nullptr);
 bool					deleteDirectory(const wchar_t* directory, IOStats& ioStats, bool errorOnMissingFile = true);
 bool					deleteAllFiles(const wchar_t* directory, IOStats& ioStats, bool errorOnMissingFile = true);
+bool					deletePath(const wchar_t* fullPath, uint attributes, IOStats& ioStats, bool errorOnMissingFile = true); // File or directory with content. Reparse points are not entered
 bool					isAbsolutePath(const wchar_t* path);
 bool					openFileRead(const wchar_t* fullPath, FileHandle& outFile, IOStats& ioStats, bool useBufferedIO, _OVERLAPPED* overlapped = nullptr, bool isSequentialScan = true, bool sharedRead = true);
 bool					openFileWrite(const wchar_t* fullPath, FileHandle& outFilee, IOStats& ioStats, bool useBufferedIO, _OVERLAPPED* overlapped = nullptr, bool hidden = false, bool createAlways = true, bool sharedRead = false);
@@ -299,6 +530,23 @@ const wchar_t*			convertToShortPath(const wchar_t* path, WString& outTempBuffer)
 bool					isDotOrDotDot(const wchar_t* str);
 
 
+// Read-only view of a whole file. Handle is closed right away, the mapping keeps file alive until close
+class MappedFile
+{
+public:
+						~MappedFile();
+	bool				open(const wchar_t* fullPath, IOStats& ioStats);
+	void				close();
+	const u8*			data() const { return m_data; }
+	u64					size() const { return m_size; }
+
+private:
+	void*				m_mapping = nullptr;
+	const u8*			m_data = nullptr;
+	u64					m_size = 0;
+};
+
+
 struct					FindFileData { u64 data[1024]; };
 FindFileHandle			findFirstFile(const wchar_t* searchStr, FindFileData& findFileData, IOStats& ioStats);
 bool					findNextFile(FindFileHandle handle, FindFileData& findFileData, IOStats& ioStats);
@@ -326,34 +574,136 @@ public:
 	using			FilesHistory = List<FileKey>;
 	struct			FileRec { WString name; Hash hash;  FilesHistory::iterator historyIt; };
 	using			FilesMap = Map<FileKey, FileRec>;
-	using			FilesHashMap = Map<Hash, FileRec*>;
-	struct			PrimeDirRec { WString directory; uint rootLen = 0; };
+	using			FilesHashMap = Map<Hash, FileKey>;
+	struct			PrimeDirRec { WString directory; uint rootLen = 0; FileTime lastWriteTime = { 0, 0 }; }; // Zero time is fetched when directory is scanned
 	using			PrimeDirs = List<PrimeDirRec>;
+	struct			PrimeHashRec { WString fullPath; uint keyOffset = 0; FileInfo info; };
+	using			PrimeHashes = List<PrimeHashRec>;
+	struct			PrimeCheckpointFile { WString name; FileTime lastWriteTime; u64 fileSize; };
+	struct			PrimeCheckpointRec { FileTime lastWriteTime; Vector<WString> subDirs; Vector<PrimeCheckpointFile> files; };
+	using			PrimeCheckpoint = Map<WString, PrimeCheckpointRec>;
+	struct			PrimeStats { Atomic<u64> dirCount { 0 }; Atomic<u64> unchangedDirCount { 0 }; Atomic<u64> fileCount { 0 }; Atomic<u64> hashQueuedCount { 0 }; Atomic<u64> hashedCount { 0 }; Atomic<u64> hashedBytes { 0 }; };
+	struct			MappedHeader;
+	struct			MappedRecord;
+	enum			{ ShardCount = 64 };
+	enum			{ JournalFlushSize = 64*1024, JournalFlushMs = 1000, JournalCompactMinSize = 64*1024*1024 };
+
+					~FileDatabase();
 
 	FileRec			getRecord(const FileKey& key);
 	FileRec			getRecord(const Hash& hash);
 	uint			getHistorySize();
+	void			getRecentFiles(Vector<WString>& outNames, u64 maxFileSize, uint maxCount); // Names of newest records with size in (0, maxFileSize]
 	bool			findFileForDeltaCopy(WString& outFile, const FileKey& key);
 
 	void			addToFilesHistory(const FileKey& key, const Hash& hash, const WString& fullFileName);
 	void			removeFileHistory(const FileKey& key);
 	uint			garbageCollect(uint maxHistory);
 
+	// Priming scans queued directories with m_primeThreadCount threads. With m_primeUseHash files are hashed once all directories are
+	// scanned. Directories with the same last write time as in the checkpoint are not listed again, only the files recorded in the
+	// checkpoint are checked for changed size or time. If they all match only their sub directories are visited
 	bool			primeDirectory(const WString& directory, IOStats& ioStats, bool useRelativePath, bool flush);
 	bool			primeUpdate(IOStats& ioStats);
 	bool			primeWait(IOStats& ioStats);
+	void			primeCancel();
+	bool			isPriming();
+	bool			primeReadCheckpoint(const wchar_t* fullPath, IOStats& ioStats);
+	bool			primeWriteCheckpoint(IOStats& ioStats); // Writes to m_primeCheckpointFile
 
+	// readFile maps compact database (and replays journal if there is one), writeFile writes compact database and truncates journal
 	void			readFile(const wchar_t* fullPath, IOStats& ioStats);
 	void			writeFile(const wchar_t* fullPath, IOStats& ioStats);
+	bool			openJournal(const wchar_t* fullPath, IOStats& ioStats); // Append all records added to history from now on to journal next to database file. Call after readFile
+	void			flushJournal(); // Records are written in batches, this writes the ones still buffered
+
+	// Records are sharded on hash of key name so lookups for delta copy only need one shard. Each shard has its own lock and history
+	struct Shard
+	{
+		CriticalSection	cs;
+		FilesMap		files;
+		FilesHistory	history;
+		Vector<uint>	mappedIndices; // Mapped records belonging to this shard in history order
+		uint			mappedHistoryBegin = 0; // Entries in mappedIndices before this have been evicted
+		uint			mappedLiveCount = 0;
+	};
+
+	// Hash lookups go through their own shards (on hash) and are verified against the key shard.
+	// A hash shard lock may be taken while holding a shard lock, never the other way around
+	struct HashShard
+	{
+		CriticalSection	cs;
+		FilesHashMap	hashes;
+	};
+
+	Shard&			getShard(const wchar_t* keyName, uint keyNameLen);
+	HashShard&		getHashShard(const Hash& hash);
+	uint			evictOldest(Shard& shard, uint count);
+	void			removeHash(const Hash& hash, const FileKey& key);
+	uint			findMappedRecord(const FileKey& key);
+	uint			findMappedRecord(const WString& keyName);
+	uint			findMappedRecord(const Hash& hash, uint& inOutSlot); // inOutSlot ~0u starts probing, next call continues after last match
+	FileRec			getMappedRecord(uint index);
+	FileKey			getMappedRecordKey(uint index);
+	void			removeMappedRecord(Shard& shard, uint index);
+	void			closeMapped();
+	void			appendToJournal(const FileKey& key, const Hash& hash, const WString& fullFileName);
+	void			writeJournal(bool all); // Only called by the thread that set m_journalWriting
+	bool			compactJournal(IOStats& ioStats);
+	bool			createJournal(IOStats& ioStats);
+	bool			reopenJournal(IOStats& ioStats);
+
+	bool			primeHashUpdate(IOStats& ioStats, CopyContext& copyContext, HashContext& hashContext);
 
 	CriticalSection	m_primeDirsCs;
 	PrimeDirs		m_primeDirs;
+	PrimeHashes		m_primeHashes;
+	PrimeCheckpoint	m_primeCheckpoint;
+	PrimeCheckpoint	m_primeCheckpointPending; // Updates made while m_primeCheckpoint is written to file without lock
+	bool			m_primeCheckpointWriting = false;
 	uint			m_primeActive = 0;
-
-	FilesMap		m_files;
-	FilesHashMap	m_fileHashes;
-	FilesHistory	m_filesHistory;
-	CriticalSection	m_filesCs;
+	u64				m_primeCheckpointTime = 0;
+	u64				m_primeHashStartTime = 0; // Start of current hash throttle window
+	u64				m_primeHashWindowBytes = 0;
+	Atomic<bool>	m_primeCancel { false };
+	uint			m_primeThreadCount = 1;
+	bool			m_primeUseHash = false;
+	u64				m_primeHashBytesPerSecond = 0; // Zero means no throttling
+	WString			m_primeCheckpointFile; // Written every minute while priming and when done. Empty means no checkpoint
+	PrimeStats		m_primeStats;
+
+	Shard			m_shards[ShardCount];
+	HashShard		m_hashShards[ShardCount];
+	uint			m_maxHistory = 0; // Each shard evicts its oldest records when it holds more than its part of this. Zero means no limit
+	HashAlgorithm	m_hashAlgorithm = DefaultHashAlgorithm; // Hashes stored in file are dropped on read if they were created with a different algorithm
+
+	// Called outside locks for every record added to history. Lets caches of file content drop other versions of the file
+	using			FileAddedFunc = Function<void(const FileKey& key, const WString& fullFileName)>;
+	FileAddedFunc	m_fileAddedFunc;
+
+	// Records read from compact database file. These are older than everything in shard memory and are never copied in to memory.
+	// Touching a record moves it to its shard and marks the mapped record as removed (only ever written under lock of owning shard)
+	MappedFile		m_mappedFile;
+	const MappedRecord* m_mappedRecords = nullptr;
+	const uint*		m_mappedKeySlots = nullptr; // Open addressing on key name. Index + 1 in to m_mappedRecords, zero is empty
+	const uint*		m_mappedHashSlots = nullptr; // Open addressing on hash. Index + 1 in to m_mappedRecords, zero is empty
+	const wchar_t*	m_mappedNames = nullptr;
+	uint			m_mappedRecordCount = 0;
+	uint			m_mappedKeySlotCount = 0;
+	uint			m_mappedHashSlotCount = 0;
+	Vector<u8>		m_mappedRemoved;
+
+	u64				m_journalCompactMinSize = JournalCompactMinSize; // Journal is rewritten with only the records not in database file when it grows past this
+	CriticalSection	m_journalCs; // Protects buffer and file handle. File is written without lock by the thread that set m_journalWriting
+	WString			m_journalFileName;
+	FileHandle		m_journalFile = InvalidFileHandle;
+	Atomic<bool>	m_journalActive { false }; // Checked without lock before taking m_journalCs
+	Vector<u8>		m_journalBuffer; // Records not written yet
+	Vector<u8>		m_journalWriteBuffer; // Records being written, swapped with m_journalBuffer
+	u64				m_journalBufferTime = 0; // When first record in m_journalBuffer was added
+	u64				m_journalSize = 0;
+	u64				m_journalCompactSize = 0; // Grows with size of compacted journal so compaction stays amortized
+	bool			m_journalWriting = false;
 };
 
 
@@ -364,14 +714,15 @@ public:
 class HashContext
 {
 public:
-	HashContext(u64& time, u64& count);
+	HashContext(u64& time, u64& count, HashAlgorithm algorithm = DefaultHashAlgorithm);
 
 	bool init();
 	~HashContext();
 
-	void* m_handle = nullptr;
+	void* m_handle = nullptr; // Only used by md5
 	u64& m_time;
 	u64& m_count;
+	HashAlgorithm m_algorithm;
 };
 
 class HashBuilder
@@ -402,32 +753,51 @@ void					logScopeEnter();
 void					logScopeLeave();
 
 
+// Messages are written to a ring per thread without locks or allocations and log thread merges the rings in the order
+// messages were written. Messages too big for a ring go through a locked queue
+struct					LogRing;
+class					LogContext;
+
 class Log
 {
 public:
+						~Log();
 	void				init(const wchar_t* logFile, bool logDebug, bool cacheRecentErrors);
 	void				deinit(const Function<void()>& lastChanceLogging = Function<void()>());
 	bool				isDebug() const { return m_logDebug; }
 	void				traverseRecentErrors(const Function<bool(const WString&)>& errorFunc);
 
 private:
-	struct				LogEntry { WString str; bool linefeed; bool isError; };
+	struct				LogEntry { WString str; bool linefeed; bool isError; u64 sequence; };
+	struct				DrainEntry { u64 sequence; const wchar_t* str; bool linefeed; bool isError; };
 
-	void				writeEntry(bool isDebuggerPresent, const LogEntry& entry);
+	LogRing*			acquireRing();
+	void				releaseRing(LogRing* ring);
+	void				writeToQueue(LogContext& context, const wchar_t* str, bool linefeed, bool isError);
+	void				writeEntry(bool isDebuggerPresent, const DrainEntry& entry);
 	uint				processLogQueue(bool isDebuggerPresent);
 	uint				logQueueThread();
 
 	WString				m_logFileName;
 	bool				m_logDebug = false;
 	bool				m_cacheRecentErrors = false;
+	Atomic<bool>		m_logOpen { false };
+	Atomic<u64>			m_logSequence { 0 };
 	CriticalSection		m_logQueueCs;
 	List<LogEntry>*		m_logQueue = nullptr;
+	CriticalSection		m_ringsCs;
+	Vector<LogRing*>	m_rings; // Rings are reused by new threads when their thread is done, freed with log
+	CriticalSection		m_drainCs;
+	Vector<LogRing*>	m_drainRings;
+	Vector<u64>			m_drainPositions;
+	Vector<DrainEntry>	m_drainEntries;
 	List<WString>		m_recentErrors;
-	WString				m_logLastText;
-	bool				m_logQueueFlush = false;
+	Atomic<bool>		m_logQueueFlush { false };
+	Event				m_logWake { false };
 	Thread*				m_logThread = nullptr;
 	FileHandle			m_logFile = InvalidFileHandle;
-	bool				m_logThreadActive = false;
+	Atomic<bool>		m_logThreadActive { false };
+	friend class		LogContext;
 	friend void			logInternal(const wchar_t* buffer, bool flush, bool linefeed, bool isError);
 	friend void			logScopeEnter();
 	friend void			logScopeLeave();
@@ -442,15 +812,42 @@ public:
 	int					getLastError() const { return m_lastError; }
 	void				resetLastError() { m_lastError = 0; }
 	void				mute() { m_muted = true; }
+	static LogContext*	getCurrent(); // Context of calling thread, can be used to log from helper threads
 
 	Log&				log;
 
 private:
 	LogContext*			m_lastContext;
+	LogRing*			m_ring = nullptr; // Taken from log on first message
 	int					m_lastError = 0;
 	bool				m_muted = false;
+	friend class		Log;
 	friend void			logErrorf(const wchar_t* fmt, ...);
 	friend void			logInternal(const wchar_t* buffer, bool flush, bool linefeed, bool isError);
+	friend void			logScopeEnter();
+	friend void			logScopeLeave();
+};
+
+// Threads helping the calling thread with a parallel job. Threads are created the first time they are needed and reused until
+// destroyed. They log through the log of the calling thread's context and their io stats are added to the caller's when job is done
+class HelperThreads
+{
+public:
+						~HelperThreads();
+
+						// Runs func on calling thread and on helperCount helper threads at the same time and returns when all are done
+	void				run(uint helperCount, IOStats& ioStats, const Function<void(IOStats& threadIoStats)>& func);
+
+private:
+	struct				Helper { Thread thread; Event start { false }; IOStats ioStats; };
+	uint				helperThread(Helper& helper);
+
+	List<Helper>		m_helpers; // List so helpers don't move when more are added
+	const Function<void(IOStats&)>* m_func = nullptr;
+	Log*				m_log = nullptr;
+	Atomic<uint>		m_activeCount { 0 };
+	Event				m_done { false };
+	bool				m_stop = false;
 };
 
 void					populateStatsTime(Vector<WString>& stats, const wchar_t* name, u64 ms, uint count);
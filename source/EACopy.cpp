@@ -64,6 +64,10 @@ void printHelp()
 	logInfoLinef(L"                      (If SERVERADDR is provided :port can be added there instead)");
 	logInfoLinef(L"           /C[:n]  :: use Compression. No value provided will auto adjust level. Only works with server");
 	logInfoLinef(L"                      n must be between 1=lowest, 22=highest. (uses zstd)");
+	logInfoLinef(L"     /STRIPE:bytes :: Split files of this size or bigger in ranges sent in parallel over all connections.");
+	logInfoLinef(L"                      Only works with server and /MT");
+	logInfoLinef(L"       /PACK:bytes :: Files smaller than this are sent to server packed together (default %u). 0 disables", uint(DefaultPackedFileThreshold));
+	logInfoLinef(L"/FANOUT dir [dir]...:: also write to these destinations. Source is only traversed and read once");
 	#if defined(EACOPY_ALLOW_DELTA_COPY_SEND)
 	logInfoLinef(L"           /DC[:b] :: use DeltaCompression. Provide value to set min file size");
 	logInfoLinef(L"                      b defaults to %ls (uses rsync algorithm)", toPretty(DefaultDeltaCompressionThreshold).c_str());
@@ -71,6 +75,10 @@ void printHelp()
 	logInfoLinef();
 	logInfoLinef(L"    /LINK [dir]... :: will try to create file links when files are the same. Provide extra dirs to link to");
 	logInfoLinef(L"      /LINKDB file :: will parse file containing link database");
+	logInfoLinef(L"   /DESTCACHE file :: remember files written to destination and skip them next run without checking destination.");
+	logInfoLinef(L"                      Only changes to root and first level directories are detected so only valid for");
+	logInfoLinef(L"                      destinations that are written by EACopy alone");
+	logInfoLinef(L"      /PREFETCH:n :: Threads listing destination directories ahead of copying when no server is used (default 2). 0 disables");
 	logInfoLinef(L"    /LINKMIN:bytes :: Disable links for files smaller than bytes size.");
 	logInfoLinef(L"       /LINKBYNAME :: Will link based on name only and skip relative path.");
 	logInfoLinef(L"          /OFFLOAD :: when link fails it will try using odx between link source and dest.");
@@ -86,6 +94,7 @@ void printHelp()
 	logInfoLinef(L"         /LOG:file :: output status to LOG file (overwrite existing log).");
 	logInfoLinef(L"           /LOGMIN :: logs minimal amount of information.");
 	logInfoLinef(L"          /VERBOSE :: output debug logging.");
+	logInfoLinef(L"       /TRACE:file :: Write timeline of what every thread did to file in chrome trace format.");
 	logInfoLinef(L"              /NJH :: No Job Header.");
 	logInfoLinef(L"              /NJS :: No Job Summary.");
 	logInfoLinef();
@@ -97,6 +106,7 @@ void printHelp()
 struct Settings : ClientSettings
 {
 	WString logFileName;
+	WString traceFileName;
 	bool printJobHeader = true;
 	bool printJobSummary = true;
 };
@@ -244,6 +254,14 @@ bool readSettings(Settings& outSettings, int argc, wchar_t* argv[])
 			else
 				outSettings.compressionLevel = 255;
 		}
+		else if (startsWithIgnoreCase(arg, L"/STRIPE:"))
+		{
+			outSettings.stripeThreshold = wcstoull(arg + 8, 0, 10);
+		}
+		else if (startsWithIgnoreCase(arg, L"/PACK:"))
+		{
+			outSettings.packedFileThreshold = wcstoull(arg + 6, 0, 10);
+		}
 		else if (startsWithIgnoreCase(arg, L"/DC"))
 		{
 			outSettings.deltaCompressionThreshold = 0;
@@ -296,6 +314,18 @@ bool readSettings(Settings& outSettings, int argc, wchar_t* argv[])
 				outSettings.useLinksThreshold = 0;
 			activeCommand = L"LINKDB";
 		}
+		else if (equalsIgnoreCase(arg, L"/DESTCACHE"))
+		{
+			activeCommand = L"DESTCACHE";
+		}
+		else if (equalsIgnoreCase(arg, L"/FANOUT"))
+		{
+			activeCommand = L"FANOUT";
+		}
+		else if (startsWithIgnoreCase(arg, L"/PREFETCH:"))
+		{
+			outSettings.destSnapshotThreadCount = _wtoi(arg + 10);
+		}
 		else if (startsWithIgnoreCase(arg, L"/LINKMIN:"))
 		{
 			outSettings.useLinksThreshold = _wtoi(arg + 9);
@@ -344,6 +374,10 @@ bool readSettings(Settings& outSettings, int argc, wchar_t* argv[])
 		{
 			outSettings.logFileName = arg + 5;
 		}
+		else if(startsWithIgnoreCase(arg, L"/TRACE:"))
+		{
+			outSettings.traceFileName = arg + 7;
+		}
 		else if(equalsIgnoreCase(arg, L"/LOGMIN"))
 		{
 			outSettings.logProgress = false;
@@ -412,6 +446,14 @@ bool readSettings(Settings& outSettings, int argc, wchar_t* argv[])
 			{
 				outSettings.linkDatabaseFile = arg;
 			}
+			else if (equalsIgnoreCase(activeCommand, L"destcache"))
+			{
+				outSettings.destinationCacheFile = arg;
+			}
+			else if (equalsIgnoreCase(activeCommand, L"fanout"))
+			{
+				outSettings.fanOutDirectories.push_back(getCleanedupPath(arg));
+			}
 			else if (equalsIgnoreCase(activeCommand, L"OF"))
 			{
 				outSettings.optionalWildcards.push_back(arg);
@@ -449,6 +491,8 @@ bool readSettings(Settings& outSettings, int argc, wchar_t* argv[])
 		outSettings.destDirectory = optimizeUncPath(outSettings.destDirectory.c_str(), temp, outSettings.useServer != UseServer_Required);
 		for (WString& dir : outSettings.additionalLinkDirectories)
 			dir = optimizeUncPath(dir.c_str(), temp, outSettings.useServer != UseServer_Required);
+		for (WString& dir : outSettings.fanOutDirectories)
+			dir = optimizeUncPath(dir.c_str(), temp, outSettings.useServer != UseServer_Required);
 		#endif
 	}
 
@@ -545,6 +589,8 @@ int main(int argc, char* argv_[])
 		logInfoLinef();
 		logInfoLinef(L"  Source : %ls", settings.sourceDirectory.c_str());
 		logInfoLinef(L"    Dest : %ls", settings.destDirectory.c_str());
+		for (const WString& dir : settings.fanOutDirectories)
+			logInfoLinef(L" Fan-out : %ls", dir.c_str());
 		if (options.length() > (LogBufferSize - 20))
 		{
 			WString optionsSubStr = options.substr(0, (LogBufferSize - 20));
@@ -565,9 +611,15 @@ int main(int argc, char* argv_[])
 
 	Client client(settings);
 
+	if (!settings.traceFileName.empty())
+		if (!traceBegin(settings.traceFileName.c_str(), L"EACopy"))
+			logErrorf(L"Failed to create trace file %ls", settings.traceFileName.c_str());
+
 	ClientStats stats;
 	int res = client.process(log, stats);
 
+	traceEnd();
+
 	if (settings.printJobSummary)
 	{
 		logInfoLinef();
@@ -597,6 +649,7 @@ int main(int argc, char* argv_[])
 		Vector<WString> statsVec;
 		populateStatsTime(statsVec, L"ParseSettings", parseSettingsTime, 0);
 		populateStatsTime(statsVec, L"ConnectTime", stats.connectTime, 0);
+		populateStatsValue(statsVec, L"Reconnect", uint(stats.reconnectCount));
 		populateIOStats(statsVec, stats.ioStats);
 		populateStatsTime(statsVec, L"SendFile", stats.sendTime, 0);
 		populateStatsBytes(statsVec, L"SendBytes", stats.sendSize);
@@ -604,10 +657,13 @@ int main(int argc, char* argv_[])
 		populateStatsBytes(statsVec, L"RecvBytes", stats.recvSize);
 		populateStatsTime(statsVec, L"CompressFile", stats.compressTime, 0);
 		populateStatsValue(statsVec, L"CompressLevel", stats.compressionAverageLevel);
+		populateStatsBytes(statsVec, L"CompressSkip", stats.compressionSkipSize);
+		populateStatsValue(statsVec, L"CompressSkipFiles", uint(stats.compressionSkipCount));
+		populateStatsValue(statsVec, L"CompressAdjust", uint(stats.compressionLevelChanges));
 		populateStatsTime(statsVec, L"DecompressFile", stats.decompressTime, 0);
 		populateStatsTime(statsVec, L"DeltaCompress", stats.deltaCompressionTime, 0);
 		populateStatsTime(statsVec, L"HashCalc", stats.hashTime, stats.hashCount);
-		populateStatsTime(statsVec, L"PurgeDir", stats.purgeTime, 0);
+		populateStatsTime(statsVec, L"PurgeDir", stats.purgeTime, stats.purgeCount);
 		populateStatsTime(statsVec, L"NetSecretGuid", stats.netSecretGuid, 0);
 		populateStatsTime(statsVec, L"NetResponseCopy", stats.netWriteResponseTime[WriteResponse_Copy], stats.netWriteResponseCount[WriteResponse_Copy]);
 		populateStatsTime(statsVec, L"NetResponseCopyDelta", stats.netWriteResponseTime[WriteResponse_CopyDelta], stats.netWriteResponseCount[WriteResponse_CopyDelta]);
@@ -616,11 +672,20 @@ int main(int argc, char* argv_[])
 		populateStatsTime(statsVec, L"NetResponseOdx", stats.netWriteResponseTime[WriteResponse_Odx], stats.netWriteResponseCount[WriteResponse_Odx]);
 		populateStatsTime(statsVec, L"NetResponseSkip", stats.netWriteResponseTime[WriteResponse_Skip], stats.netWriteResponseCount[WriteResponse_Skip]);
 		populateStatsTime(statsVec, L"NetResponseHash", stats.netWriteResponseTime[WriteResponse_Hash], stats.netWriteResponseCount[WriteResponse_Hash]);
+		populateStatsTime(statsVec, L"NetResponseChunks", stats.netWriteResponseTime[WriteResponse_CopyChunks], stats.netWriteResponseCount[WriteResponse_CopyChunks]);
+		populateStatsTime(statsVec, L"NetWriteFiles", stats.netWriteFilesTime, stats.netWriteFilesCount);
+		populateStatsTime(statsVec, L"NetWritePacked", stats.netWritePackedFilesTime, stats.netWritePackedFilesCount);
 		populateStatsTime(statsVec, L"NetFindFiles", stats.netFindFilesTime, stats.netFindFilesCount);
 		populateStatsTime(statsVec, L"NetCreateDir", stats.netCreateDirTime, stats.netCreateDirCount);
 		populateStatsTime(statsVec, L"NetFileInfo", stats.netFileInfoTime, stats.netFileInfoCount);
+		populateStatsTime(statsVec, L"NetDeletePaths", stats.netDeletePathsTime, stats.netDeletePathsCount);
 		populateStatsTime(statsVec, L"ReadLinkDb", stats.readLinkDbTime, stats.readLinkDbEntries);
 		populateStatsTime(statsVec, L"WriteLinkDb", stats.writeLinkDbTime, stats.writeLinkDbEntries);
+		populateStatsTime(statsVec, L"ReadDestCache", stats.readDestCacheTime, stats.readDestCacheEntries);
+		populateStatsTime(statsVec, L"WriteDestCache", stats.writeDestCacheTime, stats.writeDestCacheEntries);
+		populateStatsValue(statsVec, L"DestCacheSkip", uint(stats.destCacheSkipCount));
+		populateStatsTime(statsVec, L"DestPrefetch", stats.destSnapshotTime, stats.destSnapshotCount);
+		populateStatsValue(statsVec, L"DestPrefetchHit", uint(stats.destSnapshotHitCount));
 		populateStatsTime(statsVec, L"RETRY", stats.retryTime, stats.retryCount);
 
 		logInfoLinef();
@@ -0,0 +1,401 @@
+// (c) Electronic Arts. All Rights Reserved.
+
+#include "EACopyChunks.h"
+#include "EACopyDependencies.h"
+
+namespace eacopy
+{
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+constexpr u8 chunkStoreCookie[] = "eacopych001"; // Cookie is followed by HashAlgorithm, wchar size and a stream of file entries
+
+// Normalized chunking. Harder to find a boundary before average size and easier after to narrow the chunk size distribution
+constexpr u64 ChunkMaskHard = 0xFFFFC00000000000ull; // 18 bits
+constexpr u64 ChunkMaskEasy = 0xFFFC000000000000ull; // 14 bits
+
+const u64* getGearTable()
+{
+	// Table must be identical on client and server so it is generated from a fixed seed (splitmix64)
+	struct GearTable
+	{
+		GearTable()
+		{
+			u64 state = 0x45414370794344ull;
+			for (u64& value : values)
+			{
+				state += 0x9E3779B97F4A7C15ull;
+				u64 z = state;
+				z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+				z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+				value = z ^ (z >> 31);
+			}
+		}
+		u64 values[256];
+	};
+	static GearTable table;
+	return table.values;
+}
+
+uint findChunkBoundary(const u8* data, uint size)
+{
+	if (size <= ChunkMinSize)
+		return size;
+
+	const u64* gear = getGearTable();
+	uint normalSize = min(size, uint(ChunkAvgSize));
+	uint maxSize = min(size, uint(ChunkMaxSize));
+	u64 fingerprint = 0;
+	uint i = ChunkMinSize;
+	for (; i < normalSize; ++i)
+	{
+		fingerprint = (fingerprint << 1) + gear[data[i]];
+		if (!(fingerprint & ChunkMaskHard))
+			return i + 1;
+	}
+	for (; i < maxSize; ++i)
+	{
+		fingerprint = (fingerprint << 1) + gear[data[i]];
+		if (!(fingerprint & ChunkMaskEasy))
+			return i + 1;
+	}
+	return maxSize;
+}
+
+bool traverseFileChunks(const wchar_t* fullPath, u64 fileSize, const Vector<ChunkInfo>* knownChunks, CopyContext& copyContext, IOStats& ioStats, const ChunkFunc& func)
+{
+	FileHandle file;
+	if (!openFileRead(fullPath, file, ioStats, true, nullptr, true))
+		return false;
+	ScopeGuard fileGuard([&]() { closeFile(fullPath, file, AccessType_Read, ioStats); });
+
+	// Keep at least ChunkMaxSize bytes in buffer ahead of current position so boundaries don't depend on read sizes
+	u8* buffer = copyContext.buffers[0];
+	uint bufferPos = 0;
+	uint bufferEnd = 0;
+	u64 fileLeft = fileSize;
+	uint index = 0;
+
+	while (true)
+	{
+		if (bufferEnd - bufferPos < ChunkMaxSize && fileLeft)
+		{
+			uint remaining = bufferEnd - bufferPos;
+			memmove(buffer, buffer + bufferPos, remaining);
+			bufferPos = 0;
+			bufferEnd = remaining;
+
+			uint toRead = uint(min(fileLeft, u64(CopyContextBufferSize - remaining)));
+			u64 read;
+			if (!readFile(fullPath, file, buffer + bufferEnd, toRead, read, ioStats))
+				return false;
+			if (read != toRead)
+			{
+				logErrorf(L"File %ls changed size while reading chunks", fullPath);
+				return false;
+			}
+			bufferEnd += toRead;
+			fileLeft -= toRead;
+		}
+
+		uint available = bufferEnd - bufferPos;
+		if (!available)
+			break;
+
+		uint chunkSize;
+		if (knownChunks)
+		{
+			if (index == knownChunks->size() || (*knownChunks)[index].size > available)
+			{
+				logErrorf(L"Chunks of file %ls does not match file content", fullPath);
+				return false;
+			}
+			chunkSize = (*knownChunks)[index].size;
+		}
+		else
+			chunkSize = findChunkBoundary(buffer + bufferPos, available);
+
+		if (!func(index, buffer + bufferPos, chunkSize))
+			return false;
+
+		bufferPos += chunkSize;
+		++index;
+	}
+
+	return true;
+}
+
+bool getFileChunks(Vector<ChunkInfo>& outChunks, const wchar_t* fullPath, u64 fileSize, CopyContext& copyContext, HashContext& hashContext, IOStats& ioStats)
+{
+	outChunks.clear();
+	outChunks.reserve(size_t(fileSize / ChunkAvgSize + 1));
+	return traverseFileChunks(fullPath, fileSize, nullptr, copyContext, ioStats, [&](uint index, const u8* data, uint size)
+		{
+			outChunks.emplace_back();
+			ChunkInfo& chunk = outChunks.back();
+			chunk.size = size;
+			HashBuilder builder(hashContext);
+			return builder.add(const_cast<u8*>(data), size) && builder.getHash(chunk.hash);
+		});
+}
+
+bool sendChunk(Socket& socket, const u8* data, uint size, WriteFileType writeType, int compressionLevel, NetworkCopyContext& copyContext, SendFileStats& sendStats)
+{
+	if (writeType != WriteFileType_Compressed)
+	{
+		u64 startSendTime = getTime();
+		if (!sendData(socket, data, size))
+			return false;
+		sendStats.sendTime += getTime() - startSendTime;
+		sendStats.sendSize += size;
+		return true;
+	}
+
+	static_assert(ZSTD_COMPRESSBOUND(ChunkMaxSize) <= CopyContextBufferSize - 4, "");
+
+	if (!copyContext.compContext)
+		copyContext.compContext = ZSTD_createCCtx();
+	auto cctx = (ZSTD_CCtx*)copyContext.compContext;
+	ZSTD_CCtx_reset(cctx, ZSTD_reset_session_and_parameters);
+
+	u8* compressed = copyContext.buffers[1];
+	u64 startCompressTime = getTime();
+	size_t compressedSize = ZSTD_compressCCtx(cctx, compressed + 4, CopyContextBufferSize - 4, data, size, compressionLevel);
+	if (ZSTD_isError(compressedSize))
+	{
+		logErrorf(L"Fail compressing chunk: %hs", ZSTD_getErrorName(compressedSize));
+		return false;
+	}
+	sendStats.compressTime += getTime() - startCompressTime;
+	sendStats.compressionLevelSum += compressionLevel;
+
+	*(uint*)compressed = uint(compressedSize);
+	u64 startSendTime = getTime();
+	if (!sendData(socket, compressed, uint(compressedSize + 4)))
+		return false;
+	sendStats.sendTime += getTime() - startSendTime;
+	sendStats.sendSize += compressedSize + 4;
+	return true;
+}
+
+bool receiveChunk(Socket& socket, u8* dest, uint size, WriteFileType writeType, NetworkCopyContext& copyContext, RecvFileStats& recvStats)
+{
+	u64 startRecvTime = getTime();
+	if (writeType != WriteFileType_Compressed)
+	{
+		if (!receiveData(socket, dest, size))
+			return false;
+		recvStats.recvTime += getTime() - startRecvTime;
+		recvStats.recvSize += size;
+		return true;
+	}
+
+	uint compressedSize;
+	if (!receiveData(socket, &compressedSize, sizeof(uint)))
+		return false;
+	if (compressedSize > CopyContextBufferSize)
+	{
+		logErrorf(L"Compressed chunk size is bigger than compression buffer capacity");
+		return false;
+	}
+	u8* compressed = copyContext.buffers[1];
+	if (!receiveData(socket, compressed, compressedSize))
+		return false;
+	recvStats.recvTime += getTime() - startRecvTime;
+	recvStats.recvSize += compressedSize + 4;
+
+	if (!copyContext.decompContext)
+		copyContext.decompContext = ZSTD_createDCtx();
+	auto dctx = (ZSTD_DCtx*)copyContext.decompContext;
+	ZSTD_DCtx_reset(dctx, ZSTD_reset_session_and_parameters);
+
+	u64 startDecompressTime = getTime();
+	size_t decompressedSize = ZSTD_decompressDCtx(dctx, dest, size, compressed, compressedSize);
+	recvStats.decompressTime += getTime() - startDecompressTime;
+	if (ZSTD_isError(decompressedSize) || decompressedSize != size)
+	{
+		logErrorf(L"Decompression error while decompressing chunk of %u bytes", size);
+		return false;
+	}
+	return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+bool
+ChunkStore::findChunk(Location& outLocation, const ChunkInfo& chunk)
+{
+	ScopedCriticalSection _(m_cs);
+	auto findIt = m_chunks.find(chunk.hash);
+	if (findIt == m_chunks.end() || findIt->second.size != chunk.size)
+		return false;
+	outLocation.fileName = findIt->second.file->first;
+	outLocation.fileInfo = findIt->second.file->second.fileInfo;
+	outLocation.offset = findIt->second.offset;
+	return true;
+}
+
+void
+ChunkStore::addFile(const WString& fullPath, const FileInfo& fileInfo, const Vector<ChunkInfo>& chunks)
+{
+	ScopedCriticalSection _(m_cs);
+	addFileNoLock(fullPath, fileInfo, chunks);
+}
+
+void
+ChunkStore::removeFile(const WString& fullPath)
+{
+	ScopedCriticalSection _(m_cs);
+	auto findIt = m_files.find(fullPath);
+	if (findIt != m_files.end())
+		removeFileNoLock(findIt);
+}
+
+uint
+ChunkStore::getChunkCount()
+{
+	ScopedCriticalSection _(m_cs);
+	return m_chunkCount;
+}
+
+bool
+ChunkStore::readFile(const wchar_t* fullPath, IOStats& ioStats)
+{
+	FileInfo info;
+	if (!getFileInfo(info, fullPath, ioStats))
+		return true;
+
+	MappedFile file;
+	if (!file.open(fullPath, ioStats))
+		return false;
+
+	const u8* pos = file.data();
+	const u8* end = pos + file.size();
+	if (file.size() < sizeof(chunkStoreCookie) + 2 || memcmp(pos, chunkStoreCookie, sizeof(chunkStoreCookie)) != 0)
+	{
+		logErrorf(L"Chunk store file %ls has unknown format", fullPath);
+		return false;
+	}
+	pos += sizeof(chunkStoreCookie);
+	HashAlgorithm hashAlgorithm = HashAlgorithm(*pos++);
+	uint wcharSize = *pos++;
+	if (hashAlgorithm != m_hashAlgorithm || wcharSize != sizeof(wchar_t))
+		return true; // Chunk hashes can't be compared.. start over with empty store
+
+	ScopedCriticalSection _(m_cs);
+	Vector<ChunkInfo> chunks;
+	while (pos != end)
+	{
+		uint nameLen;
+		FileInfo fileInfo;
+		uint chunkCount;
+		if (end - pos < sizeof(uint))
+			break;
+		memcpy(&nameLen, pos, sizeof(uint));
+		pos += sizeof(uint);
+		if (u64(end - pos) < u64(nameLen)*sizeof(wchar_t) + sizeof(FileTime) + sizeof(u64) + sizeof(uint))
+			break;
+		WString name((const wchar_t*)pos, nameLen);
+		pos += nameLen*sizeof(wchar_t);
+		memcpy(&fileInfo.lastWriteTime, pos, sizeof(FileTime));
+		pos += sizeof(FileTime);
+		memcpy(&fileInfo.fileSize, pos, sizeof(u64));
+		pos += sizeof(u64);
+		memcpy(&chunkCount, pos, sizeof(uint));
+		pos += sizeof(uint);
+		if (u64(end - pos) < u64(chunkCount)*sizeof(ChunkInfo))
+			break;
+		chunks.resize(chunkCount);
+		memcpy(chunks.data(), pos, chunkCount*sizeof(ChunkInfo));
+		pos += chunkCount*sizeof(ChunkInfo);
+		addFileNoLock(name, fileInfo, chunks);
+	}
+
+	if (pos != end)
+		logErrorf(L"Chunk store file %ls is truncated", fullPath);
+	return true;
+}
+
+bool
+ChunkStore::writeFile(const wchar_t* fullPath, IOStats& ioStats)
+{
+	ScopedCriticalSection _(m_cs);
+
+	FileHandle handle;
+	if (!openFileWrite(fullPath, handle, ioStats, true))
+		return false;
+	ScopeGuard fileGuard([&]() { closeFile(fullPath, handle, AccessType_Write, ioStats); });
+
+	Vector<u8> buffer;
+	buffer.reserve(1024*1024);
+	auto append = [&](const void* data, size_t size) { buffer.insert(buffer.end(), (const u8*)data, (const u8*)data + size); };
+	auto flush = [&]() { bool res = eacopy::writeFile(fullPath, handle, buffer.data(), buffer.size(), ioStats); buffer.clear(); return res; };
+
+	append(chunkStoreCookie, sizeof(chunkStoreCookie));
+	u8 hashAlgorithm = m_hashAlgorithm;
+	u8 wcharSize = sizeof(wchar_t);
+	append(&hashAlgorithm, 1);
+	append(&wcharSize, 1);
+
+	// Oldest first so history is recreated in the same order on read
+	for (auto& name : m_history)
+	{
+		const FileRec& rec = m_files.find(name)->second;
+		uint nameLen = uint(name.size());
+		uint chunkCount = uint(rec.chunks.size());
+		append(&nameLen, sizeof(uint));
+		append(name.c_str(), nameLen*sizeof(wchar_t));
+		append(&rec.fileInfo.lastWriteTime, sizeof(FileTime));
+		append(&rec.fileInfo.fileSize, sizeof(u64));
+		append(&chunkCount, sizeof(uint));
+		append(rec.chunks.data(), chunkCount*sizeof(ChunkInfo));
+		if (buffer.size() >= 1024*1024 && !flush())
+			return false;
+	}
+	return flush();
+}
+
+void
+ChunkStore::addFileNoLock(const WString& fullPath, const FileInfo& fileInfo, const Vector<ChunkInfo>& chunks)
+{
+	auto findIt = m_files.find(fullPath);
+	if (findIt != m_files.end())
+		removeFileNoLock(findIt);
+
+	auto insres = m_files.insert({fullPath, FileRec()});
+	FileRec& rec = insres.first->second;
+	rec.fileInfo = fileInfo;
+	rec.chunks = chunks;
+	rec.historyIt = m_history.insert(m_history.end(), fullPath);
+
+	// Latest file wins when the same chunk exists in multiple files
+	u64 offset = 0;
+	for (auto& chunk : chunks)
+	{
+		m_chunks[chunk.hash] = { insres.first, offset, chunk.size };
+		offset += chunk.size;
+	}
+	m_chunkCount += uint(chunks.size());
+
+	while (m_chunkCount > m_maxChunkCount && m_history.size() > 1)
+		removeFileNoLock(m_files.find(m_history.front()));
+}
+
+void
+ChunkStore::removeFileNoLock(Files::iterator it)
+{
+	for (auto& chunk : it->second.chunks)
+	{
+		auto findIt = m_chunks.find(chunk.hash);
+		if (findIt != m_chunks.end() && findIt->second.file == it)
+			m_chunks.erase(findIt);
+	}
+	m_chunkCount -= uint(it->second.chunks.size());
+	m_history.erase(it->second.historyIt);
+	m_files.erase(it);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+} // namespace eacopy
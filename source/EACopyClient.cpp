@@ -1,6 +1,7 @@
 // (c) Electronic Arts. All Rights Reserved.
 
 #include "EACopyClient.h"
+#include "EACopyChunks.h"
 #include <assert.h>
 #include <utility>
 #if defined(_WIN32)
@@ -34,13 +35,6 @@
 #else
 #define TIMEVAL timeval
 namespace eacopy {
-bool PathMatchSpecW(const wchar_t* file, const wchar_t* spec)
-{
-	if (wcscmp(spec, "*.*") == 0)
-		return true;
-	EACOPY_NOT_IMPLEMENTED
-	return false;
-}
 enum : int { FindExSearchNameMatch, FindExInfoStandard };
 bool RemoveDirectoryW(const wchar_t* dir);
 #define WSAHOST_NOT_FOUND                11001L
@@ -63,8 +57,17 @@ namespace eacopy
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+enum { WorkWaitTimeoutMs = 10 }; // Max time an idle thread sleeps before checking prime queue and done state again
+enum { ReconnectIntervalMs = 1000 }; // Min time between attempts to connect a dropped connection again
+
+// Index of the work queue owned by the current thread. Entries found by a thread are pushed to its own queue
+thread_local uint t_workQueueIndex;
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
 Client::Client(const ClientSettings& settings)
 :	m_settings(settings)
+,	m_workAvailable(false)
 {
 }
 
@@ -79,6 +82,8 @@ int
 Client::process(Log& log, ClientStats& outStats)
 {
 	resetWorkState(log);
+	t_workQueueIndex = 0;
+	traceThreadName(L"Main");
 
 	m_networkWsaInitDone = false;
 
@@ -87,7 +92,10 @@ Client::process(Log& log, ClientStats& outStats)
 	#endif
 
 	m_serverAddrInfo = nullptr;
-	ScopeGuard addrCleanup([this]() { if (m_serverAddrInfo) freeAddrInfo(m_serverAddrInfo); });
+	ScopeGuard addrCleanup([this]() { if (m_serverAddrInfo && !m_settings.connectionPool) freeAddrInfo(m_serverAddrInfo); });
+
+	// Runs after all connections went back to pool so next client can take the session
+	ScopeGuard poolSessionGuard([this]() { endPoolSession(); });
 
 	LogContext logContext(log);
 
@@ -104,6 +112,40 @@ Client::process(Log& log, ClientStats& outStats)
 		return -1;
 	ScopeGuard destConnectionCleanup([this]() { delete m_destConnection; m_destConnection = nullptr; });
 
+	// Client side linking and odx write in to destination directories before server has seen any file there
+	m_deferCreateDirs = isValid(m_destConnection) && m_settings.useLinksThreshold == ~u64(0) && !m_settings.useOdx;
+
+	// Fan-out destinations get their own clients with their own connections and state. They are fed by this client so
+	// source is only traversed once and each thread reuses what it read, hashed and compressed for all destinations
+	ScopeGuard fanOutCleanup([this]()
+		{
+			for (Client* fanOut : m_fanOut)
+			{
+				fanOut->stopFanOut();
+				delete fanOut;
+			}
+			m_fanOut.clear();
+			m_fanOutSettings.clear();
+		});
+	for (auto& fanOutDir : m_settings.fanOutDirectories)
+	{
+		m_fanOutSettings.push_back(m_settings);
+		ClientSettings& fanOutSettings = m_fanOutSettings.back();
+		fanOutSettings.destDirectory = fanOutDir;
+		fanOutSettings.fanOutDirectories.clear();
+		fanOutSettings.additionalLinkDirectories.clear();
+		fanOutSettings.linkDatabaseFile.clear();
+		fanOutSettings.destinationCacheFile.clear();
+
+		Client* fanOut = new Client(fanOutSettings);
+		m_fanOut.push_back(fanOut);
+		fanOut->startFanOut(log);
+		if (!fanOut->connectFanOut(0, &m_sourceCaches[0], outStats))
+			return -1;
+	}
+	if (m_destConnection && !m_fanOut.empty())
+		m_destConnection->m_sourceCache = &m_sourceCaches[0];
+
 	#if defined(_WIN32)
 	if (m_settings.threadCount > 0)
 		SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_ABOVE_NORMAL);
@@ -113,30 +155,52 @@ Client::process(Log& log, ClientStats& outStats)
 	for (auto& primeDir : m_settings.additionalLinkDirectories)
 		m_fileDatabase.primeDirectory(primeDir, outStats.ioStats, m_settings.useLinksRelativePath, false);
 
-	// Spawn worker threads that will copy the files
+	// Spawn worker threads that will copy the files. Same stats are used by both copy and purge workers
 	struct WorkerThreadData { ClientStats stats; Client* client = nullptr; uint connectionIndex = 0; };
 	Vector<WorkerThreadData> workerThreadDataList(m_settings.threadCount);
 
-	Vector<Thread> workerThreadList(m_settings.threadCount);
-	for (int i=0; i!=m_settings.threadCount; ++i)
+	auto startWorkerThreads = [&](Vector<Thread>& threadList)
 	{
-		auto& threadData = workerThreadDataList[i];
-		threadData.client = this;
-		threadData.connectionIndex = i + 1;
-		workerThreadList[i].start([&]() -> int
-			{
-				return threadData.client->workerThread(threadData.connectionIndex, threadData.stats);
-			});
-	}
+		for (int i=0; i!=m_settings.threadCount; ++i)
+		{
+			auto& threadData = workerThreadDataList[i];
+			threadData.client = this;
+			threadData.connectionIndex = i + 1;
+			threadList[i].start([&]() -> int
+				{
+					return threadData.client->workerThread(threadData.connectionIndex, threadData.stats);
+				});
+		}
+	};
 
-	// Setup guard that will make sure all threads are waited for before leaving method
-	ScopeGuard waitThreadsGuard([&]()
+	auto waitWorkerThreads = [&](Vector<Thread>& threadList)
 	{
 		// Wait for all threads to finish
 		m_workDone.set();
-		for (auto& thread : workerThreadList)
+		m_workAvailable.set();
+		for (auto& thread : threadList)
 			thread.wait();
-	});
+	};
+
+	// Go through all threads and see if any of them had an error code.
+	auto getWorkerThreadsExitCode = [&](Vector<Thread>& threadList) -> int
+	{
+		for (Thread& wt : threadList)
+		{
+			uint threadExitCode;
+			if (!wt.getExitCode(threadExitCode))
+				return -1;
+			if (threadExitCode != 0)
+				return threadExitCode;
+		}
+		return 0;
+	};
+
+	Vector<Thread> workerThreadList(m_settings.threadCount);
+	startWorkerThreads(workerThreadList);
+
+	// Setup guard that will make sure all threads are waited for before leaving method
+	ScopeGuard waitThreadsGuard([&]() { waitWorkerThreads(workerThreadList); });
 
 	// Connect to source if no destination is set
 	if (!m_destConnection)
@@ -144,6 +208,23 @@ Client::process(Log& log, ClientStats& outStats)
 			return -1;
 	ScopeGuard sourceConnectionCleanup([&] { delete m_sourceConnection; m_sourceConnection = nullptr; });
 
+	// Without a server every destination file would be checked one at a time. Prefetch threads list destination
+	// directories as they are found during traversal so workers can decide to copy or skip from the listing
+	m_destSnapshots.enabled = m_settings.destSnapshotThreadCount && !isValid(m_destConnection) && !isValid(m_sourceConnection);
+	Vector<Thread> destSnapshotThreadList(m_destSnapshots.enabled ? m_settings.destSnapshotThreadCount : 0);
+	for (auto& thread : destSnapshotThreadList)
+		thread.start([this]() -> int { destinationSnapshotThread(); return 0; });
+	ScopeGuard destSnapshotThreadsGuard([&]()
+		{
+			{
+				ScopedCriticalSection cs(m_destSnapshots.cs);
+				m_destSnapshots.stop = true;
+			}
+			m_destSnapshots.queueAvailable.set();
+			for (auto& thread : destSnapshotThreadList)
+				thread.wait();
+		});
+
 	// Collect exclusions provided through file
 	for (auto& file : m_settings.filesExcludeFiles)
 		if (!excludeFilesFromFile(logContext, outStats, sourceDir, file, destDir))
@@ -152,6 +233,10 @@ Client::process(Log& log, ClientStats& outStats)
 	// Help out flush out all primed directories
 	m_fileDatabase.primeWait(outStats.ioStats);
 
+	// Destination cache can't tell us if a changed file should be kept. It only covers one destination so it is not used when fanning out
+	if (!m_settings.destinationCacheFile.empty() && !m_settings.forceCopy && !m_settings.excludeChangedFiles && m_fanOut.empty())
+		readDestinationCache(m_destConnection, outStats);
+
 	if (!m_settings.linkDatabaseFile.empty())
 	{
 		TimerScope _(outStats.readLinkDbTime);
@@ -184,56 +269,70 @@ Client::process(Log& log, ClientStats& outStats)
 
 	// Wait for all worker threads to finish
 	waitThreadsGuard.execute();
+	destSnapshotThreadsGuard.execute();
+	outStats.destSnapshotTime = m_destSnapshots.time;
+	outStats.destSnapshotCount = m_destSnapshots.count;
+	outStats.ioStats.findFileTime += m_destSnapshots.findFileTime;
+	outStats.ioStats.findFileCount += m_destSnapshots.findFileCount;
 
 	// If main thread had an error code, return that
 	if (int exitCode = logContext.getLastError())
 		return exitCode;
 
-	// Go through all threads and see if any of them had an error code.
-	for (Thread& wt : workerThreadList)
-	{
-		uint threadExitCode;
-		if (!wt.getExitCode(threadExitCode))
+	if (int exitCode = getWorkerThreadsExitCode(workerThreadList))
+		return exitCode;
+
+	// Create directories that didn't get any files and get all directories server created for us
+	if (!createDeferredDirectories(outStats))
+		return -1;
+	for (Client* fanOut : m_fanOut)
+		if (!fanOut->createDeferredDirectories(outStats))
 			return -1;
-		if (threadExitCode != 0)
-			return threadExitCode;
-	}
 
 	// If purge feature is enabled.. traverse destination and remove unwanted files/directories
-	if (m_settings.purgeDestination)
+	if (m_settings.purgeDestination || !m_purgeDirs.empty())
 	{
 		TimerScope ps(outStats.purgeTime);
-		if (m_createdDirs.find(destDir) == m_createdDirs.end()) // We don't need to purge directories we know we created
-			if (!purgeFilesInDirectory(destDir, 0, m_settings.copySubdirDepth, outStats)) // use 0 for directory attribute because we always want to purge root dir even if it is a symlink (which it probably never is)
+
+		// Every destination is purged using what was handled by this client
+		if (!queuePurgeRoots(*this, outStats))
+			return -1;
+		for (Client* fanOut : m_fanOut)
+			if (!queuePurgeRoots(*fanOut, outStats))
 				return -1;
-	}
 
-	// Purge individual directories (can be provided in filelist file)
-	for (auto& purgeDir : m_purgeDirs)
-	{
-		TimerScope ps(outStats.purgeTime);
-		if (m_createdDirs.find(purgeDir) == m_createdDirs.end()) // We don't need to purge directories we know we created
+		// Purge is a second pipeline stage. Worker threads are started again and list/delete directories in parallel
+		if (m_pendingEntryCount)
 		{
-			FileInfo dirInfo;
-			uint dirAttributes;
-			if (isValid(m_destConnection))
-			{
-				uint error = 0;
-				if (!m_destConnection->sendGetFileAttributes(purgeDir.c_str(), dirInfo, dirAttributes, error))
-					return -1;
-				if (error)
-					return -1;
-			}
-			else
-				dirAttributes = getFileInfo(dirInfo, purgeDir.c_str(), outStats.ioStats);
+			m_workDone.reset();
+			Vector<Thread> purgeThreadList(m_settings.threadCount);
+			startWorkerThreads(purgeThreadList);
+			ScopeGuard waitPurgeThreadsGuard([&]() { waitWorkerThreads(purgeThreadList); });
 
-			if (!purgeFilesInDirectory(purgeDir.c_str(), dirAttributes, m_settings.copySubdirDepth, outStats))
-				return -1;
+			processQueues(logContext, m_sourceConnection, m_destConnection, m_copyContext, outStats, true);
+
+			waitPurgeThreadsGuard.execute();
+
+			if (int exitCode = logContext.getLastError())
+				return exitCode;
+			if (int exitCode = getWorkerThreadsExitCode(purgeThreadList))
+				return exitCode;
 		}
 	}
 
+	// Only write destination cache if everything made it to the destination
+	if (!m_settings.destinationCacheFile.empty() && !m_settings.excludeChangedFiles && m_fanOut.empty())
+	{
+		u64 failCount = outStats.failCount;
+		for (auto& threadData : workerThreadDataList)
+			failCount += threadData.stats.failCount;
+		if (!failCount)
+			writeDestinationCache(m_destConnection, outStats);
+	}
+
 	sourceConnectionCleanup.execute();
 	destConnectionCleanup.execute();
+	fanOutCleanup.execute();
 
 	if (!m_settings.linkDatabaseFile.empty())
 	{
@@ -259,6 +358,7 @@ Client::process(Log& log, ClientStats& outStats)
 		outStats.skipTime = max(outStats.skipTime, threadStats.skipTime);
 		outStats.linkTime = max(outStats.linkTime, threadStats.linkTime);
 		outStats.purgeTime = max(outStats.purgeTime, threadStats.purgeTime);
+		outStats.purgeCount += threadStats.purgeCount;
 
 		outStats.createDirCount += threadStats.createDirCount;
 		outStats.compressTime += threadStats.compressTime;
@@ -268,10 +368,15 @@ Client::process(Log& log, ClientStats& outStats)
 		outStats.recvTime += threadStats.recvTime;
 		outStats.recvSize += threadStats.recvSize;
 		outStats.compressionLevelSum += threadStats.compressionLevelSum;
+		outStats.compressionSkipCount += threadStats.compressionSkipCount;
+		outStats.compressionSkipSize += threadStats.compressionSkipSize;
+		outStats.compressionLevelChanges += threadStats.compressionLevelChanges;
 		outStats.failCount += threadStats.failCount;
 		outStats.retryCount += threadStats.retryCount;
 		outStats.retryTime += threadStats.retryTime;
 		outStats.connectTime += threadStats.connectTime;
+		outStats.connectReuseCount += threadStats.connectReuseCount;
+		outStats.reconnectCount += threadStats.reconnectCount;
 		outStats.hashCount += threadStats.hashCount;
 		outStats.hashTime += threadStats.hashTime;
 		outStats.netSecretGuid += threadStats.netSecretGuid;
@@ -280,42 +385,22 @@ Client::process(Log& log, ClientStats& outStats)
 			outStats.netWriteResponseTime[i] += threadStats.netWriteResponseTime[i];
 			outStats.netWriteResponseCount[i] += threadStats.netWriteResponseCount[i];
 		}
+		outStats.netWriteFilesTime += threadStats.netWriteFilesTime;
+		outStats.netWriteFilesCount += threadStats.netWriteFilesCount;
+		outStats.netWritePackedFilesTime += threadStats.netWritePackedFilesTime;
+		outStats.netWritePackedFilesCount += threadStats.netWritePackedFilesCount;
+		outStats.dictionaryCount += threadStats.dictionaryCount;
+		outStats.destCacheSkipCount += threadStats.destCacheSkipCount;
+		outStats.destSnapshotHitCount += threadStats.destSnapshotHitCount;
 		outStats.netFindFilesTime += threadStats.netFindFilesTime;
 		outStats.netFindFilesCount += threadStats.netFindFilesCount;
 		outStats.netCreateDirTime += threadStats.netCreateDirTime;
 		outStats.netCreateDirCount += threadStats.netCreateDirCount;
 		outStats.netFileInfoTime += threadStats.netFileInfoTime;
 		outStats.netFileInfoCount += threadStats.netFileInfoCount;
-		outStats.ioStats.createReadTime += threadStats.ioStats.createReadTime;
-		outStats.ioStats.closeReadTime += threadStats.ioStats.closeReadTime;
-		outStats.ioStats.closeReadCount += threadStats.ioStats.closeReadCount;
-		outStats.ioStats.readTime += threadStats.ioStats.readTime;
-		outStats.ioStats.readCount += threadStats.ioStats.readCount;
-		outStats.ioStats.createReadCount += threadStats.ioStats.createReadCount;
-		outStats.ioStats.createWriteTime += threadStats.ioStats.createWriteTime;
-		outStats.ioStats.createWriteCount += threadStats.ioStats.createWriteCount;
-		outStats.ioStats.closeWriteTime += threadStats.ioStats.closeWriteTime;
-		outStats.ioStats.closeWriteCount += threadStats.ioStats.closeWriteCount;
-		outStats.ioStats.writeTime += threadStats.ioStats.writeTime;
-		outStats.ioStats.writeCount += threadStats.ioStats.writeCount;
-		outStats.ioStats.removeDirTime += threadStats.ioStats.removeDirTime;
-		outStats.ioStats.removeDirCount += threadStats.ioStats.removeDirCount;
-		outStats.ioStats.deleteFileTime += threadStats.ioStats.deleteFileTime;
-		outStats.ioStats.deleteFileCount += threadStats.ioStats.deleteFileCount;
-		outStats.ioStats.moveFileTime += threadStats.ioStats.moveFileTime;
-		outStats.ioStats.moveFileCount += threadStats.ioStats.moveFileCount;
-		outStats.ioStats.createLinkTime += threadStats.ioStats.createLinkTime;
-		outStats.ioStats.createLinkCount += threadStats.ioStats.createLinkCount;
-		outStats.ioStats.setLastWriteTime += threadStats.ioStats.setLastWriteTime;
-		outStats.ioStats.setLastWriteTimeCount += threadStats.ioStats.setLastWriteTimeCount;
-		outStats.ioStats.findFileTime += threadStats.ioStats.findFileTime;
-		outStats.ioStats.findFileCount += threadStats.ioStats.findFileCount;
-		outStats.ioStats.fileInfoTime += threadStats.ioStats.fileInfoTime;
-		outStats.ioStats.fileInfoCount += threadStats.ioStats.fileInfoCount;
-		outStats.ioStats.createDirCount += threadStats.ioStats.createDirCount;
-		outStats.ioStats.createDirTime += threadStats.ioStats.createDirTime;
-		outStats.ioStats.copyFileCount += threadStats.ioStats.copyFileCount;
-		outStats.ioStats.copyFileTime += threadStats.ioStats.copyFileTime;
+		outStats.netDeletePathsTime += threadStats.netDeletePathsTime;
+		outStats.netDeletePathsCount += threadStats.netDeletePathsCount;
+		addIOStats(outStats.ioStats, threadStats.ioStats);
 	}
 
 	outStats.compressionAverageLevel = outStats.copySize ? (float)((double)outStats.compressionLevelSum / outStats.copySize) : 0;
@@ -380,43 +465,150 @@ Client::resetWorkState(Log& log)
 	m_tryCopyFirst = true;
 	m_networkInitDone = false;
 	m_networkServerName.clear();
-	m_copyEntries.clear();
+	m_poolKey.clear();
+	m_workQueues = Vector<WorkQueue>(m_settings.threadCount + 1);
+	m_sourceCaches = Vector<SourceFileCache>(m_settings.threadCount + 1);
+	m_queuedEntryCount = 0;
+	m_pendingEntryCount = 0;
+	m_workAvailable.reset();
 	m_handledFiles.clear();
 	m_createdDirs.clear();
+	m_paths.clear();
+	m_deferCreateDirs = false;
+	m_deferredDirs.clear();
 	m_sourceConnection = nullptr;
 	m_destConnection = nullptr;
 	m_secretGuid = {0};
+	m_excludeWildcards.clear();
+	m_excludeWildcards.add(m_settings.excludeWildcards);
+	m_excludeWildcardDirectories.clear();
+	m_excludeWildcardDirectories.add(m_settings.excludeWildcardDirectories);
+	m_optionalWildcards.clear();
+	m_optionalWildcards.add(m_settings.optionalWildcards);
+	m_dictionaries.listed = false;
+	m_dictionaries.ids.clear();
+	m_dictionaries.store.clear();
+	m_destCache.valid = false;
+	m_destCache.known.clear();
+	m_destCache.written.clear();
+	m_destSnapshots.enabled = false;
+	m_destSnapshots.stop = false;
+	m_destSnapshots.dirs.clear();
+	m_destSnapshots.queue.clear();
+	m_destSnapshots.queueAvailable.reset();
+	m_destSnapshots.fileCount = 0;
+	m_destSnapshots.time = 0;
+	m_destSnapshots.count = 0;
+	m_destSnapshots.findFileTime = 0;
+	m_destSnapshots.findFileCount = 0;
+}
+
+template<class Entry>
+void
+Client::pushEntry(Entry&& entry, Deque<Entry> WorkQueue::* entries, Atomic<uint> WorkQueue::* entryCount)
+{
+	// Pending count must be increased before entry is visible to other threads
+	++m_pendingEntryCount;
 
-	m_processDirActive = 0;
+	WorkQueue& queue = m_workQueues[t_workQueueIndex];
+	queue.cs.scoped([&]()
+		{
+			(queue.*entries).push_back(std::move(entry));
+			++(queue.*entryCount);
+		});
+	++m_queuedEntryCount;
 
-	// These are used for when sending files to server with compression enabled
-	m_compressionStats.fixedLevel = m_settings.compressionLevel != 255;
-	m_compressionStats.currentLevel = std::min<u8>(std::max<u8>(m_settings.compressionLevel, 1), 22);
+	m_workAvailable.set();
 }
 
+template<class Entry>
 bool
-Client::processDir(LogContext& logContext, Connection* sourceConnection, Connection* destConnection, NetworkCopyContext& copyContext, ClientStats& stats)
+Client::popEntry(Entry& outEntry, Deque<Entry> WorkQueue::* entries, Atomic<uint> WorkQueue::* entryCount)
 {
-	// Pop first entry off the queue (and increase active count to point out that something is being processed)
-	DirEntry entry;
-	m_dirEntriesCs.scoped([&]()
-		{
-			if (!m_dirEntries.empty())
+	// Start with own queue and then try to steal from the others. Queue counts are checked first to avoid taking locks on empty queues
+	uint queueCount = uint(m_workQueues.size());
+	for (uint i=0; i!=queueCount; ++i)
+	{
+		WorkQueue& queue = m_workQueues[(t_workQueueIndex + i) % queueCount];
+		if (!(queue.*entryCount))
+			continue;
+
+		bool found = false;
+		queue.cs.scoped([&]()
 			{
-				entry = std::move(m_dirEntries.front());
-				m_dirEntries.pop_front();
-				++m_processDirActive;
-			}
-		});
+				auto& list = queue.*entries;
+				if (list.empty())
+					return;
+				if (i == 0) // Own queue, take newest
+				{
+					outEntry = std::move(list.back());
+					list.pop_back();
+				}
+				else // Steal oldest
+				{
+					outEntry = std::move(list.front());
+					list.pop_front();
+				}
+				--(queue.*entryCount);
+				found = true;
+			});
+
+		if (!found)
+			continue;
+
+		// Wake up another sleeping thread if there are more entries to grab
+		if (--m_queuedEntryCount)
+			m_workAvailable.set();
+		return true;
+	}
+	return false;
+}
+
+void
+Client::finishEntry()
+{
+	// Wake up main thread if this was the last entry
+	if (--m_pendingEntryCount == 0)
+		m_workAvailable.set();
+}
 
-	// If no new entry queued
-	if (entry.destDir.empty())
+bool
+Client::processDir(LogContext& logContext, Connection* sourceConnection, Connection* destConnection, NetworkCopyContext& copyContext, ClientStats& stats)
+{
+	// Pop entry from own queue or steal one from another thread. Entry counts as pending until traversal is done
+	DirEntry entry;
+	if (!popEntry(entry, &WorkQueue::dirEntries, &WorkQueue::dirEntryCount))
 		return false;
 
+	WString sourceDir(entry.sourceDir->str, entry.sourceDir->length);
+	WString destDir(entry.destDir->str, entry.destDir->length);
+	WString wildcard(entry.wildcard->str, entry.wildcard->length);
+	TraceScope trace(L"Traverse", sourceDir.c_str());
+	traverseFilesInDirectory(logContext, sourceConnection, destConnection, copyContext, sourceDir, destDir, wildcard, entry.depthLeft, stats);
+
+	finishEntry();
 
-	traverseFilesInDirectory(logContext, sourceConnection, destConnection, copyContext, entry.sourceDir, entry.destDir, entry.wildcard, entry.depthLeft, stats);
+	return true;
+}
+
+bool
+Client::processPurgeDir(Connection* destConnection, NetworkCopyContext& copyContext, ClientStats& stats)
+{
+	// Purge entries are only queued once all files are copied. Directories that are kept are pushed back while the entry is pending
+	PurgeEntry entry;
+	if (!popEntry(entry, &WorkQueue::purgeEntries, &WorkQueue::purgeEntryCount))
+		return false;
+
+	Client& dest = *entry.dest;
+	WString destDir(entry.destDir->str, entry.destDir->length);
+	TraceScope trace(L"Purge", destDir.c_str());
+	if (!purgeFilesInDirectory(dest, &dest == this ? destConnection : dest.getFanOutConnection(), copyContext, destDir, entry.depthLeft, stats))
+	{
+		++stats.failCount;
+		logErrorf(L"Failed to purge directory %ls", destDir.c_str());
+	}
 
-	m_dirEntriesCs.scoped([&]() { --m_processDirActive; } );
+	finishEntry();
 
 	return true;
 }
@@ -424,28 +616,315 @@ Client::processDir(LogContext& logContext, Connection* sourceConnection, Connect
 bool
 Client::processFile(LogContext& logContext, Connection* sourceConnection, Connection* destConnection, NetworkCopyContext& copyContext, ClientStats& stats)
 {
-	// Pop first entry off the queue
+	// Pop entry from own queue or steal one from another thread
 	CopyEntry entry;
-	m_copyEntriesCs.scoped([&]()
+	if (!popEntry(entry, &WorkQueue::copyEntries, &WorkQueue::copyEntryCount))
+		return false;
+	ScopeGuard finishGuard([this]() { finishEntry(); });
+
+	// Covers everything done for the entry, batches and fan-out included
+	WString traceDetail;
+	if (g_traceActive)
+		traceDetail = entry.src();
+	TraceScope trace(entry.stripe ? L"FileRange" : L"File", traceDetail.c_str());
+
+	if (entry.stripe)
+		return processFileRange(logContext, destConnection, copyContext, entry, stats);
+
+	// Huge files are split in ranges that are written in parallel by all connections
+	if (isValid(destConnection) && useStripes(entry))
+		return processStripedFile(logContext, destConnection, copyContext, entry, stats);
+
+	// When writing to server we negotiate multiple files in one round trip
+	if (isValid(destConnection) && !entry.batched && useWriteFilesBatch(entry))
+		return processFileBatch(logContext, sourceConnection, destConnection, copyContext, entry, stats);
+
+	if (m_fanOut.empty())
+		return processCopyEntry(logContext, sourceConnection, destConnection, copyContext, entry, stats, entry.batchResponse);
+
+	// Fan-out writes the file to all destinations in turn. Hash, chunks and compressed data are kept in the source cache
+	// of the thread's connections so they are only produced once. Sends are blocking so slowest destination sets the pace
+	bool success = processCopyEntry(logContext, sourceConnection, destConnection, copyContext, entry, stats);
+	for (Client* fanOut : m_fanOut)
+		if (!fanOut->processCopyEntry(logContext, nullptr, fanOut->getFanOutConnection(), copyContext, entry, stats))
+			success = false;
+	return success;
+}
+
+bool
+Client::useWriteFilesBatch(const CopyEntry& entry)
+{
+	// Local link database and odx must be checked per file before server is involved. Fan-out handles one file at a time
+	if (m_settings.useOdx || entry.srcInfo.fileSize >= m_settings.useLinksThreshold || !m_fanOut.empty())
+		return false;
+	return entry.srcInfo.lastWriteTime.dwLowDateTime || entry.srcInfo.lastWriteTime.dwHighDateTime;
+}
+
+bool
+Client::useStripes(const CopyEntry& entry)
+{
+	// Stripes are negotiated with WriteFiles so same restrictions apply
+	return m_settings.threadCount != 0 && entry.srcInfo.fileSize >= m_settings.stripeThreshold && entry.srcInfo.fileSize > m_settings.stripeSize && useWriteFilesBatch(entry);
+}
+
+bool
+Client::processStripedFile(LogContext& logContext, Connection* destConnection, NetworkCopyContext& copyContext, CopyEntry& entry, ClientStats& stats)
+{
+	u64 startTime = getTime();
+
+	// Server might already have the file or be able to link it
+	Vector<CopyEntry*> entries { &entry };
+	Vector<WriteResponse> writeResponses;
+	if (!destConnection->sendWriteFilesCommand(entries, writeResponses))
+		return processCopyEntry(logContext, nullptr, destConnection, copyContext, entry, stats);
+
+	if (reportServerWriteResponse(entry, writeResponses[0], getTime() - startTime, stats))
+		return true;
+
+	// Ranges are always sent whole so hash lookup and chunk exchange are skipped for striped files
+	WriteResponse writeResponse = writeResponses[0];
+	if (writeResponse != WriteResponse_Copy && writeResponse != WriteResponse_Hash && writeResponse != WriteResponse_CopyChunks)
+		return processCopyEntry(logContext, nullptr, destConnection, copyContext, entry, stats);
+
+	// Range sizes must be multiple of chunk size to keep reads aligned when using unbuffered io
+	u64 stripeSize = std::max<u64>(m_settings.stripeSize / NetworkTransferChunkSize, 1) * NetworkTransferChunkSize;
+	u64 fileSize = entry.srcInfo.fileSize;
+	uint rangeCount = uint((fileSize + stripeSize - 1) / stripeSize);
+
+	// Ranges are queued as separate entries so idle threads steal them. Last range to finish reports and deletes stripe
+	auto stripe = new StripedFile();
+	stripe->rangesLeft = rangeCount;
+	stripe->failed = false;
+	stripe->startTime = startTime;
+
+	for (uint i=0; i!=rangeCount; ++i)
+	{
+		CopyEntry rangeEntry(entry);
+		rangeEntry.stripe = stripe;
+		rangeEntry.stripeOffset = i*stripeSize;
+		rangeEntry.stripeSize = std::min<u64>(stripeSize, fileSize - rangeEntry.stripeOffset);
+		pushEntry(std::move(rangeEntry), &WorkQueue::copyEntries, &WorkQueue::copyEntryCount);
+	}
+	return true;
+}
+
+bool
+Client::processFileRange(LogContext& logContext, Connection* destConnection, NetworkCopyContext& copyContext, CopyEntry& entry, ClientStats& stats)
+{
+	StripedFile& stripe = *entry.stripe;
+
+	if (!isValid(destConnection))
+	{
+		logErrorf(L"Failed to write range of file %ls: No connection to server", entry.dst().c_str());
+		stripe.failed = true;
+	}
+	else if (!destConnection->sendWriteFileRangeCommand(entry, copyContext))
+		stripe.failed = true;
+
+	if (--stripe.rangesLeft != 0)
+		return true;
+
+	u64 startTime = stripe.startTime;
+	bool failed = stripe.failed;
+	delete &stripe;
+
+	if (!failed)
+	{
+		if (m_settings.logProgress)
+			logInfoLinef(L"%ls   %ls", L"New File ", getRelativeSourceFile(entry.src()));
+		stats.copyTime += getTime() - startTime;
+		++stats.copyCount;
+		stats.copySize += entry.srcInfo.fileSize;
+		++stats.processedByServerCount;
+		return true;
+	}
+
+	if (entry.stripeRetryCount == m_settings.retryCount)
+	{
+		++stats.failCount;
+		logErrorf(L"failed to copy file (%ls)", entry.src().c_str());
+		return true;
+	}
+
+	// Whole file is queued again and negotiated from the start, server might have gotten it some other way meanwhile
+	u64 retryStartTime = getTime();
+	logContext.resetLastError();
+	TraceScope trace(L"Retry", entry.src().c_str());
+	logInfoLinef(L"Warning - failed to copy file %ls to %ls, retrying in %i seconds", entry.src().c_str(), entry.dst().c_str(), m_settings.retryWaitTimeMs/1000);
+	Sleep(m_settings.retryWaitTimeMs);
+	if (destConnection && !isValid(destConnection))
+		reconnect(*destConnection, stats);
+	++stats.retryCount;
+	stats.retryTime += getTime() - retryStartTime;
+
+	CopyEntry retryEntry(entry);
+	retryEntry.stripe = nullptr;
+	retryEntry.stripeOffset = 0;
+	retryEntry.stripeSize = 0;
+	++retryEntry.stripeRetryCount;
+	pushEntry(std::move(retryEntry), &WorkQueue::copyEntries, &WorkQueue::copyEntryCount);
+	return true;
+}
+
+bool
+Client::reportServerWriteResponse(const CopyEntry& entry, WriteResponse writeResponse, u64 time, ClientStats& stats)
+{
+	switch (writeResponse)
+	{
+	case WriteResponse_Skip:
+		if (m_settings.logProgress)
+			logInfoLinef(L"Skip File   %ls", getRelativeSourceFile(entry.src()));
+		stats.skipTime += time;
+		++stats.skipCount;
+		stats.skipSize += entry.srcInfo.fileSize;
+		++stats.processedByServerCount;
+		return true;
+
+	case WriteResponse_Link:
+	case WriteResponse_Odx:
+		{
+			bool linked = writeResponse == WriteResponse_Link;
+			if (m_settings.logProgress)
+				logInfoLinef(L"%ls   %ls", linked ? L"Link File" : L"New File ", getRelativeSourceFile(entry.src()));
+			(linked ? stats.linkTime : stats.copyTime) += time;
+			++(linked ? stats.linkCount : stats.copyCount);
+			(linked ? stats.linkSize : stats.copySize) += entry.srcInfo.fileSize;
+			++stats.processedByServerCount;
+		}
+		return true;
+
+	default:
+		return false; // Needs content (or failed)
+	}
+}
+
+bool
+Client::processFileBatch(LogContext& logContext, Connection* sourceConnection, Connection* destConnection, NetworkCopyContext& copyContext, CopyEntry& firstEntry, ClientStats& stats)
+{
+	// Grab more entries. Entries that need a full WriteFile after the batch are pushed back so all threads share them
+	Vector<CopyEntry> entries;
+	entries.push_back(std::move(firstEntry));
+	while (entries.size() != WriteFilesMaxCount)
+	{
+		CopyEntry entry;
+		if (!popEntry(entry, &WorkQueue::copyEntries, &WorkQueue::copyEntryCount))
+			break;
+		entries.push_back(std::move(entry));
+	}
+
+	// First entry is finished by caller
+	ScopeGuard finishGuard([&]() { for (uint i=1; i<entries.size(); ++i) finishEntry(); });
+
+	// Files big enough for stripes are negotiated by processStripedFile
+	Vector<CopyEntry*> batchEntries;
+	for (auto& entry : entries)
+		if (useWriteFilesBatch(entry) && (&entry == &entries[0] || !useStripes(entry)))
+			batchEntries.push_back(&entry);
+
+	u64 startTime = getTime();
+	Vector<WriteResponse> writeResponses;
+	if (batchEntries.size() > 1)
+		if (!destConnection->sendWriteFilesCommand(batchEntries, writeResponses))
+			writeResponses.clear(); // Let normal path handle errors and retries
+	u64 timePerEntry = (getTime() - startTime) / std::max<u64>(writeResponses.size(), 1);
+
+	// Pushed back entries are not batched again. WriteFile continues from the batch response instead of negotiating again
+	auto pushBack = [&](CopyEntry& entry, WriteResponse batchResponse)
+	{
+		entry.batched = true;
+		entry.batchResponse = batchResponse;
+		pushEntry(std::move(entry), &WorkQueue::copyEntries, &WorkQueue::copyEntryCount);
+	};
+
+	// Small files that need content are sent packed together. Files failing to pack are written the normal way
+	Vector<CopyEntry*> packEntries;
+	u64 packSize = 0;
+	auto flushPack = [&]()
+	{
+		u64 packStartTime = getTime();
+		Vector<u8> results;
+		if (!destConnection->sendWritePackedFilesCommand(packEntries, copyContext, results))
+			results.assign(packEntries.size(), 0);
+		u64 packTimePerEntry = (getTime() - packStartTime) / std::max<u64>(packEntries.size(), 1);
+
+		for (uint i=0; i!=packEntries.size(); ++i)
 		{
-			if (!m_copyEntries.empty())
+			CopyEntry& entry = *packEntries[i];
+			if (!results[i])
 			{
-				entry = std::move(m_copyEntries.front());
-				m_copyEntries.pop_front();
+				pushBack(entry, WriteResponseCount);
+				continue;
 			}
-		});
+			if (m_settings.logProgress)
+				logInfoLinef(L"%ls   %ls", L"New File ", getRelativeSourceFile(entry.src()));
+			stats.copyTime += packTimePerEntry;
+			++stats.copyCount;
+			stats.copySize += entry.srcInfo.fileSize;
+			++stats.processedByServerCount;
+		}
+		packEntries.clear();
+		packSize = 0;
+	};
 
-	// If no new entry queued, sleep a bit and return in order to try again
-	if (entry.src.empty())
+	CopyEntry* inlineEntry = nullptr;
+	WriteResponse inlineResponse = WriteResponseCount;
+	uint responseIndex = 0;
+	for (auto& entry : entries)
 	{
-		Sleep(1);
-		return false;
+		WriteResponse writeResponse = WriteResponse_Copy;
+		bool negotiated = responseIndex < writeResponses.size() && batchEntries[responseIndex] == &entry;
+		if (negotiated)
+			writeResponse = writeResponses[responseIndex++];
+
+		if (reportServerWriteResponse(entry, writeResponse, timePerEntry, stats))
+			continue;
+
+		// Packed files are written as is so hash lookup is skipped for them
+		bool needsContent = negotiated && (writeResponse == WriteResponse_Copy || writeResponse == WriteResponse_Hash || writeResponse == WriteResponse_CopyChunks);
+		if (needsContent && writeResponse != WriteResponse_CopyChunks && entry.srcInfo.fileSize < m_settings.packedFileThreshold)
+		{
+			u64 entrySize = sizeof(FileInfo) + (entry.dst().size() + 1)*2 + entry.srcInfo.fileSize;
+			if (packSize + entrySize > WritePackedFilesMaxSize)
+				flushPack();
+			packEntries.push_back(&entry);
+			packSize += entrySize;
+			continue;
+		}
+
+		// Needs content (or failed), fall back to normal path. First entry is written by this thread, the rest by any thread
+		WriteResponse batchResponse = needsContent ? writeResponse : WriteResponseCount;
+		if (&entry == &entries[0])
+		{
+			inlineEntry = &entry;
+			inlineResponse = batchResponse;
+		}
+		else
+			pushBack(entry, batchResponse);
 	}
 
+	if (!packEntries.empty())
+		flushPack();
+
+	if (!inlineEntry)
+		return true;
+	return processCopyEntry(logContext, sourceConnection, destConnection, copyContext, *inlineEntry, stats, inlineResponse);
+}
+
+bool
+Client::processCopyEntry(LogContext& logContext, Connection* sourceConnection, Connection* destConnection, NetworkCopyContext& copyContext, CopyEntry& entry, ClientStats& stats, WriteResponse batchResponse)
+{
 	bool useLinks = entry.srcInfo.fileSize >= m_settings.useLinksThreshold;
 
+	WString srcFile = entry.src();
+	WString dstFile = entry.dst();
+
 	// Get full destination path
-	WString fullDst = m_settings.destDirectory + entry.dst;
+	WString fullDst = m_settings.destDirectory + dstFile;
+
+	// Listing of destination directory made ahead of us. Only used on first attempt, retries check the file
+	FileInfo snapshotInfo;
+	uint snapshotAttributes = 0;
+	DestSnapshotResult snapshot = findInDestinationSnapshot(entry, snapshotInfo, snapshotAttributes);
 	 
 	// Try to copy file
 	int retryCountLeft = m_settings.retryCount;
@@ -456,7 +935,7 @@ Client::processFile(LogContext& logContext, Connection* sourceConnection, Connec
 		auto reportSkip = [&]()
 		{
 			if (m_settings.logProgress)
-				logInfoLinef(L"Skip File   %ls", getRelativeSourceFile(entry.src));
+				logInfoLinef(L"Skip File   %ls", getRelativeSourceFile(srcFile));
 			stats.skipTime += getTime() - startTime;
 			++stats.skipCount;
 			stats.skipSize += entry.srcInfo.fileSize;
@@ -464,7 +943,7 @@ Client::processFile(LogContext& logContext, Connection* sourceConnection, Connec
 
 		if (useLinks)
 		{
-			FileKey key{ getFileKeyPath(entry.dst), entry.srcInfo.lastWriteTime, entry.srcInfo.fileSize }; // Robocopy style key for uniqueness of file
+			FileKey key{ getFileKeyPath(dstFile), entry.srcInfo.lastWriteTime, entry.srcInfo.fileSize }; // Robocopy style key for uniqueness of file
 			FileDatabase::FileRec dbFile = m_fileDatabase.getRecord(key);
 			if (!dbFile.name.empty())
 			{
@@ -493,7 +972,7 @@ Client::processFile(LogContext& logContext, Connection* sourceConnection, Connec
 						else
 						{
 							if (m_settings.logProgress)
-								logInfoLinef(L"Link File   %ls", getRelativeSourceFile(entry.src));
+								logInfoLinef(L"Link File   %ls", getRelativeSourceFile(srcFile));
 							stats.linkTime += getTime() - startTime;
 							++stats.linkCount;
 							stats.linkSize += entry.srcInfo.fileSize;
@@ -518,7 +997,7 @@ Client::processFile(LogContext& logContext, Connection* sourceConnection, Connec
 
 		if (m_settings.useOdx) // Try to use ODX (use system copy call using previous destination as source expecting the system to optimize the copy)
 		{
-			FileKey key{ getFileKeyPath(entry.dst), entry.srcInfo.lastWriteTime, entry.srcInfo.fileSize };
+			FileKey key{ getFileKeyPath(dstFile), entry.srcInfo.lastWriteTime, entry.srcInfo.fileSize };
 			FileDatabase::FileRec dbFile = m_fileDatabase.getRecord(key);
 			if (!dbFile.name.empty())
 			{
@@ -554,13 +1033,15 @@ Client::processFile(LogContext& logContext, Connection* sourceConnection, Connec
 			bool linked;
 			bool processedByServer;
 
-			// Send file to server (might be skipped if server already has it).. returns false if it fails
-			if (destConnection->sendWriteFileCommand(entry.src.c_str(), entry.dst.c_str(), entry.srcInfo, entry.attributes, size, written, linked, copyContext, processedByServer))
+			// Send file to server (might be skipped if server already has it).. returns false if it fails. Retries negotiate from scratch
+			WriteResponse response = batchResponse;
+			batchResponse = WriteResponseCount;
+			if (destConnection->sendWriteFileCommand(srcFile.c_str(), dstFile.c_str(), entry.srcInfo, entry.attributes, size, written, linked, copyContext, processedByServer, response))
 			{
 				if (written)
 				{
 					if (m_settings.logProgress)
-						logInfoLinef(L"%ls   %ls", linked ? L"Link File" : L"New File ", getRelativeSourceFile(entry.src));
+						logInfoLinef(L"%ls   %ls", linked ? L"Link File" : L"New File ", getRelativeSourceFile(srcFile));
 					(linked ? stats.linkTime : stats.copyTime) += getTime() - startTime;
 					++(linked ? stats.linkCount : stats.copyCount);
 					(linked ? stats.linkSize : stats.copySize) += written;
@@ -581,13 +1062,13 @@ Client::processFile(LogContext& logContext, Connection* sourceConnection, Connec
 			u64 size;
 			u64 read;
 			bool processedByServer;
-			switch (sourceConnection->sendReadFileCommand(entry.src.c_str(), entry.dst.c_str(), entry.srcInfo, entry.attributes, size, read, copyContext, processedByServer))
+			switch (sourceConnection->sendReadFileCommand(srcFile.c_str(), dstFile.c_str(), entry.srcInfo, entry.attributes, size, read, copyContext, processedByServer))
 			{
 			case Connection::ReadFileResult_Success:
 				if (read)
 				{
 					if (m_settings.logProgress)
-						logInfoLinef(L"%ls   %ls", L"New File ", getRelativeSourceFile(entry.src));
+						logInfoLinef(L"%ls   %ls", L"New File ", getRelativeSourceFile(srcFile));
 					stats.copyTime += getTime() - startTime;
 					++stats.copyCount;
 					stats.copySize += size;
@@ -595,7 +1076,7 @@ Client::processFile(LogContext& logContext, Connection* sourceConnection, Connec
 				else
 				{
 					if (m_settings.logProgress)
-						logInfoLinef(L"Skip File   %ls", getRelativeSourceFile(entry.src));
+						logInfoLinef(L"Skip File   %ls", getRelativeSourceFile(srcFile));
 					stats.skipTime += getTime() - startTime;
 					++stats.skipCount;
 					stats.skipSize += size;
@@ -610,7 +1091,7 @@ Client::processFile(LogContext& logContext, Connection* sourceConnection, Connec
 				return false;
 
 			case Connection::ReadFileResult_ServerBusy:	// Server was busy, return entry in to queue and take a long break (this should never happen on mainthread)
-				m_copyEntriesCs.scoped([&]() { m_copyEntries.push_front(entry); });
+				pushEntry(std::move(entry), &WorkQueue::copyEntries, &WorkQueue::copyEntryCount);
 				m_workDone.isSet(5*1000);
 				return true;
 			}
@@ -621,13 +1102,23 @@ Client::processFile(LogContext& logContext, Connection* sourceConnection, Connec
 			{
 				if (useLinks)
 				{
-					FileKey key{ getFileKeyPath(entry.dst), entry.srcInfo.lastWriteTime, entry.srcInfo.fileSize }; // Robocopy style key for uniqueness of file
+					FileKey key{ getFileKeyPath(dstFile), entry.srcInfo.lastWriteTime, entry.srcInfo.fileSize }; // Robocopy style key for uniqueness of file
 					m_fileDatabase.addToFilesHistory(key, Hash(), fullDst);
 				}
 			};
 
 			bool useSystemCopy = m_settings.useSystemCopy || (m_settings.useOdx && !isLocalPath(m_settings.destDirectory.c_str()) && !isLocalPath(m_settings.sourceDirectory.c_str()));
-			bool tryCopyFirst = m_tryCopyFirst;
+			bool tryCopyFirst = snapshot == DestSnapshot_Unknown ? m_tryCopyFirst : snapshot == DestSnapshot_Missing;
+			if (snapshot != DestSnapshot_Unknown)
+				++stats.destSnapshotHitCount;
+
+			// Same as failing to copy first because file existed
+			if (snapshot == DestSnapshot_Found && m_settings.excludeChangedFiles)
+			{
+				addToDatabase();
+				reportSkip();
+				return true;
+			}
 
 			bool existed = false;
 			u64 written;
@@ -636,10 +1127,10 @@ Client::processFile(LogContext& logContext, Connection* sourceConnection, Connec
 			if (tryCopyFirst)
 			{
 				bool failIfExists = true;
-				if (copyFile(entry.src.c_str(), entry.srcInfo, entry.attributes, fullDst.c_str(), useSystemCopy, failIfExists, existed, written, copyContext, stats.ioStats, m_settings.useBufferedIO))
+				if (copyFile(srcFile.c_str(), entry.srcInfo, entry.attributes, fullDst.c_str(), useSystemCopy, failIfExists, existed, written, copyContext, stats.ioStats, m_settings.useBufferedIO))
 				{
 					if (m_settings.logProgress)
-						logInfoLinef(L"New File    %ls", getRelativeSourceFile(entry.src));
+						logInfoLinef(L"New File    %ls", getRelativeSourceFile(srcFile));
 					stats.copyTime += getTime() - startTime;
 					++stats.copyCount;
 					stats.copySize += written;
@@ -668,8 +1159,10 @@ Client::processFile(LogContext& logContext, Connection* sourceConnection, Connec
 			// Handle scenario of failing to copy because target existed or we never tried copy it
 			if (existed || !tryCopyFirst)
 			{
-				FileInfo destInfo;
-				uint fileAttributes = getFileInfo(destInfo, fullDst.c_str(), stats.ioStats);
+				FileInfo destInfo = snapshotInfo;
+				uint fileAttributes = snapshotAttributes;
+				if (existed || snapshot != DestSnapshot_Found) // File might have been created since listing
+					fileAttributes = getFileInfo(destInfo, fullDst.c_str(), stats.ioStats);
 
 				// If no file attributes it might be that the file doesnt exist
 				if (!fileAttributes)
@@ -680,7 +1173,7 @@ Client::processFile(LogContext& logContext, Connection* sourceConnection, Connec
 				else if (!m_settings.forceCopy && equals(entry.srcInfo, destInfo)) // Skip file if the same
 				{
 					if (m_settings.logProgress)
-						logInfoLinef(L"Skip File   %ls", getRelativeSourceFile(entry.src));
+						logInfoLinef(L"Skip File   %ls", getRelativeSourceFile(srcFile));
 					stats.skipTime += getTime() - startTime;
 					++stats.skipCount;
 					stats.skipSize += destInfo.fileSize;
@@ -696,10 +1189,10 @@ Client::processFile(LogContext& logContext, Connection* sourceConnection, Connec
 						logErrorf(L"Could not copy over read-only destination file (%ls).  EACopy could not forcefully unset the destination file's read-only attribute.", fullDst.c_str());
 				}
 				
-				if (copyFile(entry.src.c_str(), entry.srcInfo, entry.attributes, fullDst.c_str(), useSystemCopy, false, existed, written, copyContext, stats.ioStats, m_settings.useBufferedIO))
+				if (copyFile(srcFile.c_str(), entry.srcInfo, entry.attributes, fullDst.c_str(), useSystemCopy, false, existed, written, copyContext, stats.ioStats, m_settings.useBufferedIO))
 				{
 					if (m_settings.logProgress)
-						logInfoLinef(L"New File    %ls", getRelativeSourceFile(entry.src));
+						logInfoLinef(L"New File    %ls", getRelativeSourceFile(srcFile));
 
 					stats.copyTime += getTime() - startTime;
 					++stats.copyCount;
@@ -714,14 +1207,20 @@ Client::processFile(LogContext& logContext, Connection* sourceConnection, Connec
 		if (retryCountLeft-- == 0)
 		{
 			++stats.failCount;
-			logErrorf(L"failed to copy file (%ls)", entry.src.c_str());
+			logErrorf(L"failed to copy file (%ls)", srcFile.c_str());
 			return true;
 		}
 
 		// Reset last error and try again!
 		logContext.resetLastError();
-		logInfoLinef(L"Warning - failed to copy file %ls to %ls, retrying in %i seconds", entry.src.c_str(), fullDst.c_str(), m_settings.retryWaitTimeMs/1000);
+		snapshot = DestSnapshot_Unknown;
+		TraceScope trace(L"Retry", srcFile.c_str());
+		logInfoLinef(L"Warning - failed to copy file %ls to %ls, retrying in %i seconds", srcFile.c_str(), fullDst.c_str(), m_settings.retryWaitTimeMs/1000);
 		Sleep(m_settings.retryWaitTimeMs);
+		if (sourceConnection && !isValid(sourceConnection))
+			reconnect(*sourceConnection, stats);
+		if (destConnection && !isValid(destConnection))
+			reconnect(*destConnection, stats);
 
 		++stats.retryCount;
 		stats.retryTime += getTime() - startTime;
@@ -741,6 +1240,7 @@ Client::connectToServer(const wchar_t* networkPath, uint connectionIndex, Connec
 	LogContext logContext(*m_log);
 
 	u64 startConnect = getTime();
+	TraceScope trace(L"Connect", networkPath);
 	stats.serverAttempt = true;
 	outConnection = createConnection(networkPath, connectionIndex, stats, failedToConnect, true);
 	stats.connectTime += getTime() - startConnect;
@@ -764,6 +1264,12 @@ Client::processQueues(LogContext& logContext, Connection* sourceConnection, Conn
 	// Process file queue
 	while (!m_workDone.isSet(0))
 	{
+		// Connection to server dropped. Connect again in to same session so server still knows what was created
+		if (sourceConnection && !isValid(sourceConnection))
+			reconnect(*sourceConnection, stats);
+		if (destConnection && !isValid(destConnection))
+			reconnect(*destConnection, stats);
+
 		if (m_fileDatabase.primeUpdate(stats.ioStats))
 			continue;
 		if (processDir(logContext, sourceConnection, destConnection, copyContext, stats))
@@ -773,28 +1279,22 @@ Client::processQueues(LogContext& logContext, Connection* sourceConnection, Conn
 			++filesProcessedCount;
 			continue;
 		}
-
-		// If this is the main thread we check if we can leave processing
-		if (!isMainThread)
+		if (processPurgeDir(destConnection, copyContext, stats))
 			continue;
 
-		{
-			// If there are no active dir processing in any thread plus dir entries are empty there is no way to add more file entries. (all calls are protected by locks)
-			ScopedCriticalSection cs(m_dirEntriesCs);
-			if (m_processDirActive || !m_dirEntries.empty())
-				continue;
-		}
-
-		// If there are still copy entries left, keep helping out. 
-		// We can only end up here if dir processing is _fully_ done...
-		// but another thread might just have added the last file entries and m_dirEntries were empty and m_processDirActive was 0 in the check above
-		ScopedCriticalSection cs2(m_copyEntriesCs);
-		if (!m_copyEntries.empty())
-			continue;
+		// If this is the main thread we check if we can leave processing.
+		// Entries are only added by threads processing other entries so when nothing is pending there is no more work
+		if (isMainThread && m_pendingEntryCount == 0)
+			break;
 
-		break;
+		// Sleep until an entry is pushed to any of the queues (or until all work is done)
+		TraceScope trace(L"WaitForWork");
+		m_workAvailable.isSet(WorkWaitTimeoutMs);
 	}
 
+	// Pass on wake up to other sleeping threads so they can see that work is done
+	m_workAvailable.set();
+
 	logDebugLinef(L"Worker done - %u file(s) processed", filesProcessedCount);
 
 	return true;
@@ -809,6 +1309,15 @@ Client::workerThread(uint connectionIndex, ClientStats& stats)
 		return false;
 	ScopeGuard destConnectionGuard([&] { delete destConnection; });
 
+	// Thread has its own connection to every fan-out destination. They all share the thread's source cache
+	SourceFileCache* sourceCache = m_fanOut.empty() ? nullptr : &m_sourceCaches[connectionIndex];
+	if (destConnection)
+		destConnection->m_sourceCache = sourceCache;
+	ScopeGuard fanOutConnectionsGuard([&] { for (Client* fanOut : m_fanOut) fanOut->disconnectFanOut(connectionIndex); });
+	for (Client* fanOut : m_fanOut)
+		if (!fanOut->connectFanOut(connectionIndex, sourceCache, stats))
+			return false;
+
 	Connection* sourceConnection = nullptr;
 	if (!destConnection)
 		if (!connectToServer(m_settings.sourceDirectory.c_str(), connectionIndex, sourceConnection, m_useSourceServerFailed, stats))
@@ -817,6 +1326,8 @@ Client::workerThread(uint connectionIndex, ClientStats& stats)
 
 
 	// Help process the files
+	t_workQueueIndex = connectionIndex;
+	traceThreadName(L"Worker");
 	LogContext logContext(*m_log);
 	NetworkCopyContext copyContext;
 	processQueues(logContext, sourceConnection, destConnection, copyContext, stats, false);
@@ -829,6 +1340,9 @@ Client::addDirectoryToHandledFiles(LogContext& logContext, Connection* destConne
 {
 	WString destFile = destFullPath.c_str() + m_settings.destDirectory.size();
 
+	FileInfo directoryInfo; // Directories are in destination cache with zero time and no size
+	directoryInfo.fileSize = ~u64(0);
+
 	uint lastSlashIndex = destFile.find_last_of(L'\\');
 	if (lastSlashIndex != WString::npos)
 	{
@@ -838,9 +1352,10 @@ Client::addDirectoryToHandledFiles(LogContext& logContext, Connection* destConne
 		{
 			ScopedCriticalSection cs(m_handledFilesCs); // Need to cover entire thing to make sure directory is always created
 
-			if (!m_handledFiles.insert(destPath).second)
+			if (!m_handledFiles.insert(destPath))
 				break;
-			if (first)
+			addToDestinationCache(destPath, directoryInfo.lastWriteTime, directoryInfo.fileSize);
+			if (first && !findInDestinationCache(destPath, directoryInfo))
 			{
 				WString destFullPath2(destFullPath);
 				destFullPath2.resize(destFullPath2.find_last_of(L'\\') + 1);
@@ -856,6 +1371,7 @@ Client::addDirectoryToHandledFiles(LogContext& logContext, Connection* destConne
 					// Reset last error and try again!
 					logContext.resetLastError();
 					TimerScope _(stats.retryTime);
+					TraceScope trace(L"Retry");
 					logInfoLinef(L"Warning - Failed to create directory %ls, retrying in %i seconds", destFullPath2.c_str(), m_settings.retryWaitTimeMs/1000);
 					Sleep(m_settings.retryWaitTimeMs);
 					++stats.retryCount;
@@ -891,9 +1407,8 @@ Client::handleFile(LogContext& logContext, Connection* destConnection, const WSt
 	WString destFullPath = destPath + destFileName;
 
 	// Check if file should be excluded because of wild cards
-	for (auto& excludeWildcard : m_settings.excludeWildcards)
-		if (PathMatchSpecW(destFullPath.c_str(), excludeWildcard.c_str()))
-			return true;
+	if (m_excludeWildcards.match(destFullPath.c_str()))
+		return true;
 
 	// This is the path of the dest file relative root directory
 	WString destFile = destFullPath.c_str() + m_settings.destDirectory.size();
@@ -901,7 +1416,7 @@ Client::handleFile(LogContext& logContext, Connection* destConnection, const WSt
 	// Keep track of handled files so we don't do duplicated work
 	{
 		ScopedCriticalSection cs(m_handledFilesCs);
-		if (!m_handledFiles.insert(destFile).second)
+		if (!m_handledFiles.insert(destFile))
 			return true;
 	}
 
@@ -912,14 +1427,37 @@ Client::handleFile(LogContext& logContext, Connection* destConnection, const WSt
 		return false;
 	WString srcFile = sourcePath + fileName;
 
+	addToDestinationCache(destFile, fileInfo.lastWriteTime, fileInfo.fileSize);
+
+	// Previous run left destination file identical to source, skip without touching destination
+	if (findInDestinationCache(destFile, fileInfo))
+	{
+		if (m_settings.logProgress)
+			logInfoLinef(L"Skip File   %ls", getRelativeSourceFile(srcFile));
+		++stats.skipCount;
+		++stats.destCacheSkipCount;
+		stats.skipSize += fileInfo.fileSize;
+
+		if (fileInfo.fileSize >= m_settings.useLinksThreshold)
+		{
+			FileKey key{ getFileKeyPath(destFile), fileInfo.lastWriteTime, fileInfo.fileSize };
+			FileDatabase::FileRec dbFile = m_fileDatabase.getRecord(key);
+			m_fileDatabase.addToFilesHistory(key, dbFile.name == destFullPath ? dbFile.hash : Hash(), destFullPath); // Touch db
+		}
+		return true;
+	}
+
 	// Add entry (workers will pick this up as soon as possible )
-	ScopedCriticalSection cs(m_copyEntriesCs);
-	m_copyEntries.push_back(CopyEntry());
-	auto& entry = m_copyEntries.back();
-	entry.src = srcFile;
-	entry.dst = destFile;
+	// Directories are interned and destination name is the tail of the source name so each file only adds its name
+	CopyEntry entry;
+	entry.srcDir = m_paths.intern(sourcePath);
+	entry.srcName = m_paths.add(fileName, uint(wcslen(fileName)));
+	uint destNameOffset = uint(destFile.size() - wcslen(lastSlash ? lastSlash + 1 : fileName));
+	entry.dstDir = m_paths.intern(destFile.c_str(), destNameOffset);
+	entry.dstName = entry.srcName + (lastSlash ? lastSlash + 1 - fileName : 0);
 	entry.srcInfo = fileInfo;
 	entry.attributes = attributes;
+	pushEntry(std::move(entry), &WorkQueue::copyEntries, &WorkQueue::copyEntryCount);
 	return true;
 }
 
@@ -943,27 +1481,25 @@ Client::handleDirectory(LogContext& logContext, Connection* destConnection, cons
 			return false;
 	}
 
-	ScopedCriticalSection cs(m_dirEntriesCs);
-	m_dirEntries.push_back(DirEntry());
-	DirEntry& dirEntry = m_dirEntries.back();
-	dirEntry.sourceDir = newSourceDirectory;
-	dirEntry.destDir = newDestDirectory;
-	dirEntry.wildcard = wildcard;
+	// Directory waits in queue before it is traversed. List destination in the mean time
+	requestDestinationSnapshot(newDestDirectory);
+
+	DirEntry dirEntry;
+	dirEntry.sourceDir = m_paths.intern(newSourceDirectory);
+	dirEntry.destDir = m_paths.intern(newDestDirectory);
+	dirEntry.wildcard = m_paths.intern(wildcard, uint(wcslen(wildcard)));
 	dirEntry.depthLeft = depthLeft;
+	pushEntry(std::move(dirEntry), &WorkQueue::dirEntries, &WorkQueue::dirEntryCount);
 	return true;
 }
 
 bool
 Client::handleMissingFile(const wchar_t* fileName)
 	{
-	for (auto& optionalWildcard : m_settings.optionalWildcards)
-		if (PathMatchSpecW(fileName, optionalWildcard.c_str()))
-			return true;
-	for (auto& excludeWildcard : m_settings.excludeWildcards)
-		if (PathMatchSpecW(fileName, excludeWildcard.c_str()))
-			return true;
+	if (m_optionalWildcards.match(fileName) || m_excludeWildcards.match(fileName))
+		return true;
 	ScopedCriticalSection cs(m_handledFilesCs);
-	if (m_handledFiles.find(fileName) != m_handledFiles.end())
+	if (m_handledFiles.contains(fileName))
 		return true;
 	return false;
 }
@@ -1025,6 +1561,7 @@ Client::handlePath(LogContext& logContext, Connection* sourceConnection, Connect
 			// Reset last error and try again!
 			logContext.resetLastError();
 			TimerScope _(stats.retryTime);
+			TraceScope trace(L"Retry");
 			logInfoLinef(L"Warning - %ls, retrying in %i seconds", errorDesc, m_settings.retryWaitTimeMs/1000);
 			Sleep(m_settings.retryWaitTimeMs);
 
@@ -1082,19 +1619,59 @@ Client::traverseFilesInDirectory(LogContext& logContext, Connection* sourceConne
 
 		WString searchStr = relPath + wildcard;
 
-		Vector<NameAndFileInfo> files;
-		if (!sourceConnection->sendFindFiles(searchStr.c_str(), files, copyContext))
-			return false;
-		for (auto& file : files)
+		// Let server walk entire tree. Entries are handled while server is still sending the rest
+		if (depthLeft)
 		{
-			if(!(file.attributes & FILE_ATTRIBUTE_DIRECTORY))
-			{
-				if (!handleFile(logContext, destConnection, sourcePath, destPath, file.name.c_str(), file.info, file.attributes, stats))
-					return false;
-			}
-		}
-
-		// Handle directories separately
+			FilesSet ignoredDirs; // Relative paths of directories excluded by wildcards
+			return sourceConnection->sendFindFilesRecursive(searchStr.c_str(), depthLeft, copyContext, [&](NameAndFileInfo& entry)
+				{
+					WString relDir;
+					const wchar_t* name = entry.name.c_str();
+					if (const wchar_t* lastSlash = wcsrchr(name, L'\\'))
+					{
+						relDir.assign(name, lastSlash + 1);
+						name = lastSlash + 1;
+					}
+
+					bool isDir = (entry.attributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+					if (!relDir.empty() && ignoredDirs.find(relDir) != ignoredDirs.end())
+					{
+						if (isDir)
+							ignoredDirs.insert(entry.name + L'\\');
+						return true;
+					}
+
+					WString entrySourcePath = sourcePath + relDir;
+					WString entryDestPath = m_settings.flattenDestination ? destPath : destPath + relDir;
+					if (!isDir)
+						return handleFile(logContext, destConnection, entrySourcePath, entryDestPath, name, entry.info, entry.attributes, stats);
+
+					if (isIgnoredDirectory(name))
+					{
+						ignoredDirs.insert(entry.name + L'\\');
+						return true;
+					}
+
+					if (!m_settings.copyEmptySubdirectories)
+						return true;
+					WString newDestDirectory = m_settings.flattenDestination ? entryDestPath : entryDestPath + name + L'\\';
+					return addDirectoryToHandledFiles(logContext, destConnection, newDestDirectory, entry.attributes, stats);
+				});
+		}
+
+		Vector<NameAndFileInfo> files;
+		if (!sourceConnection->sendFindFiles(searchStr.c_str(), files, copyContext))
+			return false;
+		for (auto& file : files)
+		{
+			if(!(file.attributes & FILE_ATTRIBUTE_DIRECTORY))
+			{
+				if (!handleFile(logContext, destConnection, sourcePath, destPath, file.name.c_str(), file.info, file.attributes, stats))
+					return false;
+			}
+		}
+
+		// Handle directories separately
 		Vector<NameAndFileInfo> directories;
 		WString dirSearchStr = relPath + L"*.*";
 		if (!sourceConnection->sendFindFiles(dirSearchStr.c_str(), directories, copyContext))
@@ -1117,7 +1694,10 @@ Client::traverseFilesInDirectory(LogContext& logContext, Connection* sourceConne
 		if (wildcard.find('*') == std::string::npos)
 			searchStr += wildcard;
 		else
+		{
 			searchStr += L"*.*";
+			requestDestinationSnapshot(destPath); // Root and flattened destinations are not requested by handleDirectory
+		}
 
 		FindFileData fd; 
 		FindFileHandle findFileHandle; 
@@ -1147,6 +1727,7 @@ Client::traverseFilesInDirectory(LogContext& logContext, Connection* sourceConne
 			// Reset last error and try again!
 			logContext.resetLastError();
 			TimerScope _(stats.retryTime);
+			TraceScope trace(L"Retry");
 			logInfoLinef(L"Warning - FindFirstFile %ls failed, retrying in %i seconds", searchStr.c_str(), m_settings.retryWaitTimeMs/1000);
 			Sleep(m_settings.retryWaitTimeMs);
 			++stats.retryCount;
@@ -1157,6 +1738,9 @@ Client::traverseFilesInDirectory(LogContext& logContext, Connection* sourceConne
 		{
 			ScopeGuard _([&]() { findClose(findFileHandle, stats.ioStats); });
 
+			WildcardMatcher wildcardMatcher;
+			wildcardMatcher.add(wildcard.c_str());
+
 			do
 			{
 				FileInfo fileInfo;
@@ -1168,7 +1752,7 @@ Client::traverseFilesInDirectory(LogContext& logContext, Connection* sourceConne
 						continue;
 
 					wchar_t* fileName = getFileName(fd);
-					if (PathMatchSpecW(fileName, wildcard.c_str()))
+					if (wildcardMatcher.match(fileName))
 						if (!handleFile(logContext, destConnection, sourcePath, destPath, getFileName(fd), fileInfo, fileAttr, stats))
 							return false;
 				}
@@ -1233,6 +1817,7 @@ Client::findFilesInDirectory(Vector<NameAndFileInfo>& outEntries, LogContext& lo
 
 			// Reset last error and try again!
 			logContext.resetLastError();
+			TraceScope trace(L"Retry", searchStr.c_str());
 			logInfoLinef(L"Warning - FindFirstFile %ls failed, retrying in %i seconds", searchStr.c_str(), m_settings.retryWaitTimeMs/1000);
 			Sleep(m_settings.retryWaitTimeMs);
 			++stats.retryCount;
@@ -1294,6 +1879,7 @@ Client::handleFilesOrWildcardsFromFile(LogContext& logContext, ClientStats& stat
 				return false;
 
 			logContext.resetLastError();
+			TraceScope trace(L"Retry", originalFullPath.c_str());
 			logInfoLinef(L"Warning - Failed reading input file %ls, retrying in %i seconds", originalFullPath.c_str(), m_settings.retryWaitTimeMs/1000);
 			Sleep(m_settings.retryWaitTimeMs);
 
@@ -1341,7 +1927,7 @@ Client::handleFilesOrWildcardsFromFile(LogContext& logContext, ClientStats& stat
 			u64 read = 0;
 			u64 toRead = CopyContextBufferSize - left - 1;
 			{
-				TimerScope _(stats.ioStats.readTime);
+				IOTimerScope _(stats.ioStats, stats.ioStats.readTime, IOOp_Read);
 				++stats.ioStats.readCount;
 				if (!readFile(fullPath.c_str(), hFile, buffer + left, toRead, read, stats.ioStats))
 				{
@@ -1570,106 +2156,271 @@ Client::processQueuedWildcardFileEntries(LogContext& logContext, ClientStats& st
 }
 
 bool
-Client::purgeFilesInDirectory(const WString& path, uint destPathAttributes, int depthLeft, ClientStats& stats)
+Client::queuePurgeRoots(Client& dest, ClientStats& stats)
+{
+	// Dest is this client or one of the fan-out clients. Paths handled by this client are relative so they apply to all of them
+	const WString& destDir = dest.m_settings.destDirectory;
+
+	if (m_settings.purgeDestination)
+		if (!dest.m_createdDirs.contains(destDir)) // We don't need to purge directories we know we created
+			queuePurgeDirectory(dest, destDir, 0, m_settings.copySubdirDepth); // use 0 for directory attribute because we always want to purge root dir even if it is a symlink (which it probably never is)
+
+	// Purge individual directories (can be provided in filelist file)
+	for (const wchar_t* purgeDir : m_purgeDirs)
+	{
+		WString destPurgeDir(purgeDir);
+		if (&dest != this)
+		{
+			if (!startsWithIgnoreCase(purgeDir, m_settings.destDirectory.c_str()))
+				continue;
+			destPurgeDir = destDir + (purgeDir + m_settings.destDirectory.size());
+		}
+
+		if (dest.m_createdDirs.contains(destPurgeDir)) // We don't need to purge directories we know we created
+			continue;
+
+		FileInfo dirInfo;
+		uint dirAttributes;
+		if (isValid(dest.m_destConnection))
+		{
+			uint error = 0;
+			if (!dest.m_destConnection->sendGetFileAttributes(destPurgeDir.c_str(), dirInfo, dirAttributes, error))
+				return false;
+			if (error)
+				return false;
+		}
+		else
+			dirAttributes = getFileInfo(dirInfo, destPurgeDir.c_str(), stats.ioStats);
+
+		queuePurgeDirectory(dest, destPurgeDir, dirAttributes, m_settings.copySubdirDepth);
+	}
+	return true;
+}
+
+void
+Client::queuePurgeDirectory(Client& dest, const WString& destPath, uint destPathAttributes, int depthLeft)
 {
 	// We don't enter symlinks for purging. Maybe this should be an command line option to treat symlinks just like normal directories
 	// but in the use cases we have at ea we don't want to enter symlinks for purging
 	if ((destPathAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0)
-		return true;
+		return;
 
+	PurgeEntry entry;
+	entry.dest = &dest;
+	entry.destDir = m_paths.intern(destPath);
+	entry.depthLeft = depthLeft;
+	pushEntry(std::move(entry), &WorkQueue::purgeEntries, &WorkQueue::purgeEntryCount);
+}
 
+bool
+Client::purgeFilesInDirectory(Client& dest, Connection* destConnection, NetworkCopyContext& copyContext, const WString& path, int depthLeft, ClientStats& stats)
+{
 	WString relPath;
-	if (path.size() > m_settings.destDirectory.size())
-		relPath.append(path.c_str() + m_settings.destDirectory.size());
+	if (path.size() > dest.m_settings.destDirectory.size())
+		relPath.append(path.c_str() + dest.m_settings.destDirectory.size());
 
 	// If there is a connection and no files were handled inside the directory we can just do a full delete on the server side
-	if (isValid(m_destConnection))
-		if ((relPath.empty() && m_handledFiles.empty()) || (!relPath.empty() && (m_handledFiles.find(relPath) == m_handledFiles.end())))
-			return m_destConnection->sendDeleteAllFiles(relPath.c_str());
-
+	if (isValid(destConnection))
+		if ((relPath.empty() && m_handledFiles.empty()) || (!relPath.empty() && !m_handledFiles.contains(relPath)))
+			return destConnection->sendDeleteAllFiles(relPath.c_str());
 
-    FindFileData fd; 
-    WString searchStr = path + L"*.*";
-    FindFileHandle findHandle = findFirstFile(searchStr.c_str(), fd, stats.ioStats); 
-    if(findHandle == InvalidFindFileHandle)
+	// List destination directory. With a connection the server does the listing so nothing goes over smb
+	Vector<NameAndFileInfo> entries;
+	if (isValid(destConnection))
 	{
-		uint lastError = GetLastError();
-		if (lastError == ERROR_FILE_NOT_FOUND)
-			return true;
-		logErrorf(L"FindFirstFile failed while purging with search string %ls: %ls", searchStr.c_str(), getErrorText(lastError).c_str());
-		return false;
+		if (!destConnection->sendFindFiles((relPath + L"*.*").c_str(), entries, copyContext))
+			return false;
+	}
+	else
+	{
+		FindFileData fd; 
+		WString searchStr = path + L"*.*";
+		FindFileHandle findHandle = findFirstFile(searchStr.c_str(), fd, stats.ioStats); 
+		if(findHandle == InvalidFindFileHandle)
+		{
+			uint lastError = GetLastError();
+			if (lastError == ERROR_FILE_NOT_FOUND)
+				return true;
+			logErrorf(L"FindFirstFile failed while purging with search string %ls: %ls", searchStr.c_str(), getErrorText(lastError).c_str());
+			return false;
+		}
+		ScopeGuard _([&]() { findClose(findHandle, stats.ioStats); });
+
+		do
+		{
+			FileInfo fileInfo;
+			uint fileAttr = getFileInfo(fileInfo, fd);
+			const wchar_t* fileName = getFileName(fd);
+			if ((fileAttr & FILE_ATTRIBUTE_DIRECTORY) && isDotOrDotDot(fileName))
+				continue;
+			entries.push_back({fileName, fileInfo, fileAttr});
+		}
+		while (findNextFile(findHandle, fd, stats.ioStats));
+
+		uint error = GetLastError();
+		if (error != ERROR_NO_MORE_FILES)
+		{
+			logErrorf(L"FindNextFile failed while purging for %ls: %ls", searchStr.c_str(), getErrorText(error).c_str());
+			return false;
+		}
 	}
-	ScopeGuard _([&]() { findClose(findHandle, stats.ioStats); });
 
-	bool errorOnMissingFile = false;
+	// Diff listing against what was copied. Deletes are done straight away or batched in to one command to the server
+	// and sub directories that are kept are queued up for any thread to purge
+	Vector<NameAndFileInfo> deletePaths;
 	bool res = true;
-    do
+	for (auto& entry : entries)
 	{
-		FileInfo fileInfo;
-		uint fileAttr = getFileInfo(fileInfo, fd);
-		bool isDir = (fileAttr & FILE_ATTRIBUTE_DIRECTORY) != 0;
-
-		if (!isDir && !isFileWithAttributeAllowed(fileAttr))
+		bool isDir = (entry.attributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+		if (!isDir && !isFileWithAttributeAllowed(entry.attributes))
 			continue;
 
-		const wchar_t* fileName = getFileName(fd);
 		// Check if file was copied here
-		WString filePath = relPath + fileName;
-
+		WString filePath = relPath + entry.name;
 		if (isDir)
-		{
-			if (isDotOrDotDot(fileName))
-				continue;
 			filePath += L'\\';
-		}
 
-		// File/directory was not part of source, delete
-		if (m_handledFiles.find(filePath) == m_handledFiles.end())
+		if (m_handledFiles.contains(filePath))
 		{
-			if (isIgnoredDirectory(fileName))
-				continue;
-			WString fullPath = (path + fileName);
-	        if(isDir)
-			{
-				bool isSymlink = (fileAttr & FILE_ATTRIBUTE_REPARSE_POINT) != 0;
-				if (isSymlink)
-				{
-					if (!RemoveDirectoryW(fullPath.c_str()))
-					{
-						logErrorf(L"Trying to remove reparse point while purging destination %ls: %ls", fullPath.c_str(), getLastErrorText().c_str());
-						res = false;
-					}
-				}
-				else if (!deleteDirectory(fullPath.c_str(), stats.ioStats, errorOnMissingFile))
-					res = false;
-			}
-			else
-			{
-				if (fileAttr & FILE_ATTRIBUTE_READONLY)
-				{
-					if (!setFileWritable(fullPath.c_str(), true))
-						logErrorf(L"Could not purge read-only file in destination (%ls).  EACopy could not forcefully unset the file's read-only attribute in destination.", fullPath.c_str());
-				}
-				if (!deleteFile(fullPath.c_str(), stats.ioStats, errorOnMissingFile))
-					res = false;
-			}
+			// Directories we created can only contain what we copied in to them
+			WString fullPath = path + entry.name + L'\\';
+			if (isDir && !dest.m_createdDirs.contains(fullPath))
+				queuePurgeDirectory(dest, fullPath, entry.attributes, depthLeft - 1);
+			continue;
 		}
-        else if(isDir)
+
+		// File/directory was not part of source, delete
+		if (isIgnoredDirectory(entry.name.c_str()))
+			continue;
+
+		++stats.purgeCount;
+		if (isValid(destConnection))
 		{
-			if (!purgeFilesInDirectory(path + fileName + L'\\', fileAttr, depthLeft - 1, stats))
-				res = false;
+			entry.name = relPath + entry.name;
+			deletePaths.push_back(std::move(entry));
 		}
+		else if (!deletePath((path + entry.name).c_str(), entry.attributes, stats.ioStats, false))
+			res = false;
+	}
 
-	} while (findNextFile(findHandle, fd, stats.ioStats));
+	if (!deletePaths.empty())
+		if (!destConnection->sendDeletePathsCommand(deletePaths))
+			return false;
+
+	return res;
+}
+
+bool
+Client::createDeferredDirectories(ClientStats& stats)
+{
+	if (!m_deferCreateDirs)
+		return true;
+	m_deferCreateDirs = false;
 
-	uint error = GetLastError();
-	if (error != ERROR_NO_MORE_FILES)
+	if (isValid(m_destConnection))
 	{
-		logErrorf(L"FindNextFile failed while purging for %ls: %ls", searchStr.c_str(), getErrorText(error).c_str());
-		res = false;
+		FilesSet createdDirs;
+		if (!m_destConnection->sendCreateDirectoriesCommand(m_deferredDirs, createdDirs))
+			return false;
+		for (auto& dir : createdDirs)
+			m_createdDirs.insert(dir);
 	}
+	else
+		for (auto& dir : m_deferredDirs)
+			if (!ensureDirectory(m_destConnection, dir, 0, stats.ioStats))
+				return false;
+	return true;
+}
 
-	return res;
+void
+Client::startFanOut(Log& log)
+{
+	resetWorkState(log);
+	m_networkWsaInitDone = false;
+	m_serverAddrInfo = nullptr;
+
+	// Source is only read by the client feeding this one
+	m_useSourceServerFailed = true;
+
+	const WString& destDir = m_settings.destDirectory;
+	if (destDir.size() < 5 || destDir[0] != '\\' || destDir[1] != '\\')
+		m_useDestServerFailed = true;
+
+	m_fanOutConnections.assign(m_settings.threadCount + 1, nullptr);
+}
+
+void
+Client::stopFanOut()
+{
+	disconnectFanOut(0);
+	endPoolSession();
+
+	if (m_serverAddrInfo && !m_settings.connectionPool)
+		freeAddrInfo(m_serverAddrInfo);
+	m_serverAddrInfo = nullptr;
+
+	#if defined(_WIN32)
+	if (m_networkWsaInitDone)
+		WSACleanup();
+	#endif
+	m_networkWsaInitDone = false;
+}
+
+bool
+Client::connectFanOut(uint connectionIndex, SourceFileCache* sourceCache, ClientStats& stats)
+{
+	// Index zero is the main thread, it connects with the same index as the first worker just like the main connection
+	Connection* connection;
+	if (!connectToServer(m_settings.destDirectory.c_str(), max(connectionIndex, 1u), connection, m_useDestServerFailed, stats))
+		return false;
+	if (connection)
+		connection->m_sourceCache = sourceCache;
+	m_fanOutConnections[connectionIndex] = connection;
+
+	if (connectionIndex == 0)
+	{
+		m_destConnection = connection;
+		m_deferCreateDirs = isValid(m_destConnection) && m_settings.useLinksThreshold == ~u64(0) && !m_settings.useOdx;
+	}
+	return true;
+}
+
+void
+Client::disconnectFanOut(uint connectionIndex)
+{
+	delete m_fanOutConnections[connectionIndex];
+	m_fanOutConnections[connectionIndex] = nullptr;
+	if (connectionIndex == 0)
+		m_destConnection = nullptr;
+}
+
+Client::Connection*
+Client::getFanOutConnection() const
+{
+	return m_fanOutConnections[t_workQueueIndex];
+}
+
+void
+Client::SourceFileCache::setFile(const wchar_t* file, const FileInfo& fileInfo)
+{
+	if (path == file && equals(info, fileInfo))
+		return;
+	path = file;
+	info = fileInfo;
+	hasHash = false;
+	hasChunks = false;
+	hasCompressed = false;
+	compressed.clear();
+}
+
+void
+Client::SourceFileCache::setHashAlgorithm(HashAlgorithm algorithm)
+{
+	if (hashAlgorithm == algorithm)
+		return;
+	hashAlgorithm = algorithm;
+	hasHash = false;
+	hasChunks = false;
 }
 
 bool
@@ -1681,6 +2432,18 @@ Client::ensureDirectory(Connection* destConnection, const WString& directory, ui
 		return false;
 	}
 
+	// Fan-out destinations get the same directory
+	for (Client* fanOut : m_fanOut)
+		if (!fanOut->ensureDirectory(fanOut->getFanOutConnection(), fanOut->m_settings.destDirectory + (directory.c_str() + m_settings.destDirectory.size()), attributes, ioStats))
+			return false;
+
+	if (m_deferCreateDirs && isValid(destConnection))
+	{
+		ScopedCriticalSection cs(m_createdDirsCs);
+		m_deferredDirs.insert(directory);
+		return true;
+	}
+
 	FilesSet createdDirs;
 
 	if (isValid(destConnection))
@@ -1697,69 +2460,370 @@ Client::ensureDirectory(Connection* destConnection, const WString& directory, ui
 	}
 
 	ScopedCriticalSection cs(m_createdDirsCs);
-	m_createdDirs.insert(createdDirs.begin(), createdDirs.end());
+	for (auto& dir : createdDirs)
+		m_createdDirs.insert(dir);
 
 	return true;
 }
 
-const wchar_t*
-Client::getRelativeSourceFile(const WString& sourcePath) const
+// Cookie is followed by wchar size, destination root, root last write time, count and name/last write time of first level
+// directories and a stream of entries
+constexpr u8 destCacheCookie[] = "eacopydc002";
+
+bool
+Client::getDestinationStamp(FileTime& outTime, const WString& destDir, Connection* destConnection, ClientStats& stats)
 {
-	const wchar_t* logStr = sourcePath.c_str();
-	const WString& baseDir = m_settings.sourceDirectory;
-	if (_wcsnicmp(logStr, baseDir.c_str(), baseDir.size()) == 0)
-		logStr += baseDir.size();
-	return logStr;
+	// Directory time changes when entries are added, removed or renamed in it. Stamps are taken last in every run
+	WString fullPath = m_settings.destDirectory + destDir;
+	FileInfo dirInfo;
+	uint dirAttributes = 0;
+	if (isValid(destConnection))
+	{
+		uint error = 0;
+		if (!destConnection->sendGetFileAttributes(fullPath.c_str(), dirInfo, dirAttributes, error) || error)
+			return false;
+	}
+	else
+		dirAttributes = getFileInfo(dirInfo, fullPath.c_str(), stats.ioStats);
+
+	if (!(dirAttributes & FILE_ATTRIBUTE_DIRECTORY))
+		return false;
+	outTime = dirInfo.lastWriteTime;
+	return true;
 }
 
-const wchar_t*
-Client::getFileKeyPath(const WString& relativePath) const
+void
+Client::readDestinationCache(Connection* destConnection, ClientStats& stats)
 {
-	if (m_settings.useLinksRelativePath)
-		return relativePath.c_str();
-	auto lastSlash = relativePath.find_last_of(L'\\');
-	if (lastSlash == WString::npos)
-		return relativePath.c_str();
-	return relativePath.c_str() + lastSlash + 1;
-}
+	TimerScope _(stats.readDestCacheTime);
+	const wchar_t* fullPath = m_settings.destinationCacheFile.c_str();
 
+	FileInfo fileInfo;
+	if (!getFileInfo(fileInfo, fullPath, stats.ioStats))
+		return;
 
-///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	{ // Mapping must be closed before file is deleted
+		MappedFile file;
+		if (!file.open(fullPath, stats.ioStats))
+			return;
 
-Client::Connection*
-Client::createConnection(const wchar_t* networkPath, uint connectionIndex, ClientStats& stats, bool& failedToConnect, bool doProtocolCheck)
-{
-	u64 startTime = getTime();
+		const u8* pos = file.data();
+		const u8* end = pos + file.size();
+		auto readString = [&](WString& out)
+		{
+			uint len;
+			if (u64(end - pos) < sizeof(uint))
+				return false;
+			memcpy(&len, pos, sizeof(uint));
+			pos += sizeof(uint);
+			if (u64(end - pos) < u64(len)*sizeof(wchar_t))
+				return false;
+			out.assign((const wchar_t*)pos, len);
+			pos += len*sizeof(wchar_t);
+			return true;
+		};
 
-	ScopedCriticalSection networkInitScope(m_networkInitCs);
+		// Returns why cache can't be used, null on success
+		auto load = [&]() -> const wchar_t*
+		{
+			if (file.size() < sizeof(destCacheCookie) + 1 || memcmp(pos, destCacheCookie, sizeof(destCacheCookie)) != 0 || pos[sizeof(destCacheCookie)] != sizeof(wchar_t))
+				return L"has unknown format";
+			pos += sizeof(destCacheCookie) + 1;
+
+			WString root;
+			FileTime stamp;
+			if (!readString(root) || u64(end - pos) < sizeof(FileTime))
+				return L"is truncated";
+			if (!equalsIgnoreCase(root.c_str(), m_settings.destDirectory.c_str()))
+				return L"is for a different destination";
+			memcpy(&stamp, pos, sizeof(FileTime));
+			pos += sizeof(FileTime);
+
+			FileTime currentStamp;
+			if (!getDestinationStamp(currentStamp, WString(), destConnection, stats) || memcmp(&stamp, &currentStamp, sizeof(FileTime)) != 0)
+				return L"is out of date";
+
+			// Changes deeper down are only seen in the time of the directory they were made in, those are not checked
+			uint dirCount;
+			if (u64(end - pos) < sizeof(uint))
+				return L"is truncated";
+			memcpy(&dirCount, pos, sizeof(uint));
+			pos += sizeof(uint);
+			WString dir;
+			for (uint i=0; i!=dirCount; ++i)
+			{
+				if (!readString(dir) || u64(end - pos) < sizeof(FileTime))
+					return L"is truncated";
+				memcpy(&stamp, pos, sizeof(FileTime));
+				pos += sizeof(FileTime);
+				if (!getDestinationStamp(currentStamp, dir, destConnection, stats) || memcmp(&stamp, &currentStamp, sizeof(FileTime)) != 0)
+					return L"is out of date";
+			}
 
-	if (!m_networkInitDone)
-	{
-		m_networkInitDone = true;
+			WString name;
+			DestCacheEntry entry;
+			while (pos != end)
+			{
+				if (!readString(name) || u64(end - pos) < sizeof(DestCacheEntry))
+				{
+					m_destCache.known.clear();
+					return L"is truncated";
+				}
+				memcpy(&entry, pos, sizeof(DestCacheEntry));
+				pos += sizeof(DestCacheEntry);
+				m_destCache.known.emplace(std::move(name), entry);
+			}
+			return nullptr;
+		};
 
-		// Initialize Winsock
-		#if defined(_WIN32)
-		WSADATA wsaData;
-		int wsaRes = WSAStartup(MAKEWORD(2,2), &wsaData);
-		if (wsaRes != 0)
+		if (const wchar_t* reason = load())
+			logDebugLinef(L"Destination cache %ls %ls", fullPath, reason);
+		else
 		{
-			logErrorf(L"WSAStartup failed with error: %d", wsaRes);
-			return nullptr;
+			m_destCache.valid = true;
+			stats.readDestCacheEntries = m_destCache.known.size();
 		}
-		#endif
+	}
 
-		m_networkWsaInitDone = true;
+	// Cache is only written back when all files made it to destination. An interrupted run must not leave a stale cache behind
+	deleteFile(fullPath, stats.ioStats, false);
+}
 
-		WString networkServerName;
+bool
+Client::writeDestinationCache(Connection* destConnection, ClientStats& stats)
+{
+	TimerScope _(stats.writeDestCacheTime);
 
-		if (m_settings.serverAddress.empty())
-		{
-			const wchar_t* serverNameStart = networkPath + 2;
-			const wchar_t* serverNameEnd = wcschr(serverNameStart, L'\\');
-			if (!serverNameEnd)
-				return nullptr;
+	FileTime stamp;
+	if (!getDestinationStamp(stamp, WString(), destConnection, stats))
+		return true;
 
-			const wchar_t* netDirectoryStart = serverNameEnd;
+	Vector<u8> buffer;
+	auto append = [&](const void* data, size_t size) { buffer.insert(buffer.end(), (const u8*)data, (const u8*)data + size); };
+	auto appendString = [&](const WString& str) { uint len = uint(str.size()); append(&len, sizeof(uint)); append(str.c_str(), len*sizeof(wchar_t)); };
+
+	append(destCacheCookie, sizeof(destCacheCookie));
+	u8 wcharSize = sizeof(wchar_t);
+	append(&wcharSize, 1);
+	appendString(m_settings.destDirectory);
+	append(&stamp, sizeof(FileTime));
+
+	// Directories written have ~0 size and keys ending with a slash, first level ones have no other slash
+	Vector<std::pair<const WString*, FileTime>> dirStamps;
+	for (auto& kv : m_destCache.written)
+	{
+		if (kv.second.fileSize != ~u64(0) || kv.first.empty() || kv.first.find(L'\\') != kv.first.size() - 1)
+			continue;
+		if (!getDestinationStamp(stamp, kv.first, destConnection, stats))
+			return true;
+		dirStamps.emplace_back(&kv.first, stamp);
+	}
+	uint dirCount = uint(dirStamps.size());
+	append(&dirCount, sizeof(uint));
+	for (auto& dirStamp : dirStamps)
+	{
+		appendString(*dirStamp.first);
+		append(&dirStamp.second, sizeof(FileTime));
+	}
+
+	for (auto& kv : m_destCache.written)
+	{
+		appendString(kv.first);
+		append(&kv.second, sizeof(DestCacheEntry));
+	}
+	stats.writeDestCacheEntries = m_destCache.written.size();
+
+	const wchar_t* fullPath = m_settings.destinationCacheFile.c_str();
+	FileHandle handle;
+	if (!openFileWrite(fullPath, handle, stats.ioStats, true))
+		return false;
+	ScopeGuard fileGuard([&]() { closeFile(fullPath, handle, AccessType_Write, stats.ioStats); });
+	return eacopy::writeFile(fullPath, handle, buffer.data(), buffer.size(), stats.ioStats);
+}
+
+bool
+Client::findInDestinationCache(const WString& destFile, const FileInfo& fileInfo)
+{
+	if (!m_destCache.valid)
+		return false;
+	auto findIt = m_destCache.known.find(destFile); // known is never modified after read
+	if (findIt == m_destCache.known.end())
+		return false;
+	return findIt->second.fileSize == fileInfo.fileSize && memcmp(&findIt->second.lastWriteTime, &fileInfo.lastWriteTime, sizeof(FileTime)) == 0;
+}
+
+void
+Client::addToDestinationCache(const WString& destFile, const FileTime& lastWriteTime, u64 fileSize)
+{
+	if (m_settings.destinationCacheFile.empty())
+		return;
+	ScopedCriticalSection cs(m_destCache.cs);
+	m_destCache.written[destFile] = { lastWriteTime, fileSize };
+}
+
+void
+Client::requestDestinationSnapshot(const WString& destPath)
+{
+	if (!m_destSnapshots.enabled)
+		return;
+	WString destDir(destPath.c_str() + m_settings.destDirectory.size());
+	ScopedCriticalSection cs(m_destSnapshots.cs);
+	if (m_destSnapshots.stop || m_destSnapshots.fileCount >= DestSnapshotMaxFileCount)
+		return;
+	if (!m_destSnapshots.dirs.emplace(destDir, DestSnapshotDir()).second)
+		return;
+	m_destSnapshots.queue.push_back(std::move(destDir));
+	m_destSnapshots.queueAvailable.set();
+}
+
+void
+Client::destinationSnapshotThread()
+{
+	traceThreadName(L"Prefetch");
+	IOStats ioStats;
+	while (true)
+	{
+		WString destDir;
+		{
+			ScopedCriticalSection cs(m_destSnapshots.cs);
+			if (m_destSnapshots.stop)
+			{
+				m_destSnapshots.queueAvailable.set(); // Pass on to other prefetch threads
+				break;
+			}
+			if (m_destSnapshots.queue.empty())
+			{
+				cs.leave();
+				m_destSnapshots.queueAvailable.isSet();
+				continue;
+			}
+			destDir = std::move(m_destSnapshots.queue.front());
+			m_destSnapshots.queue.pop_front();
+			if (!m_destSnapshots.queue.empty())
+				m_destSnapshots.queueAvailable.set();
+		}
+
+		TraceScope trace(L"DestSnapshot", destDir.c_str());
+		u64 startTime = getTime();
+
+		// Directory not existing is a valid listing, every file in it will be copied without checking first.
+		// Other errors leave the snapshot unlisted and workers check each file themselves
+		DestSnapshotDir snapshot;
+		FindFileData fd;
+		WString searchStr = m_settings.destDirectory + destDir + L"*.*";
+		FindFileHandle findHandle = findFirstFile(searchStr.c_str(), fd, ioStats);
+		if (findHandle == InvalidFindFileHandle)
+		{
+			uint error = GetLastError();
+			snapshot.listed = error == ERROR_FILE_NOT_FOUND || error == ERROR_PATH_NOT_FOUND;
+		}
+		else
+		{
+			ScopeGuard _([&]() { findClose(findHandle, ioStats); });
+			do
+			{
+				DestSnapshotFile file;
+				file.attributes = getFileInfo(file.info, fd);
+				if (!(file.attributes & FILE_ATTRIBUTE_DIRECTORY))
+					snapshot.files.emplace(getFileName(fd), file);
+			}
+			while (findNextFile(findHandle, fd, ioStats));
+			snapshot.listed = snapshot.exists = GetLastError() == ERROR_NO_MORE_FILES;
+		}
+
+		ScopedCriticalSection cs(m_destSnapshots.cs);
+		++m_destSnapshots.count;
+		m_destSnapshots.time += getTime() - startTime;
+		if (!snapshot.listed)
+			continue;
+		m_destSnapshots.fileCount += uint(snapshot.files.size());
+		m_destSnapshots.dirs[destDir] = std::move(snapshot);
+	}
+
+	ScopedCriticalSection cs(m_destSnapshots.cs);
+	m_destSnapshots.findFileTime += ioStats.findFileTime;
+	m_destSnapshots.findFileCount += ioStats.findFileCount;
+}
+
+Client::DestSnapshotResult
+Client::findInDestinationSnapshot(const CopyEntry& entry, FileInfo& outInfo, uint& outAttributes)
+{
+	if (!m_destSnapshots.enabled)
+		return DestSnapshot_Unknown;
+	WString destDir(entry.dstDir->str, entry.dstDir->length);
+	ScopedCriticalSection cs(m_destSnapshots.cs);
+	auto dirIt = m_destSnapshots.dirs.find(destDir);
+	if (dirIt == m_destSnapshots.dirs.end() || !dirIt->second.listed)
+		return DestSnapshot_Unknown;
+	DestSnapshotFiles& files = dirIt->second.files;
+	auto fileIt = files.find(entry.dstName);
+	if (fileIt == files.end())
+		return DestSnapshot_Missing;
+	outInfo = fileIt->second.info;
+	outAttributes = fileIt->second.attributes;
+	files.erase(fileIt);
+	--m_destSnapshots.fileCount;
+	return DestSnapshot_Found;
+}
+
+const wchar_t*
+Client::getRelativeSourceFile(const WString& sourcePath) const
+{
+	const wchar_t* logStr = sourcePath.c_str();
+	const WString& baseDir = m_settings.sourceDirectory;
+	if (_wcsnicmp(logStr, baseDir.c_str(), baseDir.size()) == 0)
+		logStr += baseDir.size();
+	return logStr;
+}
+
+const wchar_t*
+Client::getFileKeyPath(const WString& relativePath) const
+{
+	if (m_settings.useLinksRelativePath)
+		return relativePath.c_str();
+	auto lastSlash = relativePath.find_last_of(L'\\');
+	if (lastSlash == WString::npos)
+		return relativePath.c_str();
+	return relativePath.c_str() + lastSlash + 1;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+Client::Connection*
+Client::createConnection(const wchar_t* networkPath, uint connectionIndex, ClientStats& stats, bool& failedToConnect, bool doProtocolCheck)
+{
+	u64 startTime = getTime();
+
+	ScopedCriticalSection networkInitScope(m_networkInitCs);
+
+	if (!m_networkInitDone)
+	{
+		m_networkInitDone = true;
+
+		// Initialize Winsock
+		#if defined(_WIN32)
+		WSADATA wsaData;
+		int wsaRes = WSAStartup(MAKEWORD(2,2), &wsaData);
+		if (wsaRes != 0)
+		{
+			logErrorf(L"WSAStartup failed with error: %d", wsaRes);
+			return nullptr;
+		}
+		#endif
+
+		m_networkWsaInitDone = true;
+
+		WString networkServerName;
+
+		if (m_settings.serverAddress.empty())
+		{
+			const wchar_t* serverNameStart = networkPath + 2;
+			const wchar_t* serverNameEnd = wcschr(serverNameStart, L'\\');
+			if (!serverNameEnd)
+				return nullptr;
+
+			const wchar_t* netDirectoryStart = serverNameEnd;
 			while (*netDirectoryStart == '\\' && *netDirectoryStart != 0)
 				++netDirectoryStart;
 			if (!*netDirectoryStart)
@@ -1779,32 +2843,44 @@ Client::createConnection(const wchar_t* networkPath, uint connectionIndex, Clien
 			m_networkServerNetDirectory = networkPath;
 		}
    
-		AddrInfo  hints;
-		memset(&hints, 0, sizeof(hints));
-		hints.ai_family = AF_INET; //AF_UNSPEC; (Skip AF_INET6)
-		hints.ai_socktype = SOCK_STREAM;
-		hints.ai_protocol = IPPROTO_TCP;
-
 		wchar_t defaultPortStr[32];
 		itow(m_settings.serverPort, defaultPortStr, eacopy_sizeof_array(defaultPortStr));
 
-		// Resolve the server address and port
-		int res = getAddrInfoW(networkServerName.c_str(), defaultPortStr, &hints, &m_serverAddrInfo);
-		if (res != 0)
+		// Connection pool remembers resolved addresses so they are not looked up for every process call
+		WString serverAndPort = networkServerName + L':' + defaultPortStr;
+		m_poolKey = serverAndPort + L'\\' + m_networkServerNetDirectory;
+		if (m_settings.connectionPool)
+			m_serverAddrInfo = m_settings.connectionPool->getAddress(serverAndPort);
+
+		if (!m_serverAddrInfo)
 		{
-			if (res == WSAHOST_NOT_FOUND)
+			AddrInfo  hints;
+			memset(&hints, 0, sizeof(hints));
+			hints.ai_family = AF_INET; //AF_UNSPEC; (Skip AF_INET6)
+			hints.ai_socktype = SOCK_STREAM;
+			hints.ai_protocol = IPPROTO_TCP;
+
+			// Resolve the server address and port
+			int res = getAddrInfoW(networkServerName.c_str(), defaultPortStr, &hints, &m_serverAddrInfo);
+			if (res != 0)
 			{
-				if (!failedToConnect) // Just to reduce chance of getting multiple log entries in multithreading scenarios (which doesnt matter)
+				if (res == WSAHOST_NOT_FOUND)
 				{
-					logInfoLinef(L"   !!Invalid server address '%ls'", networkServerName.c_str());
-					logInfoLinef();
-					failedToConnect = true;
+					if (!failedToConnect) // Just to reduce chance of getting multiple log entries in multithreading scenarios (which doesnt matter)
+					{
+						logInfoLinef(L"   !!Invalid server address '%ls'", networkServerName.c_str());
+						logInfoLinef();
+						failedToConnect = true;
+					}
+					return nullptr;
 				}
+				logErrorf(L"GetAddrInfoW failed with error: %ls", getErrorText(res).c_str());
+
 				return nullptr;
 			}
-			logErrorf(L"GetAddrInfoW failed with error: %ls", getErrorText(res).c_str());
 
-			return nullptr;
+			if (m_settings.connectionPool)
+				m_serverAddrInfo = m_settings.connectionPool->setAddress(serverAndPort, m_serverAddrInfo);
 		}
 
 		// Set server name and net directory (this will enable all connections to try to connect)
@@ -1816,6 +2892,35 @@ Client::createConnection(const wchar_t* networkPath, uint connectionIndex, Clien
 
 	networkInitScope.leave();
 
+	// Connection from pool is past version and environment commands. All connections of a client use the session of the first one it gets
+	if (ConnectionPool* pool = m_settings.connectionPool)
+	{
+		ScopedCriticalSection cs(m_secretGuidCs);
+		ConnectionPool::SessionInfo info;
+		info.secretGuid = m_secretGuid;
+		ConnectionPool::IdleConnection idle;
+		if (pool->acquire(m_poolKey, info, idle))
+		{
+			m_secretGuid = info.secretGuid;
+			cs.leave();
+
+			auto connection = new Connection(m_settings, stats, idle.socket, info.hashAlgorithm);
+			if (info.useDictionaries)
+				connection->m_dictionaries = &m_dictionaries;
+			if (!connection->m_compressionStats.fixedLevel)
+				connection->m_compressionStats.currentLevel = idle.compressionLevel;
+			connection->m_networkPath = networkPath;
+			connection->m_connectionIndex = connectionIndex;
+			connection->m_pool = pool;
+			connection->m_poolKey = m_poolKey;
+			connection->m_poolInfo = info;
+			stats.info = info.serverInfo;
+			++stats.connectReuseCount;
+			logDebugLinef(L"Connect to server SUCCESS. Connection taken from pool");
+			return connection;
+		}
+	}
+
 	Socket sock = {INVALID_SOCKET, 0};
 
 	// Loop through and attempt to connect to an address until one succeeds
@@ -1887,6 +2992,8 @@ Client::createConnection(const wchar_t* networkPath, uint connectionIndex, Clien
 		return nullptr;
 
 	bool useSecurityFile;
+	bool useDictionaries;
+	HashAlgorithm hashAlgorithm;
 
 	{
 		// Read version command
@@ -1913,11 +3020,15 @@ Client::createConnection(const wchar_t* networkPath, uint connectionIndex, Clien
 		}
 
 		useSecurityFile = (cmd.protocolFlags & UseSecurityFile) != 0;
+		useDictionaries = (cmd.protocolFlags & UseDictionaries) != 0;
+		hashAlgorithm = (cmd.protocolFlags & UseHashXxh3) ? HashAlgorithm_Xxh3 : HashAlgorithm_Md5; // Server decides since its database hashes must match
 	}
 
 	// Connection is ready, cancel socket cleanup and create connection object
 	socketCleanup.cancel();
-	auto connection = new Connection(m_settings, stats, sock, m_compressionStats);
+	auto connection = new Connection(m_settings, stats, sock, hashAlgorithm);
+	if (useDictionaries)
+		connection->m_dictionaries = &m_dictionaries;
 	ScopeGuard connectionGuard([&] { delete connection; });
 
 	{
@@ -1968,6 +3079,7 @@ Client::createConnection(const wchar_t* networkPath, uint connectionIndex, Clien
 		if (!hasSecretGuid)
 		{
 			TimerScope _(stats.netSecretGuid);
+			TraceScope trace(L"NetSecretGuid");
 			Guid securityFileGuid;
 			if (!receiveData(sock, &securityFileGuid, sizeof(securityFileGuid)))
 			{
@@ -2010,17 +3122,60 @@ Client::createConnection(const wchar_t* networkPath, uint connectionIndex, Clien
 
 	connectionGuard.cancel();
 
+	connection->m_networkPath = networkPath;
+	connection->m_connectionIndex = connectionIndex;
+	if (ConnectionPool* pool = m_settings.connectionPool)
+	{
+		ScopedCriticalSection cs(m_secretGuidCs);
+		connection->m_pool = pool;
+		connection->m_poolKey = m_poolKey;
+		connection->m_poolInfo.secretGuid = m_secretGuid;
+		connection->m_poolInfo.hashAlgorithm = hashAlgorithm;
+		connection->m_poolInfo.useDictionaries = useDictionaries;
+		connection->m_poolInfo.serverInfo = stats.info;
+	}
+
 	return connection;
 }
 
+bool
+Client::reconnect(Connection& connection, ClientStats& stats)
+{
+	// Don't hammer a server that is gone. Work continues without server in the mean time
+	u64 time = getTime();
+	if (time - connection.m_reconnectTime < u64(ReconnectIntervalMs)*10000)
+		return false;
+	connection.m_reconnectTime = time;
+
+	// Environment command is sent with secret guid of session so server finds directories it knows for this client
+	LogContext logContext(*m_log);
+	logContext.mute();
+	TraceScope trace(L"Reconnect", connection.m_networkPath.c_str());
+	bool failedToConnect = false;
+	Connection* newConnection = createConnection(connection.m_networkPath.c_str(), connection.m_connectionIndex, stats, failedToConnect, true);
+	if (!newConnection)
+		return false;
+	connection.m_socket = newConnection->m_socket;
+	newConnection->m_socket.socket = INVALID_SOCKET;
+	delete newConnection;
+	++stats.reconnectCount;
+	logDebugLinef(L"Reconnected to server");
+	return true;
+}
+
+void
+Client::endPoolSession()
+{
+	Guid zeroGuid = {0};
+	if (m_settings.connectionPool && m_secretGuid != zeroGuid)
+		m_settings.connectionPool->endSession(m_poolKey, m_secretGuid);
+}
+
 bool
 Client::isIgnoredDirectory(const wchar_t *directory)
 {
 	// Check if dir should be excluded because of wild cards
-	for (auto& excludeWildcard : m_settings.excludeWildcardDirectories)
-		if (PathMatchSpecW(directory, excludeWildcard.c_str()))
-			return true;
-	return false;
+	return m_excludeWildcardDirectories.match(directory);
 }
 
 bool
@@ -2036,13 +3191,13 @@ Client::isFileWithAttributeAllowed(uint fileAttr)
 		(m_settings.includeAttributes == 0 || fileAttr & m_settings.includeAttributes);
 }
 
-Client::Connection::Connection(const ClientSettings& settings, ClientStats& stats, Socket s, CompressionStats& compressionStats)
+Client::Connection::Connection(const ClientSettings& settings, ClientStats& stats, Socket s, HashAlgorithm hashAlgorithm)
 :	m_settings(settings)
 ,	m_stats(stats)
-,	m_hashContext(stats.hashTime, stats.hashCount)
+,	m_hashContext(stats.hashTime, stats.hashCount, hashAlgorithm)
 ,	m_socket(s)
-,	m_compressionStats(compressionStats)
 {
+	m_compressionStats.init(settings.compressionLevel);
 }
 
 Client::Connection::~Connection()
@@ -2053,12 +3208,20 @@ Client::Connection::~Connection()
 	DoneCommand cmd;
 	cmd.commandType = CommandType_Done;
 	cmd.commandSize = sizeof(cmd);
+	cmd.keepOpen = m_pool != nullptr;
 	sendCommand(cmd);
 
 	u64 compressionLevelSum = 0;
-	receiveData(m_socket, &compressionLevelSum, sizeof(compressionLevelSum), false);
+	bool received = receiveData(m_socket, &compressionLevelSum, sizeof(compressionLevelSum), false);
 	m_stats.compressionLevelSum += compressionLevelSum;
 
+	// Server keeps connection as it is for next client taking it from pool
+	if (received && m_pool)
+	{
+		m_pool->release(m_poolKey, m_poolInfo, { m_socket, m_compressionStats.currentLevel, 0 });
+		return;
+	}
+
 	destroy();
 }
 
@@ -2088,7 +3251,7 @@ Client::Connection::sendTextCommand(const wchar_t* text)
 }
 
 bool
-Client::Connection::sendWriteFileCommand(const wchar_t* src, const wchar_t* dst, const FileInfo& srcInfo, uint srcAttributes, u64& outSize, u64& outWritten, bool& outLinked, NetworkCopyContext& copyContext, bool &processedByServer)
+Client::Connection::sendWriteFileCommand(const wchar_t* src, const wchar_t* dst, const FileInfo& srcInfo, uint srcAttributes, u64& outSize, u64& outWritten, bool& outLinked, NetworkCopyContext& copyContext, bool &processedByServer, WriteResponse batchResponse)
 {
 	outSize = 0;
 	outWritten = 0;
@@ -2101,6 +3264,7 @@ Client::Connection::sendWriteFileCommand(const wchar_t* src, const wchar_t* dst,
 	auto& cmd = *(WriteFileCommand*)buffer;
 	cmd.commandType = CommandType_WriteFile;
 	cmd.writeType = writeType;
+	cmd.batchResponse = batchResponse;
 	//cmd.excludeRules = ; // TODO: IMPLEMENT THIS m_settings.excludeChangedFiles
 	cmd.commandSize = sizeof(cmd) + uint(wcslen(dst)*2);
 	if (!stringCopy(cmd.path, MaxPath, dst))
@@ -2117,18 +3281,36 @@ Client::Connection::sendWriteFileCommand(const wchar_t* src, const wchar_t* dst,
 
 	outSize = cmd.info.fileSize;
 
+	SourceFileCache* sourceCache = m_sourceCache;
+	if (sourceCache)
+	{
+		sourceCache->setFile(src, cmd.info);
+		sourceCache->setHashAlgorithm(m_hashContext.m_algorithm);
+	}
+
+	// Dictionary only pays off for small files
+	CompressionDictionary* dictionary = nullptr;
+	if (writeType == WriteFileType_Compressed && cmd.info.fileSize < DictionaryMaxFileSize)
+		dictionary = getDictionary(dst);
+	cmd.dictionaryId = dictionary ? dictionary->id : 0;
+
 	if (!sendCommand(cmd))
 		return false;
 
-	WriteResponse writeResponse;
-	u64 netWriteResponseTime = 0;
+	// Server does not answer again for files negotiated with WriteFiles
+	WriteResponse writeResponse = batchResponse;
+	if (batchResponse == WriteResponseCount)
 	{
-		TimerScope _(netWriteResponseTime);
-		if (!receiveData(m_socket, &writeResponse, sizeof(writeResponse)))
-			return false;
+		u64 netWriteResponseTime = 0;
+		{
+			TimerScope _(netWriteResponseTime);
+			TraceScope trace(L"Negotiate");
+			if (!receiveData(m_socket, &writeResponse, sizeof(writeResponse)))
+				return false;
+		}
+		++m_stats.netWriteResponseCount[writeResponse];
+		m_stats.netWriteResponseTime[writeResponse] += netWriteResponseTime;
 	}
-	++m_stats.netWriteResponseCount[writeResponse];
-	m_stats.netWriteResponseTime[writeResponse] += netWriteResponseTime;
 
 	do
 	{
@@ -2157,14 +3339,25 @@ Client::Connection::sendWriteFileCommand(const wchar_t* src, const wchar_t* dst,
 			break;
 
 		Hash hash;
-		if (!getFileHash(hash, src, copyContext, m_stats.ioStats, m_hashContext, m_stats.hashTime))
-			return false;
+		if (sourceCache && sourceCache->hasHash)
+			hash = sourceCache->hash;
+		else if (isHashAlgorithmSupported(m_hashContext.m_algorithm)) // If not supported we send invalid hash and server will fall back to copy
+		{
+			if (!getFileHash(hash, src, copyContext, m_stats.ioStats, m_hashContext, m_stats.hashTime))
+				return false;
+			if (sourceCache)
+			{
+				sourceCache->hash = hash;
+				sourceCache->hasHash = true;
+			}
+		}
 		if (!sendData(m_socket, &hash, sizeof(hash)))
 			return false;
 
 		u64 netWriteResponseTime = 0;
 		{
 			TimerScope _(netWriteResponseTime);
+			TraceScope trace(L"Negotiate");
 			if (!receiveData(m_socket, &writeResponse, sizeof(writeResponse)))
 				return false;
 		}
@@ -2173,17 +3366,95 @@ Client::Connection::sendWriteFileCommand(const wchar_t* src, const wchar_t* dst,
 
 	} while (true);
 
+	if (writeResponse == WriteResponse_CopyChunks)
+	{
+		// Server only wants the chunks it doesn't already have. If file can't be chunked we send zero chunks and fall back to sending all of it
+		Vector<ChunkInfo> chunks;
+		if (sourceCache && sourceCache->hasChunks)
+			chunks = sourceCache->chunks;
+		else if (!isHashAlgorithmSupported(m_hashContext.m_algorithm) || !getFileChunks(chunks, src, cmd.info.fileSize, copyContext, m_hashContext, m_stats.ioStats))
+			chunks.clear();
+		else if (sourceCache)
+		{
+			sourceCache->chunks = chunks;
+			sourceCache->hasChunks = true;
+		}
+		uint chunkCount = uint(chunks.size());
+		if (!sendData(m_socket, &chunkCount, sizeof(chunkCount)))
+			return false;
+
+		if (chunkCount)
+		{
+			if (!sendData(m_socket, chunks.data(), uint(chunkCount*sizeof(ChunkInfo))))
+				return false;
+			Vector<u8> needChunks(chunkCount);
+			if (!receiveData(m_socket, needChunks.data(), chunkCount))
+				return false;
+
+			// Server is waiting for the chunks it asked for so any failure here means connection is out of sync
+			SendFileStats sendStats;
+			int compressionLevel = m_compressionStats.currentLevel;
+			if (!traverseFileChunks(src, cmd.info.fileSize, &chunks, copyContext, m_stats.ioStats, [&](uint index, const u8* data, uint size)
+				{
+					return !needChunks[index] || sendChunk(m_socket, data, size, writeType, compressionLevel, copyContext, sendStats);
+				}))
+				return false;
+			m_stats.sendTime += sendStats.sendTime;
+			m_stats.sendSize += sendStats.sendSize;
+			m_stats.compressTime += sendStats.compressTime;
+
+			u8 writeSuccess;
+			if (!receiveData(m_socket, &writeSuccess, sizeof(writeSuccess)))
+				return false;
+
+			if (!writeSuccess)
+			{
+				logErrorf(L"Failed to write file %ls: server returned failure after sending chunks", dst);
+				return false;
+			}
+
+			outWritten = cmd.info.fileSize;
+			processedByServer = true;
+			return true;
+		}
+
+		writeResponse = WriteResponse_Copy;
+	}
+
 	if (writeResponse == WriteResponse_Copy)
 	{
 		bool useBufferedIO = getUseBufferedIO(m_settings.useBufferedIO, cmd.info.fileSize);
 
 		SendFileStats sendStats;
-		if (!sendFile(m_socket, src, cmd.info.fileSize, writeType, copyContext, m_compressionStats, useBufferedIO, m_stats.ioStats, sendStats))
-			return false;
+
+		// Compressed stream can be replayed to other fan-out destinations. Dictionaries are per server so those streams can't
+		bool useRecord = sourceCache && writeType == WriteFileType_Compressed && !dictionary;
+		if (useRecord && sourceCache->hasCompressed)
+		{
+			u64 startSendTime = getTime();
+			if (!sourceCache->compressed.empty())
+				if (!sendData(m_socket, sourceCache->compressed.data(), uint(sourceCache->compressed.size())))
+					return false;
+			sendStats.sendTime += getTime() - startSendTime;
+			sendStats.sendSize += sourceCache->compressed.size();
+		}
+		else
+		{
+			copyContext.dictionary = dictionary;
+			copyContext.sendRecord = useRecord ? &sourceCache->compressed : nullptr;
+			ScopeGuard dictionaryGuard([&]() { copyContext.dictionary = nullptr; copyContext.sendRecord = nullptr; });
+			if (!sendFile(m_socket, src, cmd.info.fileSize, writeType, copyContext, m_compressionStats, useBufferedIO, m_stats.ioStats, sendStats))
+				return false;
+			if (useRecord)
+				sourceCache->hasCompressed = cmd.info.fileSize <= SendRecordMaxSize;
+		}
 		m_stats.sendTime += sendStats.sendTime;
 		m_stats.sendSize += sendStats.sendSize;
 		m_stats.compressTime += sendStats.compressTime;
 		m_stats.compressionLevelSum += sendStats.compressionLevelSum;
+		m_stats.compressionSkipCount += sendStats.compressionSkipCount;
+		m_stats.compressionSkipSize += sendStats.compressionSkipSize;
+		m_stats.compressionLevelChanges += sendStats.compressionLevelChanges;
 
 		u8 writeSuccess;
 		if (!receiveData(m_socket, &writeSuccess, sizeof(writeSuccess)))
@@ -2253,6 +3524,252 @@ Client::Connection::sendWriteFileCommand(const wchar_t* src, const wchar_t* dst,
 	return false;
 }
 
+bool
+Client::Connection::sendWriteFileRangeCommand(const CopyEntry& entry, NetworkCopyContext& copyContext)
+{
+	WriteFileType writeType = m_settings.compressionLevel != 0 ? WriteFileType_Compressed : WriteFileType_Send;
+
+	char buffer[MaxPath*2 + sizeof(WriteFileRangeCommand)];
+	auto& cmd = *(WriteFileRangeCommand*)buffer;
+	cmd.commandType = CommandType_WriteFileRange;
+	cmd.writeType = writeType;
+	cmd.info = entry.srcInfo;
+	cmd.offset = entry.stripeOffset;
+	cmd.size = entry.stripeSize;
+	WString dst = entry.dst();
+	cmd.commandSize = sizeof(cmd) + uint(dst.size()*2);
+	if (!stringCopy(cmd.path, MaxPath, dst.c_str()))
+	{
+		logErrorf(L"Failed to write file %ls: wcscpy_s in sendWriteFileRangeCommand failed", dst.c_str());
+		return false;
+	}
+
+	if (!sendCommand(cmd))
+		return false;
+
+	bool useBufferedIO = getUseBufferedIO(m_settings.useBufferedIO, cmd.info.fileSize);
+
+	SendFileStats sendStats;
+	if (!sendFile(m_socket, entry.src().c_str(), cmd.size, writeType, copyContext, m_compressionStats, useBufferedIO, m_stats.ioStats, sendStats, cmd.offset))
+		return false;
+	m_stats.sendTime += sendStats.sendTime;
+	m_stats.sendSize += sendStats.sendSize;
+	m_stats.compressTime += sendStats.compressTime;
+	m_stats.compressionLevelSum += sendStats.compressionLevelSum;
+	m_stats.compressionSkipCount += sendStats.compressionSkipCount;
+	m_stats.compressionSkipSize += sendStats.compressionSkipSize;
+	m_stats.compressionLevelChanges += sendStats.compressionLevelChanges;
+
+	u8 writeSuccess;
+	if (!receiveData(m_socket, &writeSuccess, sizeof(writeSuccess)))
+		return false;
+
+	if (!writeSuccess)
+	{
+		logErrorf(L"Failed to write file %ls: server returned failure after sending range at offset %llu", dst.c_str(), cmd.offset);
+		return false;
+	}
+
+	return true;
+}
+
+bool
+Client::Connection::sendWriteFilesCommand(const Vector<CopyEntry*>& entries, Vector<WriteResponse>& outResponses)
+{
+	++m_stats.netWriteFilesCount;
+	TimerScope _(m_stats.netWriteFilesTime);
+	TraceScope trace(L"NetWriteFiles");
+
+	enum { MaxCommandSize = 256*1024 }; // Must fit in server receive buffer
+
+	Vector<u8> buffer(MaxCommandSize);
+	auto& cmd = *(WriteFilesCommand*)buffer.data();
+	cmd.commandType = CommandType_WriteFiles;
+	cmd.writeType = m_settings.compressionLevel != 0 ? WriteFileType_Compressed : WriteFileType_Send;
+	cmd.fileCount = 0;
+
+	// Files that don't fit are left out and will get no response (caller treat them as Copy)
+	u8* bufferPos = cmd.files;
+	for (CopyEntry* entry : entries)
+	{
+		WString dst = entry->dst();
+		uint pathBytes = uint(dst.size() + 1)*2;
+		if (cmd.fileCount == WriteFilesMaxCount || bufferPos + sizeof(FileInfo) + pathBytes > buffer.data() + buffer.size())
+			break;
+		memcpy(bufferPos, &entry->srcInfo, sizeof(FileInfo));
+		bufferPos += sizeof(FileInfo);
+		memcpy(bufferPos, dst.c_str(), pathBytes);
+		bufferPos += pathBytes;
+		++cmd.fileCount;
+	}
+	cmd.commandSize = uint(bufferPos - buffer.data());
+
+	if (!sendCommand(cmd))
+		return false;
+
+	outResponses.resize(cmd.fileCount);
+	if (!receiveData(m_socket, outResponses.data(), cmd.fileCount*sizeof(WriteResponse)))
+		return false;
+
+	for (WriteResponse writeResponse : outResponses)
+		if (writeResponse == WriteResponse_Link || writeResponse == WriteResponse_Odx || writeResponse == WriteResponse_Skip)
+			++m_stats.netWriteResponseCount[writeResponse];
+
+	return true;
+}
+
+CompressionDictionary*
+Client::Connection::getDictionary(const wchar_t* fileName)
+{
+	if (!m_dictionaries || m_settings.compressionLevel == 0)
+		return nullptr;
+	DictionaryCache& cache = *m_dictionaries;
+	if (CompressionDictionary* dictionary = cache.store.findDictionary(fileName))
+		return dictionary;
+
+	WString extension;
+	if (!getDictionaryExtension(extension, fileName))
+		return nullptr;
+
+	// List is fetched once and each dictionary is fetched the first time a file with its extension is written
+	ScopedCriticalSection _(cache.cs);
+	if (!cache.listed)
+	{
+		cache.listed = true;
+		GetDictionariesCommand cmd;
+		cmd.commandType = CommandType_GetDictionaries;
+		cmd.commandSize = sizeof(cmd);
+		if (!sendCommand(cmd))
+			return nullptr;
+		uint count;
+		if (!receiveData(m_socket, &count, sizeof(count)))
+			return nullptr;
+		Vector<DictionaryInfo> infos(count);
+		if (count && !receiveData(m_socket, infos.data(), uint(count*sizeof(DictionaryInfo))))
+			return nullptr;
+		for (auto& info : infos)
+		{
+			info.extension[DictionaryMaxExtensionLength - 1] = 0;
+			cache.ids[info.extension] = info.id;
+		}
+	}
+
+	auto findIt = cache.ids.find(extension);
+	if (findIt == cache.ids.end())
+		return nullptr;
+	uint id = findIt->second;
+	cache.ids.erase(findIt);
+
+	GetDictionaryCommand cmd;
+	cmd.commandType = CommandType_GetDictionary;
+	cmd.commandSize = sizeof(cmd);
+	cmd.id = id;
+	if (!sendCommand(cmd))
+		return nullptr;
+	uint size;
+	if (!receiveData(m_socket, &size, sizeof(size)))
+		return nullptr;
+	if (!size || size > DictionaryMaxSize)
+		return nullptr;
+	Vector<u8> data(size);
+	if (!receiveData(m_socket, data.data(), size))
+		return nullptr;
+	cache.store.addDictionary(id, extension, std::move(data));
+	++m_stats.dictionaryCount;
+	return cache.store.getDictionary(id);
+}
+
+bool
+Client::Connection::sendWritePackedFilesCommand(const Vector<CopyEntry*>& entries, NetworkCopyContext& copyContext, Vector<u8>& outResults)
+{
+	++m_stats.netWritePackedFilesCount;
+	TimerScope _(m_stats.netWritePackedFilesTime);
+	TraceScope trace(L"NetWritePacked");
+
+	outResults.assign(entries.size(), 0);
+
+	// Files that don't fit or fail to read are left out with a failed result and caller sends them the normal way
+	u8* packed = copyContext.buffers[0];
+	uint packedSize = 0;
+	Vector<uint> packedIndices;
+	for (uint i=0; i!=entries.size(); ++i)
+	{
+		const CopyEntry& entry = *entries[i];
+		WString src = entry.src();
+		WString dst = entry.dst();
+		uint pathBytes = uint(dst.size() + 1)*2;
+		u64 fileSize = entry.srcInfo.fileSize;
+		if (packedIndices.size() == WriteFilesMaxCount || packedSize + sizeof(FileInfo) + pathBytes + fileSize > WritePackedFilesMaxSize)
+			break;
+
+		u8* pos = packed + packedSize;
+		memcpy(pos, &entry.srcInfo, sizeof(FileInfo));
+		pos += sizeof(FileInfo);
+		memcpy(pos, dst.c_str(), pathBytes);
+		pos += pathBytes;
+
+		FileHandle file;
+		if (!openFileRead(src.c_str(), file, m_stats.ioStats, true, nullptr, true))
+			continue;
+		u64 read = 0;
+		bool success = readFile(src.c_str(), file, pos, fileSize, read, m_stats.ioStats) && read == fileSize;
+		closeFile(src.c_str(), file, AccessType_Read, m_stats.ioStats);
+		if (!success)
+			continue;
+
+		packedSize = uint(pos + fileSize - packed);
+		packedIndices.push_back(i);
+	}
+
+	if (packedIndices.empty())
+		return true;
+
+	// Room for compressed data even if it grows a bit
+	Vector<u8> buffer(sizeof(WritePackedFilesCommand) + packedSize + packedSize/128 + 1024);
+	auto& cmd = *(WritePackedFilesCommand*)buffer.data();
+	cmd.commandType = CommandType_WritePackedFiles;
+	cmd.writeType = WriteFileType_Send;
+	cmd.fileCount = uint(packedIndices.size());
+	cmd.packedSize = packedSize;
+	cmd.dictionaryId = 0;
+	uint dataCapacity = uint(buffer.data() + buffer.size() - cmd.data);
+	uint dataSize = packedSize;
+
+	// All files are compressed as one frame which gives much better ratio than compressing them one by one
+	if (m_settings.compressionLevel != 0)
+	{
+		u64 startCompressTime = getTime();
+		// Use dictionary of first file. Packs are usually files from the same directory with the same extension
+		CompressionDictionary* dictionary = getDictionary(entries[packedIndices[0]]->dst().c_str());
+		copyContext.dictionary = dictionary;
+		ScopeGuard dictionaryGuard([&]() { copyContext.dictionary = nullptr; });
+		uint compressedSize;
+		if (compressData(compressedSize, cmd.data, dataCapacity, packed, packedSize, m_compressionStats.currentLevel, copyContext) && compressedSize < packedSize)
+		{
+			cmd.writeType = WriteFileType_Compressed;
+			cmd.dictionaryId = dictionary ? dictionary->id : 0;
+			dataSize = compressedSize;
+		}
+		m_stats.compressTime += getTime() - startCompressTime;
+	}
+	if (cmd.writeType == WriteFileType_Send)
+		memcpy(cmd.data, packed, packedSize);
+	cmd.commandSize = uint(cmd.data + dataSize - buffer.data());
+
+	u64 startSendTime = getTime();
+	if (!sendCommand(cmd))
+		return false;
+	m_stats.sendTime += getTime() - startSendTime;
+	m_stats.sendSize += cmd.commandSize;
+
+	Vector<u8> results(packedIndices.size());
+	if (!receiveData(m_socket, results.data(), uint(results.size())))
+		return false;
+	for (uint i=0; i!=packedIndices.size(); ++i)
+		outResults[packedIndices[i]] = results[i];
+	return true;
+}
+
 Client::Connection::ReadFileResult
 Client::Connection::sendReadFileCommand(const wchar_t* src, const wchar_t* dst, const FileInfo& srcInfo, uint srcAttributes, u64& outSize, u64& outRead, NetworkCopyContext& copyContext, bool& processedByServer)
 {
@@ -2322,7 +3839,7 @@ Client::Connection::sendReadFileCommand(const wchar_t* src, const wchar_t* dst,
 		// Test file exists before actually calculating hash or we will crash the program and leave the server hanging waiting for the hash input.
 		// If file doesn't exist, we will just return empty hash info and the server will test for invalid hash.
 		FILE *file;
-		if (_wfopen_s(&file, fullDest.c_str(), L"r") == 0)
+		if (isHashAlgorithmSupported(m_hashContext.m_algorithm) && _wfopen_s(&file, fullDest.c_str(), L"r") == 0)
 		{
 			if (file != nullptr)
 			{
@@ -2430,6 +3947,7 @@ Client::Connection::sendCreateDirectoryCommand(const wchar_t* directory, FilesSe
 {
 	++m_stats.netCreateDirCount;
 	TimerScope _(m_stats.netCreateDirTime);
+	TraceScope trace(L"NetCreateDir");
 	const wchar_t* relDir = directory + m_settings.destDirectory.size();
 
 	char buffer[MaxPath*2 + sizeof(CreateDirCommand)+1];
@@ -2480,6 +3998,70 @@ Client::Connection::sendCreateDirectoryCommand(const wchar_t* directory, FilesSe
 	return true;
 }
 
+bool
+Client::Connection::sendCreateDirectoriesCommand(const FilesSet& directories, FilesSet& outCreatedDirs)
+{
+	// Directories are sent in chunks. Only last one asks for the directories created by the session
+	Vector<char> buffer(sizeof(CreateDirsCommand) + CreateDirsMaxSize + MaxPath*2);
+	auto& cmd = *(CreateDirsCommand*)buffer.data();
+	auto it = directories.begin();
+	do
+	{
+		++m_stats.netCreateDirCount;
+		TimerScope _(m_stats.netCreateDirTime);
+		TraceScope trace(L"NetCreateDir");
+
+		cmd.commandType = CommandType_CreateDirs;
+		cmd.dirCount = 0;
+		wchar_t* pathPos = cmd.paths;
+		for (; it != directories.end() && uint((char*)pathPos - buffer.data()) < CreateDirsMaxSize; ++it)
+		{
+			const wchar_t* relDir = it->c_str() + m_settings.destDirectory.size();
+			uint relDirLen = uint(wcslen(relDir));
+			if (relDirLen >= MaxPath)
+			{
+				logErrorf(L"Failed to create directory %ls: Path is too long", relDir);
+				return false;
+			}
+			memcpy(pathPos, relDir, (relDirLen + 1)*2);
+			pathPos += relDirLen + 1;
+			++cmd.dirCount;
+		}
+		cmd.returnCreatedDirs = it == directories.end();
+		cmd.commandSize = uint((char*)pathPos - buffer.data());
+
+		if (!sendCommand(cmd))
+			return false;
+
+		CreateDirResponse createDirResponse;
+		if (!receiveData(m_socket, &createDirResponse, sizeof(createDirResponse)))
+			return false;
+
+		if (createDirResponse == CreateDirResponse_BadDestination)
+		{
+			logErrorf(L"Failed to create directories: Server reported Bad destination (check your destination path)");
+			return false;
+		}
+
+		if (createDirResponse == CreateDirResponse_Error)
+		{
+			logErrorf(L"Failed to create directories: Server reported unknown error");
+			return false;
+		}
+	}
+	while (it != directories.end());
+
+	uint createdDirsSize;
+	if (!receiveData(m_socket, &createdDirsSize, sizeof(createdDirsSize)))
+		return false;
+	Vector<wchar_t> createdDirs(createdDirsSize/2);
+	if (createdDirsSize && !receiveData(m_socket, createdDirs.data(), createdDirsSize))
+		return false;
+	for (const wchar_t* pos = createdDirs.data(), *end = pos + createdDirs.size(); pos < end; pos += wcslen(pos) + 1)
+		outCreatedDirs.insert(m_settings.destDirectory + pos);
+	return true;
+}
+
 bool
 Client::Connection::sendDeleteAllFiles(const wchar_t* dir)
 {
@@ -2515,11 +4097,65 @@ Client::Connection::sendDeleteAllFiles(const wchar_t* dir)
 	return true;
 }
 
+bool
+Client::Connection::sendDeletePathsCommand(const Vector<NameAndFileInfo>& paths)
+{
+	Vector<char> buffer(sizeof(DeletePathsCommand) + DeletePathsMaxSize + MaxPath*2 + sizeof(uint));
+	auto& cmd = *(DeletePathsCommand*)buffer.data();
+	auto it = paths.begin();
+	while (it != paths.end())
+	{
+		++m_stats.netDeletePathsCount;
+		TimerScope _(m_stats.netDeletePathsTime);
+		TraceScope trace(L"NetDeletePaths");
+
+		cmd.commandType = CommandType_DeletePaths;
+		cmd.pathCount = 0;
+		u8* pathPos = cmd.paths;
+		for (; it != paths.end() && uint((char*)pathPos - buffer.data()) < DeletePathsMaxSize; ++it)
+		{
+			uint pathLen = uint(it->name.size());
+			if (pathLen >= MaxPath)
+			{
+				logErrorf(L"Failed to delete %ls: Path is too long", it->name.c_str());
+				return false;
+			}
+			*(uint*)pathPos = it->attributes;
+			pathPos += sizeof(uint);
+			memcpy(pathPos, it->name.c_str(), (pathLen + 1)*2);
+			pathPos += (pathLen + 1)*2;
+			++cmd.pathCount;
+		}
+		cmd.commandSize = uint((char*)pathPos - buffer.data());
+
+		if (!sendCommand(cmd))
+			return false;
+
+		DeleteFilesResponse deleteFilesResponse;
+		if (!receiveData(m_socket, &deleteFilesResponse, sizeof(deleteFilesResponse)))
+			return false;
+
+		if (deleteFilesResponse == DeleteFilesResponse_BadDestination)
+		{
+			logErrorf(L"Failed to delete files: Server reported Bad destination (check your destination path)");
+			return false;
+		}
+
+		if (deleteFilesResponse == DeleteFilesResponse_Error)
+		{
+			logErrorf(L"Failed to delete files: Server reported unknown error");
+			return false;
+		}
+	}
+	return true;
+}
+
 bool
 Client::Connection::sendFindFiles(const wchar_t* dirAndWildcard, Vector<NameAndFileInfo>& outFiles, CopyContext& copyContext)
 {
 	++m_stats.netFindFilesCount;
 	TimerScope _(m_stats.netFindFilesTime);
+	TraceScope trace(L"NetFindFiles");
 
 	char buffer[MaxPath*2 + sizeof(FindFilesCommand)+1];
 	auto& cmd = *(FindFilesCommand*)buffer;
@@ -2576,11 +4212,79 @@ Client::Connection::sendFindFiles(const wchar_t* dirAndWildcard, Vector<NameAndF
 	return false;
 }
 
+bool
+Client::Connection::sendFindFilesRecursive(const wchar_t* dirAndWildcard, int depthLeft, CopyContext& copyContext, const Function<bool(NameAndFileInfo&)>& entryFunc)
+{
+	++m_stats.netFindFilesCount;
+	TimerScope _(m_stats.netFindFilesTime);
+	TraceScope trace(L"NetFindFiles");
+
+	char buffer[MaxPath*2 + sizeof(FindFilesRecursiveCommand)+1];
+	auto& cmd = *(FindFilesRecursiveCommand*)buffer;
+	cmd.commandType = CommandType_FindFilesRecursive;
+	cmd.commandSize = sizeof(cmd) + uint(wcslen(dirAndWildcard)*2);
+	cmd.depthLeft = depthLeft;
+
+	if (!stringCopy(cmd.pathAndWildcard, MaxPath, dirAndWildcard))
+	{
+		logErrorf(L"Failed to find files %ls: wcscpy_s in sendFindFilesRecursive failed", dirAndWildcard);
+		return false;
+	}
+
+	if (!sendCommand(cmd))
+		return false;
+
+	u8* copyBuffer = copyContext.buffers[0]; // Important that we use '0'.. '1' is used by file wildcard reading
+
+	// Keep reading blocks even if entryFunc fails to not leave socket in a bad state
+	bool success = true;
+
+	while (true)
+	{
+		uint blockSize;
+		if (!receiveData(m_socket, &blockSize, sizeof(blockSize)))
+			return false;
+
+		if (blockSize == 0)
+			return success;
+
+		if (blockSize == ~0u)
+		{
+			logErrorf(L"Can't find %ls", dirAndWildcard);
+			return false;
+		}
+	
+		if (!receiveData(m_socket, copyBuffer, blockSize))
+			return false;
+
+		u8* blockPos = copyBuffer;
+		u8* blockEnd = blockPos + blockSize;
+		while (blockPos != blockEnd)
+		{
+			NameAndFileInfo nafi;
+
+			nafi.attributes = *(uint*)blockPos;
+			blockPos += sizeof(uint);
+			nafi.info.lastWriteTime = *(FileTime*)blockPos;
+			blockPos += sizeof(u64);
+			nafi.info.fileSize = *(u64*)blockPos;
+			blockPos += sizeof(u64);
+			nafi.name = (wchar_t*)blockPos;
+			blockPos += (nafi.name.size()+1)*2;
+			if (success)
+				success = entryFunc(nafi);
+		}
+	}
+
+	return false;
+}
+
 bool
 Client::Connection::sendGetFileAttributes(const wchar_t* path, FileInfo& outInfo, uint& outAttributes, uint& outError)
 {
 	++m_stats.netFileInfoCount;
 	TimerScope _(m_stats.netFileInfoTime);
+	TraceScope trace(L"NetFileInfo");
 
 	char buffer[MaxPath*2 + sizeof(GetFileInfoCommand)+1];
 	auto& cmd = *(GetFileInfoCommand*)buffer;
@@ -2648,6 +4352,201 @@ Client::Connection::destroy()
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+ConnectionPool::ConnectionPool()
+{
+	// Sockets in pool must survive clients calling WSACleanup
+	#if defined(_WIN32)
+	WSADATA wsaData;
+	m_wsaInitDone = WSAStartup(MAKEWORD(2,2), &wsaData) == 0;
+	#endif
+}
+
+ConnectionPool::~ConnectionPool()
+{
+	clear();
+
+	#if defined(_WIN32)
+	if (m_wsaInitDone)
+		WSACleanup();
+	#endif
+}
+
+void
+ConnectionPool::clear()
+{
+	Vector<IdleConnection> toClose;
+	{
+		ScopedCriticalSection cs(m_cs);
+		for (auto& kv : m_sessions)
+			for (auto& session : kv.second)
+				toClose.insert(toClose.end(), session.idle.begin(), session.idle.end());
+		m_sessions.clear();
+
+		for (auto& kv : m_addresses)
+			m_oldAddresses.push_back(kv.second.addrInfo);
+		m_addresses.clear();
+		for (AddrInfo* addrInfo : m_oldAddresses)
+			freeAddrInfo(addrInfo);
+		m_oldAddresses.clear();
+	}
+	closeIdle(toClose);
+}
+
+uint
+ConnectionPool::getIdleCount()
+{
+	ScopedCriticalSection cs(m_cs);
+	uint count = 0;
+	for (auto& kv : m_sessions)
+		for (auto& session : kv.second)
+			count += uint(session.idle.size());
+	return count;
+}
+
+AddrInfo*
+ConnectionPool::getAddress(const WString& serverAndPort)
+{
+	ScopedCriticalSection cs(m_cs);
+	auto findIt = m_addresses.find(serverAndPort);
+	if (findIt == m_addresses.end() || getTime() - findIt->second.resolveTime > u64(m_addressTimeoutMs)*10000)
+		return nullptr;
+	return findIt->second.addrInfo;
+}
+
+AddrInfo*
+ConnectionPool::setAddress(const WString& serverAndPort, AddrInfo* addrInfo)
+{
+	ScopedCriticalSection cs(m_cs);
+	Address& address = m_addresses[serverAndPort];
+	if (address.addrInfo)
+		m_oldAddresses.push_back(address.addrInfo);
+	address.addrInfo = addrInfo;
+	address.resolveTime = getTime();
+	return addrInfo;
+}
+
+bool
+ConnectionPool::acquire(const WString& key, SessionInfo& inOutInfo, IdleConnection& outConnection)
+{
+	Vector<IdleConnection> toClose;
+	ScopeGuard closeGuard([&]() { closeIdle(toClose); });
+
+	ScopedCriticalSection cs(m_cs);
+	auto findIt = m_sessions.find(key);
+	if (findIt == m_sessions.end())
+		return false;
+
+	// Client that already has a session must stay in it, otherwise it can take any session no other client is using
+	Guid zeroGuid = {0};
+	bool hasSession = inOutInfo.secretGuid != zeroGuid;
+	u64 time = getTime();
+	auto& sessions = findIt->second;
+	for (auto it = sessions.begin(); it != sessions.end();)
+	{
+		Session& session = *it;
+		if (hasSession ? session.info.secretGuid != inOutInfo.secretGuid : session.inUse)
+		{
+			++it;
+			continue;
+		}
+
+		// Connections closed by server while idle show up as readable
+		while (!session.idle.empty())
+		{
+			IdleConnection connection = session.idle.back();
+			session.idle.pop_back();
+			if (time - connection.releaseTime <= u64(m_idleTimeoutMs)*10000 && isSocketIdle(connection.socket))
+			{
+				session.inUse = true;
+				inOutInfo = session.info;
+				outConnection = connection;
+				return true;
+			}
+			toClose.push_back(connection);
+		}
+
+		if (session.inUse) // Session of this client, it has no more idle connections
+			return false;
+		it = sessions.erase(it);
+	}
+	if (sessions.empty())
+		m_sessions.erase(findIt);
+	return false;
+}
+
+void
+ConnectionPool::release(const WString& key, const SessionInfo& info, const IdleConnection& connection)
+{
+	Vector<IdleConnection> toClose;
+	ScopeGuard closeGuard([&]() { closeIdle(toClose); });
+
+	ScopedCriticalSection cs(m_cs);
+	auto& sessions = m_sessions[key];
+	Session* session = nullptr;
+	for (auto& s : sessions)
+		if (s.info.secretGuid == info.secretGuid)
+			session = &s;
+	if (!session)
+	{
+		sessions.push_back(Session());
+		session = &sessions.back();
+		session->info = info;
+		session->inUse = true; // Client releasing connection is still running. It ends session when done
+	}
+
+	uint idleCount = 0;
+	for (auto& s : sessions)
+		idleCount += uint(s.idle.size());
+	if (idleCount >= m_maxIdleCount)
+		toClose.push_back(connection);
+	else
+		session->idle.push_back({ connection.socket, connection.compressionLevel, getTime() });
+}
+
+void
+ConnectionPool::endSession(const WString& key, const Guid& secretGuid)
+{
+	ScopedCriticalSection cs(m_cs);
+	auto findIt = m_sessions.find(key);
+	if (findIt == m_sessions.end())
+		return;
+	for (auto it = findIt->second.begin(); it != findIt->second.end(); ++it)
+	{
+		if (it->info.secretGuid != secretGuid)
+			continue;
+		it->inUse = false;
+		if (it->idle.empty())
+			findIt->second.erase(it);
+		break;
+	}
+	if (findIt->second.empty())
+		m_sessions.erase(findIt);
+}
+
+void
+ConnectionPool::closeIdle(Vector<IdleConnection>& connections)
+{
+	// Connections still open are told they are done and wait for the answer so server doesn't log a failed send. Errors
+	// are ignored, this runs inside the log context of whatever client happens to release or acquire
+	for (auto& connection : connections)
+	{
+		if (isSocketIdle(connection.socket))
+		{
+			DoneCommand cmd;
+			cmd.commandType = CommandType_Done;
+			cmd.commandSize = sizeof(cmd);
+			cmd.keepOpen = false;
+			u64 compressionLevelSum;
+			if (::send(connection.socket.socket, (const char*)&cmd, sizeof(cmd), 0) == int(sizeof(cmd)))
+				::recv(connection.socket.socket, (char*)&compressionLevelSum, sizeof(compressionLevelSum), MSG_WAITALL);
+		}
+		closeSocket(connection.socket);
+	}
+	connections.clear();
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
 } // namespace eacopy
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
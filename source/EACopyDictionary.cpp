@@ -0,0 +1,234 @@
+// (c) Electronic Arts. All Rights Reserved.
+
+#include "EACopyDictionary.h"
+#include "EACopyDependencies.h"
+#include <zdict.h>
+#include <wctype.h>
+
+namespace eacopy
+{
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+CompressionDictionary::CompressionDictionary(uint i, const WString& e, Vector<u8>&& d)
+:	id(i)
+,	extension(e)
+,	data(std::move(d))
+{
+}
+
+CompressionDictionary::~CompressionDictionary()
+{
+	for (void* cdict : m_cdicts)
+		if (cdict)
+			ZSTD_freeCDict((ZSTD_CDict*)cdict);
+	if (m_ddict)
+		ZSTD_freeDDict((ZSTD_DDict*)m_ddict);
+}
+
+void*
+CompressionDictionary::getCDict(int level)
+{
+	level = std::max(1, std::min(level, int(eacopy_sizeof_array(m_cdicts)) - 1));
+	ScopedCriticalSection _(m_cs);
+	if (!m_cdicts[level])
+		m_cdicts[level] = ZSTD_createCDict(data.data(), data.size(), level);
+	return m_cdicts[level];
+}
+
+void*
+CompressionDictionary::getDDict()
+{
+	ScopedCriticalSection _(m_cs);
+	if (!m_ddict)
+		m_ddict = ZSTD_createDDict(data.data(), data.size());
+	return m_ddict;
+}
+
+bool getDictionaryExtension(WString& outExtension, const wchar_t* fileName)
+{
+	const wchar_t* extension = L"";
+	for (const wchar_t* it = fileName; *it; ++it)
+		if (*it == L'.')
+			extension = it + 1;
+		else if (*it == L'\\' || *it == L'/')
+			extension = L"";
+
+	if (wcslen(extension) >= DictionaryMaxExtensionLength)
+		return false;
+	outExtension = extension;
+	for (wchar_t& c : outExtension)
+		c = towlower(c);
+	return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+DictionaryStore::~DictionaryStore()
+{
+	clear();
+}
+
+void
+DictionaryStore::addSample(const wchar_t* fileName, const u8* data, u64 size)
+{
+	WString extension;
+	if (!size || size > DictionaryMaxFileSize || !getDictionaryExtension(extension, fileName))
+		return;
+
+	uint sampleSize = uint(std::min(size, u64(DictionarySampleMaxSize)));
+	ScopedCriticalSection _(m_cs);
+	if (m_dictionaries.size() >= DictionaryMaxCount)
+		return;
+	Samples& samples = m_samples[extension];
+	if (samples.sizes.size() >= DictionaryTrainSampleCount)
+		return;
+	samples.data.insert(samples.data.end(), data, data + sampleSize);
+	samples.sizes.push_back(sampleSize);
+}
+
+bool
+DictionaryStore::addSampleFile(const wchar_t* fullPath, IOStats& ioStats)
+{
+	FileHandle file;
+	if (!openFileRead(fullPath, file, ioStats, true))
+		return false;
+	u8 buffer[DictionarySampleMaxSize];
+	u64 read = 0;
+	bool success = readFile(fullPath, file, buffer, sizeof(buffer), read, ioStats);
+	closeFile(fullPath, file, AccessType_Read, ioStats);
+	if (!success)
+		return false;
+	addSample(fullPath, buffer, read);
+	return true;
+}
+
+bool
+DictionaryStore::needsSamples(const wchar_t* fileName)
+{
+	WString extension;
+	if (!getDictionaryExtension(extension, fileName))
+		return false;
+	ScopedCriticalSection _(m_cs);
+	if (m_dictionaries.size() >= DictionaryMaxCount)
+		return false;
+	auto findIt = m_samples.find(extension);
+	return findIt == m_samples.end() || findIt->second.sizes.size() < DictionaryTrainSampleCount;
+}
+
+uint
+DictionaryStore::train()
+{
+	uint trainedCount = 0;
+	while (true)
+	{
+		// Take samples out of store so files can keep adding samples while we train
+		WString extension;
+		Samples samples;
+		m_cs.scoped([&]()
+			{
+				for (auto& kv : m_samples)
+					if (kv.second.sizes.size() >= DictionaryTrainSampleCount)
+					{
+						extension = kv.first;
+						samples = std::move(kv.second);
+						m_samples.erase(extension);
+						break;
+					}
+			});
+		if (samples.sizes.empty())
+			return trainedCount;
+
+		Vector<u8> dictionary(DictionaryMaxSize);
+		size_t dictionarySize = ZDICT_trainFromBuffer(dictionary.data(), dictionary.size(), samples.data.data(), samples.sizes.data(), uint(samples.sizes.size()));
+		if (ZDICT_isError(dictionarySize))
+		{
+			// Happens when samples are too few or too small to find anything. Not an error, extension just won't have a dictionary
+			logDebugLinef(L"Failed to train dictionary for extension '%ls': %hs", extension.c_str(), ZDICT_getErrorName(dictionarySize));
+			continue;
+		}
+		dictionary.resize(dictionarySize);
+
+		ScopedCriticalSection _(m_cs);
+		if (m_dictionaries.size() >= DictionaryMaxCount)
+			return trainedCount;
+		uint id = m_nextId++;
+		auto dict = new CompressionDictionary(id, extension, std::move(dictionary));
+		m_dictionaries[id] = dict;
+		m_latest[extension] = dict;
+		++trainedCount;
+	}
+}
+
+void
+DictionaryStore::addDictionary(uint id, const WString& extension, Vector<u8>&& data)
+{
+	auto dict = new CompressionDictionary(id, extension, std::move(data));
+	ScopedCriticalSection _(m_cs);
+	auto insres = m_dictionaries.insert({id, dict});
+	if (!insres.second)
+	{
+		delete dict;
+		return;
+	}
+	auto& latest = m_latest[extension];
+	if (!latest || latest->id < id)
+		latest = dict;
+}
+
+CompressionDictionary*
+DictionaryStore::getDictionary(uint id)
+{
+	ScopedCriticalSection _(m_cs);
+	auto findIt = m_dictionaries.find(id);
+	return findIt != m_dictionaries.end() ? findIt->second : nullptr;
+}
+
+CompressionDictionary*
+DictionaryStore::findDictionary(const wchar_t* fileName)
+{
+	WString extension;
+	if (!getDictionaryExtension(extension, fileName))
+		return nullptr;
+	ScopedCriticalSection _(m_cs);
+	auto findIt = m_latest.find(extension);
+	return findIt != m_latest.end() ? findIt->second : nullptr;
+}
+
+void
+DictionaryStore::getDictionaryInfos(Vector<DictionaryInfo>& outInfos)
+{
+	ScopedCriticalSection _(m_cs);
+	for (auto& kv : m_latest)
+	{
+		DictionaryInfo info;
+		memset(&info, 0, sizeof(info));
+		info.id = kv.second->id;
+		info.size = uint(kv.second->data.size());
+		stringCopy(info.extension, DictionaryMaxExtensionLength, kv.first.c_str());
+		outInfos.push_back(info);
+	}
+}
+
+uint
+DictionaryStore::getDictionaryCount()
+{
+	ScopedCriticalSection _(m_cs);
+	return uint(m_dictionaries.size());
+}
+
+void
+DictionaryStore::clear()
+{
+	ScopedCriticalSection _(m_cs);
+	for (auto& kv : m_dictionaries)
+		delete kv.second;
+	m_dictionaries.clear();
+	m_latest.clear();
+	m_samples.clear();
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+} // namespace eacopy
@@ -0,0 +1,465 @@
+// (c) Electronic Arts. All Rights Reserved.
+
+#include "EACopyDownloads.h"
+
+namespace eacopy
+{
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void
+DownloadScheduler::reset(uint maxActiveCount)
+{
+	ScopedCriticalSection cs(m_cs);
+	m_maxActiveCount = max(maxActiveCount, 1u);
+	m_admitLimit = m_maxActiveCount;
+	m_admitDirection = -1;
+	m_stopped = false;
+	m_windowStart = 0;
+	m_windowBytes = 0;
+	m_bytesPerSecond = 0;
+}
+
+bool
+DownloadScheduler::acquire(const WString& clientKey, u64 fileSize, uint timeoutMs)
+{
+	u64 cost = max(fileSize, u64(DownloadMinCost));
+	Waiter waiter;
+	{
+		ScopedCriticalSection cs(m_cs);
+		if (m_stopped)
+			return false;
+
+		Client& client = m_clients[clientKey];
+		if (m_waiters.empty() && canAdmitNoLock())
+		{
+			admitNoLock(client, cost);
+			return true;
+		}
+
+		if (!timeoutMs)
+		{
+			++m_timedOutCount;
+			removeClientIfIdleNoLock(clientKey);
+			return false;
+		}
+
+		waiter.client = &client;
+		waiter.cost = cost;
+		++client.waitingCount;
+		m_waiters.push_back(&waiter);
+		++m_queuedCount;
+	}
+
+	u64 startTime = getTime();
+	waiter.granted.isSet(timeoutMs);
+
+	ScopedCriticalSection cs(m_cs);
+	m_queueTime += getTime() - startTime;
+	if (waiter.isGranted) // Can have been granted after wait timed out
+		return true;
+	m_waiters.remove(&waiter);
+	--waiter.client->waitingCount;
+	++m_timedOutCount;
+	removeClientIfIdleNoLock(clientKey);
+	return false;
+}
+
+void
+DownloadScheduler::release(const WString& clientKey, u64 bytesSent)
+{
+	ScopedCriticalSection cs(m_cs);
+	auto findIt = m_clients.find(clientKey);
+	if (findIt != m_clients.end())
+		--findIt->second.activeCount;
+	--m_activeCount;
+	updateRateNoLock(bytesSent, !m_waiters.empty());
+	removeClientIfIdleNoLock(clientKey);
+	dispatchNoLock();
+}
+
+void
+DownloadScheduler::stop()
+{
+	ScopedCriticalSection cs(m_cs);
+	m_stopped = true;
+	for (Waiter* waiter : m_waiters)
+		waiter->granted.set();
+}
+
+DownloadScheduler::Stats
+DownloadScheduler::getStats()
+{
+	ScopedCriticalSection cs(m_cs);
+	return { m_activeCount, uint(m_waiters.size()), m_admitLimit, m_bytesPerSecond, m_queuedCount, m_timedOutCount, m_queueTime };
+}
+
+bool
+DownloadScheduler::canAdmitNoLock() const
+{
+	return !m_stopped && m_activeCount < m_admitLimit;
+}
+
+void
+DownloadScheduler::admitNoLock(Client& client, u64 cost)
+{
+	// Client that was idle starts at current virtual time so it can't save up for a burst
+	u64 startTag = max(client.virtualTime, m_virtualTime);
+	m_virtualTime = startTag;
+	client.virtualTime = startTag + cost;
+	++client.activeCount;
+	++m_activeCount;
+}
+
+void
+DownloadScheduler::dispatchNoLock()
+{
+	while (!m_waiters.empty() && canAdmitNoLock())
+	{
+		// Pick waiter whose client has received the least. Waiters of the same client are served in arrival order
+		auto bestIt = m_waiters.begin();
+		u64 bestTag = max((*bestIt)->client->virtualTime, m_virtualTime);
+		for (auto it = std::next(bestIt), e = m_waiters.end(); it != e; ++it)
+		{
+			u64 tag = max((*it)->client->virtualTime, m_virtualTime);
+			if (tag < bestTag)
+			{
+				bestTag = tag;
+				bestIt = it;
+			}
+		}
+
+		Waiter& waiter = **bestIt;
+		m_waiters.erase(bestIt);
+		--waiter.client->waitingCount;
+		admitNoLock(*waiter.client, waiter.cost);
+		waiter.isGranted = true;
+		waiter.granted.set();
+	}
+}
+
+void
+DownloadScheduler::updateRateNoLock(u64 bytesSent, bool isQueued)
+{
+	u64 now = getTime();
+	m_windowBytes += bytesSent;
+	if (!m_windowStart)
+	{
+		m_windowStart = now;
+		return;
+	}
+
+	u64 windowTime = now - m_windowStart;
+	if (timeToMs(windowTime) < DownloadRateWindowMs)
+		return;
+
+	u64 lastBytesPerSecond = m_bytesPerSecond;
+	m_bytesPerSecond = m_windowBytes * 10000000 / windowTime;
+	m_windowStart = now;
+	m_windowBytes = 0;
+
+	// Throughput only says something about the limit when downloads are held back by it
+	if (!isQueued || !lastBytesPerSecond)
+		return;
+
+	// Hill climb on number of active downloads. Limit keeps moving the same way until throughput drops and then turns
+	// around. Starting out going down it settles at the smallest count that keeps disk and network busy
+	if (m_bytesPerSecond < lastBytesPerSecond - lastBytesPerSecond/20)
+		m_admitDirection = -m_admitDirection;
+	uint step = max(m_admitLimit/8, 1u);
+	if (m_admitDirection < 0)
+		m_admitLimit = max(m_admitLimit > step ? m_admitLimit - step : 0, min(uint(DownloadMinActiveCount), m_maxActiveCount));
+	else
+		m_admitLimit = min(m_admitLimit + step, m_maxActiveCount);
+}
+
+void
+DownloadScheduler::removeClientIfIdleNoLock(const WString& clientKey)
+{
+	auto findIt = m_clients.find(clientKey);
+	if (findIt != m_clients.end() && !findIt->second.activeCount && !findIt->second.waitingCount)
+		m_clients.erase(findIt);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+bool
+SendCacheKey::operator<(const SendCacheKey& o) const
+{
+	if (file < o.file)
+		return true;
+	if (o.file < file)
+		return false;
+	if (compressionLevel != o.compressionLevel)
+		return compressionLevel < o.compressionLevel;
+	return dictionaryId < o.dictionaryId;
+}
+
+SharedSendCache::~SharedSendCache()
+{
+	for (auto& it : m_entries)
+		delete it.second;
+	IOStats ioStats;
+	for (auto& it : m_spillEntries)
+		deleteFile(it.second.fileName.c_str(), ioStats, false);
+}
+
+void
+SharedSendCache::setSpillDirectory(const wchar_t* directory, u64 maxSize, IOStats& ioStats)
+{
+	ScopedCriticalSection cs(m_cs);
+	for (auto& it : m_spillEntries)
+		deleteFile(it.second.fileName.c_str(), ioStats, false);
+	m_spillEntries.clear();
+	m_spillSize = 0;
+	m_spillDirectory.clear();
+	m_spillMaxSize = maxSize;
+	if (!*directory)
+		return;
+
+	// Spill files are only known by this process so everything left from last run is thrown away
+	WString spillDirectory(directory);
+	if (spillDirectory.back() != L'\\')
+		spillDirectory += L'\\';
+	spillDirectory += L"EACopySendCache";
+	if (!ensureDirectory(spillDirectory.c_str(), 0, ioStats, false, false) || !deleteAllFiles(spillDirectory.c_str(), ioStats, false))
+	{
+		logErrorf(L"Failed to prepare send cache spill directory %ls, streams will only be kept in memory", spillDirectory.c_str());
+		return;
+	}
+	m_spillDirectory = spillDirectory + L'\\';
+}
+
+SharedSendCache::Entry*
+SharedSendCache::acquire(const SendCacheKey& key, bool& outIsProducer, IOStats& ioStats)
+{
+	ScopedCriticalSection cs(m_cs);
+	auto insertRes = m_entries.insert({ key, nullptr });
+	Entry*& entry = insertRes.first->second;
+	outIsProducer = false;
+	if (!insertRes.second)
+	{
+		++m_hitCount;
+		++entry->refCount;
+		entry->lastUseTime = getTime();
+		return entry;
+	}
+
+	entry = new Entry();
+	entry->key = key;
+	entry->refCount = 1;
+	entry->lastUseTime = getTime();
+
+	auto spillIt = m_spillEntries.find(key);
+	if (spillIt == m_spillEntries.end())
+	{
+		++m_missCount;
+		outIsProducer = true;
+		return entry;
+	}
+
+	// Stream is on disk. Downloads asking for it meanwhile wait for it to be read back just like they wait for a producer
+	++m_spillHitCount;
+	SpillEntry spillEntry = spillIt->second;
+	m_spillSize -= spillEntry.size;
+	m_spillEntries.erase(spillIt);
+	Entry* readEntry = entry;
+	cs.leave();
+
+	bool success = readSpill(*readEntry, spillEntry, ioStats);
+	deleteFile(spillEntry.fileName.c_str(), ioStats, false);
+	produced(readEntry, success, ioStats);
+	return readEntry;
+}
+
+void
+SharedSendCache::produced(Entry* entry, bool success, IOStats& ioStats)
+{
+	Vector<Entry*> spillEntries;
+	{
+		ScopedCriticalSection cs(m_cs);
+		entry->valid = success;
+		if (!success)
+		{
+			entry->data.clear();
+			entry->data.shrink_to_fit();
+		}
+
+		// Waiting downloads will send file themselves if it failed and next one asking becomes producer.
+		// Entries invalidated while being produced are only used by the downloads already holding them
+		if (!entry->removed)
+		{
+			if (success)
+				m_size += entry->data.size();
+			else
+				removeNoLock(m_entries.find(entry->key));
+		}
+		entry->done.set();
+		evictNoLock(spillEntries);
+	}
+	spill(spillEntries, ioStats);
+}
+
+bool
+SharedSendCache::wait(Entry* entry, uint timeoutMs)
+{
+	if (!entry->done.isSet(timeoutMs))
+		return false;
+	ScopedCriticalSection cs(m_cs);
+	return entry->valid;
+}
+
+void
+SharedSendCache::release(Entry* entry, IOStats& ioStats)
+{
+	Vector<Entry*> spillEntries;
+	{
+		ScopedCriticalSection cs(m_cs);
+		entry->lastUseTime = getTime();
+		if (!--entry->refCount && entry->removed)
+		{
+			delete entry;
+			return;
+		}
+		evictNoLock(spillEntries);
+	}
+	spill(spillEntries, ioStats);
+}
+
+void
+SharedSendCache::invalidate(const WString& fullPath, const FileTime& lastWriteTime, u64 fileSize)
+{
+	auto isOtherVersion = [&](const SendCacheKey& key)
+	{
+		const FileKey& file = key.file;
+		return file.fileSize != fileSize || file.lastWriteTime.dwLowDateTime != lastWriteTime.dwLowDateTime || file.lastWriteTime.dwHighDateTime != lastWriteTime.dwHighDateTime;
+	};
+
+	// Keys are sorted on name first so all versions of file are next to each other
+	SendCacheKey firstKey { FileKey{ fullPath, { 0, 0 }, 0 }, 0, 0 };
+	IOStats ioStats;
+
+	ScopedCriticalSection cs(m_cs);
+	for (auto it = m_entries.lower_bound(firstKey); it != m_entries.end() && it->first.file.name == fullPath;)
+	{
+		auto current = it++;
+		if (isOtherVersion(current->first))
+			removeNoLock(current);
+	}
+
+	for (auto it = m_spillEntries.lower_bound(firstKey); it != m_spillEntries.end() && it->first.file.name == fullPath;)
+	{
+		auto current = it++;
+		if (!isOtherVersion(current->first))
+			continue;
+		deleteFile(current->second.fileName.c_str(), ioStats, false);
+		m_spillSize -= current->second.size;
+		m_spillEntries.erase(current);
+	}
+}
+
+SharedSendCache::Stats
+SharedSendCache::getStats()
+{
+	ScopedCriticalSection cs(m_cs);
+	return { uint(m_entries.size()), m_size, uint(m_spillEntries.size()), m_spillSize, m_hitCount, m_spillHitCount, m_missCount };
+}
+
+void
+SharedSendCache::removeNoLock(Entries::iterator it)
+{
+	Entry* entry = it->second;
+	m_entries.erase(it);
+	if (entry->valid)
+		m_size -= entry->data.size();
+	if (entry->refCount)
+		entry->removed = true;
+	else
+		delete entry;
+}
+
+void
+SharedSendCache::evictNoLock(Vector<Entry*>& outSpill)
+{
+	// Oldest entries nobody is using go first. Number of entries is bounded by size so a linear search is fine
+	while (m_size > m_maxSize)
+	{
+		auto oldestIt = m_entries.end();
+		for (auto it = m_entries.begin(), e = m_entries.end(); it != e; ++it)
+			if (!it->second->refCount && it->second->valid && (oldestIt == m_entries.end() || it->second->lastUseTime < oldestIt->second->lastUseTime))
+				oldestIt = it;
+		if (oldestIt == m_entries.end())
+			return;
+
+		Entry* entry = oldestIt->second;
+		m_size -= entry->data.size();
+		m_entries.erase(oldestIt);
+		if (!m_spillDirectory.empty() && entry->data.size() <= m_spillMaxSize)
+			outSpill.push_back(entry);
+		else
+			delete entry;
+	}
+}
+
+void
+SharedSendCache::evictSpillNoLock(IOStats& ioStats)
+{
+	while (m_spillSize > m_spillMaxSize && !m_spillEntries.empty())
+	{
+		auto oldestIt = m_spillEntries.begin();
+		for (auto it = m_spillEntries.begin(), e = m_spillEntries.end(); it != e; ++it)
+			if (it->second.lastUseTime < oldestIt->second.lastUseTime)
+				oldestIt = it;
+		deleteFile(oldestIt->second.fileName.c_str(), ioStats, false);
+		m_spillSize -= oldestIt->second.size;
+		m_spillEntries.erase(oldestIt);
+	}
+}
+
+void
+SharedSendCache::spill(Vector<Entry*>& entries, IOStats& ioStats)
+{
+	// Written outside lock. A download asking for an entry while it is being written becomes producer again
+	for (Entry* entry : entries)
+	{
+		WString fileName;
+		m_cs.scoped([&]() { fileName = m_spillDirectory + L"Stream" + std::to_wstring(m_spillFileIndex++) + L".bin"; });
+
+		FileHandle file;
+		bool success = openFileWrite(fileName.c_str(), file, ioStats, true);
+		if (success)
+		{
+			success = entry->data.empty() || writeFile(fileName.c_str(), file, entry->data.data(), entry->data.size(), ioStats);
+			success = closeFile(fileName.c_str(), file, AccessType_Write, ioStats) && success;
+		}
+
+		ScopedCriticalSection cs(m_cs);
+		if (success && !m_spillEntries.count(entry->key))
+		{
+			m_spillEntries[entry->key] = SpillEntry{ fileName, entry->data.size(), entry->lastUseTime };
+			m_spillSize += entry->data.size();
+			evictSpillNoLock(ioStats);
+		}
+		else
+			deleteFile(fileName.c_str(), ioStats, false);
+		delete entry;
+	}
+}
+
+bool
+SharedSendCache::readSpill(Entry& entry, const SpillEntry& spillEntry, IOStats& ioStats)
+{
+	FileHandle file;
+	if (!openFileRead(spillEntry.fileName.c_str(), file, ioStats, true))
+		return false;
+	entry.data.resize(spillEntry.size);
+	u64 read = 0;
+	bool success = spillEntry.size == 0 || readFile(spillEntry.fileName.c_str(), file, entry.data.data(), spillEntry.size, read, ioStats);
+	success = closeFile(spillEntry.fileName.c_str(), file, AccessType_Read, ioStats) && success;
+	return success && read == spillEntry.size;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+} // namespace eacopy
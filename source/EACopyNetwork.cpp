@@ -1,8 +1,10 @@
 // (c) Electronic Arts. All Rights Reserved.
 
 #include "EACopyNetwork.h"
+#include "EACopyDictionary.h"
 #include <utility>
 #include <assert.h>
+#include <math.h>
 #if defined(_WIN32)
 #define NOMINMAX
 #include <winsock2.h>
@@ -21,6 +23,9 @@
 #include <netinet/tcp.h>
 #include <netdb.h>
 #include <unistd.h>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
 #endif
 
 #define ZSTD_STATIC_LINKING_ONLY
@@ -32,6 +37,7 @@ typedef void* HANDLE;
 struct _OVERLAPPED { uint Offset; uint OffsetHigh; HANDLE hEvent; };
 namespace eacopy {
 #define WSAECONNABORTED                  10053L
+#define WSAECONNRESET                    10054L
 #define ioctlsocket ioctl
 #define closesocket close
 #define ERROR_IO_PENDING                 997L    // dderror
@@ -188,7 +194,7 @@ bool sendData(Socket& socket, const void* buffer, uint size)
 		if (res == SOCKET_ERROR)
 		{
 			int lastError = getLastNetworkError();
-			if (lastError == WSAECONNABORTED)
+			if (lastError == WSAECONNABORTED || lastError == WSAECONNRESET)
 				closeSocket(socket);
 			logErrorf(L"send failed with error: %ls", getErrorText(lastError).c_str());
 			return false;
@@ -210,7 +216,7 @@ bool receiveData(Socket& socket, void* buffer, uint size, bool closeIsError)
 		if (res < 0)
 		{
 			int lastError = getLastNetworkError();
-			if (lastError == WSAECONNABORTED)
+			if (lastError == WSAECONNABORTED || lastError == WSAECONNRESET)
 				closeSocket(socket);
 			logErrorf(L"recv failed with error: %ls", getErrorText(lastError).c_str());
 			return false;
@@ -231,6 +237,19 @@ bool receiveData(Socket& socket, void* buffer, uint size, bool closeIsError)
 	return true;
 }
 
+bool receiveBufferedData(Socket& socket, void* buffer, uint size, const char* recvBuffer, uint recvPos, uint& commandSize)
+{
+	if (recvPos > commandSize)
+	{
+		uint toCopy = min(recvPos - commandSize, size);
+		memcpy(buffer, recvBuffer + commandSize, toCopy);
+		commandSize += toCopy;
+		buffer = (char*)buffer + toCopy;
+		size -= toCopy;
+	}
+	return !size || receiveData(socket, buffer, size);
+}
+
 bool setBlocking(Socket& socket, bool blocking)
 {
 	u_long value = blocking ? 0 : 1;
@@ -280,22 +299,142 @@ bool isValidSocket(Socket& socket)
 	return socket.socket != INVALID_SOCKET;
 }
 
+bool isSocketIdle(Socket& socket)
+{
+	fd_set read;
+	FD_ZERO(&read);
+	FD_SET(socket.socket, &read);
+	timeval timeout = { 0, 0 };
+	return select(int(socket.socket + 1), &read, NULL, NULL, &timeout) == 0;
+}
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-bool sendFile(Socket& socket, const wchar_t* src, size_t fileSize, WriteFileType writeType, NetworkCopyContext& copyContext, CompressionStats& compressionStats, bool useBufferedIO, IOStats& ioStats, SendFileStats& sendStats)
+void
+CompressionStats::init(u8 compressionLevel)
+{
+	fixedLevel = compressionLevel != 255;
+	currentLevel = fixedLevel ? std::min(std::max(int(compressionLevel), 1), 22) : 1;
+	direction = 1;
+	windowSize = 0;
+	windowTime = 0;
+	lastBytesPerSecond = 0;
+}
+
+bool
+CompressionStats::update(u64 size, u64 time)
+{
+	if (fixedLevel)
+		return false;
+
+	windowSize += size;
+	windowTime += time;
+	if (windowTime < CompressionWindowTime)
+		return false;
+
+	// Keep going while throughput gets better, turn around when it gets worse. Level ends up going back and forth around the best one
+	u64 bytesPerSecond = windowSize * 10000000 / windowTime;
+	if (bytesPerSecond < lastBytesPerSecond)
+		direction = -direction;
+	lastBytesPerSecond = bytesPerSecond;
+	windowSize = 0;
+	windowTime = 0;
+
+	int level = currentLevel + direction;
+	if (level < 1 || level > int(CompressionMaxAdaptiveLevel))
+	{
+		direction = -direction;
+		level = currentLevel + direction;
+	}
+	currentLevel = level;
+	return true;
+}
+
+// Order-0 entropy of slices spread over data. Already compressed data (paks, videos, archives) is close to 8 bits per byte
+static bool isHighEntropy(const u8* data, uint size)
 {
+	enum { SliceCount = 16, SliceSize = CompressionSampleSize / SliceCount };
+
+	uint counts[256] = { 0 };
+	uint sampleSize = 0;
+	auto addSlice = [&](const u8* slice, uint sliceSize)
+	{
+		for (uint i=0; i!=sliceSize; ++i)
+			++counts[slice[i]];
+		sampleSize += sliceSize;
+	};
+
+	if (size <= CompressionSampleSize)
+		addSlice(data, size);
+	else
+		for (uint i=0; i!=SliceCount; ++i)
+			addSlice(data + u64(size - SliceSize) * i / (SliceCount - 1), SliceSize);
+
+	double entropy = 0;
+	for (uint count : counts)
+	{
+		if (!count)
+			continue;
+		double p = double(count) / sampleSize;
+		entropy -= p * log2(p);
+	}
+	return entropy > 7.9;
+}
+
+// Writes data as a zstd frame of raw blocks. Costs a copy and is read by any zstd decoder, with or without dictionary
+static size_t writeRawFrame(u8* dest, const u8* data, uint size)
+{
+	u8* pos = dest;
+	uint magic = ZSTD_MAGICNUMBER;
+	memcpy(pos, &magic, 4);
+	pos[4] = 0xA0; // Frame header descriptor. Single segment, content size in 4 bytes
+	memcpy(pos + 5, &size, 4);
+	pos += 9;
+
+	uint left = size;
+	do
+	{
+		uint blockSize = std::min(left, uint(ZSTD_BLOCKSIZE_MAX));
+		left -= blockSize;
+		uint blockHeader = (blockSize << 3) | (left ? 0 : 1); // Block type raw, last bit set on last block
+		pos[0] = u8(blockHeader);
+		pos[1] = u8(blockHeader >> 8);
+		pos[2] = u8(blockHeader >> 16);
+		memcpy(pos + 3, data, blockSize);
+		pos += 3 + blockSize;
+		data += blockSize;
+	}
+	while (left);
+
+	return size_t(pos - dest);
+}
+
+bool sendFile(Socket& socket, const wchar_t* src, size_t fileSize, WriteFileType writeType, NetworkCopyContext& copyContext, CompressionStats& compressionStats, bool useBufferedIO, IOStats& ioStats, SendFileStats& sendStats, u64 offset)
+{
+	TraceScope trace(L"SendFile", src);
+
 	FileHandle sourceFile;
 	if (!openFileRead(src, sourceFile, ioStats, useBufferedIO, nullptr, true))
 		return false;
 
 	ScopeGuard closeSourceFile([&]() { closeFile(src, sourceFile, AccessType_Read, ioStats); });
 
+	if (offset && !setFilePosition(src, sourceFile, offset, ioStats))
+		return false;
+
+	#if defined(__linux__)
+	// Same bytes on the wire as Send but sendfile moves them from page cache to socket without a copy through our buffers
+	if (writeType == WriteFileType_Send)
+		writeType = WriteFileType_TransmitFile;
+	#endif
 
 	if (writeType == WriteFileType_TransmitFile)
 	{
 		#if defined(_WIN32)
 		_OVERLAPPED overlapped;
 		memset(&overlapped, 0, sizeof(overlapped));
+		overlapped.Offset = static_cast<uint>(offset);
+		overlapped.OffsetHigh = static_cast<uint>(offset >> 32);
 		overlapped.hEvent = WSACreateEvent();
 		ScopeGuard closeEvent([&]() { WSACloseEvent(overlapped.hEvent); });
 
@@ -328,8 +467,30 @@ bool sendFile(Socket& socket, const wchar_t* src, size_t fileSize, WriteFileType
 			sendStats.sendSize += toWrite;
 
 			pos += toWrite;
-			overlapped.Offset = static_cast<uint>(pos);
-			overlapped.OffsetHigh = static_cast<uint>(pos >> 32);
+			overlapped.Offset = static_cast<uint>(offset + pos);
+			overlapped.OffsetHigh = static_cast<uint>((offset + pos) >> 32);
+		}
+		#elif defined(__linux__)
+		int fileHandle = (int)(uintptr_t)sourceFile;
+		off_t filePos = off_t(offset);
+		u64 left = fileSize;
+		while (left)
+		{
+			u64 startSendTime = getTime();
+			ssize_t sent = sendfile(int(socket.socket), fileHandle, &filePos, size_t(min(left, u64(INT_MAX-1))));
+			if (sent == -1)
+			{
+				logErrorf(L"Error while transmitting %ls: %hs", src, strerror(errno));
+				return false;
+			}
+			if (sent == 0)
+			{
+				logErrorf(L"File %ls ended before all data was transmitted", src);
+				return false;
+			}
+			sendStats.sendTime += getTime() - startSendTime;
+			sendStats.sendSize += sent;
+			left -= sent;
 		}
 		#else
 		EACOPY_NOT_IMPLEMENTED
@@ -366,15 +527,31 @@ bool sendFile(Socket& socket, const wchar_t* src, size_t fileSize, WriteFileType
 	else if (writeType == WriteFileType_Compressed)
 	{
 		enum { CompressedNetworkTransferChunkSize = NetworkTransferChunkSize/4 };
+		enum { CompressBoundReservation = 32 * 1024 };
+		enum { CompressReadChunkSize = CompressedNetworkTransferChunkSize - CompressBoundReservation };
 
-		u64 left = fileSize;
-		while (left)
-		{
-			enum { CompressBoundReservation = 32 * 1024 };
-			// Make sure the amount of data we've read fit in the destination compressed buffer
-			static_assert(ZSTD_COMPRESSBOUND(CompressedNetworkTransferChunkSize - CompressBoundReservation) <= CompressedNetworkTransferChunkSize - 4, "");
+		// Make sure the amount of data we've read fit in the destination compressed buffer
+		static_assert(ZSTD_COMPRESSBOUND(CompressReadChunkSize) <= CompressedNetworkTransferChunkSize - 4, "");
+
+		if (!copyContext.compContext)
+			copyContext.compContext = ZSTD_createCCtx();
+		auto cctx = (ZSTD_CCtx*)copyContext.compContext;
 
-			uint toRead = min(left, u64(CompressedNetworkTransferChunkSize - CompressBoundReservation));
+		CompressionStats& cs = compressionStats;
+
+		Vector<u8>* record = fileSize <= SendRecordMaxSize ? copyContext.sendRecord : nullptr;
+		if (record)
+			record->clear();
+
+		struct CompressedChunk { u8* buffer; uint read; uint sendBytes; int level; u64 compressTime; };
+
+		// Chunks that look incompressible are sent as raw zstd blocks, level 0. Only touched by the thread compressing
+		u64 compressedCount = 0;
+
+		// Reads next chunk of file and compresses it in to chunk.buffer. Use the first 4 bytes to write size of buffer.. can probably be replaced with zstd header instead
+		auto readAndCompress = [&](CompressedChunk& chunk, u64 left)
+		{
+			uint toRead = min(left, u64(CompressReadChunkSize));
 			uint toReadAligned = useBufferedIO ? toRead : (((toRead + 4095) / 4096) * 4096);
 			u64 read;
 			if (!readFile(src, sourceFile, copyContext.buffers[0], toReadAligned, read, ioStats))
@@ -386,65 +563,164 @@ bool sendFile(Socket& socket, const wchar_t* src, size_t fileSize, WriteFileType
 				}
 			}
 
-			if (!copyContext.compContext)
-				copyContext.compContext = ZSTD_createCCtx();
-			auto cctx = (ZSTD_CCtx*)copyContext.compContext;
-			ZSTD_CCtx_reset(cctx, ZSTD_reset_session_and_parameters);
-
-			CompressionStats& cs = compressionStats;
-
-			// Use the first 4 bytes to write size of buffer.. can probably be replaced with zstd header instead
-			u8* destBuf = copyContext.buffers[1];
+			TraceScope trace(L"Compress");
 			u64 startCompressTime = getTime();
-			size_t compressedSize = ZSTD_compressCCtx(cctx, destBuf + 4, CompressedNetworkTransferChunkSize - 4, copyContext.buffers[0], read, cs.currentLevel);
-			if (ZSTD_isError(compressedSize))
+			size_t compressedSize = 0;
+			chunk.level = 0;
+			if (!isHighEntropy(copyContext.buffers[0], uint(read)))
 			{
-				logErrorf(L"Fail compressing file %ls: %ls", src, ZSTD_getErrorName(compressedSize));
-				return false;
-			}
-			u64 compressTime = getTime() - startCompressTime;
+				ZSTD_CCtx_reset(cctx, ZSTD_reset_session_and_parameters);
 
-			*(uint*)destBuf =  uint(compressedSize);
+				chunk.level = cs.currentLevel;
+				if (copyContext.dictionary)
+					compressedSize = ZSTD_compress_usingCDict(cctx, chunk.buffer + 4, CompressedNetworkTransferChunkSize - 4, copyContext.buffers[0], read, (const ZSTD_CDict*)copyContext.dictionary->getCDict(chunk.level));
+				else
+					compressedSize = ZSTD_compressCCtx(cctx, chunk.buffer + 4, CompressedNetworkTransferChunkSize - 4, copyContext.buffers[0], read, chunk.level);
+				if (ZSTD_isError(compressedSize))
+				{
+					logErrorf(L"Fail compressing file %ls: %ls", src, ZSTD_getErrorName(compressedSize));
+					return false;
+				}
 
-			uint sendBytes = compressedSize + 4;
+				// Sampling missed it, raw blocks are smaller than what compression produced
+				if (compressedSize >= read)
+					chunk.level = 0;
+				else
+					++compressedCount;
+			}
+			if (!chunk.level)
+				compressedSize = writeRawFrame(chunk.buffer + 4, copyContext.buffers[0], uint(read));
+			chunk.compressTime = getTime() - startCompressTime;
+
+			*(uint*)chunk.buffer =  uint(compressedSize);
+			chunk.read = uint(read);
+			chunk.sendBytes = uint(compressedSize + 4);
+			return true;
+		};
+
+		// Sends compressed chunk and adapts compression level to how fast the connection is. When compression runs on the
+		// helper thread it overlaps the send so the slower one of them decides the throughput
+		bool pipelined = false;
+		auto sendChunk = [&](const CompressedChunk& chunk)
+		{
 			u64 startSendTime = getTime();
-			if (!sendData(socket, destBuf, sendBytes))
+			if (!sendData(socket, chunk.buffer, chunk.sendBytes))
 				return false;
 			u64 sendTime = getTime() - startSendTime;
 
-			sendStats.compressionLevelSum += read * cs.currentLevel;
+			if (record)
+				record->insert(record->end(), chunk.buffer, chunk.buffer + chunk.sendBytes);
 
-			if (!cs.fixedLevel)
-			{
-				ScopedCriticalSection _(cs.lock);
+			sendStats.compressionLevelSum += chunk.read * chunk.level;
 
-				cs.activeSendTime += sendTime;
-				cs.activeSendBytes += sendBytes;
-				if (cs.activeSendTime > 100000)
-				{
-					cs.currentIndex = (cs.currentIndex + 1) % eacopy_sizeof_array(cs.sendTime);
-					cs.currentSendTime += cs.activeSendTime - cs.sendTime[cs.currentIndex];
-					cs.currentSendBytes += cs.activeSendBytes - cs.sendBytes[cs.currentIndex];
-					cs.sendTime[cs.currentIndex] = cs.activeSendTime;
-					cs.sendBytes[cs.currentIndex] = cs.activeSendBytes;
-					cs.activeSendTime = 0;
-					cs.activeSendBytes = 0;
-
-					u64 timeUnitsPerBytes = (cs.currentSendTime * 1000000) / cs.currentSendBytes;
-					if (timeUnitsPerBytes < cs.lastTimeUnitPerBytes)
-						cs.currentLevel = min(14, cs.currentLevel + 1);
-					else
-						cs.currentLevel = max(1, cs.currentLevel - 1);
-					cs.lastTimeUnitPerBytes = timeUnitsPerBytes;
-				}
+			// Raw chunks take the same time on any level so they would only blur the measurement
+			if (chunk.level)
+			{
+				u64 time = pipelined ? max(chunk.compressTime, sendTime) : chunk.compressTime + sendTime;
+				if (cs.update(chunk.read, time))
+					++sendStats.compressionLevelChanges;
 			}
+			else
+				sendStats.compressionSkipSize += chunk.read;
 
-			sendStats.compressTime += compressTime;
+			sendStats.compressTime += chunk.compressTime;
 			sendStats.sendTime += sendTime;
-			sendStats.sendSize += compressedSize + 4;
+			sendStats.sendSize += chunk.sendBytes;
+			return true;
+		};
 
-			left -= read;
+		// Files that fit in one chunk has nothing to overlap. Helper thread needs a log context to report errors
+		LogContext* parentLogContext = LogContext::getCurrent();
+		if (fileSize <= CompressReadChunkSize || !parentLogContext)
+		{
+			CompressedChunk chunk;
+			chunk.buffer = copyContext.buffers[1];
+			u64 left = fileSize;
+			while (left)
+			{
+				if (!readAndCompress(chunk, left))
+					return false;
+				if (!sendChunk(chunk))
+					return false;
+				left -= chunk.read;
+			}
+			if (fileSize && !compressedCount)
+				++sendStats.compressionSkipCount;
+			return true;
 		}
+
+		// Pipelined version. Helper thread reads and compresses in to a ring of chunks while this thread sends the previous ones.
+		// Compression level changes made by sendChunk are picked up by the chunks compressed after the change
+		enum { CompressedChunkCount = CopyContextBufferSize / CompressedNetworkTransferChunkSize };
+		static_assert(CompressedChunkCount >= 2, "");
+
+		pipelined = true;
+		CompressedChunk chunks[CompressedChunkCount];
+		for (uint i=0; i!=CompressedChunkCount; ++i)
+			chunks[i].buffer = copyContext.buffers[1] + i*CompressedNetworkTransferChunkSize;
+
+		Atomic<uint> producedCount(0);
+		Atomic<uint> consumedCount(0);
+		Atomic<bool> producerFailed(false);
+		Atomic<bool> consumerDone(false);
+		Event chunkProduced(false);
+		Event chunkConsumed(false);
+
+		Thread producer([&]()
+			{
+				LogContext logContext(parentLogContext->log);
+				traceThreadName(L"Compressor");
+				u64 left = fileSize;
+				for (uint index=0; left; ++index)
+				{
+					while (index - consumedCount >= CompressedChunkCount)
+					{
+						if (consumerDone)
+							return 0;
+						chunkConsumed.isSet();
+					}
+					CompressedChunk& chunk = chunks[index % CompressedChunkCount];
+					if (!readAndCompress(chunk, left))
+					{
+						producerFailed = true;
+						chunkProduced.set();
+						return -1;
+					}
+					left -= chunk.read;
+					++producedCount;
+					chunkProduced.set();
+				}
+				return 0;
+			});
+
+		bool success = true;
+		u64 left = fileSize;
+		for (uint index=0; left; ++index)
+		{
+			while (producedCount == index && !producerFailed)
+				chunkProduced.isSet();
+			if (producedCount == index)
+			{
+				success = false;
+				break;
+			}
+			CompressedChunk& chunk = chunks[index % CompressedChunkCount];
+			if (!sendChunk(chunk))
+			{
+				success = false;
+				break;
+			}
+			left -= chunk.read;
+			++consumedCount;
+			chunkConsumed.set();
+		}
+
+		consumerDone = true;
+		chunkConsumed.set();
+		producer.wait();
+		if (success && !compressedCount)
+			++sendStats.compressionSkipCount;
+		return success;
 	}
 
 	return true;
@@ -458,148 +734,112 @@ NetworkCopyContext::~NetworkCopyContext()
 		ZSTD_freeDCtx((ZSTD_DCtx*)decompContext);
 }
 
-bool receiveFile(bool& outSuccess, Socket& socket, const wchar_t* fullPath, size_t fileSize, FileTime lastWriteTime, WriteFileType writeType, bool useBufferedIO, NetworkCopyContext& copyContext, char* recvBuffer, uint recvPos, uint& commandSize, IOStats& ioStats, RecvFileStats& recvStats)
+bool receiveFileData(bool& outSuccess, Socket& socket, const wchar_t* fullPath, FileHandle& file, u64 offset, u64 size, WriteFileType writeType, NetworkCopyContext& copyContext, char* recvBuffer, uint recvPos, uint& commandSize, IOStats& ioStats, RecvFileStats& recvStats)
 {
-	u64 totalReceivedSize = 0;
+	TraceScope trace(L"RecvFile", fullPath);
 
-	if (writeType == WriteFileType_TransmitFile || writeType == WriteFileType_Send)
+	_OVERLAPPED osWrite;
+	memset(&osWrite, 0, sizeof(osWrite));
+	osWrite.hEvent = CreateEvent(nullptr, false, true, nullptr);
+	ScopeGuard eventGuard([&]() { CloseHandle(osWrite.hEvent); });
+
+	// When file is opened for overlapped io the write is still in flight when we return here and we receive/decompress
+	// the next chunk in to the other buffer while it finishes. The write must always complete before buffer or osWrite is touched again
+	bool writePending = false;
+	auto waitForWrite = [&]()
 	{
-		FileHandle file;
-		_OVERLAPPED osWrite;
-		memset(&osWrite, 0, sizeof(osWrite));
-		osWrite.Offset = 0xFFFFFFFF;
-		osWrite.OffsetHigh = 0xFFFFFFFF;
-		osWrite.hEvent = CreateEvent(nullptr, false, true, nullptr);
+		if (!writePending)
+			return true;
+		writePending = false;
+		#if defined(_WIN32)
+		DWORD written;
+		if (GetOverlappedResult(file, &osWrite, &written, TRUE))
+			return true;
+		logErrorf(L"Trying to write data to %ls: %ls", fullPath, getErrorText(fullPath, GetLastError()).c_str());
+		return false;
+		#else
+		return WaitForSingleObject(osWrite.hEvent, INFINITE) == WAIT_OBJECT_0;
+		#endif
+	};
+	ScopeGuard writeGuard([&]() { waitForWrite(); });
 
-		outSuccess = openFileWrite(fullPath, file, ioStats, useBufferedIO);
-		ScopeGuard fileGuard([&]() { CloseHandle(osWrite.hEvent); if (!closeFile(fullPath, file, AccessType_Write, ioStats)) outSuccess = false; });
+	// Either append to end of file or write at explicit position (ranges of striped files can arrive in any order)
+	u64 writePos = offset;
+	auto write = [&](const void* data, u64 dataSize)
+	{
+		if (!waitForWrite())
+			return false;
+		osWrite.Offset = offset == ~u64(0) ? 0xFFFFFFFF : uint(writePos);
+		osWrite.OffsetHigh = offset == ~u64(0) ? 0xFFFFFFFF : uint(writePos >> 32);
+		writePos += dataSize;
+		if (!writeFile(fullPath, file, data, dataSize, ioStats, &osWrite))
+			return false;
+		writePending = true;
+		return true;
+	};
 
-		u64 read = 0;
+	u64 read = 0;
 
-		// Copy the stuff already in the buffer
-		if (recvPos > commandSize)
+	// Content can follow the command without the client waiting for an answer (ranges, files negotiated with WriteFiles) so
+	// what is already in the receive buffer is consumed before reading from socket. Applies to compressed content as well
+	auto receive = [&](void* dest, uint toRead)
+	{
+		u64 startRecvTime = getTime();
+		uint buffered = recvPos > commandSize ? min(recvPos - commandSize, toRead) : 0;
+		if (!receiveBufferedData(socket, dest, toRead, recvBuffer, recvPos, commandSize))
 		{
-			u64 toCopy = min(u64(recvPos - commandSize), u64(fileSize));
-			outSuccess = outSuccess && writeFile(fullPath, file, recvBuffer + commandSize, toCopy, ioStats, &osWrite);
-			read = toCopy;
-			commandSize += (uint)toCopy;
+			logErrorf(L"Socket closed before full file has been received (%ls)", fullPath);
+			return false;
 		}
+		recvStats.recvTime += getTime() - startRecvTime;
+		recvStats.recvSize += toRead - buffered;
+		return true;
+	};
 
-		int fileBufIndex = 0;
+	int fileBufIndex = 0;
 
-		while (read != fileSize)
+	if (writeType == WriteFileType_TransmitFile || writeType == WriteFileType_Send)
+	{
+		while (read != size)
 		{
-			u64 startRecvTime = getTime();
-			u64 left = fileSize - read;
-			uint toRead = (uint)min(left, u64(NetworkTransferChunkSize));
-			WSABUF wsabuf;
-			wsabuf.len = toRead;
-			wsabuf.buf = (char*)copyContext.buffers[fileBufIndex];
-			uint recvBytes = 0;
-			uint flags = MSG_WAITALL;
-			int fileRes = WSARecv(socket.socket, &wsabuf, 1, &recvBytes, &flags, NULL, NULL);
-			if (fileRes != 0)
-			{
-				logErrorf(L"recv failed with error: %ls", getErrorText(getLastNetworkError()).c_str());
-				return false;
-			}
-			if (recvBytes == 0)
-			{
-				logErrorf(L"Socket closed before full file has been received (%ls)", fullPath);
+			uint toRead = (uint)min(size - read, u64(NetworkTransferChunkSize));
+			if (!receive(copyContext.buffers[fileBufIndex], toRead))
 				return false;
-			}
 
-			outSuccess = outSuccess && WaitForSingleObject(osWrite.hEvent, INFINITE) == WAIT_OBJECT_0;
-			recvStats.recvTime += getTime() - startRecvTime;
-			recvStats.recvSize += recvBytes;
+			outSuccess = outSuccess && write(copyContext.buffers[fileBufIndex], toRead);
 
-			outSuccess = outSuccess && writeFile(fullPath, file, copyContext.buffers[fileBufIndex], recvBytes, ioStats, &osWrite);
-
-			read += recvBytes;
+			read += toRead;
 			fileBufIndex = fileBufIndex == 0 ? 1 : 0;
 		}
-
-		totalReceivedSize += read;
-
-		u64 startWriteTime = getTime();
-		outSuccess = outSuccess && WaitForSingleObject(osWrite.hEvent, INFINITE) == WAIT_OBJECT_0;
-		ioStats.writeTime = getTime() - startWriteTime;
-		outSuccess = outSuccess && setFileLastWriteTime(fullPath, file, lastWriteTime, ioStats);
 	}
 	else if (writeType == WriteFileType_Compressed)
 	{
-		FileHandle file;
-		_OVERLAPPED osWrite;
-		memset(&osWrite, 0, sizeof(osWrite));
-		osWrite.Offset = 0xFFFFFFFF;
-		osWrite.OffsetHigh = 0xFFFFFFFF;
-		osWrite.hEvent = CreateEvent(nullptr, false, true, nullptr);
-
-		outSuccess = openFileWrite(fullPath, file, ioStats, useBufferedIO);
-		ScopeGuard fileGuard([&]() { CloseHandle(osWrite.hEvent); if (!closeFile(fullPath, file, AccessType_Write, ioStats)) outSuccess = false; });
-
-		u64 read = 0;
-
-		// Copy the stuff already in the buffer
-		if (recvPos > commandSize)
+		while (read != size)
 		{
-			u64 toCopy = min(u64(recvPos - commandSize), u64(fileSize));
-			outSuccess = outSuccess && writeFile(fullPath, file, recvBuffer + commandSize, toCopy, ioStats, &osWrite);
-			read = toCopy;
-			commandSize += (uint)toCopy;
-		}
-
-		int fileBufIndex = 0;
-
-		while (read != fileSize)
-		{
-			u64 startRecvTime = getTime();
-
 			uint compressedSize;
-			if (!receiveData(socket, &compressedSize, sizeof(uint)))
+			if (!receive(&compressedSize, sizeof(uint)))
 				return false;
 
-			totalReceivedSize += compressedSize + sizeof(uint);
-
 			if (compressedSize > NetworkTransferChunkSize)
 			{
 				logErrorf(L"Compressed size is bigger than compression buffer capacity");
 				return false;
 			}
 
-			uint toRead = compressedSize;
-
-			while (toRead > 0)
-			{
-				WSABUF wsabuf;
-				wsabuf.len = toRead;
-				wsabuf.buf = (char*)copyContext.buffers[2];
-				uint recvBytes = 0;
-				uint flags = MSG_WAITALL;
-				int fileRes = WSARecv(socket.socket, &wsabuf, 1, &recvBytes, &flags, NULL, NULL);
-				if (fileRes != 0)
-				{
-					logErrorf(L"recv failed with error: %ls", getErrorText(getLastNetworkError()).c_str());
-					return false;
-				}
-				if (recvBytes == 0)
-				{
-					logErrorf(L"Socket closed before full file has been received (%ls)", fullPath);
-					return false;
-				}
-
-				recvStats.recvTime += getTime() - startRecvTime;
-				recvStats.recvSize += recvBytes;
-				toRead -= recvBytes;
-			}
+			if (!receive(copyContext.buffers[2], compressedSize))
+				return false;
 
 			if (!copyContext.decompContext)
 				copyContext.decompContext = ZSTD_createDCtx();
 			auto dctx = (ZSTD_DCtx*)copyContext.decompContext;
 			ZSTD_DCtx_reset(dctx, ZSTD_reset_session_and_parameters);
 
-			u64 startDecompressTime = getTime();
-			size_t decompressedSize = ZSTD_decompressDCtx(dctx, copyContext.buffers[fileBufIndex], NetworkTransferChunkSize, copyContext.buffers[2], compressedSize);
+			u64 startDecompressTime = getPreciseTime();
+			size_t decompressedSize;
+			if (copyContext.dictionary)
+				decompressedSize = ZSTD_decompress_usingDDict(dctx, copyContext.buffers[fileBufIndex], NetworkTransferChunkSize, copyContext.buffers[2], compressedSize, (const ZSTD_DDict*)copyContext.dictionary->getDDict());
+			else
+				decompressedSize = ZSTD_decompressDCtx(dctx, copyContext.buffers[fileBufIndex], NetworkTransferChunkSize, copyContext.buffers[2], compressedSize);
 			if (outSuccess)
 			{
 				outSuccess &= ZSTD_isError(decompressedSize) == 0;
@@ -610,25 +850,119 @@ bool receiveFile(bool& outSuccess, Socket& socket, const wchar_t* fullPath, size
 				}
 			}
 
-			recvStats.decompressTime = getTime() - startDecompressTime;
-
-			outSuccess = outSuccess && WaitForSingleObject(osWrite.hEvent, INFINITE) == WAIT_OBJECT_0;
+			u64 endDecompressTime = getPreciseTime();
+			recvStats.decompressTime += endDecompressTime - startDecompressTime;
+			if (g_traceActive)
+				traceSpan(L"Decompress", nullptr, startDecompressTime, endDecompressTime);
 
-			outSuccess = outSuccess && writeFile(fullPath, file, copyContext.buffers[fileBufIndex], decompressedSize, ioStats, &osWrite);
+			outSuccess = outSuccess && write(copyContext.buffers[fileBufIndex], decompressedSize);
 
 			read += decompressedSize;
 			fileBufIndex = fileBufIndex == 0 ? 1 : 0;
 		}
+	}
+
+	u64 startWriteTime = getTime();
+	outSuccess = waitForWrite() && outSuccess;
+	ioStats.writeTime += getTime() - startWriteTime;
+	return true;
+}
+
+bool receiveFile(bool& outSuccess, Socket& socket, const wchar_t* fullPath, size_t fileSize, FileTime lastWriteTime, WriteFileType writeType, bool useBufferedIO, NetworkCopyContext& copyContext, char* recvBuffer, uint recvPos, uint& commandSize, IOStats& ioStats, RecvFileStats& recvStats)
+{
+	// Open for overlapped io to let writes run in parallel with receive and decompression of the next chunk
+	_OVERLAPPED overlapped;
+	FileHandle file;
+	outSuccess = openFileWrite(fullPath, file, ioStats, useBufferedIO, &overlapped);
+	ScopeGuard fileGuard([&]() { if (!closeFile(fullPath, file, AccessType_Write, ioStats)) outSuccess = false; });
+
+	if (!receiveFileData(outSuccess, socket, fullPath, file, ~u64(0), fileSize, writeType, copyContext, recvBuffer, recvPos, commandSize, ioStats, recvStats))
+		return false;
 
-		u64 startWriteTime = getTime();
-		outSuccess = outSuccess && WaitForSingleObject(osWrite.hEvent, INFINITE) == WAIT_OBJECT_0;
-		ioStats.writeTime = getTime() - startWriteTime;
-		outSuccess = outSuccess && setFileLastWriteTime(fullPath, file, lastWriteTime, ioStats);
+	outSuccess = outSuccess && setFileLastWriteTime(fullPath, file, lastWriteTime, ioStats);
+	return true;
+}
+
+BufferedFileData getBufferedFileData(uint& outSize, const char* data, uint available, uint capacity, u64 fileSize, WriteFileType writeType)
+{
+	if (writeType == WriteFileType_TransmitFile || writeType == WriteFileType_Send)
+	{
+		if (fileSize > capacity)
+			return BufferedFileData_Unknown;
+		outSize = uint(fileSize);
+		return available >= fileSize ? BufferedFileData_Complete : BufferedFileData_Partial;
+	}
+
+	if (writeType != WriteFileType_Compressed)
+		return BufferedFileData_Unknown;
+
+	// Walk the [size][frame] pairs, frames written by sendFile always have content size in their header
+	u64 left = fileSize;
+	uint pos = 0;
+	while (left)
+	{
+		if (pos + sizeof(uint) > capacity)
+			return BufferedFileData_Unknown;
+		if (pos + sizeof(uint) > available)
+			return BufferedFileData_Partial;
+		uint compressedSize;
+		memcpy(&compressedSize, data + pos, sizeof(uint));
+		pos += sizeof(uint);
+		if (compressedSize > NetworkTransferChunkSize || pos + compressedSize > capacity)
+			return BufferedFileData_Unknown;
+		if (pos + compressedSize > available)
+			return BufferedFileData_Partial;
+		unsigned long long contentSize = ZSTD_getFrameContentSize(data + pos, compressedSize);
+		if (contentSize == ZSTD_CONTENTSIZE_UNKNOWN || contentSize == ZSTD_CONTENTSIZE_ERROR || contentSize == 0 || contentSize > left)
+			return BufferedFileData_Unknown;
+		left -= contentSize;
+		pos += compressedSize;
 	}
+	outSize = pos;
+	return BufferedFileData_Complete;
+}
 
+bool compressData(uint& outSize, void* dest, uint destCapacity, const void* source, uint sourceSize, int level, NetworkCopyContext& copyContext)
+{
+	if (!copyContext.compContext)
+		copyContext.compContext = ZSTD_createCCtx();
+	auto cctx = (ZSTD_CCtx*)copyContext.compContext;
+	ZSTD_CCtx_reset(cctx, ZSTD_reset_session_and_parameters);
+
+	size_t compressedSize;
+	if (copyContext.dictionary)
+		compressedSize = ZSTD_compress_usingCDict(cctx, dest, destCapacity, source, sourceSize, (const ZSTD_CDict*)copyContext.dictionary->getCDict(level));
+	else
+		compressedSize = ZSTD_compressCCtx(cctx, dest, destCapacity, source, sourceSize, level);
+	if (ZSTD_isError(compressedSize))
+	{
+		logErrorf(L"Fail compressing %u bytes: %hs", sourceSize, ZSTD_getErrorName(compressedSize));
+		return false;
+	}
+	outSize = uint(compressedSize);
 	return true;
 }
 
+bool decompressData(uint& outSize, void* dest, uint destCapacity, const void* source, uint sourceSize, NetworkCopyContext& copyContext)
+{
+	if (!copyContext.decompContext)
+		copyContext.decompContext = ZSTD_createDCtx();
+	auto dctx = (ZSTD_DCtx*)copyContext.decompContext;
+	ZSTD_DCtx_reset(dctx, ZSTD_reset_session_and_parameters);
+
+	size_t decompressedSize;
+	if (copyContext.dictionary)
+		decompressedSize = ZSTD_decompress_usingDDict(dctx, dest, destCapacity, source, sourceSize, (const ZSTD_DDict*)copyContext.dictionary->getDDict());
+	else
+		decompressedSize = ZSTD_decompressDCtx(dctx, dest, destCapacity, source, sourceSize);
+	if (ZSTD_isError(decompressedSize))
+	{
+		logErrorf(L"Decompression error while decompressing %u bytes: %hs", sourceSize, ZSTD_getErrorName(decompressedSize));
+		return false;
+	}
+	outSize = uint(decompressedSize);
+	return true;
+}
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
@@ -10,6 +10,7 @@
 #include <strsafe.h>
 #include <psapi.h>
 #include <Rpc.h>
+#include <shlwapi.h>
 
 #if defined(EACOPY_ALLOW_DELTA_COPY)
 #include "EACopyDelta.h"
@@ -20,6 +21,7 @@
 #endif
 
 #pragma comment (lib, "Netapi32.lib")
+#pragma comment (lib, "Shlwapi.lib") // PathMatchSpecW
 
 namespace eacopy
 {
@@ -34,11 +36,116 @@ Server::start(const ServerSettings& settings, Log& log, bool isConsole, ReportSe
 
 	LogContext logContext(log);
 
+	if (!settings.traceFileName.empty())
+		if (!traceBegin(settings.traceFileName.c_str(), L"EACopyService"))
+			logErrorf(L"Failed to create trace file %ls", settings.traceFileName.c_str());
+	ScopeGuard traceGuard([&]() { if (!settings.traceFileName.empty()) traceEnd(); });
+	traceThreadName(L"Main");
+
 	if (!reportStatus(SERVICE_START_PENDING, NO_ERROR, 3000))
 		return;
 
+	if (settings.useHash && !isHashAlgorithmSupported(settings.hashAlgorithm))
+	{
+		logErrorf(L"Hash algorithm %ls is not supported by this build", getHashAlgorithmName(settings.hashAlgorithm));
+		reportStatus(SERVICE_START_PENDING, -1, 3000);
+		return;
+	}
+	m_database.m_hashAlgorithm = settings.hashAlgorithm;
+	m_database.m_maxHistory = settings.maxHistory; // History is trimmed as records are added, no need for sweeps
+	m_database.m_primeThreadCount = settings.primeThreadCount;
+	m_database.m_primeUseHash = settings.primeUseHash && isHashAlgorithmSupported(settings.hashAlgorithm);
+	m_database.m_primeHashBytesPerSecond = settings.primeHashBytesPerSecond;
+	m_chunkStore.m_hashAlgorithm = settings.hashAlgorithm;
+	m_chunkStore.m_maxChunkCount = settings.maxChunkCount;
+	m_downloads.reset(settings.maxConcurrentDownloadCount);
+
+	if (settings.useChunks && !isHashAlgorithmSupported(settings.hashAlgorithm))
+	{
+		logErrorf(L"Chunks need hash algorithm %ls which is not supported by this build", getHashAlgorithmName(settings.hashAlgorithm));
+		reportStatus(SERVICE_START_PENDING, -1, 3000);
+		return;
+	}
+
+	// Compressed streams of files sent are cached. File database tells cache when another version of a file is added
+	{
+		IOStats ioStats;
+		m_sharedSends.m_maxSize = settings.sendCacheMaxSize;
+		m_sharedSends.setSpillDirectory(settings.sendCacheDirectory.c_str(), settings.sendCacheSpillMaxSize, ioStats);
+		m_database.m_fileAddedFunc = [this](const FileKey& key, const WString& fullFileName) { m_sharedSends.invalidate(fullFileName, key.lastWriteTime, key.fileSize); };
+	}
+
+	if (!settings.linkDatabaseFile.empty())
+	{
+		IOStats ioStats;
+		m_database.readFile(settings.linkDatabaseFile.c_str(), ioStats);
+		m_database.openJournal(settings.linkDatabaseFile.c_str(), ioStats);
+		logInfoLinef(L"Read %u entries from file database %ls", m_database.getHistorySize(), settings.linkDatabaseFile.c_str());
+
+		m_database.m_primeCheckpointFile = settings.linkDatabaseFile + L".prime";
+		m_database.primeReadCheckpoint(m_database.m_primeCheckpointFile.c_str(), ioStats);
+
+		if (settings.useChunks)
+		{
+			m_chunkStore.readFile((settings.linkDatabaseFile + L".chunks").c_str(), ioStats);
+			logInfoLinef(L"Read %u chunks from chunk store", m_chunkStore.getChunkCount());
+		}
+	}
+
+	// Declared before connections so it runs after all of them are gone
+	ScopeGuard writeDatabase([&]()
+		{
+			if (settings.linkDatabaseFile.empty())
+				return;
+			IOStats ioStats;
+			m_database.writeFile(settings.linkDatabaseFile.c_str(), ioStats);
+			if (settings.useChunks)
+				m_chunkStore.writeFile((settings.linkDatabaseFile + L".chunks").c_str(), ioStats);
+		});
+
+	// Priming runs in the background while connections are served. Declared after writeDatabase so priming is stopped before database is written
 	for (auto& primeDir : settings.additionalLinkDirectories)
-		primeDirectory(primeDir.c_str(), settings.useLinksRelativePath);
+		primeDirectory(primeDir.c_str(), settings.useLinksRelativePath, false);
+	Thread primeThread;
+	ScopeGuard primeThreadGuard([&]() { m_database.primeCancel(); primeThread.wait(); });
+	if (!settings.additionalLinkDirectories.empty())
+		primeThread.start([&]()
+			{
+				LogContext logContext(log);
+				IOStats ioStats;
+				u64 startTime = getTime();
+				m_database.primeWait(ioStats);
+				auto& stats = m_database.m_primeStats;
+				logInfoLinef(L"Primed %llu files in %llu directories (%llu unchanged) in %ls. Hashed %llu files (%ls)", stats.fileCount.load(), stats.dirCount.load(), stats.unchangedDirCount.load(), toHourMinSec(getTime() - startTime).c_str(), stats.hashedCount.load(), toPretty(stats.hashedBytes).c_str());
+				return 0;
+			});
+
+	// Dictionaries are trained in the background. Newest small files in database are sampled first so a restarted server doesn't start from scratch
+	Event trainStop;
+	Thread trainThread;
+	ScopeGuard trainThreadGuard([&]() { trainStop.set(); trainThread.wait(); });
+	if (settings.useDictionaries)
+		trainThread.start([&]()
+			{
+				LogContext logContext(log);
+				IOStats ioStats;
+				Vector<WString> files;
+				m_database.getRecentFiles(files, DictionaryMaxFileSize, DictionarySeedFileCount);
+				for (auto& file : files)
+				{
+					if (trainStop.isSet(0))
+						return 0;
+					if (m_dictionaries.needsSamples(file.c_str()))
+						m_dictionaries.addSampleFile(file.c_str(), ioStats);
+				}
+				do
+				{
+					if (uint trainedCount = m_dictionaries.train())
+						logInfoLinef(L"Trained %u compression dictionaries (%u total)", trainedCount, m_dictionaries.getDictionaryCount());
+				}
+				while (!trainStop.isSet(1000));
+				return 0;
+			});
 
 	// Initialize Winsock
 	WSADATA wsaData;
@@ -134,16 +241,79 @@ Server::start(const ServerSettings& settings, Log& log, bool isConsole, ReportSe
 		return;
 	}
 
+	// Metrics are served on their own socket by a small http loop so they can be scraped without the client protocol
+	SOCKET metricsSocket = INVALID_SOCKET;
+	Event metricsStop;
+	Thread metricsThreadHandle;
+	ScopeGuard metricsCleanup([&]() { metricsStop.set(); metricsThreadHandle.wait(); if (metricsSocket != INVALID_SOCKET) closesocket(metricsSocket); });
+	if (settings.metricsPort)
+	{
+		sockaddr_in metricsAddr = { 0 };
+		metricsAddr.sin_family = AF_INET;
+		metricsAddr.sin_port = htons(u16(settings.metricsPort));
+		metricsAddr.sin_addr.s_addr = localip ? inet_addr(localip) : htonl(INADDR_ANY);
+
+		metricsSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if (metricsSocket == INVALID_SOCKET || bind(metricsSocket, (sockaddr*)&metricsAddr, sizeof(metricsAddr)) == SOCKET_ERROR || listen(metricsSocket, SOMAXCONN) == SOCKET_ERROR)
+		{
+			logErrorf(L"Failed to listen for metrics on port %u: %ls", settings.metricsPort, getErrorText(getLastNetworkError()).c_str());
+			reportStatus(SERVICE_START_PENDING, -1, 3000);
+			return;
+		}
+		metricsThreadHandle.start([&]() { return metricsThread(log, metricsSocket, metricsStop); });
+		logInfoLinef(L"Serving metrics on port %u", settings.metricsPort);
+	}
+
 	logInfoLinef(L"Server started. Listening on port %i (Press Esc to quit)", settings.listenPort);
 
 	List<ConnectionInfo> connections;
 
+	// When using completion port all connections are served by a fixed set of workers instead of one thread each
+	HANDLE completionPort = nullptr;
+	List<Thread> completionPortThreads;
+	if (settings.useCompletionPort)
+	{
+		SYSTEM_INFO systemInfo;
+		GetSystemInfo(&systemInfo);
+		uint threadCount = settings.completionPortThreadCount;
+		if (!threadCount)
+			threadCount = systemInfo.dwNumberOfProcessors * 2;
+		m_handoffMaxCount = settings.handoffThreadCount;
+		if (!m_handoffMaxCount)
+			m_handoffMaxCount = systemInfo.dwNumberOfProcessors * 4;
+
+		completionPort = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 0);
+		if (!completionPort)
+		{
+			logErrorf(L"CreateIoCompletionPort failed with error: %ls", getErrorText(GetLastError()).c_str());
+			reportStatus(SERVICE_START_PENDING, -1, 3000);
+			return;
+		}
+
+		for (uint i=0; i!=threadCount; ++i)
+			completionPortThreads.emplace_back([this, &log, completionPort]() { return completionPortThread(log, completionPort); });
+	}
+
+	ScopeGuard completionPortCleanup([&]()
+		{
+			for (uint i=0, e=uint(completionPortThreads.size()); i!=e; ++i)
+				PostQueuedCompletionStatus(completionPort, 0, 0, nullptr);
+			completionPortThreads.clear();
+			m_handoffCs.scoped([&]() { m_handoffStop = true; });
+			m_handoffAvailable.set();
+			m_handoffThreads.clear();
+			m_handoffRetired.clear();
+			if (completionPort)
+				CloseHandle(completionPort);
+		});
+
 	reportStatus(SERVICE_RUNNING, NO_ERROR, 0);
 
 	// 1ms timeout if console application.. otherwise 5 seconds (and 1ms) timeout
 	TIMEVAL timeval;
 	timeval.tv_sec = isConsole ? 0 : 5;
 	timeval.tv_usec = 1000;
+	u64 journalFlushTime = getTime();
 
 	while (m_loopServer || !connections.empty())
 	{
@@ -178,15 +348,38 @@ Server::start(const ServerSettings& settings, Log& log, bool isConsole, ReportSe
 		// If nothing was set we got a timeout and take the chance to do some cleanup of state
 		if(!selectRes)
 		{
+			// Journal records are written in batches, don't keep the last batch in memory when server goes idle
+			u64 time = getTime();
+			if (timeToMs(time - journalFlushTime) >= FileDatabase::JournalFlushMs)
+			{
+				journalFlushTime = time;
+				m_database.flushJournal();
+			}
+
 			for (auto i=connections.begin(); i!=connections.end();)
 			{
 				if (!m_loopServer) // If server is shutting down we need to close the connection sockets to prevent potential deadlocks
-					closeSocket(i->socket);
+				{
+					// Completion port connections can be in use by a worker. Cancelling their io makes the worker end them and
+					// close the socket when it is done with the connection. Repeated every round in case a receive was posted after
+					if (i->thread)
+						closeSocket(i->socket);
+					else
+						i->ioCs.scoped([&]() { if (i->socket.socket != INVALID_SOCKET) CancelIoEx((HANDLE)i->socket.socket, nullptr); });
+				}
 
-				uint exitCode;
-				if (!i->thread->getExitCode(exitCode))
-					return;
-				if (exitCode == STILL_ACTIVE)
+				if (i->thread)
+				{
+					uint exitCode;
+					if (!i->thread->getExitCode(exitCode))
+						return;
+					if (exitCode == STILL_ACTIVE)
+					{
+						++i;
+						continue;
+					}
+				}
+				else if (!i->finished)
 				{
 					++i;
 					continue;
@@ -196,13 +389,8 @@ Server::start(const ServerSettings& settings, Log& log, bool isConsole, ReportSe
 				--m_activeConnectionCount;
 			}
 
-			// When there are no connections active we take the opportunity to shrink history if overflowed
 			if (connections.empty())
-			{
-				if (uint removeCount = m_database.garbageCollect(settings.maxHistory))
-					logDebugLinef(L"History overflow. Removed %u entries", removeCount);
 				logFlush();
-			}
 			continue;
 		}
 
@@ -231,9 +419,24 @@ Server::start(const ServerSettings& settings, Log& log, bool isConsole, ReportSe
 			ConnectionInfo& info = connections.back();
 			info.remoteIp = WString(remoteIp, remoteIp + strlen(remoteIp));
 
-			info.thread = new Thread([this, &info]() { return connectionThread(info); });
-
 			++m_activeConnectionCount;
+
+			if (!completionPort)
+			{
+				info.thread = new Thread([this, &info]() { return connectionThread(info); });
+				continue;
+			}
+
+			// Associate socket with completion port and post first receive. From here on a worker owns the connection
+			if (CreateIoCompletionPort((HANDLE)clientSocket, completionPort, (ULONG_PTR)&info, 0) != completionPort)
+			{
+				logErrorf(L"CreateIoCompletionPort failed to associate socket with error: %ls", getErrorText(GetLastError()).c_str());
+				connectionEnd(info);
+				continue;
+			}
+
+			if (!connectionBegin(info) || !postReceive(info))
+				connectionEnd(info);
 		}
 	}
 }
@@ -242,13 +445,14 @@ void
 Server::stop()
 {
 	m_loopServer = false;
+	m_downloads.stop();
 	SOCKET listenSocket = m_listenSocket;
 	m_listenSocket = INVALID_SOCKET;
 	closesocket(listenSocket);
 }
 
 bool
-Server::primeDirectory(const wchar_t* directory, bool useLinksRelativePath)
+Server::primeDirectory(const wchar_t* directory, bool useLinksRelativePath, bool flush)
 {
 	WString serverDir;
 	bool isExternalDir;
@@ -259,7 +463,7 @@ Server::primeDirectory(const wchar_t* directory, bool useLinksRelativePath)
 	if (*serverDir.rbegin() != '\\')
 		serverDir += '\\';
 	IOStats ioStats;
-	return m_database.primeDirectory(serverDir, ioStats, useLinksRelativePath, true);
+	return m_database.primeDirectory(serverDir, ioStats, useLinksRelativePath, flush);
 }
 
 #define EACOPY_COMMAND(x) L"CMD" L#x,
@@ -269,63 +473,162 @@ const wchar_t* commandNames[] =
 	EACOPY_COMMANDS
 };
 
+void
+Server::addCommandLatency(const WString& serverPath, CommandType type, u64 time)
+{
+	m_commandHistograms[type].add(time);
+	if (serverPath.size() > 1 && serverPath[1] == ':')
+	{
+		wchar_t drive = towupper(serverPath[0]);
+		if (drive >= 'A' && drive <= 'Z')
+			m_volumeHistograms[drive - 'A'].add(time);
+	}
+}
+
+void
+Server::populateMetrics(String& out)
+{
+	char buffer[1024];
+	char labels[128];
+
+	out += "# TYPE eacopy_command_seconds summary\n";
+	for (uint i = 0; i != CommandType_Bad; ++i)
+	{
+		sprintf_s(labels, sizeof(labels), "command=\"%ls\"", commandNames[i] + 3); // Skip CMD prefix
+		appendPrometheusSummary(out, "eacopy_command_seconds", labels, m_commandHistograms[i]);
+	}
+
+	static const char* writeResponseNames[] = { "Copy", "CopyDelta", "CopySmb", "Link", "Odx", "Skip", "Hash", "Chunks" };
+	static_assert(eacopy_sizeof_array(writeResponseNames) == WriteResponseCount, "Missing write response names");
+	out += "# TYPE eacopy_write_seconds summary\n";
+	for (uint i = 0; i != WriteResponseCount; ++i)
+	{
+		sprintf_s(labels, sizeof(labels), "response=\"%s\"", writeResponseNames[i]);
+		appendPrometheusSummary(out, "eacopy_write_seconds", labels, m_writeResponseHistograms[i]);
+	}
+
+	out += "# TYPE eacopy_io_seconds summary\n";
+	for (uint i = 0; i != IOOp_Count; ++i)
+	{
+		sprintf_s(labels, sizeof(labels), "op=\"%ls\"", getIOOpName(IOOp(i)));
+		appendPrometheusSummary(out, "eacopy_io_seconds", labels, m_ioHistograms.ops[i]);
+	}
+
+	out += "# TYPE eacopy_volume_command_seconds summary\n";
+	for (uint i = 0; i != uint(eacopy_sizeof_array(m_volumeHistograms)); ++i)
+	{
+		sprintf_s(labels, sizeof(labels), "volume=\"%c:\"", char('A' + i));
+		appendPrometheusSummary(out, "eacopy_volume_command_seconds", labels, m_volumeHistograms[i]);
+	}
+
+	sprintf_s(buffer, sizeof(buffer),
+		"# TYPE eacopy_uptime_seconds gauge\neacopy_uptime_seconds %llu\n"
+		"# TYPE eacopy_connections_active gauge\neacopy_connections_active %u\n"
+		"# TYPE eacopy_connections_handled_total counter\neacopy_connections_handled_total %u\n"
+		"# TYPE eacopy_history_size gauge\neacopy_history_size %u\n"
+		"# TYPE eacopy_bytes_total counter\n"
+		"eacopy_bytes_total{kind=\"copied\"} %llu\neacopy_bytes_total{kind=\"received\"} %llu\n"
+		"eacopy_bytes_total{kind=\"linked\"} %llu\neacopy_bytes_total{kind=\"skipped\"} %llu\n"
+		, (getTime() - m_startTime)/10000000, m_activeConnectionCount, m_handledConnectionCount, m_database.getHistorySize()
+		, m_bytesCopied, m_bytesReceived, m_bytesLinked, m_bytesSkipped);
+	out += buffer;
+
+	DownloadScheduler::Stats downloadStats = m_downloads.getStats();
+	SharedSendCache::Stats sharedSendStats = m_sharedSends.getStats();
+	sprintf_s(buffer, sizeof(buffer),
+		"# TYPE eacopy_downloads gauge\neacopy_downloads{state=\"active\"} %u\neacopy_downloads{state=\"waiting\"} %u\neacopy_downloads{state=\"limit\"} %u\n"
+		"# TYPE eacopy_download_bytes_per_second gauge\neacopy_download_bytes_per_second %llu\n"
+		"# TYPE eacopy_downloads_total counter\neacopy_downloads_total{kind=\"queued\"} %llu\neacopy_downloads_total{kind=\"busy\"} %llu\n"
+		"# TYPE eacopy_download_queue_seconds_total counter\neacopy_download_queue_seconds_total %.3f\n"
+		"# TYPE eacopy_send_cache_total counter\neacopy_send_cache_total{kind=\"hit\"} %llu\neacopy_send_cache_total{kind=\"spill_hit\"} %llu\neacopy_send_cache_total{kind=\"miss\"} %llu\n"
+		"# TYPE eacopy_send_cache_bytes gauge\neacopy_send_cache_bytes{kind=\"memory\"} %llu\neacopy_send_cache_bytes{kind=\"spill\"} %llu\n"
+		, downloadStats.activeCount, downloadStats.waitingCount, downloadStats.admitLimit, downloadStats.bytesPerSecond
+		, downloadStats.queuedCount, downloadStats.timedOutCount, double(downloadStats.queueTime)/10000000
+		, sharedSendStats.hitCount, sharedSendStats.spillHitCount, sharedSendStats.missCount, sharedSendStats.size, sharedSendStats.spillSize);
+	out += buffer;
+}
+
 uint
-Server::connectionThread(ConnectionInfo& info)
+Server::metricsThread(Log& log, SOCKET listenSocket, Event& stopEvent)
 {
-	LogContext logContext(info.log);
-	uint bufferSize = 512*1024;
-	char* recvBuffer1 = new char[bufferSize];
-	char* recvBuffer2 = new char[bufferSize];
-	char* recvBuffer = recvBuffer1;
-
-	uint commands[CommandType_Bad] = { 0 };
-	u64 commandTimes[CommandType_Bad] = { 0 };
-	uint readEntries[ReadResponse_BadSource] = { 0 };
-	uint readEntryCount = 0;
-	uint writeEntries[WriteResponse_BadDestination] = { 0 };
-	uint writeEntryCount = 0;
-	IOStats ioStats;
+	LogContext logContext(log);
 
-	ScopeGuard closeSocket([&]()
+	// Requests are tiny and served one at a time. Anything that isn't a GET ends up with the metrics anyway
+	while (!stopEvent.isSet(0))
 	{
-			closeSocket(info.socket);
-			delete[] recvBuffer1;
-			delete[] recvBuffer2;
-			logScopeEnter();
-			logDebugLinef(L"--------- Connection %u closed ---------", info.socket.index);
-			
-			if (readEntryCount)
-			{
-				logDebugLinef(L"             Copy   CopyDelta CopySmb   Skip   Hash    ServerBusy");
-				logDebugLinef(L"   Reads   %6i      %6i  %6i %6i %6i        %6i", readEntries[0], readEntries[1], readEntries[2], readEntries[3], readEntries[4], readEntries[5]);
-			}
-			if (writeEntryCount)
-			{
-				logDebugLinef(L"             Copy   CopyDelta CopySmb   Link    Odx   Skip   Hash");
-				logDebugLinef(L"   Writes  %6i      %6i  %6i %6i %6i %6i %6i", writeEntries[0], writeEntries[1], writeEntries[2], writeEntries[3], writeEntries[4], writeEntries[5], writeEntries[6]);
-			}
-			logDebugLinef(L"");
+		fd_set read;
+		FD_ZERO(&read);
+		FD_SET(listenSocket, &read);
+		TIMEVAL timeval = { 0, 500*1000 };
+		int selectRes = select(0, &read, nullptr, nullptr, &timeval);
+		if (selectRes == SOCKET_ERROR)
+		{
+			logErrorf(L"Metrics select failed with error: %ls", getErrorText(getLastNetworkError()).c_str());
+			return -1;
+		}
+		if (!selectRes)
+			continue;
 
-			Vector<WString> statsVec;
-			for (uint i = 0; i != CommandType_Bad; ++i)
-				populateStatsTime(statsVec, commandNames[i], commandTimes[i], commands[i]);
-			//populateIOStats(statsVec, ioStats);
-			logDebugStats(statsVec);
-			logDebugLinef(L"");
+		SOCKET clientSocket = accept(listenSocket, nullptr, nullptr);
+		if (clientSocket == INVALID_SOCKET)
+			continue;
+		ScopeGuard closeClient([&]() { closesocket(clientSocket); });
 
-			// This connection session is finished, flush the log.to avoid file buffer build up getting too large.
-			logFlush();
+		// Only the request line matters, wait a short while for it
+		char request[1024];
+		int requestLen = 0;
+		while (requestLen < int(sizeof(request)) - 1)
+		{
+			FD_ZERO(&read);
+			FD_SET(clientSocket, &read);
+			TIMEVAL recvTimeval = { 1, 0 };
+			if (select(0, &read, nullptr, nullptr, &recvTimeval) != 1)
+				break;
+			int res = recv(clientSocket, request + requestLen, int(sizeof(request)) - 1 - requestLen, 0);
+			if (res <= 0)
+				break;
+			requestLen += res;
+			request[requestLen] = 0;
+			if (strstr(request, "\r\n"))
+				break;
+		}
+		request[requestLen] = 0;
+
+		String body;
+		if (strncmp(request, "GET /health", 11) == 0)
+			body = "OK\n";
+		else
+			populateMetrics(body);
+
+		char header[256];
+		sprintf_s(header, sizeof(header), "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %u\r\nConnection: close\r\n\r\n", uint(body.size()));
+		String response = header + body;
+		for (uint pos = 0, size = uint(response.size()); pos != size;)
+		{
+			int res = send(clientSocket, response.c_str() + pos, int(size - pos), 0);
+			if (res <= 0)
+				break;
+			pos += res;
+		}
+	}
+	return 0;
+}
 
-			logScopeLeave();
-	});
+bool
+Server::connectionBegin(ConnectionInfo& info)
+{
+	info.recvBuffer1 = new char[ConnectionInfo::RecvBufferSize];
+	info.recvBuffer2 = new char[ConnectionInfo::RecvBufferSize];
+	info.recvBuffer = info.recvBuffer1;
+	info.compressionStats.currentLevel = 1;
+	info.ioStats.histograms = &m_ioHistograms;
 
 	// Experimenting with speeding up network performance. This didn't make any difference
 	// setRecvBufferSize(info.socket, 16*1024*1024);
 
 	// Disable Nagle's algorithm (makes a big difference!)
 	if (!disableNagle(info.socket))
-		return -1;
-
+		return false;
 
 	// Sending protocol version to connection
 	{
@@ -342,804 +645,1424 @@ Server::connectionThread(ConnectionInfo& info)
 
 		if (info.settings.useSecurityFile)
 			cmd.protocolFlags |= UseSecurityFile;
+		if (info.settings.hashAlgorithm == HashAlgorithm_Xxh3)
+			cmd.protocolFlags |= UseHashXxh3;
+		if (info.settings.useDictionaries)
+			cmd.protocolFlags |= UseDictionaries;
 		if (!sendData(info.socket, &cmd, cmd.commandSize))
-			return -1;
+			return false;
 	}
 
-	SendFileStats sendStats;
-	NetworkCopyContext copyContext;
-	CompressionStats compressionStats;
-	compressionStats.currentLevel = 1;
-
-	uint recvPos = 0;
-	WString serverPath;
-	bool isValidEnvironment = false;
-	bool isServerPathExternal = false; // Tells whether "local" directory is external or not (it could be pointing to a network share)
-	bool isDone = false;
-	uint clientConnectionIndex = ~0u; // Note that this is the connection index from the same client where 0 is the controlling connection and the rest are worker connections
-
-	ScopeGuard queueRemoveGuard([&]()
-		{
-			if (clientConnectionIndex == ~0u)
-				return;
-			ScopedCriticalSection cs(m_queuesCs);
-			Queue& q = m_queues[clientConnectionIndex];
-			q.erase(std::find(q.begin(), q.end(), &info));
-		});
-
-	ActiveSession* activeSession = nullptr;
+	return true;
+}
 
-	Guid zeroGuid = {0};
-	Guid secretGuid = {0};
-	ScopeGuard removeSecretGuid([&]()
-		{
-			ScopedCriticalSection cs(m_activeSessionsCs);
-			if (activeSession && --activeSession->connectionCount == 0)
-				m_activeSessions.erase(secretGuid);
-		});
+void
+Server::removeExpiredSessionsNoLock()
+{
+	u64 time = getTime();
+	for (auto it = m_activeSessions.begin(); it != m_activeSessions.end();)
+	{
+		if (!it->second.connectionCount && time - it->second.idleTime > u64(SessionResumeTimeMs)*10000)
+			it = m_activeSessions.erase(it);
+		else
+			++it;
+	}
+}
 
-	// Receive until the peer shuts down the connection
-	while (!isDone && m_loopServer)
+void
+Server::connectionEnd(ConnectionInfo& info)
+{
 	{
-		int res = recv(info.socket.socket, recvBuffer + recvPos, bufferSize - recvPos, 0);
-		if (res == 0)
+		ScopedCriticalSection cs(m_activeSessionsCs);
+		if (info.isParked)
+			--info.activeSession->parkedCount;
+		if (info.activeSession && --info.activeSession->connectionCount == 0)
 		{
-			logDebugLinef(L"Connection %u closing...", info.socket.index);
-			break;
+			// Striped files that never got all their ranges are left without correct last write time so they will be copied again
+			for (auto& it : info.activeSession->stripedFiles)
+				closeFile(it.first.c_str(), it.second.handle, AccessType_Write, info.ioStats);
+			info.activeSession->stripedFiles.clear();
+
+			// Keep directories known by session around in case client lost its connections and reconnects
+			info.activeSession->idleTime = getTime();
 		}
-		if (res < 0)
+		else if (info.activeSession && info.activeSession->parkedCount == info.activeSession->connectionCount)
 		{
-			int error = getLastNetworkError();
-			if (error == WSAECONNRESET) // An existing connection was forcibly closed by the remote host.
-				logInfoLinef(L"An existing connection was forcibly closed by the remote host");
-			else
-				logErrorf(L"recv failed with error: %ls", getErrorText(error).c_str());
-			return -1;
+			// Last connection still busy went away and the rest are parked, job is done same as in Done
+			ActiveSession& session = *info.activeSession;
+			session.createdDirsCs.scoped([&]()
+				{
+					session.createdDirs.clear();
+					session.knownDirs.clear();
+				});
 		}
+		removeExpiredSessionsNoLock();
+	}
 
-		//logDebugLinef("Bytes received: %d", res);
-
-		recvPos += res;
-		
-		while (true)
-		{
-			if (recvPos < sizeof(Command))
-				break;
-			auto& header = *(Command*)recvBuffer;
-			if (recvPos < header.commandSize)
-				break;
+	info.ioCs.scoped([&]() { closeSocket(info.socket); });
+	delete[] info.recvBuffer1;
+	delete[] info.recvBuffer2;
+	info.recvBuffer1 = info.recvBuffer2 = info.recvBuffer = nullptr;
+	logScopeEnter();
+	logDebugLinef(L"--------- Connection %u closed ---------", info.socket.index);
+	
+	if (info.readEntryCount)
+	{
+		logDebugLinef(L"             Copy   CopyDelta CopySmb   Skip   Hash    ServerBusy");
+		logDebugLinef(L"   Reads   %6i      %6i  %6i %6i %6i        %6i", info.readEntries[0], info.readEntries[1], info.readEntries[2], info.readEntries[3], info.readEntries[4], info.readEntries[5]);
+	}
+	if (info.writeEntryCount)
+	{
+		logDebugLinef(L"             Copy   CopyDelta CopySmb   Link    Odx   Skip   Hash  Chunks");
+		logDebugLinef(L"   Writes  %6i      %6i  %6i %6i %6i %6i %6i  %6i", info.writeEntries[0], info.writeEntries[1], info.writeEntries[2], info.writeEntries[3], info.writeEntries[4], info.writeEntries[5], info.writeEntries[6], info.writeEntries[7]);
+	}
+	logDebugLinef(L"");
 
-			++commands[header.commandType];
-			TimerScope commandTimer(commandTimes[header.commandType]);
+	Vector<WString> statsVec;
+	for (uint i = 0; i != CommandType_Bad; ++i)
+		populateStatsTime(statsVec, commandNames[i], info.commandTimes[i], info.commands[i]);
+	//populateIOStats(statsVec, ioStats);
+	logDebugStats(statsVec);
+	logDebugLinef(L"");
 
-			switch (header.commandType)
-			{
-			case CommandType_Environment:
-				{
-					auto& cmd = *(const EnvironmentCommand*)recvBuffer;
-					secretGuid = cmd.secretGuid;
+	// This connection session is finished, flush the log.to avoid file buffer build up getting too large.
+	logFlush();
 
-					logScopeEnter();
-					logDebugLinef(L"--- Connection %u opened ---", info.socket.index);
-					logDebugLinef(L"  RemoteIp              : %ls", info.remoteIp.c_str());
-					logDebugLinef(L"  ClientVersion         : %ls", getVersionString(cmd.majorVersion, cmd.minorVersion, false).c_str());
-					logDebugLinef(L"  RemoteConnectionIndex : %u", cmd.connectionIndex);
-					logDebugLinef(L"  NetDirectory          : %ls", cmd.netDirectory);
-					logDebugLinef(L"");
-					logScopeLeave();
+	logScopeLeave();
 
-					clientConnectionIndex = min(cmd.connectionIndex, MaxPriorityQueueCount - 1);
+	info.finished = true;
+}
 
-					m_queuesCs.scoped([&]() { m_queues[clientConnectionIndex].push_back(&info); });
+bool
+Server::processCommands(ConnectionInfo& info, NetworkCopyContext& copyContext)
+{
+	LogContext logContext(info.log);
 
-					if (!getLocalFromNet(serverPath, isServerPathExternal, cmd.netDirectory))
-						return -1;
+	// Local aliases for the connection state that needs to survive between calls
+	char*& recvBuffer = info.recvBuffer;
+	uint& recvPos = info.recvPos;
+	uint* commands = info.commands;
+	u64* commandTimes = info.commandTimes;
+	uint* readEntries = info.readEntries;
+	uint& readEntryCount = info.readEntryCount;
+	uint* writeEntries = info.writeEntries;
+	uint& writeEntryCount = info.writeEntryCount;
+	IOStats& ioStats = info.ioStats;
+	SendFileStats& sendStats = info.sendStats;
+	CompressionStats& compressionStats = info.compressionStats;
+	WString& serverPath = info.serverPath;
+	bool& isValidEnvironment = info.isValidEnvironment;
+	bool& isServerPathExternal = info.isServerPathExternal;
+	bool& isDone = info.isDone;
+	uint& clientConnectionIndex = info.clientConnectionIndex;
+	ActiveSession*& activeSession = info.activeSession;
+	Guid& secretGuid = info.secretGuid;
+	Guid zeroGuid = {0};
 
-					if (info.settings.useSecurityFile)
-					{
-						if (cmd.secretGuid != zeroGuid)
-						{
-							// Connection provided secretGuid, check against table of valid secretGuids
+	// Robocopy style key for uniqueness of file
+	auto getFileKey = [&](const wchar_t* path, const FileInfo& fileInfo)
+	{
+		const wchar_t* fileName = path;
+		if (!info.settings.useLinksRelativePath)
+			if (const wchar_t* lastSlash = wcsrchr(fileName, '\\'))
+				fileName = lastSlash + 1;
+		return FileKey { fileName, fileInfo.lastWriteTime, fileInfo.fileSize };
+	};
+
+	// Downloads are shared fairly between client sessions. Clients not using security file have no session and are keyed by address
+	auto getDownloadClientKey = [&]()
+	{
+		if (secretGuid == zeroGuid)
+			return info.remoteIp;
+		WString key;
+		const u8* guidBytes = (const u8*)&secretGuid;
+		for (uint i=0; i!=sizeof(Guid); ++i)
+		{
+			key += L"0123456789abcdef"[guidBytes[i] >> 4];
+			key += L"0123456789abcdef"[guidBytes[i] & 15];
+		}
+		return key;
+	};
 
-							ScopedCriticalSection _(m_activeSessionsCs);
-							auto findIt = m_activeSessions.find(cmd.secretGuid);
-							if (findIt != m_activeSessions.end())
-							{
-								activeSession = &(findIt->second);
-								++activeSession->connectionCount;
-							}
-							else
-							{
-								logInfoLinef(L"Connection is providing invalid secret guid.. disconnect");
-								return -1;
-							}
-						}
-						else
-						{
-							// No secretGuid provided, let's test the clients access to the network path
-							// by putting a hidden file there with a guid in it, if client can return that guid it means that client has access
+	// Creates directory and the parents missing. Directories are only checked the first time session sees them
+	auto ensureSessionDirectory = [&](const WString& directory, IOStats& dirIoStats)
+	{
+		bool known;
+		activeSession->createdDirsCs.scoped([&]() { known = activeSession->knownDirs.find(directory) != activeSession->knownDirs.end(); });
+		if (known)
+			return true;
+		FilesSet createdDirs;
+		if (!ensureDirectory(directory.c_str(), 0, dirIoStats, false, false, &createdDirs))
+			return false;
+		activeSession->createdDirsCs.scoped([&]()
+			{
+				activeSession->knownDirs.insert(directory);
+				for (auto& dir : createdDirs) // Parents are reported without trailing slash
+				{
+					WString createdDir = dir;
+					if (*createdDir.rbegin() != L'\\')
+						createdDir += L'\\';
+					activeSession->knownDirs.insert(createdDir);
+					activeSession->createdDirs.insert(createdDir);
+				}
+			});
+		return true;
+	};
 
-							static_assert(sizeof(GUID) == sizeof(Guid), "GUID and Guid are not matching");
-							GUID filenameGuid;
-							if (CoCreateGuid(&filenameGuid) != S_OK)
-							{
-								logErrorf(L"CoCreateGuid - Failed to create filename guid");
-								return -1;
-							}
+	// Client does not send CreateDir for directories that get files so parent is created before file is written
+	auto ensureParentDirectory = [&](const WString& fullPath, IOStats& dirIoStats)
+	{
+		const wchar_t* lastSlash = wcsrchr(fullPath.c_str(), '\\');
+		return !lastSlash || ensureSessionDirectory(WString(fullPath.c_str(), lastSlash + 1), dirIoStats);
+	};
 
-							wchar_t filename[128];
-							filename[0] = L'.';
-							StringFromGUID2(filenameGuid, filename + 1, 40);
-							filename[1] = L'f';
-							filename[38] = 0;
+	// Checks if file can be skipped, linked or odx copied from a file we already have. Returns Copy or CopyUsingSmb if content is needed
+	auto getWriteResponse = [&](const WString& fullPath, const FileKey& key, const FileInfo& fileInfo, WriteFileType writeType, Hash& outHash) -> WriteResponse
+	{
+		if (!ensureParentDirectory(fullPath, ioStats))
+			return WriteResponse_BadDestination;
 
-							if (CoCreateGuid((GUID*)&secretGuid) != S_OK)
-							{
-								logErrorf(L"CoCreateGuid - Failed to create secret guid");
-								return -1;
-							}
+		// Check if a file with the same key has already been copied at some point
+		FileDatabase::FileRec localFile = m_database.getRecord(key);
 
-							// Create hidden security file with code
-							FileInfo fileInfo;
-							fileInfo.fileSize = sizeof(secretGuid);
-							WString securityFilePath = serverPath + filename;
-							if (!ensureDirectory(serverPath.c_str(), 0, ioStats))
-							{
-								logErrorf(L"Failed to create directory '%ls' needed to create secret guid file for client. Server does not have access?", serverPath.c_str());
-								return -1;
-							}
-							ScopeGuard deleteFileGuard([&]() { deleteFile(securityFilePath.c_str(), ioStats, false); });
-							if (!createFile(securityFilePath.c_str(), fileInfo, &secretGuid, ioStats, true, true))
-								return -1;
+		WriteResponse writeResponse = (isServerPathExternal && writeType != WriteFileType_Compressed) ? WriteResponse_CopyUsingSmb : WriteResponse_Copy;
 
-							{
-								ScopedCriticalSection _(m_activeSessionsCs);
-								auto insres = m_activeSessions.insert({secretGuid, {}});
-								if (!insres.second)
-								{
-									logErrorf(L"Failed to start new session. Session has already been started by other connection. Something is wrong.");
-									return -1;
-								}
-								activeSession = &insres.first->second;
-								++activeSession->connectionCount;
-							}
+		if (!localFile.name.empty() && fileInfo.fileSize >= info.settings.useLinksThreshold)
+		{
+			// File has already been copied, if the old copied file still has the same attributes as when it was copied we create a link to it
+			FileInfo localFileInfo;
+			uint attributes = getFileInfo(localFileInfo, localFile.name.c_str(), ioStats);
+			if (attributes && equals(fileInfo, localFileInfo))
+			{
+				outHash = localFile.hash;
 
-							if (!sendData(info.socket, &filenameGuid, sizeof(filenameGuid)))
-								return -1;
+				FileInfo destInfo;
 
-							Guid returnedSecretGuid;
-							if (!receiveData(info.socket, &returnedSecretGuid, sizeof(returnedSecretGuid))) // Let client do the copying while we want for a success or not
-								return -1;
+				if (fullPath == localFile.name) // We are copying to the same place we've copied before and the file there is still up-to-date, skip
+				{
+					writeResponse = WriteResponse_Skip;
+				}
+				else
+				// For external shares CreateHardLink might return true even though it is a skip..
+				// So the correct thing would be to check the file first but it is too costly so
+				/*
+				else if (isServerPathExternal && getFileInfo(destInfo, fullPath.c_str()) && equals(fileInfo, destInfo))
+				{
+					writeResponse = WriteResponse_Skip;
+				}
+				else
+				*/
+				{
+					bool skip;
+					if (createFileLink(fullPath.c_str(), fileInfo, localFile.name.c_str(), skip, ioStats))
+					{
+						writeResponse = skip ? WriteResponse_Skip : WriteResponse_Link;
+					}
+					else
+					{
+						logContext.resetLastError(); // We want to handle failing links as non-error and fallback to normal copying
 
-							if (secretGuid != returnedSecretGuid)
+						if (info.settings.useOdx)
+						{
+							// if destination file is read-only then we will clear that flag so the copy can succeed
+							if (attributes & FILE_ATTRIBUTE_READONLY)
 							{
-								logInfoLinef(L"Connection is providing invalid secret guid.. disconnect");
-								return -1;
+								if (!setFileWritable(localFile.name.c_str(), true))
+									logErrorf(L"Could not copy over read-only destination file (%ls).  EACopy could not forcefully unset the destination file's read-only attribute.", localFile.name.c_str());
 							}
+							bool existed = false;
+							u64 bytesCopied;
+							if (copyFile(localFile.name.c_str(), localFileInfo, attributes, fullPath.c_str(), true, false, existed, bytesCopied, copyContext, ioStats, info.settings.useBufferedIO))
+								writeResponse = WriteResponse_Odx;
 						}
 					}
-					else
-					{
-						ScopedCriticalSection _(m_activeSessionsCs);
-						auto insres = m_activeSessions.insert({secretGuid, {}});
-						activeSession = &insres.first->second;
-						++activeSession->connectionCount;
-					}
-
-					isValidEnvironment  = true;
 				}
-				break;
-			case CommandType_Text:
+			}
+		}
+		else
+		{
+			// Check if file already exists at destination and has same attributes, in that case, skip copy
+			// If directory was created by session we don't have to check because we know it doesnt exist (if it is because of someone else writing it is not the end of the world.
+			const wchar_t* lastSlash = wcsrchr(fullPath.c_str(), '\\');
+			WString directory(fullPath.c_str(), lastSlash + 1);
+			bool dirCreatedBySession;
+			activeSession->createdDirsCs.scoped([&]() { dirCreatedBySession = activeSession->createdDirs.find(directory) != activeSession->createdDirs.end(); });
+			if (!dirCreatedBySession)
+			{
+				FileInfo other;
+				uint attributes = getFileInfo(other, fullPath.c_str(), ioStats);
+				if (attributes && equals(fileInfo, other))
 				{
-					auto& cmd = *(const TextCommand*)recvBuffer;
-					logInfoLinef(L"%ls", cmd.string);
+					outHash = localFile.hash;
+					writeResponse = WriteResponse_Skip;
 				}
-				break;
-			case CommandType_WriteFile:
-				{
-					if (!isValidEnvironment)
-					{
-						WriteResponse writeResponse = WriteResponse_BadDestination;
-						if (!sendData(info.socket, &writeResponse, sizeof(writeResponse)))
-							return -1;
-						break;
-					}
+			}
+		}
+		return writeResponse;
+	};
 
-					auto& cmd = *(const WriteFileCommand*)recvBuffer;
-					WString fullPath = serverPath + cmd.path;
+	while (true)
+	{
+		if (recvPos < sizeof(Command))
+			break;
+		auto& header = *(Command*)recvBuffer;
+		if (recvPos < header.commandSize)
+			break;
 
-					//logDebugLinef("%ls", fullPath.c_str());
+		++commands[header.commandType];
+		TimerScope commandTimer(commandTimes[header.commandType]);
+		TraceScope commandTrace(commandNames[header.commandType] + 3); // Skip CMD prefix
+		CommandType commandType = header.commandType;
+		u64 commandStart = getPreciseTime();
+		ScopeGuard commandLatency([&]() { addCommandLatency(serverPath, commandType, getPreciseTime() - commandStart); });
 
-					const wchar_t* fileName = cmd.path;
-					if (!info.settings.useLinksRelativePath)
-						if (const wchar_t* lastSlash = wcsrchr(fileName, '\\'))
-							fileName = lastSlash + 1;
+		// Connection taken out of client connection pool by a new job
+		if (info.isParked)
+		{
+			ScopedCriticalSection _(m_activeSessionsCs);
+			info.isParked = false;
+			--activeSession->parkedCount;
+		}
 
-					Hash hash;
+		switch (header.commandType)
+		{
+		case CommandType_Environment:
+			{
+				auto& cmd = *(const EnvironmentCommand*)recvBuffer;
+				secretGuid = cmd.secretGuid;
 
-					// Robocopy style key for uniqueness of file
-					FileKey key { fileName, cmd.info.lastWriteTime, cmd.info.fileSize };
+				logScopeEnter();
+				logDebugLinef(L"--- Connection %u opened ---", info.socket.index);
+				logDebugLinef(L"  RemoteIp              : %ls", info.remoteIp.c_str());
+				logDebugLinef(L"  ClientVersion         : %ls", getVersionString(cmd.majorVersion, cmd.minorVersion, false).c_str());
+				logDebugLinef(L"  RemoteConnectionIndex : %u", cmd.connectionIndex);
+				logDebugLinef(L"  NetDirectory          : %ls", cmd.netDirectory);
+				logDebugLinef(L"");
+				logScopeLeave();
 
-					// Check if a file with the same key has already been copied at some point
-					FileDatabase::FileRec localFile = m_database.getRecord(key);
+				clientConnectionIndex = cmd.connectionIndex;
 
-					WriteResponse writeResponse = (isServerPathExternal && cmd.writeType != WriteFileType_Compressed) ? WriteResponse_CopyUsingSmb : WriteResponse_Copy;
+				if (!getLocalFromNet(serverPath, isServerPathExternal, cmd.netDirectory))
+					return false;
 
-					if (!localFile.name.empty() && cmd.info.fileSize >= info.settings.useLinksThreshold)
+				if (info.settings.useSecurityFile)
+				{
+					if (cmd.secretGuid != zeroGuid)
 					{
-						// File has already been copied, if the old copied file still has the same attributes as when it was copied we create a link to it
-						FileInfo localFileInfo;
-						uint attributes = getFileInfo(localFileInfo, localFile.name.c_str(), ioStats);
-						if (attributes && equals(cmd.info, localFileInfo))
+						// Connection provided secretGuid, check against table of valid secretGuids
+
+						ScopedCriticalSection _(m_activeSessionsCs);
+						removeExpiredSessionsNoLock();
+						auto findIt = m_activeSessions.find(cmd.secretGuid);
+						if (findIt != m_activeSessions.end())
 						{
-							hash = localFile.hash;
+							activeSession = &(findIt->second);
+							++activeSession->connectionCount;
+						}
+						else
+						{
+							logInfoLinef(L"Connection is providing invalid secret guid.. disconnect");
+							return false;
+						}
+					}
+					else
+					{
+						// No secretGuid provided, let's test the clients access to the network path
+						// by putting a hidden file there with a guid in it, if client can return that guid it means that client has access
 
-							FileInfo destInfo;
+						static_assert(sizeof(GUID) == sizeof(Guid), "GUID and Guid are not matching");
+						GUID filenameGuid;
+						if (CoCreateGuid(&filenameGuid) != S_OK)
+						{
+							logErrorf(L"CoCreateGuid - Failed to create filename guid");
+							return false;
+						}
 
-							if (fullPath == localFile.name) // We are copying to the same place we've copied before and the file there is still up-to-date, skip
-							{
-								writeResponse = WriteResponse_Skip;
-							}
-							else
-							// For external shares CreateHardLink might return true even though it is a skip..
-							// So the correct thing would be to check the file first but it is too costly so
-							/*
-							else if (isServerPathExternal && getFileInfo(destInfo, fullPath.c_str()) && equals(cmd.info, destInfo))
-							{
-								writeResponse = WriteResponse_Skip;
-							}
-							else
-							*/
-							{
-								bool skip;
-								if (createFileLink(fullPath.c_str(), cmd.info, localFile.name.c_str(), skip, ioStats))
-								{
-									writeResponse = skip ? WriteResponse_Skip : WriteResponse_Link;
-								}
-								else
-								{
-									logContext.resetLastError(); // We want to handle failing links as non-error and fallback to normal copying
-
-									if (info.settings.useOdx)
-									{
-										// if destination file is read-only then we will clear that flag so the copy can succeed
-										if (attributes & FILE_ATTRIBUTE_READONLY)
-										{
-											if (!setFileWritable(localFile.name.c_str(), true))
-												logErrorf(L"Could not copy over read-only destination file (%ls).  EACopy could not forcefully unset the destination file's read-only attribute.", localFile.name.c_str());
-										}
-										bool existed = false;
-										u64 bytesCopied;
-										if (copyFile(localFile.name.c_str(), localFileInfo, attributes, fullPath.c_str(), true, false, existed, bytesCopied, copyContext, ioStats, info.settings.useBufferedIO))
-											writeResponse = WriteResponse_Odx;
-									}
-								}
-							}
+						wchar_t filename[128];
+						filename[0] = L'.';
+						StringFromGUID2(filenameGuid, filename + 1, 40);
+						filename[1] = L'f';
+						filename[38] = 0;
+
+						if (CoCreateGuid((GUID*)&secretGuid) != S_OK)
+						{
+							logErrorf(L"CoCreateGuid - Failed to create secret guid");
+							return false;
 						}
-					}
-					else
-					{
-						// Check if file already exists at destination and has same attributes, in that case, skip copy
-						// If directory was created by session we don't have to check because we know it doesnt exist (if it is because of someone else writing it is not the end of the world.
-						const wchar_t* lastSlash = wcsrchr(fullPath.c_str(), '\\');
-						WString directory(fullPath.c_str(), lastSlash + 1);
-						bool dirCreatedBySession;
-						activeSession->createdDirsCs.scoped([&]() { dirCreatedBySession = activeSession->createdDirs.find(directory) != activeSession->createdDirs.end(); });
-						if (!dirCreatedBySession)
+
+						// Create hidden security file with code
+						FileInfo fileInfo;
+						fileInfo.fileSize = sizeof(secretGuid);
+						WString securityFilePath = serverPath + filename;
+						if (!ensureDirectory(serverPath.c_str(), 0, ioStats))
+						{
+							logErrorf(L"Failed to create directory '%ls' needed to create secret guid file for client. Server does not have access?", serverPath.c_str());
+							return false;
+						}
+						ScopeGuard deleteFileGuard([&]() { deleteFile(securityFilePath.c_str(), ioStats, false); });
+						if (!createFile(securityFilePath.c_str(), fileInfo, &secretGuid, ioStats, true, true))
+							return false;
+
 						{
-							FileInfo other;
-							uint attributes = getFileInfo(other, fullPath.c_str(), ioStats);
-							if (attributes && equals(cmd.info, other))
+							ScopedCriticalSection _(m_activeSessionsCs);
+							auto insres = m_activeSessions.insert({secretGuid, {}});
+							if (!insres.second)
 							{
-								hash = localFile.hash;
-								writeResponse = WriteResponse_Skip;
+								logErrorf(L"Failed to start new session. Session has already been started by other connection. Something is wrong.");
+								return false;
 							}
+							activeSession = &insres.first->second;
+							++activeSession->connectionCount;
+						}
+
+						if (!sendData(info.socket, &filenameGuid, sizeof(filenameGuid)))
+							return false;
+
+						Guid returnedSecretGuid;
+						if (!receiveData(info.socket, &returnedSecretGuid, sizeof(returnedSecretGuid))) // Let client do the copying while we want for a success or not
+							return false;
+
+						if (secretGuid != returnedSecretGuid)
+						{
+							logInfoLinef(L"Connection is providing invalid secret guid.. disconnect");
+							return false;
 						}
 					}
+				}
+				else
+				{
+					ScopedCriticalSection _(m_activeSessionsCs);
+					auto insres = m_activeSessions.insert({secretGuid, {}});
+					activeSession = &insres.first->second;
+					++activeSession->connectionCount;
+				}
 
-					// If CopyDelta is enabled we should look for a file that we believe is a very similar file and use that to send delta
-					#if defined(EACOPY_ALLOW_RSYNC)
-					WString fileForCopyDelta;
-					if (writeResponse == WriteResponse_Copy)
-						if (findFileForDeltaCopy(fileForCopyDelta, key))
+				isValidEnvironment  = true;
+			}
+			break;
+		case CommandType_Text:
+			{
+				auto& cmd = *(const TextCommand*)recvBuffer;
+				logInfoLinef(L"%ls", cmd.string);
+			}
+			break;
+		case CommandType_WriteFile:
+			{
+				if (!isValidEnvironment)
+				{
+					WriteResponse writeResponse = WriteResponse_BadDestination;
+					if (!sendData(info.socket, &writeResponse, sizeof(writeResponse)))
+						return false;
+					break;
+				}
+
+				auto& cmd = *(const WriteFileCommand*)recvBuffer;
+				WString fullPath = serverPath + cmd.path;
+
+				// Client only uses dictionaries it got from us and they are never removed
+				CompressionDictionary* dictionary = cmd.dictionaryId ? m_dictionaries.getDictionary(cmd.dictionaryId) : nullptr;
+				if (cmd.dictionaryId && !dictionary)
+				{
+					logErrorf(L"Client is using unknown compression dictionary %u for file %ls", cmd.dictionaryId, fullPath.c_str());
+					return false;
+				}
+
+				//logDebugLinef("%ls", fullPath.c_str());
+
+				Hash hash;
+				FileKey key = getFileKey(cmd.path, cmd.info);
+
+				// File already negotiated in a WriteFiles batch continues from the answer the client got there
+				bool negotiated = cmd.batchResponse == WriteResponse_Copy || cmd.batchResponse == WriteResponse_Hash || cmd.batchResponse == WriteResponse_CopyChunks;
+				WriteResponse writeResponse = negotiated ? WriteResponse_Copy : getWriteResponse(fullPath, key, cmd.info, cmd.writeType, hash);
+
+				// If CopyDelta is enabled we should look for a file that we believe is a very similar file and use that to send delta
+				#if defined(EACOPY_ALLOW_RSYNC)
+				WString fileForCopyDelta;
+				if (writeResponse == WriteResponse_Copy && !negotiated)
+					if (findFileForDeltaCopy(fileForCopyDelta, key))
+					{
+						// TODO: Right now we don't support copy delta to same destination as the file we use for delta
+						if (fileForCopyDelta != fullPath)
 						{
-							// TODO: Right now we don't support copy delta to same destination as the file we use for delta
-							if (fileForCopyDelta != fullPath)
-							{
-								FileInfo fi;
-								if (getFileInfo(fi, fileForCopyDelta.c_str()))
-									writeResponse = WriteResponse_CopyDelta;
-							}
+							FileInfo fi;
+							if (getFileInfo(fi, fileForCopyDelta.c_str()))
+								writeResponse = WriteResponse_CopyDelta;
 						}
-					#endif
+					}
+				#endif
 
-					if (info.settings.useHash && (writeResponse == WriteResponse_Copy || writeResponse == WriteResponse_CopyUsingSmb))
+				if (negotiated ? cmd.batchResponse == WriteResponse_Hash : info.settings.useHash && (writeResponse == WriteResponse_Copy || writeResponse == WriteResponse_CopyUsingSmb))
+				{
+					// Ask for hash of file first, it might still exist on the server but with different time stamp... and if it doesnt we still need the hash
+					WriteResponse hashResponse = WriteResponse_Hash;
+					if (!negotiated && !sendData(info.socket, &hashResponse, sizeof(hashResponse)))
+						return false;
+					if (!receiveBufferedData(info.socket, &hash, sizeof(hash), recvBuffer, recvPos, header.commandSize)) // Client negotiated with WriteFiles does not wait
+						return false;
+					FileDatabase::FileRec localFile = m_database.getRecord(hash);
+
+					if (!localFile.name.empty()) // File exists on server but with different time stamp.
 					{
-						// Ask for hash of file first, it might still exist on the server but with different time stamp... and if it doesnt we still need the hash
-						WriteResponse hashResponse = WriteResponse_Hash;
-						if (!sendData(info.socket, &hashResponse, sizeof(hashResponse)))
-							return -1;
-						if (!receiveData(info.socket, &hash, sizeof(hash)))
-							return -1;
-						localFile = m_database.getRecord(hash);
-
-						if (!localFile.name.empty()) // File exists on server but with different time stamp.
+						// TODO: Maybe check that localFile still has the same timestamp so noone has tampered with it
+						// 
+						// Attempt to create link to other file
+						bool skip;
+						if (cmd.info.fileSize >= info.settings.useLinksThreshold && createFileLink(fullPath.c_str(), cmd.info, localFile.name.c_str(), skip, ioStats))
 						{
-							// TODO: Maybe check that localFile still has the same timestamp so noone has tampered with it
-							// 
-							// Attempt to create link to other file
-							bool skip;
-							if (cmd.info.fileSize >= info.settings.useLinksThreshold && createFileLink(fullPath.c_str(), cmd.info, localFile.name.c_str(), skip, ioStats))
-							{
-								writeResponse = skip ? WriteResponse_Skip : WriteResponse_Link;
-							}
-							else if (info.settings.useOdx)
+							writeResponse = skip ? WriteResponse_Skip : WriteResponse_Link;
+						}
+						else if (info.settings.useOdx)
+						{
+							bool existed = false;
+							u64 bytesCopied;
+							FileInfo localFileInfo;
+							if (uint attributes = getFileInfo(localFileInfo, localFile.name.c_str(), ioStats))
 							{
-								bool existed = false;
-								u64 bytesCopied;
-								FileInfo localFileInfo;
-								if (uint attributes = getFileInfo(localFileInfo, localFile.name.c_str(), ioStats))
+								// if destination file is read-only then we will clear that flag so the copy can succeed
+								if (attributes & FILE_ATTRIBUTE_READONLY)
 								{
-									// if destination file is read-only then we will clear that flag so the copy can succeed
-									if (attributes & FILE_ATTRIBUTE_READONLY)
-									{
-										if (!setFileWritable(localFile.name.c_str(), true))
-											logErrorf(L"Could not copy over read-only destination file (%ls).  EACopy could not forcefully unset the destination file's read-only attribute.", localFile.name.c_str());
-									}
-									if (copyFile(localFile.name.c_str(), localFileInfo, attributes, fullPath.c_str(), true, false, existed, bytesCopied, copyContext, ioStats, info.settings.useBufferedIO))
-										writeResponse = WriteResponse_Odx;
+									if (!setFileWritable(localFile.name.c_str(), true))
+										logErrorf(L"Could not copy over read-only destination file (%ls).  EACopy could not forcefully unset the destination file's read-only attribute.", localFile.name.c_str());
 								}
+								if (copyFile(localFile.name.c_str(), localFileInfo, attributes, fullPath.c_str(), true, false, existed, bytesCopied, copyContext, ioStats, info.settings.useBufferedIO))
+									writeResponse = WriteResponse_Odx;
 							}
 						}
 					}
+				}
 
+				// Large files that were not found anywhere are split in to chunks by client and only chunks missing in chunk store are sent
+				if (writeResponse == WriteResponse_Copy && info.settings.useChunks && cmd.info.fileSize >= ChunkMinFileSize)
+					writeResponse = WriteResponse_CopyChunks;
+
+				// Client that got Copy or CopyChunks in batch is already sending
+				bool sendResponse = !negotiated || cmd.batchResponse == WriteResponse_Hash;
+				if (!sendResponse)
+					writeResponse = cmd.batchResponse;
+
+				if (writeResponse != WriteResponse_BadDestination)
+				{
 					++writeEntries[writeResponse];
 					++writeEntryCount;
+				}
+				ScopeGuard writeLatency([&]() { if (writeResponse != WriteResponse_BadDestination) m_writeResponseHistograms[writeResponse].add(getPreciseTime() - commandStart); });
 
-					// Send response of action
-					if (!sendData(info.socket, &writeResponse, sizeof(writeResponse)))
-						return -1;
+				// Send response of action
+				if (sendResponse && !sendData(info.socket, &writeResponse, sizeof(writeResponse)))
+					return false;
 
-					// Skip, Odx or Link means that we are done, just add to history and move on (history will kick out oldest entry if full)
-					if (writeResponse == WriteResponse_Link || writeResponse == WriteResponse_Odx || writeResponse == WriteResponse_Skip)
-					{
-						u64& bytes = writeResponse == WriteResponse_Odx ? m_bytesCopied : (writeResponse != WriteResponse_Skip ? m_bytesLinked : m_bytesSkipped);
-						InterlockedAdd64((LONG64*)&bytes, cmd.info.fileSize);
-						m_database.addToFilesHistory(key, hash, fullPath);
-						break;
-					}
+				// Skip, Odx or Link means that we are done, just add to history and move on (history will kick out oldest entry if full)
+				if (writeResponse == WriteResponse_Link || writeResponse == WriteResponse_Odx || writeResponse == WriteResponse_Skip)
+				{
+					u64& bytes = writeResponse == WriteResponse_Odx ? m_bytesCopied : (writeResponse != WriteResponse_Skip ? m_bytesLinked : m_bytesSkipped);
+					InterlockedAdd64((LONG64*)&bytes, cmd.info.fileSize);
+					m_database.addToFilesHistory(key, hash, fullPath);
+					break;
+				}
 
-					bool success = false;
-					bool sendSuccess = true;
-					u64 totalReceivedSize = 0;
+				bool success = false;
+				bool sendSuccess = true;
+				bool receiveWholeFile = false;
+				u64 totalReceivedSize = 0;
 
-					if (writeResponse == WriteResponse_CopyDelta)
-					{
-						#if defined(EACOPY_ALLOW_RSYNC)
-						RsyncStats stats;
-						if (!serverHandleRsync(info.socket, fileForCopyDelta.c_str(), fullPath.c_str(), cmd.info.lastWriteTime, stats))
-							return -1;
-						success = true;
-						#endif
-					}
-					else if (writeResponse == WriteResponse_CopyUsingSmb)
+				if (writeResponse == WriteResponse_CopyDelta)
+				{
+					#if defined(EACOPY_ALLOW_RSYNC)
+					RsyncStats stats;
+					if (!serverHandleRsync(info.socket, fileForCopyDelta.c_str(), fullPath.c_str(), cmd.info.lastWriteTime, stats))
+						return false;
+					success = true;
+					#endif
+				}
+				else if (writeResponse == WriteResponse_CopyUsingSmb)
+				{
+					u8 copyResult;
+					if (!receiveData(info.socket, &copyResult, sizeof(copyResult))) // Let client do the copying while we want for a success or not
+						return false;
+					success = copyResult != 0;
+					sendSuccess = false;
+				}
+				else if (writeResponse == WriteResponse_CopyChunks)
+				{
+					// Client sends zero chunks if it could not chunk the file and falls back to sending all of it
+					uint chunkCount;
+					if (!receiveBufferedData(info.socket, &chunkCount, sizeof(chunkCount), recvBuffer, recvPos, header.commandSize))
+						return false;
+					if (chunkCount)
 					{
-						u8 copyResult;
-						if (!receiveData(info.socket, &copyResult, sizeof(copyResult))) // Let client do the copying while we want for a success or not
-							return -1;
-						success = copyResult != 0;
-						sendSuccess = false;
+						RecvFileStats recvStats;
+						if (!receiveChunkedFile(success, info, header.commandSize, fullPath.c_str(), cmd.info, cmd.writeType, chunkCount, copyContext, recvStats))
+							return false;
+						totalReceivedSize = recvStats.recvSize;
 					}
-					else // WriteResponse_Copy
+					else
+						receiveWholeFile = true;
+				}
+				else // WriteResponse_Copy
+					receiveWholeFile = true;
+
+				if (receiveWholeFile)
+				{
+					bool useBufferedIO = getUseBufferedIO(info.settings.useBufferedIO, cmd.info.fileSize);
+					RecvFileStats recvStats;
+					copyContext.dictionary = dictionary;
+					ScopeGuard dictionaryGuard([&]() { copyContext.dictionary = nullptr; });
+					if (!receiveFile(success, info.socket, fullPath.c_str(), cmd.info.fileSize, cmd.info.lastWriteTime, cmd.writeType, useBufferedIO, copyContext, recvBuffer, recvPos, header.commandSize, ioStats, recvStats))
+						return false;
+				}
+
+				if (success)
+				{
+					m_database.addToFilesHistory(key, hash, fullPath); // Add newly written file to local file lookup.. if it existed before, make sure to move it to latest history to prevent it from being thrown out
+					InterlockedAdd64((LONG64*)&m_bytesCopied, cmd.info.fileSize);
+					InterlockedAdd64((LONG64*)&m_bytesReceived, totalReceivedSize);
+				}
+
+				if (sendSuccess)
+				{
+					u8 copyResult = success ? 1 : 0;
+					if (!sendData(info.socket, &copyResult, sizeof(copyResult)))
+						return false;
+				}
+			}
+			break;
+
+		case CommandType_WriteFiles:
+			{
+				auto& cmd = *(const WriteFilesCommand*)recvBuffer;
+				WriteResponse writeResponses[WriteFilesMaxCount];
+				uint fileCount = std::min<uint>(cmd.fileCount, WriteFilesMaxCount);
+
+				const u8* filePos = cmd.files;
+				for (uint i=0; i!=fileCount; ++i)
+				{
+					FileInfo fileInfo;
+					memcpy(&fileInfo, filePos, sizeof(FileInfo));
+					filePos += sizeof(FileInfo);
+					const wchar_t* path = (const wchar_t*)filePos;
+					filePos += (wcslen(path) + 1)*2;
+
+					WriteResponse& writeResponse = writeResponses[i];
+					if (!isValidEnvironment)
 					{
-						bool useBufferedIO = getUseBufferedIO(info.settings.useBufferedIO, cmd.info.fileSize);
-						RecvFileStats recvStats;
-						if (!receiveFile(success, info.socket, fullPath.c_str(), cmd.info.fileSize, cmd.info.lastWriteTime, cmd.writeType, useBufferedIO, copyContext, recvBuffer, recvPos, header.commandSize, ioStats, recvStats))
-							return -1;
+						writeResponse = WriteResponse_BadDestination;
+						continue;
 					}
 
-					if (success)
+					WString fullPath = serverPath + path;
+					Hash hash;
+					FileKey key = getFileKey(path, fileInfo);
+					writeResponse = getWriteResponse(fullPath, key, fileInfo, cmd.writeType, hash);
+
+					// Same first answer as WriteFile would give so client can continue with WriteFile without another round trip
+					if (writeResponse == WriteResponse_Copy)
 					{
-						m_database.addToFilesHistory(key, hash, fullPath); // Add newly written file to local file lookup.. if it existed before, make sure to move it to latest history to prevent it from being thrown out
-						InterlockedAdd64((LONG64*)&m_bytesCopied, cmd.info.fileSize);
-						InterlockedAdd64((LONG64*)&m_bytesReceived, totalReceivedSize);
+						if (info.settings.useHash)
+							writeResponse = WriteResponse_Hash;
+						else if (info.settings.useChunks && fileInfo.fileSize >= ChunkMinFileSize)
+							writeResponse = WriteResponse_CopyChunks;
 					}
 
-					if (sendSuccess)
+					// Skip, Odx or Link means that we are done, just add to history and move on
+					if (writeResponse == WriteResponse_Link || writeResponse == WriteResponse_Odx || writeResponse == WriteResponse_Skip)
 					{
-						u8 copyResult = success ? 1 : 0;
-						if (!sendData(info.socket, &copyResult, sizeof(copyResult)))
-							return -1;
+						++writeEntries[writeResponse];
+						++writeEntryCount;
+						u64& bytes = writeResponse == WriteResponse_Odx ? m_bytesCopied : (writeResponse != WriteResponse_Skip ? m_bytesLinked : m_bytesSkipped);
+						InterlockedAdd64((LONG64*)&bytes, fileInfo.fileSize);
+						m_database.addToFilesHistory(key, hash, fullPath);
 					}
 				}
-				break;
 
-			case CommandType_ReadFile:
+				if (!sendData(info.socket, writeResponses, fileCount*sizeof(WriteResponse)))
+					return false;
+			}
+			break;
+
+		case CommandType_WriteFileRange:
+			{
+				auto& cmd = *(const WriteFileRangeCommand*)recvBuffer;
+				WString fullPath = serverPath + cmd.path;
+
+				// All connections in session writing ranges of this file share the same handle. First range to arrive creates the file
+				ActiveSession::StripedFile* stripedFile = nullptr;
+				bool success = false;
+				if (isValidEnvironment)
 				{
-					if (!isValidEnvironment)
+					ScopedCriticalSection _(activeSession->stripedFilesCs);
+					auto insres = activeSession->stripedFiles.insert({fullPath, {}});
+					stripedFile = &insres.first->second;
+					if (insres.second)
 					{
-						ReadResponse readResponse = ReadResponse_BadSource;
-						if (!sendData(info.socket, &readResponse, sizeof(readResponse)))
-							return -1;
-						break;
+						stripedFile->bytesLeft = cmd.info.fileSize;
+						stripedFile->success = ensureParentDirectory(fullPath, ioStats) && openFileWrite(fullPath.c_str(), stripedFile->handle, ioStats, true);
 					}
+					success = stripedFile->success;
+				}
 
-					bool tooBusy = false;
+				// Data must be received even if write fails to keep the stream in sync
+				FileHandle dummyHandle = InvalidFileHandle;
+				RecvFileStats recvStats;
+				if (!receiveFileData(success, info.socket, fullPath.c_str(), stripedFile ? stripedFile->handle : dummyHandle, cmd.offset, cmd.size, cmd.writeType, copyContext, recvBuffer, recvPos, header.commandSize, ioStats, recvStats))
+					return false;
 
-					{
-						ScopedCriticalSection cs(m_queuesCs);
+				if (stripedFile)
+				{
+					bool isLastRange;
+					activeSession->stripedFilesCs.scoped([&]()
+						{
+							stripedFile->success &= success;
+							stripedFile->bytesLeft -= cmd.size;
+							isLastRange = stripedFile->bytesLeft == 0;
+						});
 
-						uint totalCountBeforeThis = 0;
+					if (isLastRange)
+					{
+						success = stripedFile->success && setFileLastWriteTime(fullPath.c_str(), stripedFile->handle, cmd.info.lastWriteTime, ioStats);
+						success = closeFile(fullPath.c_str(), stripedFile->handle, AccessType_Write, ioStats) && success;
+						activeSession->stripedFilesCs.scoped([&]() { activeSession->stripedFiles.erase(fullPath); });
 
-						// Count all connections with lower connection index
-						for (uint i=0, e=clientConnectionIndex; i!=e; ++i)
-							totalCountBeforeThis += m_queues[i].size();
+						++writeEntries[WriteResponse_Copy];
+						++writeEntryCount;
 
-						// If there is still room after all connections with lower connection index we prioritize oldest connection
-						if (totalCountBeforeThis < info.settings.maxConcurrentDownloadCount)
+						if (success)
 						{
-							Queue& q = m_queues[clientConnectionIndex];
-							uint spotsLeftForQueue = info.settings.maxConcurrentDownloadCount - totalCountBeforeThis;
-							if (spotsLeftForQueue < q.size())
-							{
-								for (auto i : q)
-								{
-									if (!spotsLeftForQueue--)
-									{
-										tooBusy = true;
-										break;
-									}
-									if (i == &info)
-										break;
-								}
-							}
+							m_database.addToFilesHistory(getFileKey(cmd.path, cmd.info), Hash(), fullPath);
+							InterlockedAdd64((LONG64*)&m_bytesCopied, cmd.info.fileSize);
 						}
-						else
-							tooBusy = true;
 					}
+				}
 
-					if (tooBusy)
-					{
-						ReadResponse readResponse = ReadResponse_ServerBusy;
-						++readEntryCount;
-						++readEntries[readResponse];
-						if (!sendData(info.socket, &readResponse, sizeof(readResponse)))
-							return -1;
+				InterlockedAdd64((LONG64*)&m_bytesReceived, recvStats.recvSize);
+
+				u8 copyResult = success ? 1 : 0;
+				if (!sendData(info.socket, &copyResult, sizeof(copyResult)))
+					return false;
+			}
+			break;
+
+		case CommandType_WritePackedFiles:
+			{
+				auto& cmd = *(const WritePackedFilesCommand*)recvBuffer;
+				if (cmd.fileCount > WriteFilesMaxCount)
+				{
+					logErrorf(L"Received %u packed files which is more than max %u", cmd.fileCount, uint(WriteFilesMaxCount));
+					return false;
+				}
+				Vector<u8> results(cmd.fileCount, 0);
+
+				const u8* packed = cmd.data;
+				uint packedSize = header.commandSize - uint((const char*)cmd.data - recvBuffer);
+				bool valid = isValidEnvironment && cmd.packedSize <= WritePackedFilesMaxSize;
+				if (valid && cmd.writeType == WriteFileType_Compressed)
+				{
+					copyContext.dictionary = cmd.dictionaryId ? m_dictionaries.getDictionary(cmd.dictionaryId) : nullptr;
+					ScopeGuard dictionaryGuard([&]() { copyContext.dictionary = nullptr; });
+					valid = (!cmd.dictionaryId || copyContext.dictionary) && decompressData(packedSize, copyContext.buffers[0], WritePackedFilesMaxSize, packed, packedSize, copyContext);
+					packed = copyContext.buffers[0];
+				}
+				valid = valid && packedSize == cmd.packedSize;
+
+				struct PackedFile { FileInfo info; const wchar_t* path; const u8* data; };
+				Vector<PackedFile> files;
+				const u8* packedPos = packed;
+				const u8* packedEnd = packed + packedSize;
+				while (valid && files.size() != cmd.fileCount)
+				{
+					PackedFile file;
+					valid = packedEnd - packedPos >= sizeof(FileInfo);
+					if (!valid)
 						break;
+					memcpy(&file.info, packedPos, sizeof(FileInfo));
+					packedPos += sizeof(FileInfo);
+					file.path = (const wchar_t*)packedPos;
+					uint pathLen = 0;
+					uint maxPathLen = uint(packedEnd - packedPos) / sizeof(wchar_t);
+					while (pathLen != maxPathLen && file.path[pathLen])
+						++pathLen;
+					packedPos += (pathLen + 1)*sizeof(wchar_t);
+					valid = pathLen != maxPathLen && u64(packedEnd - packedPos) >= file.info.fileSize;
+					file.data = packedPos;
+					packedPos += valid ? file.info.fileSize : 0;
+					files.push_back(file);
+				}
+				if (!valid)
+				{
+					if (isValidEnvironment)
+						logErrorf(L"Received invalid packed files");
+					files.clear();
+				}
+
+				// Files are created by multiple threads. Not worth spinning up a thread for less than a handful of files
+				Atomic<uint> nextFileIndex { 0 };
+				auto createFiles = [&](IOStats& threadIoStats)
+				{
+					while (true)
+					{
+						uint fileIndex = nextFileIndex++;
+						if (fileIndex >= files.size())
+							return 0;
+						const PackedFile& file = files[fileIndex];
+						WString fullPath = serverPath + file.path;
+						if (!ensureParentDirectory(fullPath, threadIoStats) || !createFile(fullPath.c_str(), file.info, file.data, threadIoStats, true))
+							continue;
+						results[fileIndex] = 1;
+						m_database.addToFilesHistory(getFileKey(file.path, file.info), Hash(), fullPath);
+						if (info.settings.useDictionaries)
+							m_dictionaries.addSample(file.path, file.data, file.info.fileSize);
+						InterlockedAdd64((LONG64*)&m_bytesCopied, file.info.fileSize);
 					}
+				};
 
+				uint helperCount = uint(std::min<size_t>(std::max<uint>(info.settings.packedFilesThreadCount, 1), files.size() / 4 + 1)) - 1;
+				info.helperThreads.run(helperCount, ioStats, createFiles);
 
-					auto& cmd = *(const ReadFileCommand*)recvBuffer;
-					WString fullPath = serverPath + cmd.path;
+				writeEntries[WriteResponse_Copy] += uint(files.size());
+				writeEntryCount += uint(files.size());
+				InterlockedAdd64((LONG64*)&m_bytesReceived, header.commandSize);
+
+				if (!sendData(info.socket, results.data(), uint(results.size())))
+					return false;
+			}
+			break;
+
+		case CommandType_ReadFile:
+			{
+				if (!isValidEnvironment)
+				{
+					ReadResponse readResponse = ReadResponse_BadSource;
+					if (!sendData(info.socket, &readResponse, sizeof(readResponse)))
+						return false;
+					break;
+				}
+
+				auto& cmd = *(const ReadFileCommand*)recvBuffer;
+				WString fullPath = serverPath + cmd.path;
+
+				FileInfo fi;
+				uint attributes = getFileInfo(fi, fullPath.c_str(), ioStats);
+				if (!attributes || attributes & FILE_ATTRIBUTE_DIRECTORY)
+				{
+					ReadResponse readResponse = ReadResponse_BadSource;
+					if (!sendData(info.socket, &readResponse, sizeof(readResponse)))
+						return false;
+					break;
+				}
 
-					FileInfo fi;
-					uint attributes = getFileInfo(fi, fullPath.c_str(), ioStats);
-					if (!attributes || attributes & FILE_ATTRIBUTE_DIRECTORY)
+				// Wait for turn unless client already has the file. Client retries busy downloads later. Connections served by
+				// completion port run this on a handoff thread so waiting doesn't block other connections
+				bool isDownload = !equals(fi, cmd.info);
+				WString downloadKey;
+				if (isDownload)
+				{
+					downloadKey = getDownloadClientKey();
+					TraceScope queueTrace(L"DownloadQueue");
+					if (!m_downloads.acquire(downloadKey, fi.fileSize, DownloadQueueTimeoutMs))
 					{
-						ReadResponse readResponse = ReadResponse_BadSource;
+						ReadResponse readResponse = ReadResponse_ServerBusy;
+						++readEntryCount;
+						++readEntries[readResponse];
 						if (!sendData(info.socket, &readResponse, sizeof(readResponse)))
-							return -1;
+							return false;
 						break;
 					}
-
-					const wchar_t* fileName = cmd.path;
-					if (!info.settings.useLinksRelativePath)
-						if (const wchar_t* lastSlash = wcsrchr(fileName, '\\'))
-							fileName = lastSlash + 1;
-
-					ReadResponse readResponse = (isServerPathExternal && cmd.compressionLevel == 0) ? ReadResponse_CopyUsingSmb : ReadResponse_Copy;
-					// Check if the version that the client has exist and in that case send as delta
-					#if defined(EACOPY_ALLOW_DELTA_COPY)
-					FileDatabase::FileRec referenceFile;
-					if (cmd.compressionLevel != 0 && info.settings.useDeltaCompression)
+				}
+				u64 sendSizeBefore = sendStats.sendSize;
+				ScopeGuard downloadGuard([&]() { if (isDownload) m_downloads.release(downloadKey, sendStats.sendSize - sendSizeBefore); });
+
+				const wchar_t* fileName = cmd.path;
+				if (!info.settings.useLinksRelativePath)
+					if (const wchar_t* lastSlash = wcsrchr(fileName, '\\'))
+						fileName = lastSlash + 1;
+
+				ReadResponse readResponse = (isServerPathExternal && cmd.compressionLevel == 0) ? ReadResponse_CopyUsingSmb : ReadResponse_Copy;
+				// Check if the version that the client has exist and in that case send as delta
+				#if defined(EACOPY_ALLOW_DELTA_COPY)
+				FileDatabase::FileRec referenceFile;
+				if (cmd.compressionLevel != 0 && info.settings.useDeltaCompression)
+				{
+					FileKey key{ fileName, cmd.info.lastWriteTime, cmd.info.fileSize };
+					referenceFile = m_database.getRecord(key);
+					if (!referenceFile.name.empty())
 					{
-						FileKey key{ fileName, cmd.info.lastWriteTime, cmd.info.fileSize };
-						referenceFile = m_database.getRecord(key);
-						if (!referenceFile.name.empty())
-						{
-							readResponse = ReadResponse_CopyDelta;
-						}
+						readResponse = ReadResponse_CopyDelta;
 					}
-					#endif
+				}
+				#endif
 
-					if (equals(fi, cmd.info))
+				if (equals(fi, cmd.info))
+				{
+					readResponse = ReadResponse_Skip;
+				}
+				else if (info.settings.useHash && fi.fileSize == cmd.info.fileSize)  // Check if client's file content actually matches server's.. might only differ in last write time if size is the same
+				{
+					FileKey serverKey{ fileName, fi.lastWriteTime, fi.fileSize };
+					Hash serverHash = m_database.getRecord(serverKey).hash;
+					if (!isValid(serverHash))
 					{
-						readResponse = ReadResponse_Skip;
+						// If setting already tell us to use hash and the file entry is missing from database, calculate the hash and add this to database
+						CopyContext	copyContext;
+						IOStats ioStats;
+						u64 hashtime;
+						u64 hashcount;
+						HashContext hashContext(hashtime, hashcount, info.settings.hashAlgorithm);
+						getFileHash(serverHash, fullPath.c_str(), copyContext, ioStats, hashContext, hashtime);
 					}
-					else if (info.settings.useHash && fi.fileSize == cmd.info.fileSize)  // Check if client's file content actually matches server's.. might only differ in last write time if size is the same
+					if (isValid(serverHash))
 					{
-						FileKey serverKey{ fileName, fi.lastWriteTime, fi.fileSize };
-						Hash serverHash = m_database.getRecord(serverKey).hash;
-						if (!isValid(serverHash))
+						FileKey clientKey{ fileName, cmd.info.lastWriteTime, cmd.info.fileSize };
+						Hash hash = m_database.getRecord(clientKey).hash;
+						if (!isValid(hash))
 						{
-							// If setting already tell us to use hash and the file entry is missing from database, calculate the hash and add this to database
-							CopyContext	copyContext;
-							IOStats ioStats;
-							u64 hashtime;
-							u64 hashcount;
-							HashContext hashContext(hashtime, hashcount);
-							getFileHash(serverHash, fullPath.c_str(), copyContext, ioStats, hashContext, hashtime);
+							ReadResponse hashResponse = ReadResponse_Hash;
+							if (!sendData(info.socket, &hashResponse, sizeof(hashResponse)))
+								return false;
+							if (!receiveData(info.socket, &hash, sizeof(hash)))
+								return false;
 						}
-						if (isValid(serverHash))
+						if (isValid(hash) && hash == serverHash) // They are actually the same file.. just different time
 						{
-							FileKey clientKey{ fileName, cmd.info.lastWriteTime, cmd.info.fileSize };
-							Hash hash = m_database.getRecord(clientKey).hash;
-							if (!isValid(hash))
-							{
-								ReadResponse hashResponse = ReadResponse_Hash;
-								if (!sendData(info.socket, &hashResponse, sizeof(hashResponse)))
-									return -1;
-								if (!receiveData(info.socket, &hash, sizeof(hash)))
-									return -1;
-							}
-							if (isValid(hash) && hash == serverHash) // They are actually the same file.. just different time
-							{
-								readResponse = ReadResponse_Skip;
-							}
+							readResponse = ReadResponse_Skip;
 						}
 					}
+				}
 
-					if (!sendData(info.socket, &readResponse, sizeof(readResponse)))
-						return -1;
-					++readEntryCount;
-					++readEntries[readResponse];
+				if (!sendData(info.socket, &readResponse, sizeof(readResponse)))
+					return false;
+				++readEntryCount;
+				++readEntries[readResponse];
 
-					if (readResponse == ReadResponse_Skip)
-						break;
+				if (readResponse == ReadResponse_Skip)
+					break;
 
-					if (!sendData(info.socket, &fi.lastWriteTime, sizeof(fi.lastWriteTime)))
-						return -1;
+				if (!sendData(info.socket, &fi.lastWriteTime, sizeof(fi.lastWriteTime)))
+					return false;
 
-					if (readResponse == ReadResponse_Copy)
-					{
-						if (!sendData(info.socket, &fi.fileSize, sizeof(fi.fileSize)))
-							return -1;
+				if (readResponse == ReadResponse_Copy)
+				{
+					if (!sendData(info.socket, &fi.fileSize, sizeof(fi.fileSize)))
+						return false;
 
-						WriteFileType writeType = WriteFileType_Send;
+					WriteFileType writeType = WriteFileType_Send;
 
-						if (cmd.compressionLevel != 0)
+					if (cmd.compressionLevel != 0)
+					{
+						writeType = WriteFileType_Compressed;
+						if (cmd.compressionLevel != 255)
 						{
-							writeType = WriteFileType_Compressed;
-							if (cmd.compressionLevel != 255)
-							{
-								compressionStats.currentLevel = cmd.compressionLevel;
-								compressionStats.fixedLevel = true;
-							}
-							else
-								compressionStats.fixedLevel = false;
+							compressionStats.currentLevel = cmd.compressionLevel;
+							compressionStats.fixedLevel = true;
 						}
+						else
+							compressionStats.fixedLevel = false;
+					}
 
-						bool useBufferedIO = getUseBufferedIO(info.settings.useBufferedIO, fi.fileSize);
-						if (!sendFile(info.socket, fullPath.c_str(), fi.fileSize, writeType, copyContext, compressionStats, useBufferedIO, ioStats, sendStats))
-							return -1;
+					// Clients asking for the same file with the same compression share one read and compression. First one
+					// records the stream, the others wait for it and send the recording. ReadFile never uses dictionaries
+					SharedSendCache::Entry* sharedSend = nullptr;
+					bool isProducer = false;
+					if (writeType == WriteFileType_Compressed && fi.fileSize <= SendRecordMaxSize && info.settings.sendCacheMaxSize)
+						sharedSend = m_sharedSends.acquire({ FileKey{ fullPath, fi.lastWriteTime, fi.fileSize }, cmd.compressionLevel, 0 }, isProducer, ioStats);
+					ScopeGuard sharedSendGuard([&]() { if (sharedSend) m_sharedSends.release(sharedSend, ioStats); });
+
+					bool sharedSendReady = false;
+					if (sharedSend && !isProducer)
+					{
+						TraceScope waitTrace(L"SharedSendWait");
+						sharedSendReady = m_sharedSends.wait(sharedSend, SharedSendWaitMs);
 					}
-					else if (readResponse == ReadResponse_CopyUsingSmb)
+					if (sharedSendReady)
 					{
-						// NOP, client got this
+						u64 startSendTime = getTime();
+						if (!sharedSend->data.empty())
+							if (!sendData(info.socket, sharedSend->data.data(), uint(sharedSend->data.size())))
+								return false;
+						sendStats.sendTime += getTime() - startSendTime;
+						sendStats.sendSize += sharedSend->data.size();
 					}
-					else // ReadResponse_CopyDelta
+					else
 					{
-						#if defined(EACOPY_ALLOW_DELTA_COPY)
-						if (!sendData(info.socket, &fi.fileSize, sizeof(fi.fileSize)))
-							return -1;
-						if (!sendDelta(info.socket, referenceFile.name.c_str(), cmd.info.fileSize, fullPath.c_str(), fi.fileSize, copyContext, ioStats))
-							return -1;
-						#else
-						return -1;
-						#endif
+						bool useBufferedIO = getUseBufferedIO(info.settings.useBufferedIO, fi.fileSize);
+						copyContext.sendRecord = isProducer ? &sharedSend->data : nullptr;
+						ScopeGuard sendRecordGuard([&]() { copyContext.sendRecord = nullptr; });
+						bool sent = sendFile(info.socket, fullPath.c_str(), fi.fileSize, writeType, copyContext, compressionStats, useBufferedIO, ioStats, sendStats);
+						if (isProducer)
+							m_sharedSends.produced(sharedSend, sent, ioStats);
+						if (!sent)
+							return false;
 					}
 				}
-				break;
-			
-			case CommandType_CreateDir:
+				else if (readResponse == ReadResponse_CopyUsingSmb)
 				{
-					u8 createDirResponse = CreateDirResponse_Error;
+					// NOP, client got this
+				}
+				else // ReadResponse_CopyDelta
+				{
+					#if defined(EACOPY_ALLOW_DELTA_COPY)
+					if (!sendData(info.socket, &fi.fileSize, sizeof(fi.fileSize)))
+						return false;
+					if (!sendDelta(info.socket, referenceFile.name.c_str(), cmd.info.fileSize, fullPath.c_str(), fi.fileSize, copyContext, ioStats))
+						return false;
+					#else
+					return false;
+					#endif
+				}
+			}
+			break;
+		
+		case CommandType_CreateDir:
+			{
+				u8 createDirResponse = CreateDirResponse_Error;
 
-					if (isValidEnvironment)
+				if (isValidEnvironment)
+				{
+					auto& cmd = *(const CreateDirCommand*)recvBuffer;
+					WString fullPath = serverPath + cmd.path;
+					FilesSet createdDirs;
+					if (ensureDirectory(fullPath.c_str(), 0, ioStats, false, true, &createdDirs))
 					{
-						auto& cmd = *(const CreateDirCommand*)recvBuffer;
-						WString fullPath = serverPath + cmd.path;
-						FilesSet createdDirs;
-						if (ensureDirectory(fullPath.c_str(), 0, ioStats, false, true, &createdDirs))
-						{
-							createDirResponse = CreateDirResponse_SuccessExisted + (u8)min(createdDirs.size(), 200); // is not the end of the world if 201 was created but 200 was reported
-							activeSession->createdDirsCs.scoped([&]() { activeSession->createdDirs.insert(createdDirs.begin(), createdDirs.end()); });
-						}
+						createDirResponse = CreateDirResponse_SuccessExisted + (u8)min(createdDirs.size(), 200); // is not the end of the world if 201 was created but 200 was reported
+						activeSession->createdDirsCs.scoped([&]()
+							{
+								activeSession->knownDirs.insert(fullPath);
+								activeSession->createdDirs.insert(createdDirs.begin(), createdDirs.end());
+							});
 					}
-					else
-						createDirResponse = CreateDirResponse_BadDestination;
-
-
-					if (!sendData(info.socket, &createDirResponse, sizeof(createDirResponse)))
-						return -1;
 				}
-				break;
+				else
+					createDirResponse = CreateDirResponse_BadDestination;
 
-			case CommandType_DeleteFiles:
-				{
-					DeleteFilesResponse deleteFilesResponse = DeleteFilesResponse_Success;
 
-					if (isValidEnvironment)
-					{
-						auto& cmd = *(const CreateDirCommand*)recvBuffer;
-						WString fullPath = serverPath + cmd.path;
-						if (!deleteAllFiles(fullPath.c_str(), ioStats, false)) // No error on missing files
-							deleteFilesResponse = DeleteFilesResponse_Error;
-					}
-					else
-						deleteFilesResponse = DeleteFilesResponse_BadDestination;
+				if (!sendData(info.socket, &createDirResponse, sizeof(createDirResponse)))
+					return false;
+			}
+			break;
 
-					if (!sendData(info.socket, &deleteFilesResponse, sizeof(deleteFilesResponse)))
-						return -1;
-				}
-				break;
+		case CommandType_CreateDirs:
+			{
+				auto& cmd = *(const CreateDirsCommand*)recvBuffer;
+				u8 createDirResponse = isValidEnvironment ? CreateDirResponse_SuccessExisted : CreateDirResponse_BadDestination;
 
-			case CommandType_FindFiles:
+				const wchar_t* pathPos = cmd.paths;
+				const wchar_t* pathEnd = (const wchar_t*)(recvBuffer + header.commandSize);
+				for (uint i=0; i!=cmd.dirCount && createDirResponse == CreateDirResponse_SuccessExisted; ++i)
 				{
-					auto& cmd = *(const FindFilesCommand*)recvBuffer;
-					FindFileData fd;
-					WString searchStr = serverPath + cmd.pathAndWildcard;
-
-					WString tempBuffer;
-					FindFileHandle findHandle = findFirstFile(searchStr.c_str(), fd, ioStats);
-					if(findHandle == InvalidFileHandle)
+					const wchar_t* path = pathPos;
+					while (pathPos != pathEnd && *pathPos)
+						++pathPos;
+					if (pathPos == pathEnd)
 					{
-						uint blockSize = ~0u;
-						if (!sendData(info.socket, &blockSize, sizeof(blockSize)))
-							return -1;
-						break;
+						logErrorf(L"Received invalid CreateDirs command");
+						return false;
 					}
-					ScopeGuard _([&]() { findClose(findHandle, ioStats); });
+					++pathPos;
+					if (!ensureSessionDirectory(serverPath + path, ioStats))
+						createDirResponse = CreateDirResponse_Error;
+				}
 
-					u8* bufferPos = copyContext.buffers[0];
+				if (!sendData(info.socket, &createDirResponse, sizeof(createDirResponse)))
+					return false;
 
-					auto writeBlock = [&]()
-					{
-						uint blockSize = bufferPos - copyContext.buffers[0];
-						if (!sendData(info.socket, &blockSize, sizeof(blockSize)))
-							return false;
-						bufferPos = copyContext.buffers[0];
-						if (!sendData(info.socket, bufferPos, blockSize))
-							return false;
-						return true;
-					};
+				if (!cmd.returnCreatedDirs)
+					break;
 
-					do
-					{ 
-						FileInfo fileInfo;
-						uint attributes = getFileInfo(fileInfo, fd);
+				// Directories created by all connections in session. Client uses them to know what it doesn't need to purge
+				Vector<wchar_t> createdDirs;
+				if (isValidEnvironment)
+					activeSession->createdDirsCs.scoped([&]()
+						{
+							for (auto& dir : activeSession->createdDirs)
+								if (dir.size() > serverPath.size() && startsWithIgnoreCase(dir.c_str(), serverPath.c_str()))
+									createdDirs.insert(createdDirs.end(), dir.c_str() + serverPath.size(), dir.c_str() + dir.size() + 1);
+						});
+				uint createdDirsSize = uint(createdDirs.size()*sizeof(wchar_t));
+				if (!sendData(info.socket, &createdDirsSize, sizeof(createdDirsSize)))
+					return false;
+				if (createdDirsSize && !sendData(info.socket, createdDirs.data(), createdDirsSize))
+					return false;
+			}
+			break;
 
-						const wchar_t* fileName = getFileName(fd);
-						if ((attributes & FILE_ATTRIBUTE_DIRECTORY) && isDotOrDotDot(fileName))
-							continue;
+		case CommandType_DeleteFiles:
+			{
+				DeleteFilesResponse deleteFilesResponse = DeleteFilesResponse_Success;
 
-						uint fileNameBytes = (wcslen(fileName)+1)*2;
+				if (isValidEnvironment)
+				{
+					auto& cmd = *(const CreateDirCommand*)recvBuffer;
+					WString fullPath = serverPath + cmd.path;
+					if (!deleteAllFiles(fullPath.c_str(), ioStats, false)) // No error on missing files
+						deleteFilesResponse = DeleteFilesResponse_Error;
+				}
+				else
+					deleteFilesResponse = DeleteFilesResponse_BadDestination;
 
-						if (fileNameBytes + 20 >= CopyContextBufferSize)
-							if (!writeBlock())
-								return -1;
+				if (!sendData(info.socket, &deleteFilesResponse, sizeof(deleteFilesResponse)))
+					return false;
+			}
+			break;
 
-						*(uint*)bufferPos = attributes;
-						bufferPos += sizeof(uint);
-						*(FileTime*)bufferPos = fileInfo.lastWriteTime;
-						bufferPos += sizeof(u64);
-						*(u64*)bufferPos = fileInfo.fileSize;
-						bufferPos += sizeof(u64);
+		case CommandType_DeletePaths:
+			{
+				auto& cmd = *(const DeletePathsCommand*)recvBuffer;
+				DeleteFilesResponse deleteFilesResponse = isValidEnvironment ? DeleteFilesResponse_Success : DeleteFilesResponse_BadDestination;
 
-						memcpy(bufferPos, fileName, fileNameBytes);
-						bufferPos += fileNameBytes;
+				const u8* pathPos = cmd.paths;
+				const u8* pathEnd = (const u8*)recvBuffer + header.commandSize;
+				for (uint i=0; i!=cmd.pathCount && deleteFilesResponse == DeleteFilesResponse_Success; ++i)
+				{
+					if (pathEnd - pathPos < int(sizeof(uint) + sizeof(wchar_t)))
+					{
+						logErrorf(L"Received invalid DeletePaths command");
+						return false;
 					}
-					while(findNextFile(findHandle, fd, ioStats)); 
-
-					uint error = GetLastError();
-					if (error != ERROR_NO_MORE_FILES)
+					uint attributes = *(const uint*)pathPos;
+					const wchar_t* path = (const wchar_t*)(pathPos + sizeof(uint));
+					const wchar_t* pathIt = path;
+					while ((const u8*)pathIt < pathEnd && *pathIt)
+						++pathIt;
+					if ((const u8*)pathIt >= pathEnd)
 					{
-						logErrorf(L"FindNextFile failed for %ls: %ls", searchStr.c_str(), getErrorText(error).c_str());
-						return -1;
+						logErrorf(L"Received invalid DeletePaths command");
+						return false;
 					}
+					pathPos = (const u8*)(pathIt + 1);
+					WString fullPath = serverPath + path;
+					if (!deletePath(fullPath.c_str(), attributes, ioStats, false)) // No error on missing files
+						deleteFilesResponse = DeleteFilesResponse_Error;
+				}
 
-					if (!writeBlock()) // Flush block
-						return -1;
+				if (!sendData(info.socket, &deleteFilesResponse, sizeof(deleteFilesResponse)))
+					return false;
+			}
+			break;
 
-					if (!writeBlock()) // Write empty block to tell client we're done
-						return -1;
+		case CommandType_FindFiles:
+			{
+				auto& cmd = *(const FindFilesCommand*)recvBuffer;
+				FindFileData fd;
+				WString searchStr = serverPath + cmd.pathAndWildcard;
+
+				WString tempBuffer;
+				FindFileHandle findHandle = findFirstFile(searchStr.c_str(), fd, ioStats);
+				if(findHandle == InvalidFileHandle)
+				{
+					uint blockSize = ~0u;
+					if (!sendData(info.socket, &blockSize, sizeof(blockSize)))
+						return false;
+					break;
 				}
-				break;
+				ScopeGuard _([&]() { findClose(findHandle, ioStats); });
+
+				u8* bufferPos = copyContext.buffers[0];
 
-			case CommandType_GetFileInfo:
+				auto writeBlock = [&]()
 				{
-					auto& cmd = *(const GetFileInfoCommand*)recvBuffer;
-					WIN32_FIND_DATAW fd; 
-					WString fullPath = serverPath + cmd.path;
-					__declspec(align(8)) u8 sendBuffer[3*8+2*4];
-					static_assert(sizeof(sendBuffer) == sizeof(FileInfo) + sizeof(uint) + sizeof(uint), "");
-					uint attributes = getFileInfo(*(FileInfo*)sendBuffer, fullPath.c_str(), ioStats);
-					*(uint*)(sendBuffer + sizeof(FileInfo)) = attributes;
-					uint error = 0;
-					if (!attributes)
-						error = GetLastError();
-					*(uint*)(sendBuffer + sizeof(FileInfo) + sizeof(uint)) = error;
-
-					sendData(info.socket, sendBuffer, sizeof(sendBuffer));
+					uint blockSize = bufferPos - copyContext.buffers[0];
+					if (!sendData(info.socket, &blockSize, sizeof(blockSize)))
+						return false;
+					bufferPos = copyContext.buffers[0];
+					if (!sendData(info.socket, bufferPos, blockSize))
+						return false;
+					return true;
+				};
+
+				do
+				{ 
+					FileInfo fileInfo;
+					uint attributes = getFileInfo(fileInfo, fd);
+
+					const wchar_t* fileName = getFileName(fd);
+					if ((attributes & FILE_ATTRIBUTE_DIRECTORY) && isDotOrDotDot(fileName))
+						continue;
+
+					uint fileNameBytes = (wcslen(fileName)+1)*2;
+
+					if (fileNameBytes + 20 >= CopyContextBufferSize)
+						if (!writeBlock())
+							return false;
+
+					*(uint*)bufferPos = attributes;
+					bufferPos += sizeof(uint);
+					*(FileTime*)bufferPos = fileInfo.lastWriteTime;
+					bufferPos += sizeof(u64);
+					*(u64*)bufferPos = fileInfo.fileSize;
+					bufferPos += sizeof(u64);
+
+					memcpy(bufferPos, fileName, fileNameBytes);
+					bufferPos += fileNameBytes;
 				}
-				break;
+				while(findNextFile(findHandle, fd, ioStats)); 
+
+				uint error = GetLastError();
+				if (error != ERROR_NO_MORE_FILES)
+				{
+					logErrorf(L"FindNextFile failed for %ls: %ls", searchStr.c_str(), getErrorText(error).c_str());
+					return false;
+				}
+
+				if (!writeBlock()) // Flush block
+					return false;
+
+				if (!writeBlock()) // Write empty block to tell client we're done
+					return false;
+			}
+			break;
 
-			case CommandType_RequestReport:
+		case CommandType_FindFilesRecursive:
+			{
+				auto& cmd = *(const FindFilesRecursiveCommand*)recvBuffer;
+				WString searchDir = serverPath;
+				const wchar_t* wildcard = cmd.pathAndWildcard;
+				if (const wchar_t* lastSlash = wcsrchr(wildcard, L'\\'))
 				{
-					u64 upTime = getTime() - m_startTime;
-					uint historySize = m_database.getHistorySize();
-					
-					PROCESS_MEMORY_COUNTERS memCounters;
-					memCounters.cb = sizeof(memCounters);
-					GetProcessMemoryInfo(GetCurrentProcess(), &memCounters, sizeof(memCounters));
-
-					u64 freeVolumeSpace = 0;
-					ULARGE_INTEGER freeBytesAvailable;
-					if (GetDiskFreeSpaceExW(serverPath.c_str(), nullptr, nullptr, &freeBytesAvailable))
-						freeVolumeSpace = freeBytesAvailable.QuadPart;
-
-					uint activeConnectionCount = m_activeConnectionCount - 1; // Skip the connection that is asking for this info
-
-					// Reuse the thread buffer for report
-					auto buffer = (wchar_t*)copyContext.buffers[0];
-					auto bufferSize = CopyContextBufferSize;
-					auto elementCount = bufferSize/2;
-
-					StringCbPrintfW(buffer, CopyContextBufferSize,
-						L"   Server v%ls  (c) Electronic Arts.  All Rights Reserved.\n"
-						L"\n"
-						L"   Protocol: v%u\n"
-						L"   Running as: %ls\n"
-						L"   Uptime: %ls\n"
-						L"   Connections active: %u (handled: %u)\n"
-						L"   Local file history size: %u\n"
-						L"   Memory working set: %ls (Peak: %ls)\n"
-						L"   Free space on volume: %ls\n"
-						L"\n"
-						L"   %ls copied (%ls received)\n"
-						L"   %ls linked\n"
-						L"   %ls skipped\n"
-						, getServerVersionString().c_str(), m_protocolVersion, m_isConsole ? L"Console" : L"Service"
-						, toHourMinSec(upTime).c_str()
-						, activeConnectionCount, m_handledConnectionCount, historySize, toPretty(memCounters.WorkingSetSize).c_str(), toPretty(memCounters.PeakWorkingSetSize).c_str()
-						, toPretty(freeVolumeSpace).c_str(), toPretty(m_bytesCopied).c_str(), toPretty(m_bytesReceived).c_str(), toPretty(m_bytesLinked).c_str(), toPretty(m_bytesSkipped).c_str());
-
-					bool isFirst = true;
-					info.log.traverseRecentErrors([&](const WString& error)
+					searchDir.append(wildcard, lastSlash + 1);
+					wildcard = lastSlash + 1;
+				}
+
+				if (!findFilesRecursive(info, searchDir, wildcard, cmd.depthLeft, ioStats))
+					return false;
+			}
+			break;
+
+		case CommandType_GetFileInfo:
+			{
+				auto& cmd = *(const GetFileInfoCommand*)recvBuffer;
+				WIN32_FIND_DATAW fd; 
+				WString fullPath = serverPath + cmd.path;
+				__declspec(align(8)) u8 sendBuffer[3*8+2*4];
+				static_assert(sizeof(sendBuffer) == sizeof(FileInfo) + sizeof(uint) + sizeof(uint), "");
+				uint attributes = getFileInfo(*(FileInfo*)sendBuffer, fullPath.c_str(), ioStats);
+				*(uint*)(sendBuffer + sizeof(FileInfo)) = attributes;
+				uint error = 0;
+				if (!attributes)
+					error = GetLastError();
+				*(uint*)(sendBuffer + sizeof(FileInfo) + sizeof(uint)) = error;
+
+				sendData(info.socket, sendBuffer, sizeof(sendBuffer));
+			}
+			break;
+
+		case CommandType_GetDictionaries:
+			{
+				Vector<DictionaryInfo> infos;
+				m_dictionaries.getDictionaryInfos(infos);
+				uint count = uint(infos.size());
+				if (!sendData(info.socket, &count, sizeof(count)))
+					return false;
+				if (count && !sendData(info.socket, infos.data(), uint(count*sizeof(DictionaryInfo))))
+					return false;
+			}
+			break;
+
+		case CommandType_GetDictionary:
+			{
+				auto& cmd = *(const GetDictionaryCommand*)recvBuffer;
+				CompressionDictionary* dictionary = m_dictionaries.getDictionary(cmd.id);
+				uint size = dictionary ? uint(dictionary->data.size()) : 0;
+				if (!sendData(info.socket, &size, sizeof(size)))
+					return false;
+				if (size && !sendData(info.socket, dictionary->data.data(), size))
+					return false;
+			}
+			break;
+
+		case CommandType_RequestReport:
+			{
+				u64 upTime = getTime() - m_startTime;
+				uint historySize = m_database.getHistorySize();
+				
+				PROCESS_MEMORY_COUNTERS memCounters;
+				memCounters.cb = sizeof(memCounters);
+				GetProcessMemoryInfo(GetCurrentProcess(), &memCounters, sizeof(memCounters));
+
+				u64 freeVolumeSpace = 0;
+				ULARGE_INTEGER freeBytesAvailable;
+				if (GetDiskFreeSpaceExW(serverPath.c_str(), nullptr, nullptr, &freeBytesAvailable))
+					freeVolumeSpace = freeBytesAvailable.QuadPart;
+
+				uint activeConnectionCount = m_activeConnectionCount - 1; // Skip the connection that is asking for this info
+
+				// Reuse the thread buffer for report
+				auto buffer = (wchar_t*)copyContext.buffers[0];
+				auto bufferSize = CopyContextBufferSize;
+				auto elementCount = bufferSize/2;
+
+				StringCbPrintfW(buffer, CopyContextBufferSize,
+					L"   Server v%ls  (c) Electronic Arts.  All Rights Reserved.\n"
+					L"\n"
+					L"   Protocol: v%u\n"
+					L"   Running as: %ls\n"
+					L"   Uptime: %ls\n"
+					L"   Connections active: %u (handled: %u)\n"
+					L"   Local file history size: %u\n"
+					L"   Memory working set: %ls (Peak: %ls)\n"
+					L"   Free space on volume: %ls\n"
+					L"\n"
+					L"   %ls copied (%ls received)\n"
+					L"   %ls linked\n"
+					L"   %ls skipped\n"
+					, getServerVersionString().c_str(), m_protocolVersion, m_isConsole ? L"Console" : L"Service"
+					, toHourMinSec(upTime).c_str()
+					, activeConnectionCount, m_handledConnectionCount, historySize, toPretty(memCounters.WorkingSetSize).c_str(), toPretty(memCounters.PeakWorkingSetSize).c_str()
+					, toPretty(freeVolumeSpace).c_str(), toPretty(m_bytesCopied).c_str(), toPretty(m_bytesReceived).c_str(), toPretty(m_bytesLinked).c_str(), toPretty(m_bytesSkipped).c_str());
+
+				bool isFirst = true;
+				info.log.traverseRecentErrors([&](const WString& error)
+					{
+						if (isFirst)
 						{
-							if (isFirst)
-							{
-								wcscat_s(buffer, elementCount, L"\n   Recent errors:\n");
-								isFirst = false;
-							}
-							wcscat_s(buffer, elementCount, L"      ");
-							wcscat_s(buffer, elementCount, error.c_str());
-							wcscat_s(buffer, elementCount, L"\n");
-							return true;
-						});
+							wcscat_s(buffer, elementCount, L"\n   Recent errors:\n");
+							isFirst = false;
+						}
+						wcscat_s(buffer, elementCount, L"      ");
+						wcscat_s(buffer, elementCount, error.c_str());
+						wcscat_s(buffer, elementCount, L"\n");
+						return true;
+					});
+
+				if (m_database.isPriming())
+				{
+					auto& primeStats = m_database.m_primeStats;
+					wchar_t primeBuffer[256];
+					StringCbPrintfW(primeBuffer, sizeof(primeBuffer), L"\n   Priming: %llu directories (%llu unchanged), %llu files, %llu/%llu hashed (%ls)\n"
+						, primeStats.dirCount.load(), primeStats.unchangedDirCount.load(), primeStats.fileCount.load(), primeStats.hashedCount.load(), primeStats.hashQueuedCount.load(), toPretty(primeStats.hashedBytes).c_str());
+					wcscat_s(buffer, elementCount, primeBuffer);
+				}
 
-					uint bufferLen = (uint)wcslen(buffer);
-					if (!sendData(info.socket, &bufferLen, sizeof(bufferLen)))
-						return -1;
-					if (!sendData(info.socket, buffer, bufferLen*2))
-						return -1;
+				// Download scheduling and send cache since server start
+				{
+					DownloadScheduler::Stats downloadStats = m_downloads.getStats();
+					SharedSendCache::Stats sendCacheStats = m_sharedSends.getStats();
+					u64 sendCacheRequests = sendCacheStats.hitCount + sendCacheStats.spillHitCount + sendCacheStats.missCount;
+					double sendCacheHitRate = sendCacheRequests ? double(sendCacheStats.hitCount + sendCacheStats.spillHitCount)*100/sendCacheRequests : 0;
+					wchar_t downloadBuffer[512];
+					StringCbPrintfW(downloadBuffer, sizeof(downloadBuffer),
+						L"\n   Downloads: %u active, %u waiting (limit %u, %ls/s), %llu queued, %llu busy\n"
+						L"   Send cache: %u streams (%ls), %u spilled (%ls), hit rate %.1f%% (%llu memory, %llu spill, %llu miss)\n"
+						, downloadStats.activeCount, downloadStats.waitingCount, downloadStats.admitLimit, toPretty(downloadStats.bytesPerSecond).c_str(), downloadStats.queuedCount, downloadStats.timedOutCount
+						, sendCacheStats.entryCount, toPretty(sendCacheStats.size).c_str(), sendCacheStats.spillCount, toPretty(sendCacheStats.spillSize).c_str()
+						, sendCacheHitRate, sendCacheStats.hitCount, sendCacheStats.spillHitCount, sendCacheStats.missCount);
+					wcscat_s(buffer, elementCount, downloadBuffer);
+				}
+
+				// Latency percentiles since server start
+				{
+					wchar_t line[256];
+					bool hasHeader = false;
+					auto addLatency = [&](const wchar_t* section, const wchar_t* name, const LatencyHistogram& histogram)
+					{
+						wchar_t nameBuffer[64];
+						StringCbPrintfW(nameBuffer, sizeof(nameBuffer), L"%ls%ls", section, name);
+						if (!formatLatency(line, eacopy_sizeof_array(line), nameBuffer, histogram))
+							return;
+						if (!hasHeader)
+						{
+							wcscat_s(buffer, elementCount, L"\n   Latency                      count   p50 (ms)   p90 (ms)   p99 (ms)   max (ms)\n");
+							hasHeader = true;
+						}
+						wcscat_s(buffer, elementCount, L"      ");
+						wcscat_s(buffer, elementCount, line);
+						wcscat_s(buffer, elementCount, L"\n");
+					};
+					for (uint i = 0; i != CommandType_Bad; ++i)
+						addLatency(L"", commandNames[i], m_commandHistograms[i]);
+					static const wchar_t* writeResponseNames[] = { L"Copy", L"CopyDelta", L"CopySmb", L"Link", L"Odx", L"Skip", L"Hash", L"Chunks" };
+					for (uint i = 0; i != WriteResponseCount; ++i)
+						addLatency(L"Write", writeResponseNames[i], m_writeResponseHistograms[i]);
+					for (uint i = 0; i != IOOp_Count; ++i)
+						addLatency(L"IO", getIOOpName(IOOp(i)), m_ioHistograms.ops[i]);
+					for (uint i = 0; i != uint(eacopy_sizeof_array(m_volumeHistograms)); ++i)
+					{
+						wchar_t volume[] = { wchar_t('A' + i), ':', 0 };
+						addLatency(L"Volume", volume, m_volumeHistograms[i]);
+					}
+				}
+
+				uint bufferLen = (uint)wcslen(buffer);
+				if (!sendData(info.socket, &bufferLen, sizeof(bufferLen)))
+					return false;
+				if (!sendData(info.socket, buffer, bufferLen*2))
+					return false;
+			}
+			break;
+		case CommandType_Done:
+			{
+				// Connection stays if client keeps it in its connection pool. Next client using it gets its own level sum
+				auto& cmd = *(const DoneCommand*)recvBuffer;
+				isDone = header.commandSize < sizeof(DoneCommand) || !cmd.keepOpen;
+				if (!isDone && activeSession)
+				{
+					// When all connections of session are parked the job is done. Next job taking session from pool must not
+					// trust directories created or seen by this one, they might have been deleted or have other files now
+					ScopedCriticalSection _(m_activeSessionsCs);
+					info.isParked = true;
+					if (++activeSession->parkedCount == activeSession->connectionCount)
+					{
+						activeSession->createdDirsCs.scoped([&]()
+							{
+								activeSession->createdDirs.clear();
+								activeSession->knownDirs.clear();
+							});
+					}
 				}
-				break;
-			case CommandType_Done:
-				isDone = true;
 				sendData(info.socket, &sendStats.compressionLevelSum, sizeof(sendStats.compressionLevelSum));
-				break;
+				sendStats.compressionLevelSum = 0;
 			}
+			break;
+		}
 
-			recvPos -= header.commandSize;
-			if (recvPos == 0)
-				break;
 
-			char* oldRecv = recvBuffer;
-			char* newRecv = oldRecv == recvBuffer1 ? recvBuffer2 : recvBuffer1;
-			memcpy(newRecv, oldRecv + header.commandSize, recvPos);
-			recvBuffer = newRecv;
+		recvPos -= header.commandSize;
+		if (recvPos == 0)
+			break;
+
+		char* oldRecv = recvBuffer;
+		char* newRecv = oldRecv == info.recvBuffer1 ? info.recvBuffer2 : info.recvBuffer1;
+		memcpy(newRecv, oldRecv + header.commandSize, recvPos);
+		recvBuffer = newRecv;
+	}
+	return true;
+}
+
+uint
+Server::connectionThread(ConnectionInfo& info)
+{
+	LogContext logContext(info.log);
+	traceThreadName(L"Connection");
+	ScopeGuard endGuard([&]() { connectionEnd(info); });
+
+	if (!connectionBegin(info))
+		return -1;
+
+	NetworkCopyContext copyContext;
+
+	// Receive until the peer shuts down the connection
+	while (!info.isDone && m_loopServer)
+	{
+		int res = recv(info.socket.socket, info.recvBuffer + info.recvPos, ConnectionInfo::RecvBufferSize - info.recvPos, 0);
+		if (res == 0)
+		{
+			logDebugLinef(L"Connection %u closing...", info.socket.index);
+			break;
+		}
+		if (res < 0)
+		{
+			int error = getLastNetworkError();
+			if (error == WSAECONNRESET) // An existing connection was forcibly closed by the remote host.
+				logInfoLinef(L"An existing connection was forcibly closed by the remote host");
+			else
+				logErrorf(L"recv failed with error: %ls", getErrorText(error).c_str());
+			return -1;
 		}
+
+		//logDebugLinef("Bytes received: %d", res);
+
+		info.recvPos += res;
+
+		if (!processCommands(info, copyContext))
+			return -1;
 	}
 
 	// shutdown the connection since we're done
@@ -1152,6 +2075,359 @@ Server::connectionThread(ConnectionInfo& info)
 	return 0;
 }
 
+bool
+Server::postReceive(ConnectionInfo& info)
+{
+	// Only one receive is ever in flight per connection. Commands that need more data (file content etc) either wait for it to
+	// arrive in the buffer or receive it blocking on a handoff thread, see getCompletionAction
+	memset(&info.overlapped, 0, sizeof(info.overlapped));
+	WSABUF buf;
+	buf.buf = info.recvBuffer + info.recvPos;
+	buf.len = ConnectionInfo::RecvBufferSize - info.recvPos;
+	DWORD flags = 0;
+	ScopedCriticalSection cs(info.ioCs);
+	if (WSARecv(info.socket.socket, &buf, 1, nullptr, &flags, &info.overlapped, nullptr) != SOCKET_ERROR)
+		return true;
+	int error = getLastNetworkError();
+	if (error == WSA_IO_PENDING)
+		return true;
+	logErrorf(L"WSARecv failed with error: %ls", getErrorText(error).c_str());
+	return false;
+}
+
+uint
+Server::completionPortThread(Log& log, HANDLE completionPort)
+{
+	LogContext logContext(log);
+	traceThreadName(L"CompletionPort");
+
+	// Copy context is owned by the worker instead of the connection. This is what makes it possible to serve many more connections than threads
+	NetworkCopyContext copyContext;
+
+	while (true)
+	{
+		DWORD bytes = 0;
+		ULONG_PTR key = 0;
+		OVERLAPPED* overlapped = nullptr;
+		BOOL success = GetQueuedCompletionStatus(completionPort, &bytes, &key, &overlapped, INFINITE);
+		if (!key) // Posted by start() when server is shutting down
+			return 0;
+
+		ConnectionInfo& info = *(ConnectionInfo*)key;
+
+		if (!success)
+		{
+			uint error = GetLastError();
+			if (error == ERROR_NETNAME_DELETED || error == ERROR_CONNECTION_ABORTED) // An existing connection was forcibly closed by the remote host.
+				logInfoLinef(L"An existing connection was forcibly closed by the remote host");
+			else if (error != ERROR_OPERATION_ABORTED) // Cancelled by start() when server is shutting down
+				logErrorf(L"recv failed with error: %ls", getErrorText(error).c_str());
+			connectionEnd(info);
+		}
+		else if (bytes == 0)
+		{
+			logDebugLinef(L"Connection %u closing...", info.socket.index);
+			if (shutdown(info.socket.socket, SD_BOTH) == SOCKET_ERROR)
+				logErrorf(L"shutdown failed with error: %ls", getErrorText(getLastNetworkError()).c_str());
+			connectionEnd(info);
+		}
+		else
+		{
+			info.recvPos += bytes;
+			switch (getCompletionAction(info))
+			{
+			case CompletionAction_Process:
+				completionPortProcess(info, copyContext);
+				break;
+			case CompletionAction_Receive:
+				if (!postReceive(info))
+					connectionEnd(info);
+				break;
+			case CompletionAction_Handoff:
+				handoffConnection(info);
+				break;
+			}
+		}
+	}
+}
+
+void
+Server::completionPortProcess(ConnectionInfo& info, NetworkCopyContext& copyContext)
+{
+	if (processCommands(info, copyContext))
+	{
+		if (!info.isDone && m_loopServer && postReceive(info))
+			return;
+
+		// shutdown the connection since we're done
+		if (shutdown(info.socket.socket, SD_BOTH) == SOCKET_ERROR)
+			logErrorf(L"shutdown failed with error: %ls", getErrorText(getLastNetworkError()).c_str());
+	}
+	connectionEnd(info);
+}
+
+Server::CompletionAction
+Server::getCompletionAction(ConnectionInfo& info)
+{
+	// Commands that receive or send more than fits in socket buffers, wait for the client or wait for other connections are handed
+	// off. File content the client sends without waiting for an answer (files negotiated with WriteFiles) is received in to the
+	// buffer by the completion port first when it fits, the write is then done by the worker like the disk io of other commands
+	for (uint pos = 0; pos + sizeof(Command) <= info.recvPos;)
+	{
+		auto& header = *(const Command*)(info.recvBuffer + pos);
+		if (header.commandSize < sizeof(Command) || pos + header.commandSize > info.recvPos)
+			return CompletionAction_Process;
+		switch (header.commandType)
+		{
+		case CommandType_WriteFile:
+			{
+				auto& cmd = (const WriteFileCommand&)header;
+				if (cmd.batchResponse != WriteResponse_Copy)
+					return CompletionAction_Handoff;
+				uint dataPos = pos + header.commandSize;
+				uint dataSize = 0;
+				switch (getBufferedFileData(dataSize, info.recvBuffer + dataPos, info.recvPos - dataPos, ConnectionInfo::RecvBufferSize - dataPos, cmd.info.fileSize, cmd.writeType))
+				{
+				case BufferedFileData_Complete:
+					pos = dataPos + dataSize;
+					continue;
+				case BufferedFileData_Partial: // Commands before it are processed once the rest has arrived
+					return pos == 0 ? CompletionAction_Receive : CompletionAction_Handoff;
+				default:
+					return CompletionAction_Handoff;
+				}
+			}
+		case CommandType_Environment: // Waits for client to read secret guid file
+		case CommandType_WriteFileRange:
+		case CommandType_ReadFile:
+		case CommandType_FindFiles:
+		case CommandType_FindFilesRecursive:
+		case CommandType_GetDictionary:
+			return CompletionAction_Handoff;
+		}
+		pos += header.commandSize;
+	}
+	return CompletionAction_Process;
+}
+
+void
+Server::handoffConnection(ConnectionInfo& info)
+{
+	List<Thread> retired; // Joined outside the lock
+	ScopedCriticalSection cs(m_handoffCs);
+	retired.swap(m_handoffRetired);
+	m_handoffQueue.push_back(&info);
+	if (m_handoffQueue.size() > m_handoffIdleCount && m_handoffThreads.size() < m_handoffMaxCount)
+	{
+		++m_handoffIdleCount;
+		Log& log = info.log;
+		m_handoffThreads.emplace_back();
+		auto self = std::prev(m_handoffThreads.end());
+		self->start([this, &log, self]() { return handoffThread(log, self); });
+	}
+	m_handoffAvailable.set();
+}
+
+uint
+Server::handoffThread(Log& log, List<Thread>::iterator self)
+{
+	LogContext logContext(log);
+	traceThreadName(L"Handoff");
+
+	NetworkCopyContext copyContext;
+
+	while (true)
+	{
+		bool timedOut = !m_handoffAvailable.isSet(HandoffIdleTimeoutMs);
+
+		ConnectionInfo* info = nullptr;
+		bool stop = false;
+		bool retire = false;
+		m_handoffCs.scoped([&]()
+			{
+				stop = m_handoffStop;
+				if (!m_handoffQueue.empty())
+				{
+					info = m_handoffQueue.front();
+					m_handoffQueue.pop_front();
+					--m_handoffIdleCount;
+				}
+				else if (timedOut && !stop)
+				{
+					// Thread object is moved to retired list and joined by someone else
+					retire = true;
+					--m_handoffIdleCount;
+					m_handoffRetired.splice(m_handoffRetired.end(), m_handoffThreads, self);
+				}
+				if (!m_handoffQueue.empty() || stop) // Event is auto reset, pass it on
+					m_handoffAvailable.set();
+			});
+
+		if (!info)
+		{
+			if (stop || retire)
+				return 0;
+			continue;
+		}
+
+		// Connection goes back to completion port with the receive posted here
+		completionPortProcess(*info, copyContext);
+
+		m_handoffCs.scoped([&]() { ++m_handoffIdleCount; });
+	}
+}
+
+bool
+Server::findFilesRecursive(ConnectionInfo& info, const WString& rootDir, const wchar_t* wildcard, int depthLeft, IOStats& ioStats)
+{
+	enum { BlockSize = 256*1024 };
+
+	// Directories are traversed by multiple threads. Each directory is flushed in its own block(s) before its sub directories
+	// are queued, this way client always sees a directory before the entries inside it
+	struct FindDir { WString relDir; int depthLeft; };
+	List<FindDir> findDirs;
+	CriticalSection findDirsCs;
+	Event findDirsAvailable(false);
+	uint activeCount = 0;
+	Atomic<bool> failed { false };
+	bool sendFailed = false;
+	CriticalSection sendCs;
+
+	auto sendBlock = [&](const u8* data, uint size) -> bool
+	{
+		ScopedCriticalSection cs(sendCs);
+		if (failed || sendFailed)
+			return false;
+		if (sendData(info.socket, &size, sizeof(size)) && sendData(info.socket, data, size))
+			return true;
+		sendFailed = true;
+		return false;
+	};
+
+	auto findDir = [&](const FindDir& dir, u8* buffer, IOStats& threadIoStats) -> bool
+	{
+		WString searchStr = rootDir + dir.relDir + L"*";
+		FindFileData fd;
+		FindFileHandle findHandle = findFirstFile(searchStr.c_str(), fd, threadIoStats);
+		if (findHandle == InvalidFileHandle)
+		{
+			logErrorf(L"FindFirstFile %ls failed: %ls", searchStr.c_str(), getLastErrorText().c_str());
+			return false;
+		}
+		ScopeGuard _([&]() { findClose(findHandle, threadIoStats); });
+
+		List<FindDir> subDirs;
+		uint relDirBytes = uint(dir.relDir.size()*2);
+		u8* bufferPos = buffer;
+
+		do
+		{ 
+			FileInfo fileInfo;
+			uint attributes = getFileInfo(fileInfo, fd);
+			const wchar_t* fileName = getFileName(fd);
+
+			if (attributes & FILE_ATTRIBUTE_DIRECTORY)
+			{
+				if (isDotOrDotDot(fileName) || !dir.depthLeft)
+					continue;
+				subDirs.push_back({ dir.relDir + fileName + L'\\', dir.depthLeft - 1 });
+			}
+			else if (!PathMatchSpecW(fileName, wildcard))
+				continue;
+
+			uint fileNameBytes = uint(wcslen(fileName)+1)*2;
+			if (bufferPos - buffer + 20 + relDirBytes + fileNameBytes > BlockSize)
+			{
+				if (!sendBlock(buffer, uint(bufferPos - buffer)))
+					return false;
+				bufferPos = buffer;
+			}
+
+			*(uint*)bufferPos = attributes;
+			bufferPos += sizeof(uint);
+			*(FileTime*)bufferPos = fileInfo.lastWriteTime;
+			bufferPos += sizeof(u64);
+			*(u64*)bufferPos = fileInfo.fileSize;
+			bufferPos += sizeof(u64);
+			memcpy(bufferPos, dir.relDir.c_str(), relDirBytes);
+			bufferPos += relDirBytes;
+			memcpy(bufferPos, fileName, fileNameBytes);
+			bufferPos += fileNameBytes;
+		}
+		while(findNextFile(findHandle, fd, threadIoStats)); 
+
+		uint error = GetLastError();
+		if (error != ERROR_NO_MORE_FILES)
+		{
+			logErrorf(L"FindNextFile failed for %ls: %ls", searchStr.c_str(), getErrorText(error).c_str());
+			return false;
+		}
+
+		if (bufferPos != buffer)
+			if (!sendBlock(buffer, uint(bufferPos - buffer)))
+				return false;
+
+		if (subDirs.empty())
+			return true;
+		findDirsCs.scoped([&]() { findDirs.splice(findDirs.end(), subDirs); });
+		findDirsAvailable.set();
+		return true;
+	};
+
+	auto processDirs = [&](IOStats& threadIoStats)
+	{
+		Vector<u8> buffer(BlockSize);
+		while (true)
+		{
+			FindDir dir;
+			bool found = false;
+			bool done = false;
+			findDirsCs.scoped([&]()
+				{
+					if (failed || findDirs.empty())
+					{
+						done = failed || activeCount == 0;
+						return;
+					}
+					dir = std::move(findDirs.front());
+					findDirs.pop_front();
+					++activeCount;
+					found = true;
+				});
+
+			if (done)
+				break;
+
+			if (!found)
+			{
+				findDirsAvailable.isSet(10);
+				continue;
+			}
+
+			if (!findDir(dir, buffer.data(), threadIoStats))
+				failed = true;
+
+			findDirsCs.scoped([&]() { --activeCount; });
+		}
+
+		// Pass on wake up so other threads can see that traversal is done
+		findDirsAvailable.set();
+		return 0;
+	};
+
+	findDirs.push_back({ WString(), depthLeft });
+
+	// No need for extra threads if there are no sub directories to traverse
+	uint helperCount = depthLeft ? std::max<uint>(info.settings.findFilesThreadCount, 1) - 1 : 0;
+	info.helperThreads.run(helperCount, ioStats, processDirs);
+
+	if (sendFailed)
+		return false;
+
+	uint blockSize = failed ? ~0u : 0; // Tell client we're done
+	return sendData(info.socket, &blockSize, sizeof(blockSize));
+}
+
 bool
 Server::getLocalFromNet(WString& outServerDirectory, bool& outIsExternalDirectory, const wchar_t* netDirectory)
 {
@@ -1189,6 +2465,139 @@ Server::getLocalFromNet(WString& outServerDirectory, bool& outIsExternalDirector
 	return true;
 }
 
+bool
+Server::receiveChunkedFile(bool& outSuccess, ConnectionInfo& info, uint& commandSize, const wchar_t* fullPath, const FileInfo& fileInfo, WriteFileType writeType, uint chunkCount, NetworkCopyContext& copyContext, RecvFileStats& recvStats)
+{
+	IOStats& ioStats = info.ioStats;
+	outSuccess = false;
+
+	// Anything not adding up means the stream is out of sync and connection must be closed
+	if (chunkCount > fileInfo.fileSize / ChunkMinSize + 1)
+	{
+		logErrorf(L"Client sent %u chunks for %ls which is more than possible", chunkCount, fullPath);
+		return false;
+	}
+	Vector<ChunkInfo> chunks(chunkCount);
+	if (!receiveBufferedData(info.socket, chunks.data(), uint(chunkCount*sizeof(ChunkInfo)), info.recvBuffer, info.recvPos, commandSize))
+		return false;
+	u64 chunksSize = 0;
+	for (auto& chunk : chunks)
+	{
+		if (chunk.size == 0 || chunk.size > ChunkMaxSize)
+		{
+			logErrorf(L"Client sent chunk with invalid size %u for %ls", chunk.size, fullPath);
+			return false;
+		}
+		chunksSize += chunk.size;
+	}
+	if (chunksSize != fileInfo.fileSize)
+	{
+		logErrorf(L"Chunks sent for %ls does not add up to file size", fullPath);
+		return false;
+	}
+
+	// Look up chunks we already have. Files in chunk store might have been changed by someone else so they are validated once
+	Vector<ChunkStore::Location> locations(chunkCount);
+	Vector<u8> needChunks(chunkCount, 1);
+	Map<WString, bool> validFiles;
+	for (uint i=0; i!=chunkCount; ++i)
+	{
+		ChunkStore::Location& location = locations[i];
+		if (!m_chunkStore.findChunk(location, chunks[i]))
+			continue;
+		auto insres = validFiles.insert({location.fileName, false});
+		if (insres.second)
+		{
+			FileInfo localInfo;
+			bool valid = getFileInfo(localInfo, location.fileName.c_str(), ioStats) && localInfo.fileSize == location.fileInfo.fileSize && memcmp(&localInfo.lastWriteTime, &location.fileInfo.lastWriteTime, sizeof(FileTime)) == 0;
+			if (!valid)
+				m_chunkStore.removeFile(location.fileName);
+			insres.first->second = valid;
+		}
+		needChunks[i] = insres.first->second ? 0 : 1;
+	}
+
+	if (!sendData(info.socket, needChunks.data(), chunkCount))
+		return false;
+
+	// Write to a hidden temp file since destination itself might be one of the files we read chunks from
+	WString tempFileName;
+	const wchar_t* lastSlash = wcsrchr(fullPath, L'\\');
+	if (lastSlash)
+	{
+		tempFileName.append(fullPath, lastSlash + 1);
+		tempFileName += L'.';
+		tempFileName += lastSlash + 1;
+	}
+	else
+	{
+		tempFileName += L'.';
+		tempFileName += fullPath;
+	}
+
+	FileHandle tempFile = InvalidFileHandle;
+	bool success = openFileWrite(tempFileName.c_str(), tempFile, ioStats, true, nullptr, true); // Create file hidden, and unhide it once we've moved it in place
+	ScopeGuard delTemp([&]() { deleteFile(tempFileName.c_str(), ioStats, false); });
+	ScopeGuard closeTemp([&]() { closeFile(tempFileName.c_str(), tempFile, AccessType_Write, ioStats); });
+
+	WString sourceFileName;
+	FileHandle sourceFile = InvalidFileHandle;
+	ScopeGuard closeSource([&]() { closeFile(sourceFileName.c_str(), sourceFile, AccessType_Read, ioStats); });
+
+	// Chunks are gathered in buffers[0] and written in large writes. Missing chunks must be received even if something
+	// fails locally to keep the stream in sync
+	u8* writeBuffer = copyContext.buffers[0];
+	uint writePos = 0;
+	auto flush = [&]()
+	{
+		success = success && eacopy::writeFile(tempFileName.c_str(), tempFile, writeBuffer, writePos, ioStats);
+		writePos = 0;
+	};
+
+	for (uint i=0; i!=chunkCount; ++i)
+	{
+		if (writePos + ChunkMaxSize > CopyContextBufferSize)
+			flush();
+
+		u8* dest = writeBuffer + writePos;
+		uint size = chunks[i].size;
+		writePos += size;
+
+		if (needChunks[i])
+		{
+			if (!receiveChunk(info.socket, dest, size, writeType, copyContext, recvStats))
+				return false;
+			continue;
+		}
+
+		if (!success)
+			continue;
+
+		const ChunkStore::Location& location = locations[i];
+		if (sourceFileName != location.fileName)
+		{
+			closeFile(sourceFileName.c_str(), sourceFile, AccessType_Read, ioStats);
+			sourceFileName = location.fileName;
+			success = openFileRead(sourceFileName.c_str(), sourceFile, ioStats, true);
+		}
+		u64 read = 0;
+		success = success && setFilePosition(sourceFileName.c_str(), sourceFile, location.offset, ioStats) && readFile(sourceFileName.c_str(), sourceFile, dest, size, read, ioStats) && read == size;
+	}
+	flush();
+	closeSource.execute();
+
+	success = success && setFileLastWriteTime(tempFileName.c_str(), tempFile, fileInfo.lastWriteTime, ioStats);
+	closeTemp.execute();
+	success = success && moveFile(tempFileName.c_str(), fullPath, ioStats) && setFileHidden(fullPath, false);
+	if (!success)
+		return true;
+
+	delTemp.cancel();
+	m_chunkStore.addFile(fullPath, fileInfo, chunks);
+	outSuccess = true;
+	return true;
+}
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 } // namespace eacopy
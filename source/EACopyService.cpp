@@ -46,19 +46,31 @@ void printHelp()
 	logInfoLinef(L"              /P:n :: Port that server will listen on (defaults to %i).", DefaultPort);
 	logInfoLinef(L"             /IP:n :: Local ip that server will listen on (defaults to first found).");
 	logInfoLinef(L"             /HASH :: Will use hash of files to try to reduce copying.");
+	logInfoLinef(L"        /HASH:algo :: Same as /HASH but with algorithm md5 or xxh3 (defaults to %ls).", getHashAlgorithmName(DefaultHashAlgorithm));
 	logInfoLinef(L"         /UNSECURE :: Will not check if client has access to network path using smb.");
 	logInfoLinef(L"        /HISTORY:n :: Max number of files tracked in history (defaults to %i).", DefaultHistorySize);
 	logInfoLinef(L"          /NOLINKS :: Disables hard links.");
 	logInfoLinef(L"    /LINKMIN:bytes :: Disable links for files smaller than bytes size.");
 	logInfoLinef(L"       /LINKBYNAME :: Will link based on name only and skip relative path.");
 	logInfoLinef(L"    /LINK [dir]... :: Will prepopulate file database with files that can be linked to");
+	logInfoLinef(L"     /LINKDB:file :: Keep file database in file between runs (journaled while running).");
+	logInfoLinef(L"   /PRIMETHREADS:n :: Number of threads scanning /LINK directories in background (defaults to 4).");
+	logInfoLinef(L"  /PRIMEHASH[:mbs] :: Hash files found in /LINK directories, optionally throttled to mbs megabytes per second.");
+	logInfoLinef(L"      /CHUNKS[:n] :: Transfer big files as chunks and only receive chunks not found on server.");
+	logInfoLinef(L"             /DICT :: Train compression dictionaries per file extension from small files received.");
 	logInfoLinef(L"          /OFFLOAD :: Let server do local copying as fallback when link fails.");
+	logInfoLinef(L"         /IOCP[:n] :: Serve connections from n completion port workers (defaults to two per core).");
+	logInfoLinef(L"        /HANDOFF:n :: Max threads running blocking commands for completion port workers (defaults to four per core).");
+	logInfoLinef(L"    /METRICS:port :: Serve latency histograms and counters in prometheus text format over http on port.");
+	logInfoLinef(L"    /SENDCACHE:mb :: Memory used to cache compressed files sent to clients (defaults to %u). 0 disables.", uint(SharedSendCacheMaxSize/(1024*1024)));
+	logInfoLinef(L"/SENDCACHEDIR:dir :: Spill send cache to dir when memory is full (up to 4gb).");
 	logInfoLinef();
 	logInfoLinef(L"                /J :: Enable unbuffered I/O for all files.");
 	logInfoLinef(L"               /NJ :: Disable unbuffered I/O for all files.");
 	logInfoLinef();
 	logInfoLinef(L"         /LOG:file :: output status to LOG file (overwrite existing log).");
 	logInfoLinef(L"          /VERBOSE :: output debug logging.");
+	logInfoLinef(L"       /TRACE:file :: Write timeline of commands, io and waits to file in chrome trace format when server stops.");
 	logInfoLinef();
 	logInfoLinef(L"          /INSTALL :: Install and start as auto starting windows service.");
 	logInfoLinef(L"                      Will start with parameters provided with /INSTALL call");
@@ -94,6 +106,19 @@ bool readSettings(ServerSettings& outSettings, WString& outLogFileName, uint arg
 		{
 			outSettings.useHash = true;
 		}
+		else if (startsWithIgnoreCase(arg, L"/HASH:"))
+		{
+			outSettings.useHash = true;
+			if (equalsIgnoreCase(arg + 6, L"md5"))
+				outSettings.hashAlgorithm = HashAlgorithm_Md5;
+			else if (equalsIgnoreCase(arg + 6, L"xxh3"))
+				outSettings.hashAlgorithm = HashAlgorithm_Xxh3;
+			else
+			{
+				logErrorf(L"Unknown hash algorithm %ls", arg + 6);
+				return false;
+			}
+		}
 		else if (equalsIgnoreCase(arg, L"/UNSECURE"))
 		{
 			outSettings.useSecurityFile = false;
@@ -110,6 +135,10 @@ bool readSettings(ServerSettings& outSettings, WString& outLogFileName, uint arg
 		{
 			outSettings.useLinksThreshold = _wtoi(arg + 10);
 		}
+		else if (startsWithIgnoreCase(arg, L"/LINKDB:"))
+		{
+			outSettings.linkDatabaseFile = arg + 8;
+		}
 		else if (startsWithIgnoreCase(arg, L"/LINK"))
 		{
 			activeCommand = L"LINK";
@@ -118,10 +147,52 @@ bool readSettings(ServerSettings& outSettings, WString& outLogFileName, uint arg
 		{
 			outSettings.useLinksRelativePath = false;
 		}
+		else if (startsWithIgnoreCase(arg, L"/PRIMETHREADS:"))
+		{
+			outSettings.primeThreadCount = _wtoi(arg + 14);
+		}
+		else if (equalsIgnoreCase(arg, L"/PRIMEHASH") || startsWithIgnoreCase(arg, L"/PRIMEHASH:"))
+		{
+			outSettings.primeUseHash = true;
+			if (arg[10] == ':')
+				outSettings.primeHashBytesPerSecond = u64(_wtoi(arg + 11))*1024*1024;
+		}
+		else if (equalsIgnoreCase(arg, L"/CHUNKS") || startsWithIgnoreCase(arg, L"/CHUNKS:"))
+		{
+			outSettings.useChunks = true;
+			if (arg[7] == ':')
+				outSettings.maxChunkCount = _wtoi(arg + 8);
+		}
+		else if (equalsIgnoreCase(arg, L"/DICT"))
+		{
+			outSettings.useDictionaries = true;
+		}
 		else if (equalsIgnoreCase(arg, L"/OFFLOAD"))
 		{
 			outSettings.useOdx = true;
 		}
+		else if (equalsIgnoreCase(arg, L"/IOCP") || startsWithIgnoreCase(arg, L"/IOCP:"))
+		{
+			outSettings.useCompletionPort = true;
+			if (arg[5] == ':')
+				outSettings.completionPortThreadCount = _wtoi(arg + 6);
+		}
+		else if (startsWithIgnoreCase(arg, L"/HANDOFF:"))
+		{
+			outSettings.handoffThreadCount = _wtoi(arg + 9);
+		}
+		else if (startsWithIgnoreCase(arg, L"/METRICS:"))
+		{
+			outSettings.metricsPort = _wtoi(arg + 9);
+		}
+		else if (startsWithIgnoreCase(arg, L"/SENDCACHE:"))
+		{
+			outSettings.sendCacheMaxSize = u64(_wtoi(arg + 11))*1024*1024;
+		}
+		else if (startsWithIgnoreCase(arg, L"/SENDCACHEDIR:"))
+		{
+			outSettings.sendCacheDirectory = arg + 14;
+		}
 		else if (equalsIgnoreCase(arg, L"/J"))
 		{
 			outSettings.useBufferedIO = UseBufferedIO_Enabled;
@@ -134,6 +205,10 @@ bool readSettings(ServerSettings& outSettings, WString& outLogFileName, uint arg
 		{
 			outLogFileName = arg + 5;
 		}
+		else if(startsWithIgnoreCase(arg, L"/TRACE:"))
+		{
+			outSettings.traceFileName = arg + 7;
+		}
 		else if(startsWithIgnoreCase(arg, L"/USER:"))
 		{
 			outSettings.user = arg + 6;
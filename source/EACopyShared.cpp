@@ -1,9 +1,14 @@
 // (c) Electronic Arts. All Rights Reserved.
 
 #include "EACopyShared.h"
+#include <algorithm>
 #include <utility>
+#include <wctype.h>
 #include <codecvt>
 #include <assert.h>
+#if defined(EACOPY_USE_XXHASH)
+#include <xxhash.h>
+#endif
 #if defined(_WIN32)
 #define NOMINMAX
 #include <shlwapi.h>
@@ -22,11 +27,19 @@
 #include <stdarg.h>
 #include <string.h>
 #include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <unistd.h>
 #include <utime.h>
 #include <pthread.h>
+#if defined(__linux__)
+#include <linux/fs.h> // FICLONE
+#endif
+#if defined(EACOPY_USE_IO_URING)
+#include <liburing.h>
+#endif
 #endif
 
 //#define EACOPY_USE_OUTPUTDEBUGSTRING
@@ -88,6 +101,189 @@ struct FindFileDataLinux
 	wchar_t name[128];
 	char path[1024];
 };
+// Copies content from source to dest trying the cheapest way first. A reflink shares extents (btrfs, xfs) and
+// copy_file_range copies inside the kernel. Read/write through buffer is only used when filesystem supports neither
+bool copyFileData(int sourceHandle, int destHandle, u64 fileSize, u8* buffer, u64& outWritten)
+{
+	#if defined(FICLONE)
+	if (ioctl(destHandle, FICLONE, sourceHandle) == 0)
+	{
+		outWritten = fileSize;
+		return true;
+	}
+	#endif
+
+	#if defined(__linux__)
+	while (outWritten != fileSize)
+	{
+		ssize_t res = copy_file_range(sourceHandle, nullptr, destHandle, nullptr, size_t(min(fileSize - outWritten, u64(INT_MAX-1))), 0);
+		if (res > 0)
+		{
+			outWritten += res;
+			continue;
+		}
+		if (res == 0) // Source shrunk while copying
+			return true;
+		if (errno == EINTR)
+			continue;
+		if (outWritten == 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP))
+			break;
+		return false;
+	}
+	if (outWritten == fileSize)
+		return true;
+	#endif
+
+	while (true)
+	{
+		ssize_t size = read(sourceHandle, buffer, CopyContextBufferSize);
+		if (size == 0)
+			return true;
+		if (size == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+
+		// Write can return less than asked for (signals, quotas, some network filesystems)
+		for (ssize_t pos = 0; pos != size;)
+		{
+			ssize_t res = write(destHandle, buffer + pos, size_t(size - pos));
+			if (res <= 0)
+			{
+				if (res == -1 && errno == EINTR)
+					continue;
+				if (res == 0)
+					errno = EIO;
+				return false;
+			}
+			pos += res;
+			outWritten += res;
+		}
+	}
+}
+time_t toTime(const FileTime& fileTime) { return time_t((u64(fileTime.dwLowDateTime) << 32) | fileTime.dwHighDateTime); } // Matches getFileInfo
+#if defined(EACOPY_USE_IO_URING)
+// One ring per thread. All operations on a small file are submitted as one linked chain on direct descriptors so the
+// whole file costs one io_uring_enter instead of one syscall per operation. Any failure breaks the chain and caller
+// falls back to the regular path
+enum { IoRingSmallFileSize = 256*1024 };
+enum { IoRingMaxChainLength = 8 };
+struct IoRing
+{
+	IoRing()
+	{
+		if (io_uring_queue_init(IoRingMaxChainLength, &ring, 0) != 0)
+			return;
+		isValid = io_uring_register_files_sparse(&ring, 2) == 0;
+		if (!isValid)
+			io_uring_queue_exit(&ring);
+	}
+	~IoRing() { if (isValid) io_uring_queue_exit(&ring); }
+
+	// Flags must be set after prep since prep clears them
+	void queue(io_uring_sqe* sqe, int expectedResult, u8 flags)
+	{
+		sqe->user_data = uint(expectedResult);
+		sqe->flags |= flags;
+		++count;
+	}
+
+	bool submit()
+	{
+		bool success = io_uring_submit_and_wait(&ring, count) == int(count);
+		for (uint i=0; i!=count; ++i)
+		{
+			io_uring_cqe* cqe;
+			if (io_uring_wait_cqe(&ring, &cqe) != 0)
+			{
+				count = 0;
+				return false;
+			}
+			success = success && cqe->res == int(uint(cqe->user_data));
+			io_uring_cqe_seen(&ring, cqe);
+		}
+		count = 0;
+		return success;
+	}
+
+	io_uring ring;
+	uint count = 0;
+	bool isValid = false;
+};
+thread_local IoRing t_ioRing;
+
+void ringCloseSlots()
+{
+	// Operations after a failure in a chain are cancelled so slots might still be open. Closing an empty slot just fails
+	for (uint slot=0; slot!=2; ++slot)
+	{
+		io_uring_sqe* sqe = io_uring_get_sqe(&t_ioRing.ring);
+		io_uring_prep_close_direct(sqe, slot);
+		t_ioRing.queue(sqe, 0, 0);
+	}
+	t_ioRing.submit();
+}
+
+bool ringCreateFile(const char* path, const void* data, u64 size)
+{
+	if (!t_ioRing.isValid || size > IoRingSmallFileSize)
+		return false;
+	io_uring_sqe* sqe = io_uring_get_sqe(&t_ioRing.ring);
+	io_uring_prep_openat_direct(sqe, AT_FDCWD, path, O_WRONLY | O_CREAT | O_TRUNC, 0644, 0);
+	t_ioRing.queue(sqe, 0, IOSQE_IO_LINK);
+	sqe = io_uring_get_sqe(&t_ioRing.ring);
+	io_uring_prep_write(sqe, 0, data, uint(size), 0);
+	t_ioRing.queue(sqe, int(size), IOSQE_IO_LINK | IOSQE_FIXED_FILE);
+	sqe = io_uring_get_sqe(&t_ioRing.ring);
+	io_uring_prep_close_direct(sqe, 0);
+	t_ioRing.queue(sqe, 0, 0);
+	if (t_ioRing.submit())
+		return true;
+	ringCloseSlots();
+	return false;
+}
+
+// Copies the file if it is still size bytes. outLastWriteTime is the source modification time taken right before the read, like
+// fstat of the regular path. buffer must hold size + 1 bytes
+bool ringCopyFile(const char* from, const char* to, u64 size, u8* buffer, time_t& outLastWriteTime)
+{
+	if (!t_ioRing.isValid || size > IoRingSmallFileSize)
+		return false;
+	struct statx sourceStat;
+	io_uring_sqe* sqe = io_uring_get_sqe(&t_ioRing.ring);
+	io_uring_prep_openat_direct(sqe, AT_FDCWD, from, O_RDONLY, 0, 0);
+	t_ioRing.queue(sqe, 0, IOSQE_IO_LINK);
+	sqe = io_uring_get_sqe(&t_ioRing.ring);
+	io_uring_prep_statx(sqe, AT_FDCWD, from, 0, STATX_MTIME, &sourceStat);
+	t_ioRing.queue(sqe, 0, IOSQE_IO_LINK);
+	sqe = io_uring_get_sqe(&t_ioRing.ring);
+	io_uring_prep_openat_direct(sqe, AT_FDCWD, to, O_WRONLY | O_CREAT | O_TRUNC, 0644, 1);
+	t_ioRing.queue(sqe, 0, IOSQE_IO_LINK);
+	// One byte more than expected is asked for so a file that grew is seen. Reaching end of file is a short read which would
+	// break a normal link, so the write is hard linked and result is checked after. Regular path rewrites destination on failure
+	sqe = io_uring_get_sqe(&t_ioRing.ring);
+	io_uring_prep_read(sqe, 0, buffer, uint(size) + 1, 0);
+	t_ioRing.queue(sqe, int(size), IOSQE_IO_HARDLINK | IOSQE_FIXED_FILE);
+	sqe = io_uring_get_sqe(&t_ioRing.ring);
+	io_uring_prep_write(sqe, 1, buffer, uint(size), 0);
+	t_ioRing.queue(sqe, int(size), IOSQE_IO_LINK | IOSQE_FIXED_FILE);
+	sqe = io_uring_get_sqe(&t_ioRing.ring);
+	io_uring_prep_close_direct(sqe, 0);
+	t_ioRing.queue(sqe, 0, IOSQE_IO_LINK);
+	sqe = io_uring_get_sqe(&t_ioRing.ring);
+	io_uring_prep_close_direct(sqe, 1);
+	t_ioRing.queue(sqe, 0, 0);
+	if (t_ioRing.submit())
+	{
+		outLastWriteTime = sourceStat.stx_mtime.tv_sec;
+		return true;
+	}
+	ringCloseSlots();
+	return false;
+}
+#endif
 }
 #endif
 
@@ -152,12 +348,13 @@ CriticalSection::leave()
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-Event::Event()
+Event::Event(bool manualReset_)
 {
 	#if defined(_WIN32)
-	ev = CreateEvent(nullptr, true, false, nullptr);
+	ev = CreateEvent(nullptr, manualReset_, false, nullptr);
 	#else
 	ev = nullptr;
+	manualReset = manualReset_;
 	#endif
 }
 
@@ -200,7 +397,7 @@ Event::isSet(uint timeOutMs)
 	if (timeOutMs == 0)
 	{
 		uintptr_t v;
-		cs.scoped([&]() { v = (uintptr_t)ev; });
+		cs.scoped([&]() { v = (uintptr_t)ev; if (!manualReset) ev = nullptr; });
 		return v == 1;
 	}
 
@@ -209,7 +406,7 @@ Event::isSet(uint timeOutMs)
 	while (true)
 	{
 		uintptr_t v;
-		cs.scoped([&]() { v = (uintptr_t)ev; });
+		cs.scoped([&]() { v = (uintptr_t)ev; if (!manualReset) ev = nullptr; });
 		if (v)
 			return true;
 		if (lastMs - startMs >= timeOutMs)
@@ -311,21 +508,140 @@ LogContext::LogContext(Log& l)
 
 LogContext::~LogContext()
 {
+	if (m_ring)
+		log.releaseRing(m_ring);
 	t_logContext = m_lastContext;
 }
 
+LogContext*
+LogContext::getCurrent()
+{
+	return t_logContext;
+}
+
 CriticalSection g_logCs;
 
-void Log::writeEntry(bool isDebuggerPresent, const LogEntry& entry)
+enum : uint { LogRingSize = 32*1024 }; // Messages bigger than half of this go through the locked queue
+
+struct LogRecord
+{
+	u64					sequence;	// Order between threads. ~0 is padding up to the end of the ring
+	uint				size;		// Including header and null terminated text, multiple of 16
+	u16					length;
+	u8					linefeed;
+	u8					isError;
+};
+
+static_assert(sizeof(LogRecord) == 16, "Records are padded to 16 bytes so there is always room for a padding record");
+
+struct LogRing
+{
+	Atomic<u64>			writePos { 0 };		// Only moved by thread owning ring
+	Atomic<u64>			readPos { 0 };		// Only moved by thread draining
+	Atomic<uint>		scopeDepth { 0 };	// Not drained while owner is between logScopeEnter and logScopeLeave
+	u64					scopeSequence = 0;	// All records in a scope get the sequence of its start so they are written as one run
+	bool				inUse = false;
+	alignas(16) u8		data[LogRingSize];
+};
+
+Log::~Log()
+{
+	for (LogRing* ring : m_rings)
+		delete ring;
+}
+
+LogRing*
+Log::acquireRing()
+{
+	ScopedCriticalSection cs(m_ringsCs);
+	for (LogRing* ring : m_rings)
+	{
+		if (ring->inUse)
+			continue;
+		ring->inUse = true;
+		return ring;
+	}
+	LogRing* ring = new LogRing();
+	ring->inUse = true;
+	m_rings.push_back(ring);
+	return ring;
+}
+
+void
+Log::releaseRing(LogRing* ring)
+{
+	// Whatever is left in ring is drained as usual, next owner just continues after it
+	ScopedCriticalSection cs(m_ringsCs);
+	ring->inUse = false;
+}
+
+void
+Log::writeToQueue(LogContext& context, const wchar_t* str, bool linefeed, bool isError)
+{
+	uint length = uint(wcslen(str));
+	uint size = uint(sizeof(LogRecord) + (length + 1)*sizeof(wchar_t) + 15) & ~15u;
+	if (size > LogRingSize/2)
+	{
+		ScopedCriticalSection cs(m_logQueueCs);
+		if (m_logQueue)
+			m_logQueue->push_back({str, linefeed, isError, m_logSequence++});
+		return;
+	}
+
+	LogRing* ring = context.m_ring;
+	if (!ring)
+		ring = context.m_ring = acquireRing();
+
+	u64 writePos = ring->writePos.load(std::memory_order_relaxed);
+	uint offset = uint(writePos % LogRingSize);
+	uint padding = LogRingSize - offset < size ? LogRingSize - offset : 0;
+
+	// Ring is full. Wait for log thread or, when it is gone, drain it ourselves
+	u64 readPos;
+	while (writePos + padding + size - (readPos = ring->readPos.load(std::memory_order_acquire)) > LogRingSize)
+	{
+		if (!m_logThreadActive)
+		{
+			processLogQueue(EACOPY_IS_DEBUGGER_PRESENT);
+			continue;
+		}
+		m_logWake.set();
+		Sleep(1);
+	}
+
+	if (padding)
+	{
+		LogRecord& pad = *(LogRecord*)(ring->data + offset);
+		pad.sequence = ~0ull;
+		pad.size = padding;
+		writePos += padding;
+		offset = 0;
+	}
+
+	LogRecord& record = *(LogRecord*)(ring->data + offset);
+	record.sequence = ring->scopeDepth ? ring->scopeSequence : m_logSequence++;
+	record.size = size;
+	record.length = u16(length);
+	record.linefeed = linefeed;
+	record.isError = isError;
+	memcpy(&record + 1, str, (length + 1)*sizeof(wchar_t));
+	ring->writePos.store(writePos + size, std::memory_order_release);
+
+	// Wake up log thread when ring gets half full so writers rarely have to wait for it
+	if (writePos - readPos <= LogRingSize/2 && writePos + size - readPos > LogRingSize/2)
+		m_logWake.set();
+}
+
+void Log::writeEntry(bool isDebuggerPresent, const DrainEntry& entry)
 {
 	#if defined(EACOPY_USE_OUTPUTDEBUGSTRING)
 	if (isDebuggerPresent)
-		OutputDebugStringW(entry.c_str());
+		OutputDebugStringW(entry.str);
 	#endif
 
 	if (m_logFile != InvalidFileHandle)
 	{
-		auto temp = toString(entry.str.c_str());
+		auto temp = toString(entry.str);
 		IOStats ioStats;
 		writeFile(m_logFileName.c_str(), m_logFile, temp.c_str(), temp.size(), ioStats);
 		if (entry.linefeed)
@@ -334,7 +650,7 @@ void Log::writeEntry(bool isDebuggerPresent, const LogEntry& entry)
 	else
 	{
 		ScopedCriticalSection cs(g_logCs);
-		fputws(entry.str.c_str(), stdout);
+		fputws(entry.str, stdout);
 		if (entry.linefeed)
 			fputws(L"\n", stdout);
 	}
@@ -344,26 +660,59 @@ void Log::writeEntry(bool isDebuggerPresent, const LogEntry& entry)
 		ScopedCriticalSection cs(g_logCs);
 		if (m_recentErrors.size() > 10)
 			m_recentErrors.pop_back();
-		m_recentErrors.push_front(entry.str.c_str());
+		m_recentErrors.push_front(entry.str);
 	}
 }
 
 uint Log::processLogQueue(bool isDebuggerPresent)
 {
+	ScopedCriticalSection drainCs(m_drainCs);
+
+	// Flag first, messages written before it was set are then guaranteed to be picked up below
+	bool flush = m_logQueueFlush.exchange(false);
+
+	m_ringsCs.scoped([&]() { m_drainRings = m_rings; });
+	m_drainPositions.clear();
+	m_drainEntries.clear();
+	for (LogRing* ring : m_drainRings)
+	{
+		u64 writePos = ring->writePos.load(std::memory_order_acquire);
+		u64 readPos = ring->readPos.load(std::memory_order_relaxed);
+
+		// Lines inside a scope are kept together by not taking any of them until scope is left. Unless ring fills up
+		if (ring->scopeDepth && writePos - readPos <= LogRingSize/2)
+			writePos = readPos;
+
+		m_drainPositions.push_back(writePos);
+		while (readPos != writePos)
+		{
+			auto& record = *(const LogRecord*)(ring->data + readPos % LogRingSize);
+			if (record.sequence != ~0ull)
+				m_drainEntries.push_back({record.sequence, (const wchar_t*)(&record + 1), record.linefeed != 0, record.isError != 0});
+			readPos += record.size;
+		}
+	}
+
 	List<LogEntry> temp;
-	m_logQueueCs.enter();
-	bool flush = m_logQueueFlush;
-	temp.swap(*m_logQueue);
-	m_logQueueFlush = false;
-	m_logQueueCs.leave();
-	if (temp.empty())
+	m_logQueueCs.scoped([&]() { if (m_logQueue) temp.swap(*m_logQueue); });
+	for (auto& entry : temp)
+		m_drainEntries.push_back({entry.sequence, entry.str.c_str(), entry.linefeed, entry.isError});
+
+	if (m_drainEntries.empty())
 		return 0;
 
-	for (auto& entry : temp)
+	// Stable so records of a scope, which share one sequence, stay together in the order they were written
+	std::stable_sort(m_drainEntries.begin(), m_drainEntries.end(), [](const DrainEntry& a, const DrainEntry& b) { return a.sequence < b.sequence; });
+	for (auto& entry : m_drainEntries)
 		writeEntry(isDebuggerPresent, entry);
 
+	// Text is read straight from the rings so they can't be handed back to writers until it is written
+	for (size_t i=0, e=m_drainRings.size(); i!=e; ++i)
+		m_drainRings[i]->readPos.store(m_drainPositions[i], std::memory_order_release);
+
+	uint count = uint(m_drainEntries.size());
 	if (!flush)
-		return (uint)temp.size();
+		return count;
 
 	if (m_logFile != InvalidFileHandle)
 	{
@@ -376,7 +725,7 @@ uint Log::processLogQueue(bool isDebuggerPresent)
 	else
 		fflush(stdout);
 
-	return (uint)temp.size();
+	return count;
 }
 
 uint Log::logQueueThread()
@@ -389,7 +738,7 @@ uint Log::logQueueThread()
 
 	while (m_logThreadActive)
 		if (!processLogQueue(isDebuggerPresent))
-			Sleep(5);
+			m_logWake.isSet(5);
 
 	return 0;
 }
@@ -401,6 +750,15 @@ void Log::init(const wchar_t* logFile, bool logDebug, bool cacheRecentErrors)
 	m_logFileName = logFile ? logFile : L"";
 	ScopedCriticalSection cs(m_logQueueCs);
 	m_logQueue = new List<LogEntry>();
+
+	// Drop what was written to rings while log was closed
+	m_ringsCs.scoped([&]()
+		{
+			for (LogRing* ring : m_rings)
+				ring->readPos = ring->writePos.load();
+		});
+
+	m_logOpen = true;
 	m_logThreadActive = true;
 	m_logThread = new Thread([this]() { return logQueueThread(); });
 }
@@ -409,19 +767,24 @@ void Log::deinit(const Function<void()>& lastChanceLogging)
 {
 	bool isDebuggerPresent = EACOPY_IS_DEBUGGER_PRESENT;
 
-	m_logQueueCs.scoped([&]() { m_logThreadActive = false; });
+	m_logThreadActive = false;
+	m_logWake.set();
 
 	delete m_logThread;
+	m_logThread = nullptr;
 
-	ScopedCriticalSection cs(m_logQueueCs);
 	processLogQueue(isDebuggerPresent);
 	if (lastChanceLogging)
 	{
 		lastChanceLogging();
 		processLogQueue(isDebuggerPresent);
 	}
-	delete m_logQueue;
-	m_logQueue = nullptr;
+	m_logOpen = false;
+	m_logQueueCs.scoped([&]()
+		{
+			delete m_logQueue;
+			m_logQueue = nullptr;
+		});
 	IOStats ioStats;
 	if (m_logFile != InvalidFileHandle)
 		closeFile(m_logFileName.c_str(), m_logFile, AccessType_Write, ioStats);
@@ -443,12 +806,14 @@ void logInternal(const wchar_t* buffer, bool flush, bool linefeed, bool isError)
 		if (context->m_muted)
 			return;
 		Log& log = context->log;
-		ScopedCriticalSection cs(log.m_logQueueCs);
-		if (log.m_logQueue)
+		if (!log.m_logOpen)
+			return;
+		if (buffer != nullptr)
+			log.writeToQueue(*context, buffer, linefeed, isError);
+		if (flush)
 		{
-			if (buffer != nullptr)
-				log.m_logQueue->push_back({buffer, linefeed, isError});
-			log.m_logQueueFlush |= flush;
+			log.m_logQueueFlush = true;
+			log.m_logWake.set();
 		}
 	}
 	else
@@ -550,13 +915,87 @@ void logDebugLinef(const wchar_t* fmt, ...)
 void logScopeEnter()
 {
 	if (LogContext* c = t_logContext)
-		c->log.m_logQueueCs.enter();
+	{
+		if (!c->m_ring)
+			c->m_ring = c->log.acquireRing();
+		if (!c->m_ring->scopeDepth)
+			c->m_ring->scopeSequence = c->log.m_logSequence++;
+		++c->m_ring->scopeDepth;
+	}
 }
 
 void logScopeLeave()
 {
 	if (LogContext* c = t_logContext)
-		c->log.m_logQueueCs.leave();
+		if (c->m_ring)
+			--c->m_ring->scopeDepth;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+HelperThreads::~HelperThreads()
+{
+	m_stop = true;
+	for (auto& helper : m_helpers)
+		helper.start.set();
+	for (auto& helper : m_helpers)
+		helper.thread.wait();
+}
+
+void
+HelperThreads::run(uint helperCount, IOStats& ioStats, const Function<void(IOStats& threadIoStats)>& func)
+{
+	// Helpers need a log context to report errors
+	LogContext* logContext = LogContext::getCurrent();
+	if (!logContext)
+		helperCount = 0;
+	if (!helperCount)
+	{
+		func(ioStats);
+		return;
+	}
+
+	while (m_helpers.size() < helperCount)
+	{
+		m_helpers.emplace_back();
+		Helper& helper = m_helpers.back();
+		helper.thread.start([this, &helper]() { return helperThread(helper); });
+	}
+
+	m_func = &func;
+	m_log = &logContext->log;
+	m_activeCount = helperCount;
+	auto it = m_helpers.begin();
+	for (uint i=0; i!=helperCount; ++i, ++it)
+	{
+		it->ioStats = IOStats();
+		it->ioStats.histograms = ioStats.histograms;
+		it->start.set();
+	}
+
+	func(ioStats);
+	m_done.isSet();
+
+	it = m_helpers.begin();
+	for (uint i=0; i!=helperCount; ++i, ++it)
+		addIOStats(ioStats, it->ioStats);
+}
+
+uint
+HelperThreads::helperThread(Helper& helper)
+{
+	while (true)
+	{
+		helper.start.isSet();
+		if (m_stop)
+			return 0;
+		{
+			LogContext logContext(*m_log);
+			(*m_func)(helper.ioStats);
+		}
+		if (--m_activeCount == 0)
+			m_done.set();
+	}
 }
 
 const wchar_t* getPadding(const wchar_t* name)
@@ -617,6 +1056,148 @@ void populateStatsValue(Vector<WString>& stats, const wchar_t* name, uint value)
 	stats.push_back(buf);
 }
 
+uint
+LatencyHistogram::getBucketIndex(u64 microseconds)
+{
+	// Values below SubBucketCount get one bucket each, above that each power of two is split in SubBucketCount buckets
+	if (microseconds < SubBucketCount)
+		return uint(microseconds);
+	uint exponent = 63;
+	while (!(microseconds >> exponent))
+		--exponent;
+	if (exponent >= MaxExponent)
+		return BucketCount - 1;
+	uint subBucket = uint(microseconds >> (exponent - SubBucketBits)) & (SubBucketCount - 1);
+	return (exponent - SubBucketBits + 1)*SubBucketCount + subBucket;
+}
+
+u64
+LatencyHistogram::getBucketUpperBound(uint index)
+{
+	if (index < SubBucketCount)
+		return index + 1;
+	uint exponent = index/SubBucketCount + SubBucketBits - 1;
+	uint subBucket = index % SubBucketCount;
+	return u64(SubBucketCount + subBucket + 1) << (exponent - SubBucketBits);
+}
+
+void
+LatencyHistogram::add(u64 time)
+{
+	m_buckets[getBucketIndex(time/10)].fetch_add(1, std::memory_order_relaxed);
+	m_count.fetch_add(1, std::memory_order_relaxed);
+	m_sum.fetch_add(time, std::memory_order_relaxed);
+	u64 oldMax = m_max.load(std::memory_order_relaxed);
+	while (time > oldMax && !m_max.compare_exchange_weak(oldMax, time, std::memory_order_relaxed))
+		;
+}
+
+u64
+LatencyHistogram::getPercentile(double fraction) const
+{
+	// Buckets are read without lock so count might be slightly off compared to buckets. Good enough for reporting
+	u64 count = 0;
+	for (uint i=0; i!=BucketCount; ++i)
+		count += m_buckets[i].load(std::memory_order_relaxed);
+	if (!count)
+		return 0;
+	u64 target = max(u64(fraction*count + 0.5), u64(1));
+	u64 seen = 0;
+	for (uint i=0; i!=BucketCount; ++i)
+	{
+		seen += m_buckets[i].load(std::memory_order_relaxed);
+		if (seen >= target)
+			return min(getBucketUpperBound(i)*10, getMax());
+	}
+	return getMax();
+}
+
+const wchar_t*
+getIOOpName(IOOp op)
+{
+	switch (op)
+	{
+	case IOOp_CreateRead: return L"CreateRead";
+	case IOOp_Read: return L"ReadFile";
+	case IOOp_CloseRead: return L"CloseRead";
+	case IOOp_CreateWrite: return L"CreateWrite";
+	case IOOp_Write: return L"WriteFile";
+	case IOOp_CloseWrite: return L"CloseWrite";
+	case IOOp_CreateLink: return L"LinkFile";
+	case IOOp_DeleteFile: return L"DeleteFile";
+	case IOOp_MoveFile: return L"MoveFile";
+	case IOOp_RemoveDir: return L"RemoveDir";
+	case IOOp_SetLastWriteTime: return L"SetWriteTime";
+	case IOOp_FindFile: return L"FindFile";
+	case IOOp_FileInfo: return L"FileInfo";
+	case IOOp_CreateDir: return L"CreateDir";
+	case IOOp_CopyFile: return L"CopyFile";
+	default: return L"Unknown";
+	}
+}
+
+bool
+formatLatency(wchar_t* buffer, uint bufferCapacity, const wchar_t* name, const LatencyHistogram& histogram)
+{
+	u64 count = histogram.getCount();
+	if (!count)
+		return false;
+	auto toMs = [](u64 time) { return double(time)/10000.0; };
+	swprintf(buffer, bufferCapacity, L"%-20ls %10llu %10.3f %10.3f %10.3f %10.3f", name, count, toMs(histogram.getPercentile(0.5)), toMs(histogram.getPercentile(0.9)), toMs(histogram.getPercentile(0.99)), toMs(histogram.getMax()));
+	return true;
+}
+
+void
+appendPrometheusSummary(String& out, const char* metric, const char* labels, const LatencyHistogram& histogram)
+{
+	u64 count = histogram.getCount();
+	if (!count)
+		return;
+	const char* separator = *labels ? "," : "";
+	char buffer[512];
+	for (double quantile : { 0.5, 0.9, 0.99, 0.999 })
+	{
+		snprintf(buffer, sizeof(buffer), "%s{%s%squantile=\"%g\"} %.7f\n", metric, labels, separator, quantile, double(histogram.getPercentile(quantile))/10000000.0);
+		out += buffer;
+	}
+	snprintf(buffer, sizeof(buffer), "%s_sum{%s} %.7f\n%s_count{%s} %llu\n", metric, labels, double(histogram.getSum())/10000000.0, metric, labels, count);
+	out += buffer;
+}
+
+void addIOStats(IOStats& out, const IOStats& in)
+{
+	out.createReadTime += in.createReadTime;
+	out.readTime += in.readTime;
+	out.closeReadTime += in.closeReadTime;
+	out.createReadCount += in.createReadCount;
+	out.readCount += in.readCount;
+	out.closeReadCount += in.closeReadCount;
+	out.createWriteTime += in.createWriteTime;
+	out.writeTime += in.writeTime;
+	out.closeWriteTime += in.closeWriteTime;
+	out.createWriteCount += in.createWriteCount;
+	out.writeCount += in.writeCount;
+	out.closeWriteCount += in.closeWriteCount;
+	out.createLinkTime += in.createLinkTime;
+	out.deleteFileTime += in.deleteFileTime;
+	out.moveFileTime += in.moveFileTime;
+	out.removeDirTime += in.removeDirTime;
+	out.setLastWriteTime += in.setLastWriteTime;
+	out.findFileTime += in.findFileTime;
+	out.fileInfoTime += in.fileInfoTime;
+	out.createDirTime += in.createDirTime;
+	out.copyFileTime += in.copyFileTime;
+	out.createLinkCount += in.createLinkCount;
+	out.deleteFileCount += in.deleteFileCount;
+	out.moveFileCount += in.moveFileCount;
+	out.removeDirCount += in.removeDirCount;
+	out.setLastWriteTimeCount += in.setLastWriteTimeCount;
+	out.findFileCount += in.findFileCount;
+	out.fileInfoCount += in.fileInfoCount;
+	out.createDirCount += in.createDirCount;
+	out.copyFileCount += in.copyFileCount;
+}
+
 void populateIOStats(Vector<WString>& stats, const IOStats& ioStats)
 {
 	populateStatsTime(stats, L"FindFile", ioStats.findFileTime, ioStats.findFileCount);
@@ -652,34 +1233,287 @@ void logDebugStats(const Vector<WString>& stats)
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-#if defined(EACOPY_USE_SYMLINK_FOR_LONGPATHS)
+Atomic<bool> g_traceActive;
 
-CriticalSection g_temporarySymlinkCacheCs;
-Map<WString, WString> g_temporarySymlinkCache;
-ScopeGuard g_temporarySymlinkGuard([]()  // Will run at static dtor and remove all symlinks
+struct TraceSpan { u64 start; u64 duration; const wchar_t* name; uint detailOffset; };
+
+struct TraceBuffer
+{
+	CriticalSection		cs; // Only contended while trace is written
+	uint				threadIndex;
+	const wchar_t*		threadName = nullptr;
+	Vector<TraceSpan>	spans;
+	Vector<wchar_t>		details; // Null terminated detail strings of spans
+	u64					droppedCount = 0;
+	bool				threadExited = false; // Kept until spans are written, then reused by a new thread
+};
+
+CriticalSection			g_traceCs;
+Vector<TraceBuffer*>	g_traceBuffers; // Buffers of running threads and of exited threads with spans not written yet
+Vector<TraceBuffer*>	g_traceFreeBuffers;
+uint					g_traceThreadCount;
+Atomic<u64>				g_traceMemory; // Memory used by spans of current trace
+WString					g_traceFileName;
+WString					g_traceProcessName;
+FileHandle				g_traceFile = InvalidFileHandle;
+
+void recycleTraceBuffer(TraceBuffer* buffer)
+{
+	// Must hold g_traceCs
+	g_traceBuffers.erase(std::find(g_traceBuffers.begin(), g_traceBuffers.end(), buffer));
+	Vector<TraceSpan>().swap(buffer->spans);
+	Vector<wchar_t>().swap(buffer->details);
+	buffer->threadName = nullptr;
+	buffer->droppedCount = 0;
+	buffer->threadExited = false;
+	g_traceFreeBuffers.push_back(buffer);
+}
+
+struct TraceThread
+{
+	~TraceThread()
 	{
-		for (auto& i : g_temporarySymlinkCache)
-			RemoveDirectoryW(i.second.c_str());
-	});
+		if (!buffer)
+			return;
+		ScopedCriticalSection cs(g_traceCs);
+		ScopedCriticalSection bufferCs(buffer->cs);
+		buffer->threadExited = true;
+		if (buffer->spans.empty() && !buffer->droppedCount)
+			recycleTraceBuffer(buffer);
+	}
+	TraceBuffer* buffer = nullptr;
+};
 
-bool createTemporarySymlink(const wchar_t* dest, WString& outNewDest)
+thread_local TraceThread t_traceThread;
+
+TraceBuffer& getTraceBuffer()
 {
-	wchar_t tempPath[MAX_PATH];
-	if (!GetTempPathW(MAX_PATH, tempPath))
+	if (TraceBuffer* buffer = t_traceThread.buffer)
+		return *buffer;
+	ScopedCriticalSection cs(g_traceCs);
+	TraceBuffer* buffer;
+	if (g_traceFreeBuffers.empty())
+		buffer = new TraceBuffer();
+	else
 	{
-		logErrorf(L"Failed to get temp path. Reason: %ls", getLastErrorText().c_str());
-		return false;
+		buffer = g_traceFreeBuffers.back();
+		g_traceFreeBuffers.pop_back();
 	}
+	buffer->threadIndex = ++g_traceThreadCount;
+	g_traceBuffers.push_back(buffer);
+	t_traceThread.buffer = buffer;
+	return *buffer;
+}
 
-	uint retryCount = 3;
-	while (true)
+u64 getTraceTimestamp(u64 time)
+{
+	// Unix epoch microseconds. 1601 based ones are above 2^53 and lose precision in json readers
+	#if defined(_WIN32)
+	return time/10;
+	#else
+	return (time - 116444736000000000ull)/10;
+	#endif
+}
+
+void appendTraceString(String& out, const wchar_t* str)
+{
+	out += '"';
+	for (char c : toString(str))
 	{
-		// Use time as unique id
-		uint64_t v;
-		if (!QueryPerformanceCounter((union _LARGE_INTEGER*)&v))
+		if (c == '"' || c == '\\')
 		{
-			logErrorf(L"Failed to get performance counter value. Reason: %ls", getLastErrorText().c_str());
-			return false;
+			out += '\\';
+			out += c;
+		}
+		else if (u8(c) < 0x20)
+		{
+			char buffer[8];
+			snprintf(buffer, sizeof(buffer), "\\u%04x", uint(u8(c)));
+			out += buffer;
+		}
+		else
+			out += c;
+	}
+	out += '"';
+}
+
+bool
+traceBegin(const wchar_t* fileName, const wchar_t* processName)
+{
+	ScopedCriticalSection cs(g_traceCs);
+	if (g_traceActive)
+		return true;
+
+	IOStats ioStats;
+	if (!openFileWrite(fileName, g_traceFile, ioStats, true))
+		return false;
+
+	Vector<TraceBuffer*> buffers(g_traceBuffers);
+	for (TraceBuffer* buffer : buffers)
+	{
+		ScopedCriticalSection bufferCs(buffer->cs);
+		if (buffer->threadExited)
+		{
+			recycleTraceBuffer(buffer);
+			continue;
+		}
+		buffer->spans.clear();
+		buffer->details.clear();
+		buffer->droppedCount = 0;
+	}
+	g_traceMemory = 0;
+	g_traceFileName = fileName;
+	g_traceProcessName = processName;
+	g_traceActive = true;
+	return true;
+}
+
+bool
+traceEnd()
+{
+	ScopedCriticalSection cs(g_traceCs);
+	if (!g_traceActive)
+		return true;
+	g_traceActive = false;
+
+	#if defined(_WIN32)
+	uint pid = GetCurrentProcessId();
+	#else
+	uint pid = uint(getpid());
+	#endif
+
+	// Timestamps are wall clock microseconds so traces of client and server line up when loaded together
+	u64 endTime = getTraceTimestamp(getPreciseTime());
+	IOStats ioStats;
+	bool success = true;
+	String out;
+	char buffer[256];
+	snprintf(buffer, sizeof(buffer), "{\"traceEvents\":[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,\"args\":{\"name\":", pid);
+	out += buffer;
+	appendTraceString(out, g_traceProcessName.c_str());
+	out += "}}";
+
+	Vector<TraceBuffer*> traceBuffers(g_traceBuffers);
+	for (TraceBuffer* traceBuffer : traceBuffers)
+	{
+		ScopedCriticalSection bufferCs(traceBuffer->cs);
+		if (traceBuffer->spans.empty() && !traceBuffer->droppedCount)
+			continue;
+
+		if (traceBuffer->threadName)
+		{
+			snprintf(buffer, sizeof(buffer), ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":%u,\"args\":{\"name\":", pid, traceBuffer->threadIndex);
+			out += buffer;
+			appendTraceString(out, traceBuffer->threadName);
+			out += "}}";
+		}
+
+		for (auto& span : traceBuffer->spans)
+		{
+			out += ",\n{\"name\":";
+			appendTraceString(out, span.name);
+			snprintf(buffer, sizeof(buffer), ",\"ph\":\"X\",\"pid\":%u,\"tid\":%u,\"ts\":%llu,\"dur\":%llu.%u", pid, traceBuffer->threadIndex, getTraceTimestamp(span.start), span.duration/10, uint(span.duration%10));
+			out += buffer;
+			if (span.detailOffset != ~0u)
+			{
+				out += ",\"args\":{\"detail\":";
+				appendTraceString(out, traceBuffer->details.data() + span.detailOffset);
+				out += '}';
+			}
+			out += '}';
+
+			if (out.size() > 1024*1024)
+			{
+				success &= writeFile(g_traceFileName.c_str(), g_traceFile, out.data(), out.size(), ioStats);
+				out.clear();
+			}
+		}
+
+		if (traceBuffer->droppedCount)
+		{
+			u64 ts = traceBuffer->spans.empty() ? endTime : getTraceTimestamp(traceBuffer->spans.back().start);
+			snprintf(buffer, sizeof(buffer), ",\n{\"name\":\"SpansDropped\",\"ph\":\"i\",\"s\":\"t\",\"pid\":%u,\"tid\":%u,\"ts\":%llu,\"args\":{\"count\":%llu}}", pid, traceBuffer->threadIndex, ts, traceBuffer->droppedCount);
+			out += buffer;
+		}
+
+		// Give memory back, buffer is kept for next trace or next thread
+		if (traceBuffer->threadExited)
+			recycleTraceBuffer(traceBuffer);
+		else
+		{
+			Vector<TraceSpan>().swap(traceBuffer->spans);
+			Vector<wchar_t>().swap(traceBuffer->details);
+		}
+	}
+	out += "\n]}\n";
+
+	success &= writeFile(g_traceFileName.c_str(), g_traceFile, out.data(), out.size(), ioStats);
+	success &= closeFile(g_traceFileName.c_str(), g_traceFile, AccessType_Write, ioStats);
+	return success;
+}
+
+void
+traceSpan(const wchar_t* name, const wchar_t* detail, u64 startTime, u64 endTime)
+{
+	TraceBuffer& buffer = getTraceBuffer();
+	ScopedCriticalSection cs(buffer.cs);
+	size_t detailLen = detail ? wcslen(detail) + 1 : 0;
+	u64 size = sizeof(TraceSpan) + detailLen*sizeof(wchar_t);
+	if (g_traceMemory.fetch_add(size) + size > TraceMaxMemory)
+	{
+		g_traceMemory -= size;
+		++buffer.droppedCount;
+		return;
+	}
+	uint detailOffset = ~0u;
+	if (detail)
+	{
+		detailOffset = uint(buffer.details.size());
+		buffer.details.insert(buffer.details.end(), detail, detail + detailLen);
+	}
+	buffer.spans.push_back({startTime, endTime - startTime, name, detailOffset});
+}
+
+void
+traceThreadName(const wchar_t* name)
+{
+	if (!g_traceActive)
+		return;
+	TraceBuffer& buffer = getTraceBuffer();
+	ScopedCriticalSection cs(buffer.cs);
+	buffer.threadName = name;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#if defined(EACOPY_USE_SYMLINK_FOR_LONGPATHS)
+
+CriticalSection g_temporarySymlinkCacheCs;
+Map<WString, WString> g_temporarySymlinkCache;
+ScopeGuard g_temporarySymlinkGuard([]()  // Will run at static dtor and remove all symlinks
+	{
+		for (auto& i : g_temporarySymlinkCache)
+			RemoveDirectoryW(i.second.c_str());
+	});
+
+bool createTemporarySymlink(const wchar_t* dest, WString& outNewDest)
+{
+	wchar_t tempPath[MAX_PATH];
+	if (!GetTempPathW(MAX_PATH, tempPath))
+	{
+		logErrorf(L"Failed to get temp path. Reason: %ls", getLastErrorText().c_str());
+		return false;
+	}
+
+	uint retryCount = 3;
+	while (true)
+	{
+		// Use time as unique id
+		uint64_t v;
+		if (!QueryPerformanceCounter((union _LARGE_INTEGER*)&v))
+		{
+			logErrorf(L"Failed to get performance counter value. Reason: %ls", getLastErrorText().c_str());
+			return false;
 		}
 
 		auto str = std::to_wstring(v);
@@ -771,7 +1605,7 @@ FindFileHandle
 findFirstFile(const wchar_t* searchStr, FindFileData& findFileData, IOStats& ioStats)
 {
 	++ioStats.findFileCount;
-	TimerScope _(ioStats.findFileTime);
+	IOTimerScope _(ioStats, ioStats.findFileTime, IOOp_FindFile);
 #if defined(_WIN32)
 	WString tempBuffer;
 	searchStr = convertToShortPath(searchStr, tempBuffer);
@@ -812,7 +1646,7 @@ findFirstFile(const wchar_t* searchStr, FindFileData& findFileData, IOStats& ioS
 bool
 findNextFile(FindFileHandle handle, FindFileData& findFileData, IOStats& ioStats)
 {
-	TimerScope _(ioStats.findFileTime);
+	IOTimerScope _(ioStats, ioStats.findFileTime, IOOp_FindFile);
 #if defined(_WIN32)
 	return FindNextFileW(handle, (WIN32_FIND_DATAW*)&findFileData) != 0;
 #else
@@ -837,7 +1671,7 @@ findNextFile(FindFileHandle handle, FindFileData& findFileData, IOStats& ioStats
 void
 findClose(FindFileHandle handle, IOStats& ioStats)
 {
-	TimerScope _(ioStats.findFileTime);
+	IOTimerScope _(ioStats, ioStats.findFileTime, IOOp_FindFile);
 #if defined(_WIN32)
 	FindClose(handle);
 #else
@@ -997,7 +1831,7 @@ void removeTemporarySymlinks(const wchar_t* path)
 uint getFileInfo(FileInfo& outInfo, const wchar_t* fullFileName, IOStats& ioStats)
 {
 	++ioStats.fileInfoCount;
-	TimerScope _(ioStats.fileInfoTime);
+	IOTimerScope _(ioStats, ioStats.fileInfoTime, IOOp_FileInfo);
 
 	#if defined(_WIN32)
 	WString temp;
@@ -1071,7 +1905,7 @@ bool replaceIfSymLink(const wchar_t* directory, uint attributes, IOStats& ioStat
 	{
 		// Delete reparsepoint and treat path as not existing
 		++ioStats.removeDirCount;
-		TimerScope _(ioStats.removeDirTime);
+		IOTimerScope _(ioStats, ioStats.removeDirTime, IOOp_RemoveDir);
 		if (!RemoveDirectoryW(directory))
 		{
 			logErrorf(L"Trying to remove reparse point while ensuring directory %ls: %ls", directory, getLastErrorText().c_str());
@@ -1080,7 +1914,7 @@ bool replaceIfSymLink(const wchar_t* directory, uint attributes, IOStats& ioStat
 	}
 
 	++ioStats.createDirCount;
-	TimerScope _(ioStats.createDirTime);
+	IOTimerScope _(ioStats, ioStats.createDirTime, IOOp_CreateDir);
 	if (CreateDirectoryW(directory, NULL) != 0)
 		return true;
 
@@ -1095,7 +1929,7 @@ bool ensureDirectory(const wchar_t* directory, uint attributes, IOStats& ioStats
 	{
 		{
 			++ioStats.createDirCount;
-			TimerScope _(ioStats.createDirTime);
+			IOTimerScope _(ioStats, ioStats.createDirTime, IOOp_CreateDir);
 			if (CreateDirectoryW(directory, NULL) != 0)
 			{
 				if (attributes != 0 && attributes & FILE_ATTRIBUTE_DIRECTORY)
@@ -1182,7 +2016,7 @@ bool ensureDirectory(const wchar_t* directory, uint attributes, IOStats& ioStats
 
 	{
 		++ioStats.createDirCount;
-		TimerScope _(ioStats.createDirTime);
+		IOTimerScope _(ioStats, ioStats.createDirTime, IOOp_CreateDir);
 		WString tempBuffer;
 		const wchar_t* validDirectory = convertToShortPath(directory, tempBuffer);
 		if (CreateDirectoryW(validDirectory, NULL) != 0)
@@ -1263,7 +2097,7 @@ bool deleteAllFiles(const wchar_t* directory, bool& outPathFound, IOStats& ioSta
 				const wchar_t* fullName2 = convertToShortPath(fullName.c_str(), buffer);
 				// Delete reparsepoint and treat path as not existing
 				++ioStats.removeDirCount;
-				TimerScope _(ioStats.removeDirTime);
+				IOTimerScope _(ioStats, ioStats.removeDirTime, IOOp_RemoveDir);
 				if (!RemoveDirectoryW(fullName2))
 				{
 					uint error = GetLastError();
@@ -1314,7 +2148,7 @@ bool deleteDirectory(const wchar_t* directory, IOStats& ioStats, bool errorOnMis
 	const wchar_t* validDirectory = convertToShortPath(directory, tempBuffer);
 
 	++ioStats.removeDirCount;
-	TimerScope _(ioStats.removeDirTime);
+	IOTimerScope _(ioStats, ioStats.removeDirTime, IOOp_RemoveDir);
 	if (RemoveDirectoryW(validDirectory))
 		return true;
 
@@ -1326,6 +2160,40 @@ bool deleteDirectory(const wchar_t* directory, IOStats& ioStats, bool errorOnMis
 	return false;
 }
 
+bool deletePath(const wchar_t* fullPath, uint attributes, IOStats& ioStats, bool errorOnMissingFile)
+{
+	if (!(attributes & FILE_ATTRIBUTE_DIRECTORY))
+	{
+		if (attributes & FILE_ATTRIBUTE_READONLY)
+			if (!setFileWritable(fullPath, true))
+				if (isError(GetLastError(), errorOnMissingFile))
+				{
+					logErrorf(L"Failed to set file attributes to writable for file %ls", fullPath);
+					return false;
+				}
+		return deleteFile(fullPath, ioStats, errorOnMissingFile);
+	}
+
+	if (!(attributes & FILE_ATTRIBUTE_REPARSE_POINT))
+		return deleteDirectory(fullPath, ioStats, errorOnMissingFile);
+
+	// Remove reparse point without entering it
+	WString tempBuffer;
+	const wchar_t* validPath = convertToShortPath(fullPath, tempBuffer);
+
+	++ioStats.removeDirCount;
+	IOTimerScope _(ioStats, ioStats.removeDirTime, IOOp_RemoveDir);
+	if (RemoveDirectoryW(validPath))
+		return true;
+
+	uint error = GetLastError();
+	if (!isError(error, errorOnMissingFile))
+		return true;
+
+	logErrorf(L"Trying to remove reparse point %ls: %ls", validPath, getErrorText(validPath, error).c_str());
+	return false;
+}
+
 bool isAbsolutePath(const wchar_t* path)
 {
 	uint pathLen = wcslen(path);
@@ -1353,7 +2221,7 @@ bool getUseBufferedIO(UseBufferedIO use, u64 fileSize)
 
 bool openFileRead(const wchar_t* fullPath, FileHandle& outFile, IOStats& ioStats, bool useBufferedIO, _OVERLAPPED* overlapped, bool isSequentialScan, bool sharedRead)
 {
-	TimerScope _(ioStats.createReadTime);
+	IOTimerScope _(ioStats, ioStats.createReadTime, IOOp_CreateRead);
 	++ioStats.createReadCount;
 	#if defined(_WIN32)
 	uint nobufferingFlag = useBufferedIO ? 0 : FILE_FLAG_NO_BUFFERING;
@@ -1377,6 +2245,8 @@ bool openFileRead(const wchar_t* fullPath, FileHandle& outFile, IOStats& ioStats
 		return false;
 	}
 	outFile = (FileHandle)(uintptr_t)fileHandle;
+	if (isSequentialScan)
+		posix_fadvise(fileHandle, 0, 0, POSIX_FADV_SEQUENTIAL);
 	//if (!sharedRead)
 	//	flock(fileHandle, LOCK_EX); // This does not work.. don't know how to do this on linux
 	return true;
@@ -1398,7 +2268,7 @@ bool openFileWrite(const wchar_t* fullPath, FileHandle& outFile, IOStats& ioStat
 		flagsAndAttributes = FILE_ATTRIBUTE_NORMAL;
 
 	++ioStats.createWriteCount;
-	TimerScope _(ioStats.createWriteTime);
+	IOTimerScope _(ioStats, ioStats.createWriteTime, IOOp_CreateWrite);
 	WString temp;
 	fullPath = convertToShortPath(fullPath, temp);
 	DWORD creationDisposition = createAlways ? CREATE_ALWAYS : OPEN_EXISTING;
@@ -1431,7 +2301,7 @@ bool openFileWrite(const wchar_t* fullPath, FileHandle& outFile, IOStats& ioStat
 bool writeFile(const wchar_t* fullPath, FileHandle& file, const void* data, u64 dataSize, IOStats& ioStats, _OVERLAPPED* overlapped)
 {
 	++ioStats.writeCount;
-	TimerScope _(ioStats.writeTime);
+	IOTimerScope _(ioStats, ioStats.writeTime, IOOp_Write);
 	#if defined(_WIN32)
 	if (overlapped)
 	{
@@ -1442,9 +2312,12 @@ bool writeFile(const wchar_t* fullPath, FileHandle& file, const void* data, u64
 		}
 
 		uint written;
-		if (!WriteFile(file, data, (uint)dataSize, &written, overlapped))
-			return false;
-		return true;
+		if (WriteFile(file, data, (uint)dataSize, &written, overlapped))
+			return true;
+		if (GetLastError() == ERROR_IO_PENDING) // Caller is responsible for waiting on the overlapped event
+			return true;
+		logErrorf(L"Trying to write data to %ls: %ls", fullPath, getErrorText(fullPath, GetLastError()).c_str());
+		return false;
 	}
 
 	u64 left = dataSize;
@@ -1485,7 +2358,7 @@ bool writeFile(const wchar_t* fullPath, FileHandle& file, const void* data, u64
 
 bool readFile(const wchar_t* fullPath, FileHandle& file, void* destData, u64 toRead, u64& read, IOStats& ioStats)
 {
-	TimerScope _(ioStats.readTime);
+	IOTimerScope _(ioStats, ioStats.readTime, IOOp_Read);
 	++ioStats.readCount;
 	#if defined(_WIN32)
 	DWORD dwRead = 0;
@@ -1538,7 +2411,7 @@ bool setFileLastWriteTime(const wchar_t* fullPath, FileHandle& file, FileTime la
 	//}
 
 	++ioStats.setLastWriteTimeCount;
-	TimerScope _(ioStats.setLastWriteTime);
+	IOTimerScope _(ioStats, ioStats.setLastWriteTime, IOOp_SetLastWriteTime);
 	#if defined(_WIN32)
 	if (SetFileTime(file, NULL, NULL, (FILETIME*)&lastWriteTime))
 		return true;
@@ -1547,7 +2420,10 @@ bool setFileLastWriteTime(const wchar_t* fullPath, FileHandle& file, FileTime la
 		file = InvalidFileHandle;
 	return false;
 	#else
-	EACOPY_NOT_IMPLEMENTED
+	timespec times[2] = { { 0, UTIME_NOW }, { toTime(lastWriteTime), 0 } };
+	if (futimens((int)(uintptr_t)file, times) == 0)
+		return true;
+	logErrorf(L"Failed to set file time on %ls", fullPath);
 	return false;
 	#endif
 }
@@ -1567,7 +2443,10 @@ bool setFilePosition(const wchar_t* fullPath, FileHandle& file, u64 position, IO
 	logErrorf(L"Fail setting file position on file %ls: %ls", fullPath, getErrorText(lastError).c_str());
 	return false;
 	#else
-	EACOPY_NOT_IMPLEMENTED
+	int fileHandle = (int)(uintptr_t)file;
+	if (lseek(fileHandle, off_t(position), SEEK_SET) != -1)
+		return true;
+	logErrorf(L"Fail setting file position on file %ls: %hs", fullPath, strerror(errno));
 	return false;
 	#endif
 }
@@ -1578,7 +2457,7 @@ bool closeFile(const wchar_t* fullPath, FileHandle& file, AccessType accessType,
 		return true;
 
 	++(accessType == AccessType_Read ? ioStats.closeReadCount : ioStats.closeWriteCount);
-	TimerScope _(accessType == AccessType_Read ? ioStats.closeReadTime : ioStats.closeWriteTime);
+	IOTimerScope _(ioStats, accessType == AccessType_Read ? ioStats.closeReadTime : ioStats.closeWriteTime, accessType == AccessType_Read ? IOOp_CloseRead : IOOp_CloseWrite);
 	#if defined(_WIN32)
 	bool success = CloseHandle(file) != 0;
 	file = InvalidFileHandle;
@@ -1597,8 +2476,102 @@ bool closeFile(const wchar_t* fullPath, FileHandle& file, AccessType accessType,
 	#endif
 }
 
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+bool
+MappedFile::open(const wchar_t* fullPath, IOStats& ioStats)
+{
+	close();
+
+	FileHandle file;
+	if (!openFileRead(fullPath, file, ioStats, true))
+		return false;
+	ScopeGuard fileGuard([&]() { closeFile(fullPath, file, AccessType_Read, ioStats); });
+
+	#if defined(_WIN32)
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize))
+	{
+		logErrorf(L"Failed to get size of file %ls: %ls", fullPath, getLastErrorText().c_str());
+		return false;
+	}
+	if (fileSize.QuadPart == 0) // Can't map empty files
+		return false;
+	m_mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!m_mapping)
+	{
+		logErrorf(L"Failed to create file mapping for %ls: %ls", fullPath, getLastErrorText().c_str());
+		return false;
+	}
+	m_data = (const u8*)MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!m_data)
+	{
+		logErrorf(L"Failed to map view of file %ls: %ls", fullPath, getLastErrorText().c_str());
+		close();
+		return false;
+	}
+	m_size = fileSize.QuadPart;
+	return true;
+	#else
+	int fileHandle = (int)(uintptr_t)file;
+	struct stat st;
+	if (fstat(fileHandle, &st) != 0 || st.st_size == 0)
+		return false;
+	void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fileHandle, 0);
+	if (data == MAP_FAILED)
+		return false;
+	m_data = (const u8*)data;
+	m_size = st.st_size;
+	return true;
+	#endif
+}
+
+void
+MappedFile::close()
+{
+	#if defined(_WIN32)
+	if (m_data)
+		UnmapViewOfFile(m_data);
+	if (m_mapping)
+		CloseHandle(m_mapping);
+	#else
+	if (m_data)
+		munmap((void*)m_data, m_size);
+	#endif
+	m_mapping = nullptr;
+	m_data = nullptr;
+	m_size = 0;
+}
+
 bool createFile(const wchar_t* fullPath, const FileInfo& info, const void* data, IOStats& ioStats, bool useBufferedIO, bool hidden)
 {
+	#if defined(EACOPY_USE_IO_URING)
+	String path = toLinuxPath(fullPath);
+	bool created;
+	{
+		IOTimerScope _(ioStats, ioStats.writeTime, IOOp_Write);
+		created = ringCreateFile(path.c_str(), data, info.fileSize);
+	}
+	if (created)
+	{
+		++ioStats.createWriteCount;
+		++ioStats.writeCount;
+		++ioStats.closeWriteCount;
+		if (!info.lastWriteTime.dwLowDateTime && !info.lastWriteTime.dwHighDateTime)
+			return true;
+		++ioStats.setLastWriteTimeCount;
+		IOTimerScope _(ioStats, ioStats.setLastWriteTime, IOOp_SetLastWriteTime);
+		timespec times[2] = { { 0, UTIME_NOW }, { toTime(info.lastWriteTime), 0 } };
+		if (utimensat(AT_FDCWD, path.c_str(), times, 0) == 0)
+			return true;
+		logErrorf(L"Failed to set file time on %ls", fullPath);
+		return false;
+	}
+	#endif
+
 	FileHandle file;
 	if (!openFileWrite(fullPath, file, ioStats, useBufferedIO, nullptr, hidden))
 		return false;
@@ -1623,7 +2596,7 @@ bool createFileLink(const wchar_t* fullPath, const FileInfo& info, const wchar_t
 	{
 		{
 			++ioStats.createLinkCount;
-			TimerScope _(ioStats.createLinkTime);
+			IOTimerScope _(ioStats, ioStats.createLinkTime, IOOp_CreateLink);
 			if (CreateHardLinkW(fullPath, sourcePath, NULL))
 				return true;
 		}
@@ -1740,9 +2713,11 @@ bool copyFile(const wchar_t* source, const FileInfo& sourceInfo, uint sourceAttr
 		uint flagsAndAttributes = FILE_FLAG_SEQUENTIAL_SCAN | overlappedFlag | nobufferingFlag | writeThroughFlag;
 
 		++ioStats.createWriteCount;
-		u64 startCreateWriteTime = getTime();
-		HANDLE destFile = CreateFileW(dest, FILE_WRITE_DATA|FILE_WRITE_ATTRIBUTES, 0, NULL, failIfExists ? CREATE_NEW : CREATE_ALWAYS, flagsAndAttributes, &osWrite);
-		ioStats.createWriteTime += getTime() - startCreateWriteTime;
+		HANDLE destFile;
+		{
+			IOTimerScope _(ioStats, ioStats.createWriteTime, IOOp_CreateWrite);
+			destFile = CreateFileW(dest, FILE_WRITE_DATA|FILE_WRITE_ATTRIBUTES, 0, NULL, failIfExists ? CREATE_NEW : CREATE_ALWAYS, flagsAndAttributes, &osWrite);
+		}
 
 		if (destFile == InvalidFileHandle)
 		{
@@ -1766,9 +2741,11 @@ bool copyFile(const wchar_t* source, const FileInfo& sourceInfo, uint sourceAttr
 		osRead.OffsetHigh = 0;
 		osRead.hEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
 
-		u64 startCreateReadTime = getTime();
-		HANDLE sourceFile = CreateFileW(source, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN | overlappedFlag | nobufferingFlag, &osRead);
-		ioStats.createReadTime += getTime() - startCreateReadTime;
+		HANDLE sourceFile;
+		{
+			IOTimerScope _(ioStats, ioStats.createReadTime, IOOp_CreateRead);
+			sourceFile = CreateFileW(source, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN | overlappedFlag | nobufferingFlag, &osRead);
+		}
 		++ioStats.createReadCount;
 
 		if (sourceFile == InvalidFileHandle)
@@ -1790,7 +2767,7 @@ bool copyFile(const wchar_t* source, const FileInfo& sourceInfo, uint sourceAttr
 			if (sizeFilled)
 			{
 				++ioStats.writeCount;
-				TimerScope _(ioStats.writeTime);
+				IOTimerScope _(ioStats, ioStats.writeTime, IOOp_Write);
 
 				if (UseOverlappedCopy && WaitForSingleObject(osWrite.hEvent, INFINITE) != WAIT_OBJECT_0)
 				{
@@ -1828,7 +2805,7 @@ bool copyFile(const wchar_t* source, const FileInfo& sourceInfo, uint sourceAttr
 			if (left)
 			{
 				++ioStats.readCount;
-				TimerScope _(ioStats.readTime);
+				IOTimerScope _(ioStats, ioStats.readTime, IOOp_Read);
 
 				uint toRead = (uint)min(left, u64(ReadChunkSize));
 				activeBufferIndex = (activeBufferIndex + 1) % 3;
@@ -1888,7 +2865,7 @@ bool copyFile(const wchar_t* source, const FileInfo& sourceInfo, uint sourceAttr
 	else
 	{
 		++ioStats.copyFileCount;
-		TimerScope _(ioStats.copyFileTime);
+		IOTimerScope _(ioStats, ioStats.copyFileTime, IOOp_CopyFile);
 		//BOOL cancel = false;
 		//uint flags = COPY_FILE_NO_BUFFERING;
 		//if (failIfExists)
@@ -1914,10 +2891,43 @@ bool copyFile(const wchar_t* source, const FileInfo& sourceInfo, uint sourceAttr
 
 	#else
 
+	String from = toLinuxPath(source);
+	String to = toLinuxPath(dest);
+
+	#if defined(EACOPY_USE_IO_URING)
+	// Regular path below handles all errors and existing destination files
+	if (!failIfExists && sourceInfo.fileSize <= IoRingSmallFileSize)
+	{
+		bool copied;
+		time_t lastWriteTime;
+		{
+			IOTimerScope _(ioStats, ioStats.writeTime, IOOp_Write);
+			copied = ringCopyFile(from.c_str(), to.c_str(), sourceInfo.fileSize, copyContext.buffers[0], lastWriteTime);
+		}
+		if (copied)
+		{
+			++ioStats.createReadCount;
+			++ioStats.createWriteCount;
+			++ioStats.readCount;
+			++ioStats.writeCount;
+			++ioStats.closeReadCount;
+			++ioStats.closeWriteCount;
+
+			timespec times[2] = { { 0, UTIME_NOW }, { lastWriteTime, 0 } };
+			if (utimensat(AT_FDCWD, to.c_str(), times, 0) == -1)
+			{
+				logErrorf(L"Failed to set file time on %ls: %hs", dest, strerror(errno));
+				return false;
+			}
+			outBytesCopied += sourceInfo.fileSize;
+			return true;
+		}
+	}
+	#endif
+
 	int destFlags = O_WRONLY | O_CREAT;
 	if (failIfExists)
 		destFlags |= O_EXCL;
-	String to = toLinuxPath(dest);
     int destHandle = open(to.c_str(), destFlags, 0644);
 	if (destHandle == -1)
 	{
@@ -1936,7 +2946,6 @@ bool copyFile(const wchar_t* source, const FileInfo& sourceInfo, uint sourceAttr
 		return false;
 	}
 
-	String from = toLinuxPath(source);
 	int sourceHandle = open(from.c_str(), O_RDONLY, 0);
 	if (sourceHandle == -1)
 	{
@@ -1944,24 +2953,24 @@ bool copyFile(const wchar_t* source, const FileInfo& sourceInfo, uint sourceAttr
 		return false;
 	}
 
+	struct stat sourceStat;
+	if (fstat(sourceHandle, &sourceStat) == -1)
+	{
+		EACOPY_NOT_IMPLEMENTED
+		return false;
+	}
+
+	// Source is always read front to back
+	posix_fadvise(sourceHandle, 0, 0, POSIX_FADV_SEQUENTIAL);
+
 	u64 written = 0;
-	u8* buf = copyContext.buffers[0];
-    while (true)
+	if (!copyFileData(sourceHandle, destHandle, sourceStat.st_size, copyContext.buffers[0], written))
 	{
-		size_t size = read(sourceHandle, buf, CopyContextBufferSize);
-		if (size == 0)
-			break;
-		if (size == -1)
-		{
-			EACOPY_NOT_IMPLEMENTED
-			break;
-		}
-        if (write(destHandle, buf, size) == -1)
-		{
-			EACOPY_NOT_IMPLEMENTED
-			break;
-		}
-		written += size;
+		int error = errno;
+		close(sourceHandle);
+		close(destHandle);
+		logErrorf(L"Failed to copy file %ls to %ls. Reason: %hs", source, dest, strerror(error));
+		return false;
 	}
 
 	if (ftruncate(destHandle, written) == -1)
@@ -1984,13 +2993,6 @@ bool copyFile(const wchar_t* source, const FileInfo& sourceInfo, uint sourceAttr
 	}
 
 
-	struct stat sourceStat;
-	if (stat(from.c_str(), &sourceStat) == -1)
-	{
-		EACOPY_NOT_IMPLEMENTED
-		return false;
-	}
-
 	utimbuf newTimes;
 	newTimes.actime = time(NULL);
 	newTimes.modtime = sourceStat.st_mtime;
@@ -2010,7 +3012,7 @@ bool copyFile(const wchar_t* source, const FileInfo& sourceInfo, uint sourceAttr
 bool deleteFile(const wchar_t* fullPath, IOStats& ioStats, bool errorOnMissingFile)
 {
 	++ioStats.deleteFileCount;
-	TimerScope _(ioStats.deleteFileTime);
+	IOTimerScope _(ioStats, ioStats.deleteFileTime, IOOp_DeleteFile);
 
 	#if defined(_WIN32)
 	WString tempBuffer;
@@ -2042,7 +3044,7 @@ bool deleteFile(const wchar_t* fullPath, IOStats& ioStats, bool errorOnMissingFi
 bool moveFile(const wchar_t* source, const wchar_t* dest, IOStats& ioStats)
 {
 	++ioStats.moveFileCount;
-	TimerScope _(ioStats.moveFileTime);
+	IOTimerScope _(ioStats, ioStats.moveFileTime, IOOp_MoveFile);
 	if (MoveFileExW(source, dest, MOVEFILE_REPLACE_EXISTING))
 		return true;
 	logErrorf(L"Failed to move file from %ls to %ls. Reason: %ls", source, dest, getLastErrorText().c_str());
@@ -2157,6 +3159,24 @@ u64 getTime()
 #endif
 }
 
+u64 getPreciseTime()
+{
+	// GetSystemTimeAsFileTime only moves every 1-16ms which would make sub millisecond latency buckets noise
+	#if defined(_WIN32)
+	FILETIME ft;
+	GetSystemTimePreciseAsFileTime(&ft);
+
+	LARGE_INTEGER li;
+	li.LowPart = ft.dwLowDateTime;
+	li.HighPart = ft.dwHighDateTime;
+	return (li.QuadPart - 116444736000000000LL);
+	#else
+	timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (11644473600ull + u64(ts.tv_sec))*10000000ull + u64(ts.tv_nsec)/100;
+	#endif
+}
+
 bool equalsIgnoreCase(const wchar_t* a, const wchar_t* b)
 {
 	return _wcsicmp(a, b) == 0;
@@ -2180,16 +3200,326 @@ bool startsWithIgnoreCase(const wchar_t* str, const wchar_t* substr)
 	#endif
 }
 
-WString getErrorText(uint error)
+bool matchWildcard(const wchar_t* str, const wchar_t* wildcard)
 {
-	#if defined(_WIN32)
-	uint dwRet;
-	wchar_t* lpszTemp = NULL;
-
-	dwRet = FormatMessageW( FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM |FORMAT_MESSAGE_ARGUMENT_ARRAY,
-							NULL, error, MAKELANGID(LANG_ENGLISH, SUBLANG_ENGLISH_US), (LPWSTR)&lpszTemp, 0, NULL);
+	// Greedy with backtracking to last star. Linear for all practical wildcards
+	const wchar_t* starWildcard = nullptr;
+	const wchar_t* starStr = nullptr;
+	while (*str)
+	{
+		if (*wildcard == L'*')
+		{
+			starWildcard = ++wildcard;
+			starStr = str;
+		}
+		else if (*wildcard == L'?' || (*wildcard && towlower(*wildcard) == towlower(*str)))
+		{
+			++wildcard;
+			++str;
+		}
+		else if (starWildcard)
+		{
+			wildcard = starWildcard;
+			str = ++starStr;
+		}
+		else
+			return false;
+	}
+	while (*wildcard == L'*')
+		++wildcard;
+	return *wildcard == 0;
+}
 
-	if (!lpszTemp)
+void
+WildcardMatcher::add(const wchar_t* wildcard)
+{
+	while (*wildcard)
+	{
+		const wchar_t* end = wcschr(wildcard, L';');
+		if (!end)
+			end = wildcard + wcslen(wildcard);
+		WString pattern(wildcard, end);
+		wildcard = *end ? end + 1 : end;
+		if (pattern.empty())
+			continue;
+
+		for (wchar_t& c : pattern)
+			c = towlower(c);
+
+		size_t starCount = std::count(pattern.begin(), pattern.end(), L'*');
+		bool hasQuestionMark = pattern.find(L'?') != WString::npos;
+		if (pattern == L"*" || pattern == L"*.*")
+			m_matchAll = true;
+		else if (!starCount && !hasQuestionMark)
+			m_exact.insert(pattern);
+		else if (starCount == 1 && !hasQuestionMark && pattern.front() == L'*')
+			m_suffixes[uint(pattern.size() - 1)].insert(pattern.substr(1));
+		else if (starCount == 1 && !hasQuestionMark && pattern.back() == L'*')
+			m_prefixes[uint(pattern.size() - 1)].insert(pattern.substr(0, pattern.size() - 1));
+		else
+			m_others.push_back(pattern);
+	}
+}
+
+void
+WildcardMatcher::add(const List<WString>& wildcards)
+{
+	for (auto& wildcard : wildcards)
+		add(wildcard.c_str());
+}
+
+void
+WildcardMatcher::clear()
+{
+	m_matchAll = false;
+	m_exact.clear();
+	m_prefixes.clear();
+	m_suffixes.clear();
+	m_others.clear();
+}
+
+bool
+WildcardMatcher::match(const wchar_t* str) const
+{
+	if (m_matchAll)
+		return true;
+	if (empty())
+		return false;
+
+	WString lower(str);
+	for (wchar_t& c : lower)
+		c = towlower(c);
+	uint len = uint(lower.size());
+
+	if (m_exact.find(lower) != m_exact.end())
+		return true;
+
+	WString temp;
+	temp.reserve(len);
+	for (auto& kv : m_suffixes)
+	{
+		if (kv.first > len)
+			break;
+		temp.assign(lower, len - kv.first, kv.first);
+		if (kv.second.find(temp) != kv.second.end())
+			return true;
+	}
+	for (auto& kv : m_prefixes)
+	{
+		if (kv.first > len)
+			break;
+		temp.assign(lower, 0, kv.first);
+		if (kv.second.find(temp) != kv.second.end())
+			return true;
+	}
+	for (auto& other : m_others)
+		if (matchWildcard(lower.c_str(), other.c_str()))
+			return true;
+	return false;
+}
+
+const wchar_t*
+StringArena::add(const wchar_t* str, uint length)
+{
+	uint charCount = length + 1;
+	wchar_t* dest;
+	if (charCount > BlockCharCount/4)
+	{
+		// Big strings get their own block, inserted before the block being filled
+		dest = new wchar_t[charCount];
+		m_blocks.insert(m_blocks.empty() ? m_blocks.end() : m_blocks.end() - 1, dest);
+		m_memoryUsage += charCount*sizeof(wchar_t);
+	}
+	else
+	{
+		if (m_blockPos + charCount > BlockCharCount)
+		{
+			m_blocks.push_back(new wchar_t[BlockCharCount]);
+			m_blockPos = 0;
+			m_memoryUsage += BlockCharCount*sizeof(wchar_t);
+		}
+		dest = m_blocks.back() + m_blockPos;
+		m_blockPos += charCount;
+	}
+	memcpy(dest, str, length*sizeof(wchar_t));
+	dest[length] = 0;
+	return dest;
+}
+
+void
+StringArena::clear()
+{
+	for (wchar_t* block : m_blocks)
+		delete[] block;
+	m_blocks.clear();
+	m_blockPos = BlockCharCount;
+	m_memoryUsage = 0;
+}
+
+const PathArena::Path*
+PathArena::intern(const wchar_t* str, uint length)
+{
+	// Case sensitive on purpose, paths interned come from traversal and are spelled the same way every time
+	uint hash = 2166136261u;
+	for (uint i=0; i!=length; ++i)
+		hash = (hash ^ str[i]) * 16777619u;
+
+	ScopedCriticalSection cs(m_cs);
+	if (m_paths.size()*2 >= m_table.size())
+		grow();
+	uint mask = uint(m_table.size() - 1);
+	for (uint index = hash & mask;; index = (index + 1) & mask)
+	{
+		Path* path = m_table[index];
+		if (!path)
+		{
+			m_paths.push_back({ m_strings.add(str, length), length, hash });
+			m_table[index] = &m_paths.back();
+			return m_table[index];
+		}
+		if (path->hash == hash && path->length == length && memcmp(path->str, str, length*sizeof(wchar_t)) == 0)
+			return path;
+	}
+}
+
+const wchar_t*
+PathArena::add(const wchar_t* str, uint length)
+{
+	ScopedCriticalSection cs(m_cs);
+	return m_strings.add(str, length);
+}
+
+void
+PathArena::clear()
+{
+	ScopedCriticalSection cs(m_cs);
+	m_table.clear();
+	m_paths.clear();
+	m_strings.clear();
+}
+
+u64
+PathArena::getMemoryUsage()
+{
+	ScopedCriticalSection cs(m_cs);
+	return m_strings.getMemoryUsage() + m_paths.size()*sizeof(Path) + m_table.capacity()*sizeof(Path*);
+}
+
+void
+PathArena::grow()
+{
+	Vector<Path*> table(max(m_table.size()*2, size_t(1024)), nullptr);
+	uint mask = uint(table.size() - 1);
+	for (Path& path : m_paths)
+	{
+		uint index = path.hash & mask;
+		while (table[index])
+			index = (index + 1) & mask;
+		table[index] = &path;
+	}
+	m_table.swap(table);
+}
+
+inline wchar_t
+foldPathChar(wchar_t c)
+{
+	if (c < 128)
+		return (c >= 'A' && c <= 'Z') ? wchar_t(c + 32) : c;
+	return wchar_t(towlower(c));
+}
+
+uint
+PathSet::getHash(const wchar_t* str, uint length)
+{
+	uint hash = 2166136261u;
+	for (uint i=0; i!=length; ++i)
+		hash = (hash ^ foldPathChar(str[i])) * 16777619u;
+	return hash;
+}
+
+bool
+PathSet::insert(const wchar_t* str, uint length)
+{
+	if ((m_count + 1)*4 > m_slots.size()*3)
+		grow();
+	uint hash = getHash(str, length);
+	uint mask = uint(m_slots.size() - 1);
+	for (uint index = hash & mask;; index = (index + 1) & mask)
+	{
+		Slot& slot = m_slots[index];
+		if (!slot.str)
+		{
+			slot = { m_strings.add(str, length), length, hash };
+			++m_count;
+			return true;
+		}
+		if (slot.hash != hash || slot.length != length)
+			continue;
+		uint i = 0;
+		while (i != length && foldPathChar(slot.str[i]) == foldPathChar(str[i]))
+			++i;
+		if (i == length)
+			return false;
+	}
+}
+
+bool
+PathSet::contains(const wchar_t* str, uint length) const
+{
+	if (!m_count)
+		return false;
+	uint hash = getHash(str, length);
+	uint mask = uint(m_slots.size() - 1);
+	for (uint index = hash & mask;; index = (index + 1) & mask)
+	{
+		const Slot& slot = m_slots[index];
+		if (!slot.str)
+			return false;
+		if (slot.hash != hash || slot.length != length)
+			continue;
+		uint i = 0;
+		while (i != length && foldPathChar(slot.str[i]) == foldPathChar(str[i]))
+			++i;
+		if (i == length)
+			return true;
+	}
+}
+
+void
+PathSet::clear()
+{
+	m_slots.clear();
+	m_count = 0;
+	m_strings.clear();
+}
+
+void
+PathSet::grow()
+{
+	Vector<Slot> slots(max(m_slots.size()*2, size_t(256)), Slot{ nullptr, 0, 0 });
+	uint mask = uint(slots.size() - 1);
+	for (const Slot& slot : m_slots)
+	{
+		if (!slot.str)
+			continue;
+		uint index = slot.hash & mask;
+		while (slots[index].str)
+			index = (index + 1) & mask;
+		slots[index] = slot;
+	}
+	m_slots.swap(slots);
+}
+
+WString getErrorText(uint error)
+{
+	#if defined(_WIN32)
+	uint dwRet;
+	wchar_t* lpszTemp = NULL;
+
+	dwRet = FormatMessageW( FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM |FORMAT_MESSAGE_ARGUMENT_ARRAY,
+							NULL, error, MAKELANGID(LANG_ENGLISH, SUBLANG_ENGLISH_US), (LPWSTR)&lpszTemp, 0, NULL);
+
+	if (!lpszTemp)
 		return WString();
 
 	// Remove line feed in the end
@@ -2389,107 +3719,416 @@ FileKey::operator<(const FileKey& o) const
 	return fileSize < o.fileSize;
 }
 
+struct FileDatabase::MappedHeader
+{
+	u8				cookie[12];
+	HashAlgorithm	hashAlgorithm;
+	u8				wcharSize;
+	u8				padding[2];
+	uint			recordCount;
+	uint			keySlotCount;
+	uint			hashSlotCount;
+	uint			padding2;
+	u64				namesSize; // In wchar_t
+};
+
+struct FileDatabase::MappedRecord
+{
+	u64				fileSize;
+	FileTime		lastWriteTime;
+	Hash			hash;
+	uint			nameOffset; // In wchar_t from start of names
+	u16				nameLen;
+	u16				keyLen; // Key name is the last keyLen characters of name
+};
+
+static_assert(sizeof(FileDatabase::MappedHeader) == 40, "");
+static_assert(sizeof(FileDatabase::MappedRecord) == 40, "");
+
+u64
+getKeyNameHash(const wchar_t* name, uint nameLen)
+{
+	u64 hash = 14695981039346656037ull; // fnv1a
+	for (uint i=0; i!=nameLen; ++i)
+	{
+		hash ^= u64(name[i]);
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+FileDatabase::~FileDatabase()
+{
+	flushJournal();
+	IOStats ioStats;
+	closeFile(m_journalFileName.c_str(), m_journalFile, AccessType_Write, ioStats);
+}
+
+bool
+isSameKey(const FileKey& a, const FileKey& b)
+{
+	return a.fileSize == b.fileSize && memcmp(&a.lastWriteTime, &b.lastWriteTime, sizeof(FileTime)) == 0 && a.name == b.name;
+}
+
 FileDatabase::FileRec
 FileDatabase::getRecord(const FileKey& key)
 {
-	ScopedCriticalSection cs(m_filesCs);
-	auto findIt = m_files.find(key);
-	if (findIt != m_files.end())
+	Shard& shard = getShard(key.name.c_str(), uint(key.name.size()));
+	ScopedCriticalSection cs(shard.cs);
+	auto findIt = shard.files.find(key);
+	if (findIt != shard.files.end())
 		return findIt->second;
-	return FileRec();
+	return getMappedRecord(findMappedRecord(key));
 }
 
 FileDatabase::FileRec
 FileDatabase::getRecord(const Hash& hash)
 {
-	auto findIt = m_fileHashes.find(hash);
-	if (findIt != m_fileHashes.end())
-		return *findIt->second;
-	return {};
+	if (!isValid(hash))
+		return {};
+
+	FileKey key;
+	bool found = false;
+	HashShard& hashShard = getHashShard(hash);
+	hashShard.cs.scoped([&]()
+		{
+			auto findIt = hashShard.hashes.find(hash);
+			if (findIt == hashShard.hashes.end())
+				return;
+			key = findIt->second;
+			found = true;
+		});
+
+	// Record might have been touched, removed or evicted since we looked at the hash
+	if (found)
+	{
+		FileRec rec = getRecord(key);
+		if (rec.hash == hash)
+			return rec;
+	}
+
+	// Mapped records with same hash are all in the probe sequence. Removed ones are skipped so a live duplicate is still found
+	for (uint slot = ~0u;;)
+	{
+		uint index = findMappedRecord(hash, slot);
+		if (index == ~0u)
+			return {};
+		FileRec rec = getRecord(getMappedRecordKey(index));
+		if (rec.hash == hash)
+			return rec;
+	}
 }
 
 uint
 FileDatabase::getHistorySize()
 {
-	ScopedCriticalSection cs(m_filesCs);
-	return (uint)m_files.size();
+	uint historySize = 0;
+	for (Shard& shard : m_shards)
+		shard.cs.scoped([&]() { historySize += uint(shard.files.size()) + shard.mappedLiveCount; });
+	return historySize;
+}
+
+void
+FileDatabase::getRecentFiles(Vector<WString>& outNames, u64 maxFileSize, uint maxCount)
+{
+	// Newest records of each shard first. Shards are filled evenly since keys are spread over them on hash
+	uint maxPerShard = maxCount / ShardCount + 1;
+	for (Shard& shard : m_shards)
+	{
+		ScopedCriticalSection _(shard.cs);
+		uint count = 0;
+		for (auto it = shard.history.rbegin(), e = shard.history.rend(); it != e && count != maxPerShard; ++it)
+		{
+			if (!it->fileSize || it->fileSize > maxFileSize)
+				continue;
+			outNames.push_back(shard.files.find(*it)->second.name);
+			++count;
+		}
+		for (uint i=uint(shard.mappedIndices.size()); i!=shard.mappedHistoryBegin && count != maxPerShard; --i)
+		{
+			uint index = shard.mappedIndices[i - 1];
+			if (m_mappedRemoved[index])
+				continue;
+			const MappedRecord& rec = m_mappedRecords[index];
+			if (!rec.fileSize || rec.fileSize > maxFileSize)
+				continue;
+			outNames.push_back(WString(m_mappedNames + rec.nameOffset, rec.nameLen));
+			++count;
+		}
+	}
 }
 
 bool
 FileDatabase::findFileForDeltaCopy(WString& outFile, const FileKey& key)
 {
-	ScopedCriticalSection cs(m_filesCs);
+	Shard& shard = getShard(key.name.c_str(), uint(key.name.size()));
+	ScopedCriticalSection cs(shard.cs);
 	FileKey searchKey { key.name, 0, 0 };
-	auto searchIt = m_files.lower_bound(searchKey);
-	while (searchIt != m_files.end())
+	auto searchIt = shard.files.lower_bound(searchKey);
+	while (searchIt != shard.files.end())
 	{
 		if (searchIt->first.name != key.name)
-			return false;
+			break;
 		outFile = searchIt->second.name;
 		return true;
 	}
-	return false;
+
+	uint index = findMappedRecord(key.name);
+	if (index == ~0u)
+		return false;
+	outFile = getMappedRecord(index).name;
+	return true;
 }
 
 void
 FileDatabase::addToFilesHistory(const FileKey& key, const Hash& hash, const WString& fullFileName)
 {
-	ScopedCriticalSection cs(m_filesCs);
-	auto insres = m_files.insert({key, FileRec()});
-	if (!insres.second)
-		m_filesHistory.erase(insres.first->second.historyIt);
-	m_filesHistory.push_back(key);
-	FileRec& rec = insres.first->second;
-	rec.name = fullFileName;
-	rec.hash = hash;
-	rec.historyIt = --m_filesHistory.end();
-	if (isValid(hash))
-		m_fileHashes[hash] = &rec;
+	Shard& shard = getShard(key.name.c_str(), uint(key.name.size()));
+	shard.cs.scoped([&]()
+		{
+			uint mappedIndex = findMappedRecord(key);
+			if (mappedIndex != ~0u)
+				removeMappedRecord(shard, mappedIndex);
+			auto insres = shard.files.insert({key, FileRec()});
+			FileRec& rec = insres.first->second;
+			if (!insres.second)
+			{
+				shard.history.erase(rec.historyIt);
+				if (!(rec.hash == hash))
+					removeHash(rec.hash, key);
+			}
+			shard.history.push_back(key);
+			rec.name = fullFileName;
+			rec.hash = hash;
+			rec.historyIt = --shard.history.end();
+			if (isValid(hash))
+			{
+				HashShard& hashShard = getHashShard(hash);
+				ScopedCriticalSection hashCs(hashShard.cs);
+				hashShard.hashes[hash] = key;
+			}
+
+			// Amortized eviction, each insert pays for the records it pushes out
+			if (m_maxHistory)
+			{
+				uint maxShardHistory = (m_maxHistory + ShardCount - 1) / ShardCount;
+				uint shardHistory = uint(shard.files.size()) + shard.mappedLiveCount;
+				if (shardHistory > maxShardHistory)
+					evictOldest(shard, shardHistory - maxShardHistory);
+			}
+		});
+
+	if (m_fileAddedFunc)
+		m_fileAddedFunc(key, fullFileName);
+
+	if (m_journalActive)
+		appendToJournal(key, hash, fullFileName);
 }
 
 void
 FileDatabase::removeFileHistory(const FileKey& key)
 {
-	ScopedCriticalSection cs(m_filesCs);
-	auto findIt = m_files.find(key);
-	if (findIt == m_files.end())
+	Shard& shard = getShard(key.name.c_str(), uint(key.name.size()));
+	ScopedCriticalSection cs(shard.cs);
+	uint mappedIndex = findMappedRecord(key);
+	if (mappedIndex != ~0u)
+		removeMappedRecord(shard, mappedIndex);
+	auto findIt = shard.files.find(key);
+	if (findIt == shard.files.end())
 		return;
 	FileRec& rec = findIt->second;
-	m_filesHistory.erase(rec.historyIt);
-	m_fileHashes.erase(rec.hash);
-	m_files.erase(findIt);
+	shard.history.erase(rec.historyIt);
+	removeHash(rec.hash, key);
+	shard.files.erase(findIt);
 }
 
 uint
 FileDatabase::garbageCollect(uint maxHistory)
 {
-	ScopedCriticalSection cs(m_filesCs);
-	if (m_filesHistory.size() < maxHistory)
-		return 0;
-	uint removeCount = (uint)m_filesHistory.size() - maxHistory;
-	uint it = removeCount;
-	while (it--)
+	// History is only ordered within a shard so each shard is trimmed to its part of maxHistory
+	uint maxShardHistory = (maxHistory + ShardCount - 1) / ShardCount;
+	uint removeCount = 0;
+	for (Shard& shard : m_shards)
 	{
-		auto findIt = m_files.find(m_filesHistory.front());
-		auto hashFindIt = m_fileHashes.find(findIt->second.hash);
-		if (hashFindIt->second == &findIt->second)
-			m_fileHashes.erase(hashFindIt);
-		m_files.erase(findIt);
-		m_filesHistory.pop_front();
+		ScopedCriticalSection cs(shard.cs);
+		uint shardHistory = uint(shard.files.size()) + shard.mappedLiveCount;
+		if (shardHistory > maxShardHistory)
+			removeCount += evictOldest(shard, shardHistory - maxShardHistory);
 	}
 	return removeCount;
 }
 
+FileDatabase::Shard&
+FileDatabase::getShard(const wchar_t* keyName, uint keyNameLen)
+{
+	// Low bits are used by mapped key slots
+	return m_shards[uint(getKeyNameHash(keyName, keyNameLen) >> 32) % ShardCount];
+}
+
+FileDatabase::HashShard&
+FileDatabase::getHashShard(const Hash& hash)
+{
+	// Low bits of first are used by mapped hash slots
+	return m_hashShards[uint(hash.second) % ShardCount];
+}
+
+uint
+FileDatabase::evictOldest(Shard& shard, uint count)
+{
+	// Mapped records are always older than the ones in memory
+	uint evicted = 0;
+	while (evicted != count && shard.mappedLiveCount)
+	{
+		uint index = shard.mappedIndices[shard.mappedHistoryBegin++];
+		if (m_mappedRemoved[index])
+			continue;
+		removeMappedRecord(shard, index);
+		++evicted;
+	}
+
+	while (evicted != count && !shard.history.empty())
+	{
+		auto findIt = shard.files.find(shard.history.front());
+		removeHash(findIt->second.hash, findIt->first);
+		shard.files.erase(findIt);
+		shard.history.pop_front();
+		++evicted;
+	}
+	return evicted;
+}
+
+void
+FileDatabase::removeHash(const Hash& hash, const FileKey& key)
+{
+	if (!isValid(hash))
+		return;
+	HashShard& hashShard = getHashShard(hash);
+	ScopedCriticalSection cs(hashShard.cs);
+	auto findIt = hashShard.hashes.find(hash);
+	if (findIt != hashShard.hashes.end() && isSameKey(findIt->second, key))
+		hashShard.hashes.erase(findIt);
+}
+
+uint
+FileDatabase::findMappedRecord(const FileKey& key)
+{
+	if (!m_mappedRecordCount)
+		return ~0u;
+	uint mask = m_mappedKeySlotCount - 1;
+	uint slot = uint(getKeyNameHash(key.name.c_str(), uint(key.name.size()))) & mask;
+	while (uint slotValue = m_mappedKeySlots[slot])
+	{
+		// Removed flag is only checked after key matches since it can only be read under the lock of the shard owning the record
+		uint index = slotValue - 1;
+		const MappedRecord& rec = m_mappedRecords[index];
+		if (rec.fileSize == key.fileSize && rec.keyLen == key.name.size() && memcmp(&rec.lastWriteTime, &key.lastWriteTime, sizeof(FileTime)) == 0)
+			if (wmemcmp(m_mappedNames + rec.nameOffset + rec.nameLen - rec.keyLen, key.name.c_str(), rec.keyLen) == 0)
+				return m_mappedRemoved[index] ? ~0u : index;
+		slot = (slot + 1) & mask;
+	}
+	return ~0u;
+}
+
+uint
+FileDatabase::findMappedRecord(const WString& keyName)
+{
+	if (!m_mappedRecordCount)
+		return ~0u;
+	uint mask = m_mappedKeySlotCount - 1;
+	uint slot = uint(getKeyNameHash(keyName.c_str(), uint(keyName.size()))) & mask;
+	while (uint slotValue = m_mappedKeySlots[slot])
+	{
+		uint index = slotValue - 1;
+		const MappedRecord& rec = m_mappedRecords[index];
+		if (rec.keyLen == keyName.size() && wmemcmp(m_mappedNames + rec.nameOffset + rec.nameLen - rec.keyLen, keyName.c_str(), rec.keyLen) == 0)
+			if (!m_mappedRemoved[index])
+				return index;
+		slot = (slot + 1) & mask;
+	}
+	return ~0u;
+}
+
+uint
+FileDatabase::findMappedRecord(const Hash& hash, uint& inOutSlot)
+{
+	// Can be called without holding any lock. Caller must verify record through key and call again with same slot to get next match
+	if (!m_mappedHashSlotCount || !isValid(hash))
+		return ~0u;
+	uint mask = m_mappedHashSlotCount - 1;
+	uint slot = inOutSlot == ~0u ? uint(hash.first) & mask : inOutSlot;
+	while (uint slotValue = m_mappedHashSlots[slot])
+	{
+		uint index = slotValue - 1;
+		slot = (slot + 1) & mask;
+		if (m_mappedRecords[index].hash == hash)
+		{
+			inOutSlot = slot;
+			return index;
+		}
+	}
+	return ~0u;
+}
+
+FileDatabase::FileRec
+FileDatabase::getMappedRecord(uint index)
+{
+	FileRec rec;
+	if (index == ~0u)
+		return rec;
+	const MappedRecord& mappedRec = m_mappedRecords[index];
+	rec.name.assign(m_mappedNames + mappedRec.nameOffset, mappedRec.nameLen);
+	if (m_mappedHashSlotCount) // Hash slots are dropped when hashes were made with different algorithm
+		rec.hash = mappedRec.hash;
+	return rec;
+}
+
+FileKey
+FileDatabase::getMappedRecordKey(uint index)
+{
+	const MappedRecord& rec = m_mappedRecords[index];
+	const wchar_t* keyName = m_mappedNames + rec.nameOffset + rec.nameLen - rec.keyLen;
+	return { WString(keyName, keyName + rec.keyLen), rec.lastWriteTime, rec.fileSize };
+}
+
+void
+FileDatabase::removeMappedRecord(Shard& shard, uint index)
+{
+	if (m_mappedRemoved[index])
+		return;
+	m_mappedRemoved[index] = 1;
+	--shard.mappedLiveCount;
+}
+
+void
+FileDatabase::closeMapped()
+{
+	m_mappedFile.close();
+	m_mappedRecords = nullptr;
+	m_mappedKeySlots = nullptr;
+	m_mappedHashSlots = nullptr;
+	m_mappedNames = nullptr;
+	m_mappedRecordCount = 0;
+	m_mappedKeySlotCount = 0;
+	m_mappedHashSlotCount = 0;
+	m_mappedRemoved.clear();
+	for (Shard& shard : m_shards)
+	{
+		shard.mappedIndices.clear();
+		shard.mappedHistoryBegin = 0;
+		shard.mappedLiveCount = 0;
+	}
+}
+
+constexpr u8 primeCheckpointCookie[] = "eacopypr002"; // Cookie is followed by wchar size and a stream of directories with last write time, sub directory names and files
+constexpr u8 primeCheckpointCookieV1[] = "eacopypr001"; // Same as v2 without files. Ignored, all directories are listed once more
+
 bool
 FileDatabase::primeDirectory(const WString& directory, IOStats& ioStats, bool useRelativePath, bool flush)
 {
-	ScopedCriticalSection cs(m_primeDirsCs);
-	m_primeDirs.push_back({directory, useRelativePath ? uint(directory.size()) : 0u});
+	m_primeDirsCs.scoped([&]() { m_primeDirs.push_back({directory, useRelativePath ? uint(directory.size()) : 0u}); });
 	if (!flush)
 		return true;
-	while (primeUpdate(ioStats))
-		;
-	return true;
+	return primeWait(ioStats);
 }
 
 bool
@@ -2515,16 +4154,74 @@ FileDatabase::primeUpdate(IOStats& ioStats)
 			m_primeDirsCs.scoped([this]() { --m_primeActive; });
 		});
 
-    FindFileData fd;
-    WString searchStr = rec.directory + L"*.*";
-	FindFileHandle fh = findFirstFile(searchStr.c_str(), fd, ioStats);
-    if(fh == InvalidFileHandle)
-	{
-		logErrorf(L"FindFirstFile failed with search string %ls", searchStr.c_str());
+	if (m_primeCancel)
 		return false;
-	}
+
+	if (!rec.lastWriteTime.dwLowDateTime && !rec.lastWriteTime.dwHighDateTime)
+	{
+		FileInfo dirInfo;
+		if (getFileInfo(dirInfo, rec.directory.c_str(), ioStats))
+			rec.lastWriteTime = dirInfo.lastWriteTime;
+	}
+
+	// Directory time changes when entries are added, removed or renamed so an unchanged directory does not need to be listed.
+	// Files rewritten in place don't change it though, so each file is still compared with the time and size in the checkpoint
+	PrimeCheckpointRec checkpointRec;
+	bool hasCheckpoint = false;
+	m_primeDirsCs.scoped([&]()
+		{
+			if (!rec.lastWriteTime.dwLowDateTime && !rec.lastWriteTime.dwHighDateTime)
+				return;
+			const PrimeCheckpointRec* found = nullptr;
+			auto pendingIt = m_primeCheckpointPending.find(rec.directory);
+			if (pendingIt != m_primeCheckpointPending.end())
+				found = &pendingIt->second;
+			else
+			{
+				auto findIt = m_primeCheckpoint.find(rec.directory);
+				if (findIt != m_primeCheckpoint.end())
+					found = &findIt->second;
+			}
+			if (!found || memcmp(&found->lastWriteTime, &rec.lastWriteTime, sizeof(FileTime)) != 0)
+				return;
+			checkpointRec = *found;
+			hasCheckpoint = true;
+		});
+	if (hasCheckpoint)
+	{
+		bool unchanged = true;
+		for (auto& file : checkpointRec.files)
+		{
+			FileInfo fileInfo;
+			WString fullPath = rec.directory + file.name;
+			if (!getFileInfo(fileInfo, fullPath.c_str(), ioStats) || fileInfo.fileSize != file.fileSize || memcmp(&fileInfo.lastWriteTime, &file.lastWriteTime, sizeof(FileTime)) != 0)
+			{
+				unchanged = false;
+				break;
+			}
+		}
+		if (unchanged)
+		{
+			ScopedCriticalSection cs(m_primeDirsCs);
+			for (auto& subDir : checkpointRec.subDirs)
+				m_primeDirs.push_back({rec.directory + subDir + L'\\', rec.rootLen});
+			++m_primeStats.unchangedDirCount;
+			return true;
+		}
+	}
+
+    FindFileData fd;
+    WString searchStr = rec.directory + L"*.*";
+	FindFileHandle fh = findFirstFile(searchStr.c_str(), fd, ioStats);
+    if(fh == InvalidFileHandle)
+	{
+		logErrorf(L"FindFirstFile failed with search string %ls", searchStr.c_str());
+		return false;
+	}
 
 	ScopeGuard _([&]() { findClose(fh, ioStats); });
+	Vector<WString> subDirs;
+	Vector<PrimeCheckpointFile> files;
     do
 	{
 		FileInfo fileInfo;
@@ -2535,16 +4232,29 @@ FileDatabase::primeUpdate(IOStats& ioStats)
 		{
 			if (isDotOrDotDot(fileName))
 				continue;
+			subDirs.push_back(fileName);
 			ScopedCriticalSection cs(m_primeDirsCs);
-			m_primeDirs.push_back({rec.directory + fileName + L'\\', rec.rootLen});
+			m_primeDirs.push_back({rec.directory + fileName + L'\\', rec.rootLen, fileInfo.lastWriteTime});
 		}
 		else
 		{
-			Hash hash; // TODO: Should use hashes also calculate hash for files?
+			files.push_back({fileName, fileInfo.lastWriteTime, fileInfo.fileSize});
 			WString fullPath = rec.directory + fileName;
-			if (rec.rootLen)
-				fileName = fullPath.c_str() + rec.rootLen;
-			addToFilesHistory({ fileName, fileInfo.lastWriteTime, fileInfo.fileSize }, hash, fullPath);
+			uint keyOffset = rec.rootLen ? rec.rootLen : uint(rec.directory.size());
+			FileKey key { fullPath.c_str() + keyOffset, fileInfo.lastWriteTime, fileInfo.fileSize };
+
+			// Keep hash of files primed before, only new or changed files need hashing
+			FileRec existing = getRecord(key);
+			bool hasHash = existing.name == fullPath && isValid(existing.hash);
+			addToFilesHistory(key, hasHash ? existing.hash : Hash(), fullPath);
+			++m_primeStats.fileCount;
+
+			if (m_primeUseHash && !hasHash && fileInfo.fileSize)
+			{
+				ScopedCriticalSection cs(m_primeDirsCs);
+				m_primeHashes.push_back({fullPath, keyOffset, fileInfo});
+				++m_primeStats.hashQueuedCount;
+			}
 		}
 	}
 	while(findNextFile(fh, fd, ioStats));
@@ -2556,24 +4266,336 @@ FileDatabase::primeUpdate(IOStats& ioStats)
 		return false;
 	}
 
+	++m_primeStats.dirCount;
+	bool writeCheckpoint = false;
+	m_primeDirsCs.scoped([&]()
+		{
+			auto& newRec = (m_primeCheckpointWriting ? m_primeCheckpointPending : m_primeCheckpoint)[rec.directory];
+			newRec.lastWriteTime = rec.lastWriteTime;
+			newRec.subDirs = std::move(subDirs);
+			newRec.files = std::move(files);
+
+			u64 time = getTime();
+			if (!m_primeCheckpointFile.empty() && timeToMs(time - m_primeCheckpointTime) > 60*1000)
+			{
+				m_primeCheckpointTime = time;
+				writeCheckpoint = true;
+			}
+		});
+	if (writeCheckpoint)
+		primeWriteCheckpoint(ioStats);
+
+	return true;
+}
+
+bool
+FileDatabase::primeHashUpdate(IOStats& ioStats, CopyContext& copyContext, HashContext& hashContext)
+{
+	PrimeHashRec rec;
+	u64 startTime = 0;
+	u64 windowBytes = 0;
+	m_primeDirsCs.scoped([&]()
+		{
+			if (m_primeHashes.empty())
+				return;
+			rec = std::move(m_primeHashes.front());
+			m_primeHashes.pop_front();
+			if (!m_primeHashStartTime)
+			{
+				m_primeHashStartTime = getTime();
+				m_primeHashWindowBytes = 0;
+			}
+			startTime = m_primeHashStartTime;
+			windowBytes = m_primeHashWindowBytes += rec.info.fileSize;
+			if (m_primeHashes.empty())
+				m_primeHashStartTime = 0;
+		});
+
+	if (rec.fullPath.empty())
+		return false;
+
+	// Hashing runs in the background of a live server so it is not allowed to eat all disk bandwidth
+	if (m_primeHashBytesPerSecond)
+		while (!m_primeCancel)
+		{
+			u64 elapsedMs = timeToMs(getTime() - startTime);
+			u64 allowedMs = windowBytes * 1000 / m_primeHashBytesPerSecond;
+			if (elapsedMs >= allowedMs)
+				break;
+			Sleep(uint(min(allowedMs - elapsedMs, u64(100))));
+		}
+
+	// File might have changed or be gone since it was scanned
+	FileInfo info;
+	if (!getFileInfo(info, rec.fullPath.c_str(), ioStats) || info.fileSize != rec.info.fileSize || memcmp(&info.lastWriteTime, &rec.info.lastWriteTime, sizeof(FileTime)) != 0)
+		return true;
+
+	Hash hash;
+	u64 hashTime = 0;
+	if (!getFileHash(hash, rec.fullPath.c_str(), copyContext, ioStats, hashContext, hashTime))
+		return true;
+
+	addToFilesHistory({ rec.fullPath.c_str() + rec.keyOffset, rec.info.lastWriteTime, rec.info.fileSize }, hash, rec.fullPath);
+	++m_primeStats.hashedCount;
+	m_primeStats.hashedBytes += rec.info.fileSize;
 	return true;
 }
 
 bool
 FileDatabase::primeWait(IOStats& ioStats)
 {
-	while (true)
+	auto work = [this](IOStats& threadIoStats)
 	{
-		if (primeUpdate(ioStats))
-			continue;
-		ScopedCriticalSection cs(m_primeDirsCs);
-		if (m_primeActive == 0 && m_primeDirs.empty())
+		while (!m_primeCancel)
+		{
+			if (primeUpdate(threadIoStats))
+				continue;
+			bool done = false;
+			m_primeDirsCs.scoped([&]() { done = m_primeActive == 0 && m_primeDirs.empty(); });
+			if (done)
+				break;
+			Sleep(1); // Other threads are scanning directories that can add more
+		}
+
+		// All directories are scanned so it is time to hash what was found
+		if (!m_primeUseHash)
+			return 0;
+		CopyContext copyContext;
+		u64 hashTime = 0;
+		u64 hashCount = 0;
+		HashContext hashContext(hashTime, hashCount, m_hashAlgorithm);
+		while (!m_primeCancel && primeHashUpdate(threadIoStats, copyContext, hashContext))
+			;
+		return 0;
+	};
+
+	HelperThreads helperThreads;
+	helperThreads.run(max(m_primeThreadCount, 1u) - 1, ioStats, work);
+
+	if (!m_primeCheckpointFile.empty())
+		primeWriteCheckpoint(ioStats);
+	return true;
+}
+
+void
+FileDatabase::primeCancel()
+{
+	m_primeCancel = true;
+}
+
+bool
+FileDatabase::isPriming()
+{
+	ScopedCriticalSection cs(m_primeDirsCs);
+	return m_primeActive || !m_primeDirs.empty() || !m_primeHashes.empty();
+}
+
+bool
+FileDatabase::primeReadCheckpoint(const wchar_t* fullPath, IOStats& ioStats)
+{
+	FileInfo info;
+	if (!getFileInfo(info, fullPath, ioStats))
+		return true;
+
+	MappedFile file;
+	if (!file.open(fullPath, ioStats))
+		return false;
+
+	const u8* pos = file.data();
+	const u8* end = pos + file.size();
+	if (file.size() >= sizeof(primeCheckpointCookieV1) && memcmp(pos, primeCheckpointCookieV1, sizeof(primeCheckpointCookieV1)) == 0)
+		return true;
+	if (file.size() < sizeof(primeCheckpointCookie) + 1 || memcmp(pos, primeCheckpointCookie, sizeof(primeCheckpointCookie)) != 0)
+	{
+		logErrorf(L"Prime checkpoint file %ls has unknown format", fullPath);
+		return false;
+	}
+	pos += sizeof(primeCheckpointCookie);
+	if (*pos++ != sizeof(wchar_t))
+		return true;
+
+	auto readString = [&](WString& out)
+	{
+		uint len;
+		if (u64(end - pos) < sizeof(uint))
+			return false;
+		memcpy(&len, pos, sizeof(uint));
+		pos += sizeof(uint);
+		if (u64(end - pos) < u64(len)*sizeof(wchar_t))
+			return false;
+		out.assign((const wchar_t*)pos, len);
+		pos += len*sizeof(wchar_t);
+		return true;
+	};
+
+	ScopedCriticalSection cs(m_primeDirsCs);
+	while (pos != end)
+	{
+		WString directory;
+		uint subDirCount;
+		if (!readString(directory) || u64(end - pos) < sizeof(FileTime) + sizeof(uint))
 			break;
+		PrimeCheckpointRec& rec = m_primeCheckpoint[directory];
+		memcpy(&rec.lastWriteTime, pos, sizeof(FileTime));
+		pos += sizeof(FileTime);
+		memcpy(&subDirCount, pos, sizeof(uint));
+		pos += sizeof(uint);
+		rec.subDirs.resize(subDirCount);
+		uint i = 0;
+		while (i != subDirCount && readString(rec.subDirs[i]))
+			++i;
+		uint fileCount = 0;
+		bool valid = i == subDirCount && u64(end - pos) >= sizeof(uint);
+		if (valid)
+		{
+			memcpy(&fileCount, pos, sizeof(uint));
+			pos += sizeof(uint);
+			rec.files.resize(fileCount);
+			for (i = 0; valid && i != fileCount; ++i)
+			{
+				PrimeCheckpointFile& file = rec.files[i];
+				valid = readString(file.name) && u64(end - pos) >= sizeof(FileTime) + sizeof(u64);
+				if (!valid)
+					break;
+				memcpy(&file.lastWriteTime, pos, sizeof(FileTime));
+				pos += sizeof(FileTime);
+				memcpy(&file.fileSize, pos, sizeof(u64));
+				pos += sizeof(u64);
+			}
+		}
+		if (!valid)
+		{
+			m_primeCheckpoint.erase(directory);
+			break;
+		}
 	}
+
+	if (pos != end)
+		logErrorf(L"Prime checkpoint file %ls is truncated", fullPath);
 	return true;
 }
 
-constexpr u8 linkDbCookie[] = "eacopydb003";
+bool
+FileDatabase::primeWriteCheckpoint(IOStats& ioStats)
+{
+	// Checkpoint is serialized and written without lock. Meanwhile priming threads put their updates in m_primeCheckpointPending
+	bool alreadyWriting = false;
+	m_primeDirsCs.scoped([&]()
+		{
+			alreadyWriting = m_primeCheckpointWriting;
+			m_primeCheckpointWriting = true;
+		});
+	if (alreadyWriting)
+		return true;
+	ScopeGuard pendingGuard([&]()
+		{
+			ScopedCriticalSection cs(m_primeDirsCs);
+			for (auto& kv : m_primeCheckpointPending)
+				m_primeCheckpoint[kv.first] = std::move(kv.second);
+			m_primeCheckpointPending.clear();
+			m_primeCheckpointWriting = false;
+		});
+
+	Vector<u8> buffer;
+	auto append = [&](const void* data, size_t size) { buffer.insert(buffer.end(), (const u8*)data, (const u8*)data + size); };
+	auto appendString = [&](const WString& str) { uint len = uint(str.size()); append(&len, sizeof(uint)); append(str.c_str(), len*sizeof(wchar_t)); };
+
+	append(primeCheckpointCookie, sizeof(primeCheckpointCookie));
+	u8 wcharSize = sizeof(wchar_t);
+	append(&wcharSize, 1);
+	for (auto& kv : m_primeCheckpoint)
+	{
+		appendString(kv.first);
+		append(&kv.second.lastWriteTime, sizeof(FileTime));
+		uint subDirCount = uint(kv.second.subDirs.size());
+		append(&subDirCount, sizeof(uint));
+		for (auto& subDir : kv.second.subDirs)
+			appendString(subDir);
+		uint fileCount = uint(kv.second.files.size());
+		append(&fileCount, sizeof(uint));
+		for (auto& file : kv.second.files)
+		{
+			appendString(file.name);
+			append(&file.lastWriteTime, sizeof(FileTime));
+			append(&file.fileSize, sizeof(u64));
+		}
+	}
+
+	const wchar_t* fullPath = m_primeCheckpointFile.c_str();
+	FileHandle handle;
+	if (!openFileWrite(fullPath, handle, ioStats, true))
+		return false;
+	ScopeGuard fileGuard([&]() { closeFile(fullPath, handle, AccessType_Write, ioStats); });
+	return eacopy::writeFile(fullPath, handle, buffer.data(), buffer.size(), ioStats);
+}
+
+constexpr u8 linkDbCookie[] = "eacopydb005"; // Cookie is first in MappedHeader, followed by records, key slots, hash slots and names
+constexpr u8 linkDbCookieV4[] = "eacopydb004"; // Cookie is followed by HashAlgorithm and a stream of entries
+constexpr u8 linkDbCookieV3[] = "eacopydb003"; // Same layout as v4 but without HashAlgorithm. Hashes are always md5
+constexpr u8 linkDbJournalCookie[] = "eacopyjn001"; // Cookie is followed by HashAlgorithm and a stream of entries in v4 layout
+static_assert(sizeof(linkDbCookie) == sizeof(FileDatabase::MappedHeader::cookie), "");
+
+// Entry layout used by v3/v4 databases and journal: u16 name bytes, u16 key len, name, file size, last write time, hash
+enum { DatabaseEntryFixedSize = sizeof(u16) + sizeof(u16) + sizeof(u64) + sizeof(FileTime) + sizeof(Hash) };
+
+void
+appendDatabaseEntry(Vector<u8>& out, const FileKey& key, const Hash& hash, const WString& fullFileName)
+{
+	if (fullFileName.size() >= MaxPath)
+		return;
+	u16 fullNameLen = u16(fullFileName.size() * sizeof(wchar_t));
+	u16 keyLen = u16(key.name.size());
+	size_t pos = out.size();
+	out.resize(pos + DatabaseEntryFixedSize + fullNameLen);
+	u8* dest = out.data() + pos;
+	memcpy(dest, &fullNameLen, sizeof(fullNameLen)); dest += sizeof(fullNameLen);
+	memcpy(dest, &keyLen, sizeof(keyLen)); dest += sizeof(keyLen);
+	memcpy(dest, fullFileName.c_str(), fullNameLen); dest += fullNameLen;
+	memcpy(dest, &key.fileSize, sizeof(key.fileSize)); dest += sizeof(key.fileSize);
+	memcpy(dest, &key.lastWriteTime, sizeof(key.lastWriteTime)); dest += sizeof(key.lastWriteTime);
+	memcpy(dest, &hash, sizeof(hash));
+}
+
+bool
+readDatabaseEntries(FileDatabase& database, const u8* pos, const u8* end, bool keepHashes)
+{
+	while (u64(end - pos) >= sizeof(u16))
+	{
+		u16 fullNameLen;
+		memcpy(&fullNameLen, pos, sizeof(u16));
+		if (fullNameLen == 0) // Terminator
+			return true;
+		uint nameLen = fullNameLen / sizeof(wchar_t);
+		if (fullNameLen % sizeof(wchar_t) || nameLen >= MaxPath || u64(end - pos) < DatabaseEntryFixedSize + fullNameLen)
+			return false;
+		pos += sizeof(u16);
+
+		u16 keyLen;
+		memcpy(&keyLen, pos, sizeof(u16));
+		pos += sizeof(u16);
+		if (keyLen > nameLen)
+			return false;
+
+		WString fullFileName(nameLen, 0);
+		memcpy(&fullFileName[0], pos, fullNameLen);
+		pos += fullNameLen;
+
+		FileKey key { fullFileName.c_str() + nameLen - keyLen };
+		memcpy(&key.fileSize, pos, sizeof(key.fileSize));
+		pos += sizeof(key.fileSize);
+		memcpy(&key.lastWriteTime, pos, sizeof(key.lastWriteTime));
+		pos += sizeof(key.lastWriteTime);
+
+		Hash hash;
+		memcpy(&hash, pos, sizeof(hash));
+		pos += sizeof(hash);
+		if (!keepHashes)
+			hash = Hash();
+
+		database.addToFilesHistory(key, hash, fullFileName);
+	}
+	return false;
+}
 
 void
 FileDatabase::readFile(const wchar_t* fullPath, IOStats& ioStats)
@@ -2582,128 +4604,459 @@ FileDatabase::readFile(const wchar_t* fullPath, IOStats& ioStats)
 	LogContext mutedLog(dummyLog);
 	mutedLog.mute();
 
-	FileHandle handle;
-	if (!openFileRead(fullPath, handle, ioStats, true))
-		return;
-	ScopeGuard fileGuard([&]() { closeFile(fullPath, handle, AccessType_Read, ioStats); });
+	// Journal is replayed below, entries must not be appended to it again
+	FileHandle journalFile = m_journalFile;
+	m_journalFile = InvalidFileHandle;
+	ScopeGuard journalGuard([&]() { m_journalFile = journalFile; });
 
-	u64 read = 0;
-	u8 readCookie[sizeof(linkDbCookie)];
-	if (!eacopy::readFile(fullPath, handle, readCookie, sizeof(readCookie), read, ioStats))
+	closeMapped();
+
+	MappedFile& file = m_mappedFile;
+	if (file.open(fullPath, ioStats))
 	{
-		logInfof(L"Failed to read file database cookie from %ls", fullPath);
-		return;
+		const u8* data = file.data();
+		u64 size = file.size();
+
+		if (size >= sizeof(MappedHeader) && memcmp(data, linkDbCookie, sizeof(linkDbCookie)) == 0)
+		{
+			// Validate everything up front, lookups can then trust the mapped data
+			const MappedHeader& header = *(const MappedHeader*)data;
+			u64 recordsSize = u64(header.recordCount) * sizeof(MappedRecord);
+			u64 slotsSize = (u64(header.keySlotCount) + header.hashSlotCount) * sizeof(uint);
+			bool valid = header.wcharSize == sizeof(wchar_t);
+			valid = valid && header.keySlotCount && (header.keySlotCount & (header.keySlotCount - 1)) == 0 && header.keySlotCount > header.recordCount;
+			valid = valid && header.hashSlotCount && (header.hashSlotCount & (header.hashSlotCount - 1)) == 0 && header.hashSlotCount > header.recordCount;
+			valid = valid && size == sizeof(MappedHeader) + recordsSize + slotsSize + header.namesSize * sizeof(wchar_t);
+
+			const MappedRecord* records = (const MappedRecord*)(data + sizeof(MappedHeader));
+			for (uint i=0; valid && i!=header.recordCount; ++i)
+				valid = records[i].keyLen <= records[i].nameLen && u64(records[i].nameOffset) + records[i].nameLen <= header.namesSize;
+			const uint* slots = (const uint*)(data + sizeof(MappedHeader) + recordsSize);
+			for (uint i=0, e=header.keySlotCount + header.hashSlotCount; valid && i!=e; ++i)
+				valid = slots[i] <= header.recordCount;
+
+			if (valid)
+			{
+				m_mappedRecords = records;
+				m_mappedKeySlots = slots;
+				m_mappedHashSlots = slots + header.keySlotCount;
+				m_mappedNames = (const wchar_t*)(data + sizeof(MappedHeader) + recordsSize + slotsSize);
+				m_mappedKeySlotCount = header.keySlotCount;
+				m_mappedHashSlotCount = header.hashSlotCount;
+				m_mappedRemoved.resize(header.recordCount);
+
+				// Hand out records to shards, order within each shard is kept
+				for (uint i=0; i!=header.recordCount; ++i)
+				{
+					const MappedRecord& rec = records[i];
+					Shard& shard = getShard(m_mappedNames + rec.nameOffset + rec.nameLen - rec.keyLen, rec.keyLen);
+					shard.mappedIndices.push_back(i);
+					++shard.mappedLiveCount;
+				}
+
+				// Entries are still valid for linking when hash algorithm differs, only the hashes can't be compared.
+				// Dropping the hash slots is enough, next write upgrades the file
+				if (header.hashAlgorithm != m_hashAlgorithm)
+					m_mappedHashSlotCount = 0;
+				m_mappedRecordCount = header.recordCount;
+
+				// Records already in memory (primed directories) are newer than mapped ones
+				for (Shard& shard : m_shards)
+					for (auto& kv : shard.files)
+					{
+						uint index = findMappedRecord(kv.first);
+						if (index != ~0u)
+							removeMappedRecord(shard, index);
+					}
+			}
+			else
+			{
+				logInfof(L"File database %ls is corrupt", fullPath);
+				file.close();
+			}
+		}
+		else if (size >= sizeof(linkDbCookieV4) && (memcmp(data, linkDbCookieV4, sizeof(linkDbCookieV4)) == 0 || memcmp(data, linkDbCookieV3, sizeof(linkDbCookieV3)) == 0))
+		{
+			const u8* pos = data + sizeof(linkDbCookieV4);
+			HashAlgorithm hashAlgorithm = HashAlgorithm_Md5;
+			if (memcmp(data, linkDbCookieV4, sizeof(linkDbCookieV4)) == 0 && pos != data + size)
+				hashAlgorithm = HashAlgorithm(*pos++);
+			if (!readDatabaseEntries(*this, pos, data + size, hashAlgorithm == m_hashAlgorithm))
+				logInfof(L"Failed to read complete file database %ls", fullPath);
+			file.close();
+		}
+		else
+		{
+			logInfof(L"File database cookie mismatch %ls", fullPath);
+			file.close();
+		}
 	}
-	if (memcmp(readCookie, linkDbCookie, sizeof(readCookie)) != 0)
+
+	// Replay records added after the database was last written
+	WString journalFileName = WString(fullPath) + L".journal";
+	MappedFile journal;
+	if (!journal.open(journalFileName.c_str(), ioStats))
+		return;
+	const u8* data = journal.data();
+	u64 size = journal.size();
+	if (size <= sizeof(linkDbJournalCookie) || memcmp(data, linkDbJournalCookie, sizeof(linkDbJournalCookie)) != 0)
 	{
-		logInfof(L"File database cookie mismatch %ls", fullPath);
+		logInfof(L"File database journal cookie mismatch %ls", journalFileName.c_str());
 		return;
 	}
+	HashAlgorithm hashAlgorithm = HashAlgorithm(data[sizeof(linkDbJournalCookie)]);
+	readDatabaseEntries(*this, data + sizeof(linkDbJournalCookie) + 1, data + size, hashAlgorithm == m_hashAlgorithm); // Last entry might be cut short by a crash
+}
 
-	ScopeGuard databaseFailGuard([&]() { logInfof(L"Failed to read complete file database (mismatch %ls", fullPath); });
-
+void
+FileDatabase::writeFile(const wchar_t* fullPath, IOStats& ioStats)
+{
+	flushJournal(); // Journal file is closed below, make sure no thread is writing to it
 
-	while (true)
+	// Visits all records shard by shard in history order, oldest first so it gets picked up in the same way
+	using VisitFunc = Function<void(const wchar_t* name, uint nameLen, uint keyLen, u64 fileSize, const FileTime& lastWriteTime, const Hash& hash)>;
+	auto traverse = [&](const VisitFunc& func)
 	{
-		u64 read = 0;
-
-		u16 fullNameLen;
-		if (!eacopy::readFile(fullPath, handle, &fullNameLen, sizeof(fullNameLen), read, ioStats) || read != sizeof(fullNameLen))
-			return;
-
-		if (fullNameLen == 0) // Terminator
+		for (Shard& shard : m_shards)
 		{
-			databaseFailGuard.cancel();
-			return;
+			for (uint i=shard.mappedHistoryBegin, e=uint(shard.mappedIndices.size()); i!=e; ++i)
+			{
+				uint index = shard.mappedIndices[i];
+				if (m_mappedRemoved[index])
+					continue;
+				const MappedRecord& rec = m_mappedRecords[index];
+				func(m_mappedNames + rec.nameOffset, rec.nameLen, rec.keyLen, rec.fileSize, rec.lastWriteTime, m_mappedHashSlotCount ? rec.hash : Hash());
+			}
+			for (auto& key : shard.history)
+			{
+				const FileRec& rec = shard.files.find(key)->second;
+				func(rec.name.c_str(), uint(rec.name.size()), uint(key.name.size()), key.fileSize, key.lastWriteTime, rec.hash);
+			}
 		}
+	};
+
+	uint recordCount = getHistorySize();
+	uint slotCount = 16;
+	while (slotCount < recordCount * 2)
+		slotCount *= 2;
+
+	Vector<MappedRecord> records;
+	records.reserve(recordCount);
+	Vector<uint> slots(slotCount * 2); // Key slots followed by hash slots
+	uint* keySlots = slots.data();
+	uint* hashSlots = slots.data() + slotCount;
+	uint mask = slotCount - 1;
+	u64 namesSize = 0;
+
+	traverse([&](const wchar_t* name, uint nameLen, uint keyLen, u64 fileSize, const FileTime& lastWriteTime, const Hash& hash)
+		{
+			uint index = uint(records.size());
+			records.emplace_back();
+			MappedRecord& rec = records.back();
+			rec.fileSize = fileSize;
+			rec.lastWriteTime = lastWriteTime;
+			rec.hash = hash;
+			rec.nameOffset = uint(namesSize);
+			rec.nameLen = u16(nameLen);
+			rec.keyLen = u16(keyLen);
+			namesSize += nameLen;
+
+			uint slot = uint(getKeyNameHash(name + nameLen - keyLen, keyLen)) & mask;
+			while (keySlots[slot])
+				slot = (slot + 1) & mask;
+			keySlots[slot] = index + 1;
+
+			if (!isValid(hash))
+				return;
+			// Latest record wins if there are more with same hash
+			slot = uint(hash.first) & mask;
+			while (hashSlots[slot] && !(records[hashSlots[slot] - 1].hash == hash))
+				slot = (slot + 1) & mask;
+			hashSlots[slot] = index + 1;
+		});
 
-		if (fullNameLen+1 >= MaxPath)
-			return;
-
-		u16 keyLen;
-		if (!eacopy::readFile(fullPath, handle, &keyLen, sizeof(keyLen), read, ioStats) || read != sizeof(keyLen))
+	MappedHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.cookie, linkDbCookie, sizeof(linkDbCookie));
+	header.hashAlgorithm = m_hashAlgorithm;
+	header.wcharSize = sizeof(wchar_t);
+	header.recordCount = recordCount;
+	header.keySlotCount = slotCount;
+	header.hashSlotCount = slotCount;
+	header.namesSize = namesSize;
+
+	// Write to temp file first, the database we are reading records from is mapped and can't be replaced until we are done
+	WString tempFileName = WString(fullPath) + L".tmp";
+	{
+		FileHandle handle;
+		if (!openFileWrite(tempFileName.c_str(), handle, ioStats, true))
 			return;
+		ScopeGuard fileGuard([&]() { closeFile(tempFileName.c_str(), handle, AccessType_Write, ioStats); });
 
-		u8 nameBuffer[MaxPath];
-		if (!eacopy::readFile(fullPath, handle, nameBuffer, fullNameLen, read, ioStats) || read != fullNameLen)
+		if (!eacopy::writeFile(tempFileName.c_str(), handle, &header, sizeof(header), ioStats))
 			return;
-
-		nameBuffer[fullNameLen] = 0;
-		nameBuffer[fullNameLen+1] = 0;
-		WString fullFileName = (wchar_t*)nameBuffer;
-
-		const wchar_t* fileName = fullFileName.c_str() + fullFileName.size() - keyLen;
-
-		FileKey key { fileName };
-
-		if (!eacopy::readFile(fullPath, handle, &key.fileSize, sizeof(key.fileSize), read, ioStats) || read != sizeof(key.fileSize))
+		if (!eacopy::writeFile(tempFileName.c_str(), handle, records.data(), records.size() * sizeof(MappedRecord), ioStats))
 			return;
-		if (!eacopy::readFile(fullPath, handle, &key.lastWriteTime, sizeof(key.lastWriteTime), read, ioStats) || read != sizeof(key.lastWriteTime))
+		if (!eacopy::writeFile(tempFileName.c_str(), handle, slots.data(), slots.size() * sizeof(uint), ioStats))
 			return;
 
-		Hash hash;
-		if (!eacopy::readFile(fullPath, handle, &hash, sizeof(hash), read, ioStats) || read != sizeof(hash))
+		bool success = true;
+		Vector<wchar_t> names;
+		names.reserve(256*1024);
+		traverse([&](const wchar_t* name, uint nameLen, uint keyLen, u64 fileSize, const FileTime& lastWriteTime, const Hash& hash)
+			{
+				if (names.size() + nameLen > names.capacity())
+				{
+					success = success && eacopy::writeFile(tempFileName.c_str(), handle, names.data(), names.size() * sizeof(wchar_t), ioStats);
+					names.clear();
+				}
+				names.insert(names.end(), name, name + nameLen);
+			});
+		success = success && eacopy::writeFile(tempFileName.c_str(), handle, names.data(), names.size() * sizeof(wchar_t), ioStats);
+		if (!success)
 			return;
+	}
 
-		addToFilesHistory(key, hash, fullFileName);
+	records.clear();
+	slots.clear();
+	closeMapped();
+	for (Shard& shard : m_shards)
+	{
+		shard.files.clear();
+		shard.history.clear();
 	}
+	for (HashShard& hashShard : m_hashShards)
+		hashShard.hashes.clear();
+
+	// Everything in journal is now part of the database. If the move fails we keep using the temp file
+	bool moved = moveFile(tempFileName.c_str(), fullPath, ioStats);
+	m_journalCs.scoped([&]()
+		{
+			if (m_journalFile == InvalidFileHandle)
+				return;
+			closeFile(m_journalFileName.c_str(), m_journalFile, AccessType_Write, ioStats);
+			if (moved)
+				createJournal(ioStats);
+		});
+	readFile(moved ? fullPath : tempFileName.c_str(), ioStats);
+}
+
+bool
+FileDatabase::openJournal(const wchar_t* fullPath, IOStats& ioStats)
+{
+	flushJournal();
+	ScopedCriticalSection cs(m_journalCs);
+	closeFile(m_journalFileName.c_str(), m_journalFile, AccessType_Write, ioStats);
+	m_journalFileName = WString(fullPath) + L".journal";
+	m_journalActive = reopenJournal(ioStats);
+	return m_journalActive;
 }
 
 void
-FileDatabase::writeFile(const wchar_t* fullPath, IOStats& ioStats)
+FileDatabase::flushJournal()
 {
-	FileHandle handle;
-	if (!openFileWrite(fullPath, handle, ioStats, true))
-		return;
-	ScopeGuard fileGuard([&]() { closeFile(fullPath, handle, AccessType_Write, ioStats); });
+	// Wait for thread currently writing, then take over and write the rest
+	while (true)
+	{
+		{
+			ScopedCriticalSection cs(m_journalCs);
+			if (!m_journalWriting)
+			{
+				if (m_journalFile == InvalidFileHandle || m_journalBuffer.empty())
+					return;
+				m_journalWriting = true;
+				m_journalBuffer.swap(m_journalWriteBuffer);
+				break;
+			}
+		}
+		Sleep(1);
+	}
+	writeJournal(true);
+}
 
-	if (!eacopy::writeFile(fullPath, handle, linkDbCookie, sizeof(linkDbCookie), ioStats))
-		return;
+bool
+FileDatabase::createJournal(IOStats& ioStats)
+{
+	if (!openFileWrite(m_journalFileName.c_str(), m_journalFile, ioStats, true))
+		return false;
+	if (eacopy::writeFile(m_journalFileName.c_str(), m_journalFile, linkDbJournalCookie, sizeof(linkDbJournalCookie), ioStats))
+		if (eacopy::writeFile(m_journalFileName.c_str(), m_journalFile, &m_hashAlgorithm, sizeof(m_hashAlgorithm), ioStats))
+		{
+			m_journalSize = sizeof(linkDbJournalCookie) + sizeof(m_hashAlgorithm);
+			m_journalCompactSize = m_journalCompactMinSize;
+			return true;
+		}
+	closeFile(m_journalFileName.c_str(), m_journalFile, AccessType_Write, ioStats);
+	return false;
+}
 
-	// Write in history order, oldest should be first so it gets picked up in the same way
-	for (auto& key : m_filesHistory)
-	{
-		auto findIt = m_files.find(key);
-		WString& fullFileName = findIt->second.name;
-		Hash hash = findIt->second.hash;
+bool
+FileDatabase::reopenJournal(IOStats& ioStats)
+{
+	FileInfo info;
+	if (!getFileInfo(info, m_journalFileName.c_str(), ioStats) || !info.fileSize)
+		return createJournal(ioStats);
 
-		u16 nameLen = fullFileName.size() * 2; // wchar
-		if (!eacopy::writeFile(fullPath, handle, &nameLen, sizeof(nameLen), ioStats))
-			return;
-		u16 keyLen = key.name.size();
-		if (!eacopy::writeFile(fullPath, handle, &keyLen, sizeof(keyLen), ioStats))
-			return;
-		if (!eacopy::writeFile(fullPath, handle, fullFileName.c_str(), nameLen, ioStats))
-			return;
-		if (!eacopy::writeFile(fullPath, handle, &key.fileSize, sizeof(key.fileSize), ioStats))
+	if (!openFileWrite(m_journalFileName.c_str(), m_journalFile, ioStats, true, nullptr, false, false))
+		return false;
+	m_journalSize = info.fileSize;
+	m_journalCompactSize = max(m_journalCompactMinSize, info.fileSize*2);
+	if (setFilePosition(m_journalFileName.c_str(), m_journalFile, info.fileSize, ioStats))
+		return true;
+	closeFile(m_journalFileName.c_str(), m_journalFile, AccessType_Write, ioStats);
+	return false;
+}
+
+void
+FileDatabase::appendToJournal(const FileKey& key, const Hash& hash, const WString& fullFileName)
+{
+	// Records are buffered and written in batches by the thread that fills the buffer. Others keep appending while it writes
+	{
+		ScopedCriticalSection cs(m_journalCs);
+		if (m_journalFile == InvalidFileHandle)
 			return;
-		if (!eacopy::writeFile(fullPath, handle, &key.lastWriteTime, sizeof(key.lastWriteTime), ioStats))
+		u64 time = getTime();
+		if (m_journalBuffer.empty())
+			m_journalBufferTime = time;
+		appendDatabaseEntry(m_journalBuffer, key, hash, fullFileName);
+		if (m_journalWriting || (m_journalBuffer.size() < JournalFlushSize && timeToMs(time - m_journalBufferTime) < JournalFlushMs))
 			return;
-		if (!eacopy::writeFile(fullPath, handle, &hash, sizeof(hash), ioStats))
+		m_journalWriting = true;
+		m_journalBuffer.swap(m_journalWriteBuffer);
+	}
+	writeJournal(false);
+}
+
+void
+FileDatabase::writeJournal(bool all)
+{
+	IOStats ioStats;
+	while (true)
+	{
+		bool success = eacopy::writeFile(m_journalFileName.c_str(), m_journalFile, m_journalWriteBuffer.data(), m_journalWriteBuffer.size(), ioStats);
+		m_journalSize += m_journalWriteBuffer.size();
+		m_journalWriteBuffer.clear();
+		if (success && m_journalSize > m_journalCompactSize)
+			success = compactJournal(ioStats);
+
+		ScopedCriticalSection cs(m_journalCs);
+		if (!success) // Journal is only an optimization, stop using it if writes start failing
+		{
+			closeFile(m_journalFileName.c_str(), m_journalFile, AccessType_Write, ioStats);
+			m_journalBuffer.clear();
+			m_journalActive = false;
+		}
+		if (m_journalFile == InvalidFileHandle || m_journalBuffer.empty() || (!all && m_journalBuffer.size() < JournalFlushSize))
+		{
+			m_journalWriting = false;
 			return;
+		}
+		m_journalBufferTime = getTime();
+		m_journalBuffer.swap(m_journalWriteBuffer);
 	}
+}
 
-	// Terminator
-	u16 nameLen = 0;
-	if (!eacopy::writeFile(fullPath, handle, &nameLen, sizeof(nameLen), ioStats))
-		return;
+bool
+FileDatabase::compactJournal(IOStats& ioStats)
+{
+	// Journal only needs the records in shard memory, the rest are in the database file. It is written to a temp file and moved
+	// over the journal. Records added meanwhile are in m_journalBuffer and written to the new journal after. A record added to a
+	// shard while it is visited might end up in both, replaying it twice does no harm
+	Vector<u8> records;
+	for (Shard& shard : m_shards)
+		shard.cs.scoped([&]()
+			{
+				for (auto& key : shard.history)
+				{
+					auto findIt = shard.files.find(key);
+					if (findIt != shard.files.end())
+						appendDatabaseEntry(records, key, findIt->second.hash, findIt->second.name);
+				}
+			});
+
+	WString tempFileName = m_journalFileName + L".tmp";
+	FileHandle tempFile;
+	if (!openFileWrite(tempFileName.c_str(), tempFile, ioStats, true))
+	{
+		m_journalCompactSize = m_journalSize*2; // Try again when it has grown
+		return true;
+	}
+	bool written = eacopy::writeFile(tempFileName.c_str(), tempFile, linkDbJournalCookie, sizeof(linkDbJournalCookie), ioStats)
+		&& eacopy::writeFile(tempFileName.c_str(), tempFile, &m_hashAlgorithm, sizeof(m_hashAlgorithm), ioStats)
+		&& eacopy::writeFile(tempFileName.c_str(), tempFile, records.data(), records.size(), ioStats);
+	written &= closeFile(tempFileName.c_str(), tempFile, AccessType_Write, ioStats);
+
+	ScopedCriticalSection cs(m_journalCs);
+	if (written)
+	{
+		closeFile(m_journalFileName.c_str(), m_journalFile, AccessType_Write, ioStats);
+		if (!moveFile(tempFileName.c_str(), m_journalFileName.c_str(), ioStats))
+			deleteFile(tempFileName.c_str(), ioStats, false);
+		if (!reopenJournal(ioStats))
+			return false;
+	}
+	else
+	{
+		deleteFile(tempFileName.c_str(), ioStats, false);
+		m_journalCompactSize = m_journalSize*2;
+	}
+	return true;
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-HashContext::HashContext(u64& time, u64& count)
+bool
+isHashAlgorithmSupported(HashAlgorithm algorithm)
+{
+	switch (algorithm)
+	{
+	case HashAlgorithm_Md5:
+		#if defined(_WIN32)
+		return true;
+		#else
+		return false;
+		#endif
+	case HashAlgorithm_Xxh3:
+		#if defined(EACOPY_USE_XXHASH)
+		return true;
+		#else
+		return false;
+		#endif
+	}
+	return false;
+}
+
+const wchar_t*
+getHashAlgorithmName(HashAlgorithm algorithm)
+{
+	switch (algorithm)
+	{
+	case HashAlgorithm_Md5: return L"md5";
+	case HashAlgorithm_Xxh3: return L"xxh3-128";
+	}
+	return L"unknown";
+}
+
+HashContext::HashContext(u64& time, u64& count, HashAlgorithm algorithm)
 :	m_time(time)
 ,	m_count(count)
+,	m_algorithm(algorithm)
 {
 }
 
 bool
 HashContext::init()
 {
+	if (m_algorithm != HashAlgorithm_Md5)
+		return true;
+	#if defined(_WIN32)
 	TimerScope _(m_time); // Skip these since they makes the user think hashing happens when it is not
 	if (CryptAcquireContext(&(HCRYPTPROV&)m_handle, NULL, NULL, PROV_RSA_FULL, CRYPT_VERIFYCONTEXT))
 		return true;
 	logErrorf(L"CryptAcquireContext failed: %ls", getLastErrorText().c_str());
+	#else
+	logErrorf(L"Hash algorithm %ls is not supported on this platform", getHashAlgorithmName(m_algorithm));
+	#endif
 	return false;
 }
 
@@ -2711,35 +5064,83 @@ HashContext::~HashContext()
 {
 	if (!m_handle)
 		return;
+	#if defined(_WIN32)
 	TimerScope _(m_time); // Skip these since they makes the user think hashing happens when it is not
 	CryptReleaseContext((HCRYPTPROV&)m_handle, 0);
+	#endif
 }
 
 HashBuilder::HashBuilder(HashContext& c) : m_context(c)
 {
+	++m_context.m_count;
+
+	if (m_context.m_algorithm == HashAlgorithm_Xxh3)
+	{
+		#if defined(EACOPY_USE_XXHASH)
+		auto state = XXH3_createState();
+		XXH3_128bits_reset(state);
+		m_handle = state;
+		#else
+		logErrorf(L"Hash algorithm %ls is not supported in this build", getHashAlgorithmName(m_context.m_algorithm));
+		#endif
+		return;
+	}
+
+	#if defined(_WIN32)
 	if (!m_context.m_handle)
 		m_context.init();
 
-	++m_context.m_count;
 	TimerScope _(m_context.m_time);
 
 	if (!CryptCreateHash((HCRYPTPROV&)m_context.m_handle, CALG_MD5, 0, 0, &(HCRYPTHASH&)m_handle))
 		logErrorf(L"CryptCreateHash failed: %ls", getLastErrorText().c_str());
+	#else
+	logErrorf(L"Hash algorithm %ls is not supported on this platform", getHashAlgorithmName(m_context.m_algorithm));
+	#endif
 }
 
 HashBuilder::~HashBuilder()
 {
+	if (!m_handle)
+		return;
+
+	#if defined(EACOPY_USE_XXHASH)
+	if (m_context.m_algorithm == HashAlgorithm_Xxh3)
+	{
+		XXH3_freeState((XXH3_state_t*)m_handle);
+		return;
+	}
+	#endif
+
+	#if defined(_WIN32)
 	TimerScope _(m_context.m_time);
 	CryptDestroyHash((HCRYPTHASH&)m_handle);
+	#endif
 }
 
 bool
 HashBuilder::add(u8* data, u64 size)
 {
 	TimerScope _(m_context.m_time);
+
+	if (!m_handle)
+		return false;
+
+	#if defined(EACOPY_USE_XXHASH)
+	if (m_context.m_algorithm == HashAlgorithm_Xxh3)
+	{
+		if (XXH3_128bits_update((XXH3_state_t*)m_handle, data, size) == XXH_OK)
+			return true;
+		logErrorf(L"XXH3_128bits_update failed");
+		return false;
+	}
+	#endif
+
+	#if defined(_WIN32)
 	if (CryptHashData((HCRYPTHASH&)m_handle, data, size, 0))
 		return true;
 	logErrorf(L"CryptHashData failed: %ls", getLastErrorText().c_str());
+	#endif
 	return false;
 }
 
@@ -2747,10 +5148,26 @@ bool
 HashBuilder::getHash(Hash& outHash)
 {
 	TimerScope _(m_context.m_time);
+
+	if (!m_handle)
+		return false;
+
+	#if defined(EACOPY_USE_XXHASH)
+	if (m_context.m_algorithm == HashAlgorithm_Xxh3)
+	{
+		XXH128_hash_t hash = XXH3_128bits_digest((XXH3_state_t*)m_handle);
+		outHash.first = hash.low64;
+		outHash.second = hash.high64;
+		return true;
+	}
+	#endif
+
+	#if defined(_WIN32)
 	DWORD cbHash = sizeof(Hash);
 	if (CryptGetHashParam((HCRYPTHASH&)m_handle, HP_HASHVAL, (BYTE*)&outHash, &cbHash, 0))
 		return true;
 	logErrorf(L"CryptGetHashParam failed: %ls", getLastErrorText().c_str());
+	#endif
 	return false;
 }
 
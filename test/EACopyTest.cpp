@@ -1,6 +1,7 @@
 // (c) Electronic Arts. All Rights Reserved.
 
 #include "EACopyClient.h"
+#include "EACopyDownloads.h"
 #include <assert.h>
 #include <utility>
 #if defined(_WIN32)
@@ -407,6 +408,310 @@ EACOPY_TEST(UncPathOptimization)
 }
 #endif
 
+EACOPY_TEST(FileDatabaseMappedAndJournal)
+{
+	WString dbFile = testSourceDir + L"Links.db";
+	FileKey key { L"Foo.txt", { 1, 2 }, 123 };
+	FileKey key2 { L"Bar.txt", { 3, 4 }, 456 };
+	Hash hash;
+	hash.first = 1;
+	hash.second = 2;
+
+	{
+		FileDatabase db;
+		db.addToFilesHistory(key, hash, testSourceDir + L"Foo.txt");
+		db.writeFile(dbFile.c_str(), ioStats);
+		EACOPY_ASSERT(db.getRecord(key).name == testSourceDir + L"Foo.txt"); // Now served from mapped file
+	}
+	{
+		FileDatabase db;
+		db.readFile(dbFile.c_str(), ioStats);
+		EACOPY_ASSERT(db.getHistorySize() == 1);
+		EACOPY_ASSERT(db.getRecord(hash).name == testSourceDir + L"Foo.txt");
+		EACOPY_ASSERT(db.openJournal(dbFile.c_str(), ioStats));
+		db.addToFilesHistory(key2, Hash(), testSourceDir + L"Bar.txt"); // Not written, journal must bring it back
+	}
+	{
+		FileDatabase db;
+		db.readFile(dbFile.c_str(), ioStats);
+		EACOPY_ASSERT(db.getHistorySize() == 2);
+		EACOPY_ASSERT(db.getRecord(key2).name == testSourceDir + L"Bar.txt");
+		EACOPY_ASSERT(db.garbageCollect(0) == 2);
+		EACOPY_ASSERT(db.getRecord(key).name.empty());
+		EACOPY_ASSERT(db.getHistorySize() == 0);
+	}
+}
+
+EACOPY_TEST(FileDatabaseJournalCompact)
+{
+	WString dbFile = testSourceDir + L"Links.db";
+	WString journalFile = dbFile + L".journal";
+	FileKey key { L"Foo.txt", { 1, 2 }, 123 };
+
+	{
+		FileDatabase db;
+		db.m_journalCompactMinSize = 1024;
+		EACOPY_ASSERT(db.openJournal(dbFile.c_str(), ioStats));
+		for (uint i=0; i!=100; ++i)
+		{
+			Hash hash;
+			hash.first = i + 1;
+			db.addToFilesHistory(key, hash, testSourceDir + L"Foo.txt");
+			db.flushJournal();
+		}
+		FileInfo info;
+		EACOPY_ASSERT(eacopy::getFileInfo(info, journalFile.c_str(), ioStats));
+		EACOPY_ASSERT(info.fileSize < 2048); // Only latest record of key survives compaction
+	}
+	{
+		FileDatabase db;
+		db.readFile(dbFile.c_str(), ioStats);
+		EACOPY_ASSERT(db.getHistorySize() == 1);
+		EACOPY_ASSERT(db.getRecord(key).hash.first == 100);
+	}
+}
+
+EACOPY_TEST(FileDatabasePrimeCheckpoint)
+{
+	createTestFile(L"Dir\\Foo.txt", 10);
+	createTestFile(L"Dir\\Sub\\Bar.txt", 20);
+	WString primeDir = testSourceDir + L"Dir\\";
+	WString checkpointFile = testDestDir + L"Links.db.prime"; // Outside primed directories so their time is not changed
+
+	{
+		FileDatabase db;
+		db.m_primeThreadCount = 2;
+		db.m_primeCheckpointFile = checkpointFile;
+		EACOPY_ASSERT(db.primeDirectory(primeDir, ioStats, true, true));
+		EACOPY_ASSERT(db.m_primeStats.dirCount == 2 && db.m_primeStats.fileCount == 2);
+		FileInfo info;
+		EACOPY_ASSERT(eacopy::getFileInfo(info, (primeDir + L"Sub\\Bar.txt").c_str(), ioStats));
+		EACOPY_ASSERT(db.getRecord(FileKey{ L"Sub\\Bar.txt", info.lastWriteTime, info.fileSize }).name == primeDir + L"Sub\\Bar.txt");
+		EACOPY_ASSERT(!db.isPriming());
+	}
+	{
+		FileDatabase db;
+		EACOPY_ASSERT(db.primeReadCheckpoint(checkpointFile.c_str(), ioStats));
+		EACOPY_ASSERT(db.primeDirectory(primeDir, ioStats, true, true));
+		EACOPY_ASSERT(db.m_primeStats.unchangedDirCount == 2 && db.m_primeStats.fileCount == 0);
+	}
+
+	// Rewriting a file doesn't change time of its directory but directory must still be primed again
+	createTestFile(L"Dir\\Sub\\Bar.txt", 30);
+	{
+		FileDatabase db;
+		EACOPY_ASSERT(db.primeReadCheckpoint(checkpointFile.c_str(), ioStats));
+		EACOPY_ASSERT(db.primeDirectory(primeDir, ioStats, true, true));
+		EACOPY_ASSERT(db.m_primeStats.unchangedDirCount == 1 && db.m_primeStats.fileCount == 1);
+		FileInfo info;
+		EACOPY_ASSERT(eacopy::getFileInfo(info, (primeDir + L"Sub\\Bar.txt").c_str(), ioStats));
+		EACOPY_ASSERT(db.getRecord(FileKey{ L"Sub\\Bar.txt", info.lastWriteTime, info.fileSize }).name == primeDir + L"Sub\\Bar.txt");
+	}
+}
+
+EACOPY_TEST(WildcardMatcherPatterns)
+{
+	WildcardMatcher matcher;
+	EACOPY_ASSERT(!matcher.match(L"Foo.txt"));
+	matcher.add(L"*.OBJ;Exact.txt");
+	matcher.add(L"temp*");
+	matcher.add(L"*\\Bar?\\*.pdb");
+	EACOPY_ASSERT(matcher.match(L"D:\\Dir\\Foo.obj"));
+	EACOPY_ASSERT(matcher.match(L"exact.TXT"));
+	EACOPY_ASSERT(!matcher.match(L"Dir\\Exact.txt"));
+	EACOPY_ASSERT(matcher.match(L"Temp\\Foo.txt"));
+	EACOPY_ASSERT(matcher.match(L"D:\\Dir\\Bar1\\Foo.pdb"));
+	EACOPY_ASSERT(!matcher.match(L"D:\\Dir\\Bar12\\Foo.pdb"));
+	EACOPY_ASSERT(!matcher.match(L"Foo.ob"));
+	matcher.add(L"*.*");
+	EACOPY_ASSERT(matcher.match(L"Foo"));
+}
+
+EACOPY_TEST(LatencyHistogramPercentiles)
+{
+	LatencyHistogram histogram;
+	EACOPY_ASSERT(histogram.getPercentile(0.5) == 0);
+	for (uint i=1; i<=1000; ++i)
+		histogram.add(u64(i)*10*100); // 0.1ms to 100ms
+	EACOPY_ASSERT(histogram.getCount() == 1000);
+	EACOPY_ASSERT(histogram.getMax() == 1000000);
+	u64 p50 = histogram.getPercentile(0.5);
+	u64 p99 = histogram.getPercentile(0.99);
+	EACOPY_ASSERT(p50 >= 500000 && p50 <= 500000 + 500000/8);
+	EACOPY_ASSERT(p99 >= 990000 && p99 <= 990000 + 990000/8);
+	for (uint i=0; i!=LatencyHistogram::BucketCount - 1; ++i)
+		EACOPY_ASSERT(LatencyHistogram::getBucketIndex(LatencyHistogram::getBucketUpperBound(i)) == i + 1);
+}
+
+EACOPY_TEST(TraceExitedThreads)
+{
+	WString traceFile = g_testSourceDir + L"\TraceExitedThreads.json"; // Not in source or destination
+	EACOPY_ASSERT(traceBegin(traceFile.c_str(), L"EACopyTest"));
+	for (uint i=0; i!=3; ++i)
+	{
+		Thread thread([]() { u64 time = getPreciseTime(); traceSpan(L"TestSpan", nullptr, time, time + 10); return 0; });
+		thread.wait();
+	}
+	EACOPY_ASSERT(traceEnd());
+
+	FileHandle file;
+	EACOPY_ASSERT(openFileRead(traceFile.c_str(), file, ioStats, true));
+	Vector<char> content(1024*1024);
+	u64 read = 0;
+	EACOPY_ASSERT(readFile(traceFile.c_str(), file, content.data(), content.size() - 1, read, ioStats));
+	closeFile(traceFile.c_str(), file, AccessType_Read, ioStats);
+	deleteFile(traceFile.c_str(), ioStats, false);
+	content[read] = 0;
+
+	// Spans of exited threads are written before their buffers are reused and timestamps stay below 2^53
+	uint spanCount = 0;
+	for (const char* it = strstr(content.data(), "\"TestSpan\""); it; it = strstr(it + 1, "\"TestSpan\""))
+	{
+		const char* ts = strstr(it, "\"ts\":");
+		EACOPY_ASSERT(ts);
+		u64 time = strtoull(ts + 5, nullptr, 10);
+		EACOPY_ASSERT(time > 1500000000ull*1000000 && time < (1ull << 53));
+		++spanCount;
+	}
+	EACOPY_ASSERT(spanCount == 3);
+}
+
+EACOPY_TEST(PathSetAndArena)
+{
+	PathSet set;
+	EACOPY_ASSERT(set.insert(L"Foo\\Bar.txt"));
+	EACOPY_ASSERT(!set.insert(L"foo\\BAR.txt"));
+	EACOPY_ASSERT(set.contains(L"FOO\\bar.TXT"));
+	EACOPY_ASSERT(!set.contains(L"Foo\\Bar.tx"));
+	for (uint i=0; i!=10000; ++i)
+		EACOPY_ASSERT(set.insert(L"Dir\\File" + std::to_wstring(i)));
+	EACOPY_ASSERT(set.size() == 10001);
+	EACOPY_ASSERT(set.contains(L"dir\\file9999"));
+	uint count = 0;
+	for (const wchar_t* path : set)
+		count += *path ? 1 : 0;
+	EACOPY_ASSERT(count == 10001);
+	set.clear();
+	EACOPY_ASSERT(set.empty() && !set.contains(L"Foo\\Bar.txt"));
+
+	PathArena arena;
+	const PathArena::Path* path = arena.intern(L"C:\\Source\\");
+	EACOPY_ASSERT(path != arena.intern(L"C:\\source\\"));
+	for (uint i=0; i!=5000; ++i)
+		arena.intern(L"Dir" + std::to_wstring(i));
+	EACOPY_ASSERT(path == arena.intern(L"C:\\Source\\"));
+	EACOPY_ASSERT(path->length == 10 && wcscmp(path->str, L"C:\\Source\\") == 0);
+}
+
+EACOPY_TEST(DownloadSchedulerFairness)
+{
+	DownloadScheduler scheduler;
+	scheduler.reset(1);
+	EACOPY_ASSERT(scheduler.acquire(L"A", 1024*1024, 0));
+	EACOPY_ASSERT(!scheduler.acquire(L"B", 10, 0)); // No room and not allowed to wait
+
+	// A already got a download so B waiting after it is served first
+	CriticalSection orderCs;
+	WString order;
+	auto download = [&](const wchar_t* client)
+	{
+		if (!scheduler.acquire(client, 10, 10*1000))
+			return -1;
+		orderCs.scoped([&]() { order += client; });
+		scheduler.release(client, 10);
+		return 0;
+	};
+	Thread threadA([&]() { return download(L"A"); });
+	while (scheduler.getStats().waitingCount != 1)
+		Sleep(1);
+	Thread threadB([&]() { return download(L"B"); });
+	while (scheduler.getStats().waitingCount != 2)
+		Sleep(1);
+	scheduler.release(L"A", 1024*1024);
+	threadA.wait();
+	threadB.wait();
+	EACOPY_ASSERT(order == L"BA");
+	EACOPY_ASSERT(scheduler.getStats().activeCount == 0);
+	EACOPY_ASSERT(scheduler.getStats().queuedCount == 2);
+	EACOPY_ASSERT(scheduler.getStats().timedOutCount == 1);
+
+	scheduler.stop();
+	EACOPY_ASSERT(!scheduler.acquire(L"A", 10, 10*1000));
+}
+
+EACOPY_TEST(SharedSendCacheReplay)
+{
+	IOStats ioStats;
+	SharedSendCache cache;
+	cache.setSpillDirectory(testDestDir.c_str(), 1024, ioStats);
+	SendCacheKey key { FileKey{ L"C:\\Foo.txt", { 1, 0 }, 3 }, 255, 0 };
+	bool isProducer;
+	SharedSendCache::Entry* producer = cache.acquire(key, isProducer, ioStats);
+	EACOPY_ASSERT(isProducer);
+	SharedSendCache::Entry* follower = cache.acquire(key, isProducer, ioStats);
+	EACOPY_ASSERT(!isProducer && follower == producer);
+	EACOPY_ASSERT(!cache.wait(follower, 0));
+	producer->data = { 1, 2, 3 };
+	cache.produced(producer, true, ioStats);
+	cache.release(producer, ioStats);
+	EACOPY_ASSERT(cache.wait(follower, 0));
+	EACOPY_ASSERT(follower->data.size() == 3);
+	cache.release(follower, ioStats);
+
+	// Other compression level gets its own entry and failed entries are dropped
+	SendCacheKey otherLevelKey = key;
+	otherLevelKey.compressionLevel = 3;
+	SharedSendCache::Entry* failed = cache.acquire(otherLevelKey, isProducer, ioStats);
+	EACOPY_ASSERT(isProducer);
+	cache.produced(failed, false, ioStats);
+	cache.release(failed, ioStats);
+	EACOPY_ASSERT(cache.getStats().entryCount == 1 && cache.getStats().hitCount == 1);
+
+	// Stream pushed out of memory is read back from spill directory
+	cache.m_maxSize = 0;
+	cache.release(cache.acquire(key, isProducer, ioStats), ioStats);
+	EACOPY_ASSERT(cache.getStats().entryCount == 0 && cache.getStats().spillCount == 1);
+	SharedSendCache::Entry* spilled = cache.acquire(key, isProducer, ioStats);
+	EACOPY_ASSERT(!isProducer && cache.wait(spilled, 0) && spilled->data.size() == 3 && spilled->data[2] == 3);
+	cache.release(spilled, ioStats);
+	EACOPY_ASSERT(cache.getStats().spillHitCount == 1);
+
+	// New version of file added to database drops the others
+	cache.invalidate(L"C:\\Foo.txt", { 2, 0 }, 3);
+	EACOPY_ASSERT(cache.getStats().entryCount == 0 && cache.getStats().spillCount == 0);
+}
+
+EACOPY_TEST(DictionaryTrainAndCompress)
+{
+	DictionaryStore store;
+	char sample[512];
+	for (uint i=0; i!=DictionaryTrainSampleCount; ++i)
+	{
+		int len = sprintf(sample, "{ \"name\": \"object%u\", \"size\": %u, \"flags\": [ \"compiled\", \"optimized\" ], \"hash\": \"%08x\" }", i, i*37, i*2654435761u);
+		store.addSample(L"Foo.json", (const u8*)sample, len);
+	}
+	EACOPY_ASSERT(store.train() == 1);
+	CompressionDictionary* dictionary = store.findDictionary(L"Dir\\Bar.JSON");
+	EACOPY_ASSERT(dictionary && store.getDictionary(dictionary->id) == dictionary);
+	EACOPY_ASSERT(!store.findDictionary(L"Bar.obj"));
+
+	const char* text = "{ \"name\": \"object1234\", \"size\": 4321, \"flags\": [ \"compiled\", \"optimized\" ], \"hash\": \"deadbeef\" }";
+	uint textSize = uint(strlen(text));
+	NetworkCopyContext copyContext;
+	u8 compressed[1024];
+	uint compressedSize, plainSize;
+	EACOPY_ASSERT(compressData(plainSize, compressed, sizeof(compressed), text, textSize, 3, copyContext));
+	copyContext.dictionary = dictionary;
+	EACOPY_ASSERT(compressData(compressedSize, compressed, sizeof(compressed), text, textSize, 3, copyContext));
+	EACOPY_ASSERT(compressedSize < plainSize);
+
+	char decompressed[1024];
+	uint decompressedSize;
+	EACOPY_ASSERT(decompressData(decompressedSize, decompressed, sizeof(decompressed), compressed, compressedSize, copyContext));
+	EACOPY_ASSERT(decompressedSize == textSize && memcmp(decompressed, text, textSize) == 0);
+	copyContext.dictionary = nullptr;
+}
+
 EACOPY_TEST(CopySmallFile)
 {
 	createTestFile(L"Foo.txt", 100);
@@ -460,6 +765,38 @@ EACOPY_TEST(SkipFile)
 	EACOPY_ASSERT(isSourceEqualDest(L"Foo.txt"));
 }
 
+EACOPY_TEST(SkipFileUsingDestinationCache)
+{
+	createTestFile(L"Foo.txt", 100);
+	createTestFile(L"Dir\\Bar.txt", 200);
+
+	ClientSettings clientSettings(getDefaultClientSettings());
+	clientSettings.copySubdirDepth = 100;
+	clientSettings.destinationCacheFile = g_testSourceDir + L'\\' + name + L".destcache"; // Not in source or destination
+	{
+		Client client(clientSettings);
+		ClientStats stats;
+		EACOPY_ASSERT(client.process(clientLog, stats) == 0);
+		EACOPY_ASSERT(stats.copyCount == 2 && stats.writeDestCacheEntries == 3);
+	}
+	{
+		Client client(clientSettings);
+		ClientStats stats;
+		EACOPY_ASSERT(client.process(clientLog, stats) == 0);
+		EACOPY_ASSERT(stats.destCacheSkipCount == 2 && stats.createDirCount == 0);
+	}
+
+	// New file in root changes root time so cache is not used
+	createTestFile(L"Foo2.txt", 100, false);
+	{
+		Client client(clientSettings);
+		ClientStats stats;
+		EACOPY_ASSERT(client.process(clientLog, stats) == 0);
+		EACOPY_ASSERT(stats.destCacheSkipCount == 0 && stats.skipCount == 2);
+	}
+	deleteFile(clientSettings.destinationCacheFile.c_str(), ioStats, false);
+}
+
 EACOPY_TEST(OverwriteFile)
 {
 	createTestFile(L"Foo.txt", 100);
@@ -552,6 +889,40 @@ EACOPY_TEST(CopyFileToReadOnlyDest)
 	EACOPY_ASSERT(isSourceEqualDest(L"Bar2.txt"));
 }
 
+EACOPY_TEST(CopyFilesDestPrefetch)
+{
+	createTestFile(L"Foo.txt", 10);
+	createTestFile(L"Sub\\A.txt", 10);
+	createTestFile(L"Sub\\B.txt", 10);
+	createTestFile(L"Sub\\C.txt", 10);
+
+	ClientSettings clientSettings(getDefaultClientSettings());
+	clientSettings.copySubdirDepth = 100;
+	clientSettings.destSnapshotThreadCount = 2;
+	{
+		Client client(clientSettings);
+		ClientStats clientStats;
+		EACOPY_ASSERT(client.process(clientLog, clientStats) == 0);
+		EACOPY_ASSERT(clientStats.copyCount == 4);
+	}
+
+	// Decisions are the same whether they come from the listing or from checking each file
+	createTestFile(L"Sub\\B.txt", 20);
+	createTestFile(L"Sub\\C.txt", 30, false);
+	{
+		Client client(clientSettings);
+		ClientStats clientStats;
+		EACOPY_ASSERT(client.process(clientLog, clientStats) == 0);
+		EACOPY_ASSERT(clientStats.copyCount == 2);
+		EACOPY_ASSERT(clientStats.skipCount == 2);
+		EACOPY_ASSERT(clientStats.failCount == 0);
+	}
+	EACOPY_ASSERT(isSourceEqualDest(L"Foo.txt"));
+	EACOPY_ASSERT(isSourceEqualDest(L"Sub\\A.txt"));
+	EACOPY_ASSERT(isSourceEqualDest(L"Sub\\B.txt"));
+	EACOPY_ASSERT(isSourceEqualDest(L"Sub\\C.txt"));
+}
+
 EACOPY_TEST(CopyHiddenFile)
 {
 	createTestFile(L"Hidden.txt", 10, true, FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_ARCHIVE);
@@ -1366,6 +1737,33 @@ EACOPY_TEST(ServerCopyDirectoriesDestIsLocal)
 	EACOPY_ASSERT(clientStats.skipCount == 3);
 }
 
+EACOPY_TEST(ServerCopyDeepDirectoriesDestIsLocal)
+{
+	std::swap(testSourceDir, testDestDir);
+	createTestFile(L"A\B\C\Foo.txt", 10);
+	createTestFile(L"A\B\C\D\Bar.txt", 11);
+	createTestFile(L"A\X\Meh.txt", 12);
+	createTestFile(L"A\Y\Meh.txt", 13);
+
+	ServerSettings serverSettings(getDefaultServerSettings());
+	TestServer server(serverSettings, serverLog);
+	server.waitReady();
+
+	ClientSettings clientSettings(getDefaultClientSettings());
+	clientSettings.useServer = UseServer_Required;
+	clientSettings.copySubdirDepth = 3;
+	clientSettings.excludeWildcardDirectories.push_back(L"X");
+	Client client(clientSettings);
+
+	ClientStats clientStats;
+	EACOPY_ASSERT(client.process(clientLog, clientStats) == 0);
+	EACOPY_ASSERT(clientStats.copyCount == 2);
+	EACOPY_ASSERT(isSourceEqualDest(L"A\B\C\Foo.txt"));
+	EACOPY_ASSERT(isSourceEqualDest(L"A\Y\Meh.txt"));
+	EACOPY_ASSERT(!getTestFileExists(L"A\B\C\D\Bar.txt"));
+	EACOPY_ASSERT(!getTestFileExists(L"A\X\Meh.txt"));
+}
+
 EACOPY_TEST(ServerCopyMediumFile)
 {
 	uint fileSize = 3*1024*1024 + 123;
@@ -1405,6 +1803,185 @@ EACOPY_TEST(ServerCopyMediumFileCompressed)
 	EACOPY_ASSERT(isSourceEqualDest(L"Foo.txt"));
 }
 
+EACOPY_TEST(ServerCopyLargeFileCompressed)
+{
+	// More compressed chunks than fits in the send pipeline at once
+	createTestFile(L"Foo.txt", NetworkTransferChunkSize*2 + 123);
+
+	ServerSettings serverSettings(getDefaultServerSettings());
+	TestServer server(serverSettings, serverLog);
+	server.waitReady();
+
+	ClientSettings clientSettings(getDefaultClientSettings());
+	clientSettings.useServer = UseServer_Required;
+	clientSettings.compressionLevel = 255;
+	Client client(clientSettings);
+
+	ClientStats clientStats;
+	EACOPY_ASSERT(client.process(clientLog, clientStats) == 0);
+	EACOPY_ASSERT(clientStats.copyCount == 1);
+	EACOPY_ASSERT(isSourceEqualDest(L"Foo.txt"));
+}
+
+EACOPY_TEST(ServerCopyIncompressibleCompressed)
+{
+	// First half is random and sent as raw blocks, second half is text and gets compressed
+	u64 fileSize = NetworkTransferChunkSize + 123;
+	Vector<char> data(fileSize);
+	for (u64 i=0; i!=fileSize; ++i)
+		data[i] = i < fileSize/2 ? char(rand()) : char('a' + i % 26);
+	FileInfo fileInfo;
+	fileInfo.fileSize = fileSize;
+	EACOPY_ASSERT(createFile((testSourceDir + L"Foo.pak").c_str(), fileInfo, data.data(), ioStats, true));
+	createTestFile(L"Bar.txt", fileSize);
+
+	ServerSettings serverSettings(getDefaultServerSettings());
+	TestServer server(serverSettings, serverLog);
+	server.waitReady();
+
+	ClientSettings clientSettings(getDefaultClientSettings());
+	clientSettings.useServer = UseServer_Required;
+	clientSettings.compressionLevel = 255;
+	Client client(clientSettings);
+
+	ClientStats clientStats;
+	EACOPY_ASSERT(client.process(clientLog, clientStats) == 0);
+	EACOPY_ASSERT(clientStats.copyCount == 2);
+	EACOPY_ASSERT(clientStats.compressionSkipSize != 0);
+	EACOPY_ASSERT(clientStats.compressionSkipSize < fileSize);
+	EACOPY_ASSERT(clientStats.compressionSkipCount == 0);
+	EACOPY_ASSERT(isSourceEqualDest(L"Foo.pak"));
+	EACOPY_ASSERT(isSourceEqualDest(L"Bar.txt"));
+}
+
+EACOPY_TEST(ServerCopyTrace)
+{
+	createTestFile(L"Foo.txt", 100);
+	WString traceFile = g_testSourceDir + L"\\ServerCopyTrace.json"; // Not in source or destination
+
+	ServerSettings serverSettings(getDefaultServerSettings());
+	TestServer server(serverSettings, serverLog);
+	server.waitReady();
+
+	ClientSettings clientSettings(getDefaultClientSettings());
+	clientSettings.useServer = UseServer_Required;
+	Client client(clientSettings);
+
+	EACOPY_ASSERT(traceBegin(traceFile.c_str(), L"EACopyTest"));
+	ClientStats clientStats;
+	EACOPY_ASSERT(client.process(clientLog, clientStats) == 0);
+	EACOPY_ASSERT(traceEnd());
+	EACOPY_ASSERT(clientStats.copyCount == 1);
+
+	FileInfo traceInfo;
+	EACOPY_ASSERT(getFileInfo(traceInfo, traceFile.c_str()) != 0);
+	EACOPY_ASSERT(traceInfo.fileSize != 0);
+	deleteFile(traceFile.c_str(), ioStats, false);
+}
+
+EACOPY_TEST(ServerCopyConnectionPool)
+{
+	createTestFile(L"Foo.txt", 100);
+	createTestFile(L"Bar.txt", 100);
+
+	ServerSettings serverSettings(getDefaultServerSettings());
+	TestServer server(serverSettings, serverLog);
+	server.waitReady();
+
+	ConnectionPool pool;
+	ClientSettings clientSettings(getDefaultClientSettings());
+	clientSettings.useServer = UseServer_Required;
+	clientSettings.connectionPool = &pool;
+	{
+		Client client(clientSettings);
+		ClientStats clientStats;
+		EACOPY_ASSERT(client.process(clientLog, clientStats) == 0);
+		EACOPY_ASSERT(clientStats.copyCount == 2);
+		EACOPY_ASSERT(clientStats.connectReuseCount == 0);
+	}
+	EACOPY_ASSERT(pool.getIdleCount() != 0);
+
+	// Second run takes connection from pool and skips version and environment commands
+	createTestFile(L"Foo.txt", 200);
+	{
+		Client client(clientSettings);
+		ClientStats clientStats;
+		EACOPY_ASSERT(client.process(clientLog, clientStats) == 0);
+		EACOPY_ASSERT(clientStats.copyCount == 1);
+		EACOPY_ASSERT(clientStats.skipCount == 1);
+		EACOPY_ASSERT(clientStats.connectReuseCount != 0);
+	}
+	EACOPY_ASSERT(isSourceEqualDest(L"Foo.txt"));
+	EACOPY_ASSERT(isSourceEqualDest(L"Bar.txt"));
+	pool.clear();
+}
+
+EACOPY_TEST(ServerCopyConnectionPoolPurge)
+{
+	createTestFile(L"Dir\\Foo.txt", 100);
+
+	ServerSettings serverSettings(getDefaultServerSettings());
+	TestServer server(serverSettings, serverLog);
+	server.waitReady();
+
+	ConnectionPool pool;
+	ClientSettings clientSettings(getDefaultClientSettings());
+	clientSettings.useServer = UseServer_Required;
+	clientSettings.connectionPool = &pool;
+	clientSettings.copySubdirDepth = 1;
+	clientSettings.purgeDestination = true;
+	{
+		Client client(clientSettings);
+		EACOPY_ASSERT(client.process(clientLog) == 0);
+	}
+
+	// Directory created by first job must not be treated as created by second job taking the same session
+	createTestFile(L"Dir\\Bar.txt", 100, false);
+	{
+		Client client(clientSettings);
+		ClientStats clientStats;
+		EACOPY_ASSERT(client.process(clientLog, clientStats) == 0);
+		EACOPY_ASSERT(clientStats.connectReuseCount != 0);
+	}
+	EACOPY_ASSERT(getTestFileExists(L"Dir\\Foo.txt") == true);
+	EACOPY_ASSERT(getTestFileExists(L"Dir\\Bar.txt") == false);
+	pool.clear();
+}
+
+EACOPY_TEST(ServerCopyChunks)
+{
+	u64 fileSize = ChunkMinFileSize*4 + 123;
+	createTestFile(L"Foo.txt", fileSize);
+
+	ServerSettings serverSettings(getDefaultServerSettings());
+	serverSettings.useChunks = true;
+	TestServer server(serverSettings, serverLog);
+	server.waitReady();
+
+	ClientSettings clientSettings(getDefaultClientSettings());
+	clientSettings.useServer = UseServer_Required;
+	clientSettings.compressionLevel = 255;
+
+	{
+		Client client(clientSettings);
+		ClientStats clientStats;
+		EACOPY_ASSERT(client.process(clientLog, clientStats) == 0);
+		EACOPY_ASSERT(clientStats.copyCount == 1);
+		EACOPY_ASSERT(isSourceEqualDest(L"Foo.txt"));
+	}
+
+	// Same content with different name can't be linked but all chunks are already on server
+	createTestFile(L"Bar.txt", fileSize);
+	{
+		Client client(clientSettings);
+		ClientStats clientStats;
+		EACOPY_ASSERT(client.process(clientLog, clientStats) == 0);
+		EACOPY_ASSERT(clientStats.copyCount == 1);
+		EACOPY_ASSERT(clientStats.sendSize == 0);
+		EACOPY_ASSERT(isSourceEqualDest(L"Bar.txt"));
+	}
+}
+
 EACOPY_TEST(ServerCopyMultiThreaded)
 {
 	uint fileCount = 50;
@@ -1435,6 +2012,37 @@ EACOPY_TEST(ServerCopyMultiThreaded)
 	}
 }
 
+EACOPY_TEST(ServerCopyCompletionPort)
+{
+	uint fileCount = 50;
+
+	for (uint i=0; i!=fileCount; ++i)
+	{
+		wchar_t fileName[1024];
+		StringCbPrintfW(fileName, sizeof(fileName), L"Foo%i.txt", i);
+		createTestFile(fileName, 100 + i);
+	}
+
+	ServerSettings serverSettings(getDefaultServerSettings());
+	serverSettings.useCompletionPort = true;
+	serverSettings.completionPortThreadCount = 2; // Fewer workers than client connections
+	TestServer server(serverSettings, serverLog);
+	server.waitReady();
+
+	ClientSettings clientSettings(getDefaultClientSettings());
+	clientSettings.useServer = UseServer_Required;
+	clientSettings.threadCount = 8;
+	Client client(clientSettings);
+
+	ClientStats clientStats1;
+	EACOPY_ASSERT(client.process(clientLog, clientStats1) == 0);
+	EACOPY_ASSERT(clientStats1.copyCount == fileCount);
+
+	ClientStats clientStats2;
+	EACOPY_ASSERT(client.process(clientLog, clientStats2) == 0);
+	EACOPY_ASSERT(clientStats2.skipCount == fileCount);
+}
+
 EACOPY_TEST(ServerCopyMultiClient)
 {
 	createTestFile(L"Foo.txt", 10);
@@ -1460,6 +2068,118 @@ EACOPY_TEST(ServerCopyMultiClient)
 	}
 }
 
+EACOPY_TEST(ServerCopyLinkBatched)
+{
+	uint fileCount = 100;
+	for (uint i=0; i!=fileCount; ++i)
+	{
+		wchar_t fileName[1024];
+		StringCbPrintfW(fileName, sizeof(fileName), L"Foo%i.txt", i);
+		createTestFile(fileName, 10 + i);
+	}
+
+	ServerSettings serverSettings(getDefaultServerSettings());
+	TestServer server(serverSettings, serverLog);
+	server.waitReady();
+
+	for (uint i=0; i!=2; ++i)
+	{
+		wchar_t iStr[10];
+		itow(i, iStr, eacopy_sizeof_array(iStr));
+
+		ClientSettings clientSettings(getDefaultClientSettings());
+		clientSettings.useServer = UseServer_Required;
+		clientSettings.destDirectory = testDestDir + iStr + L"\\";
+		Client client(clientSettings);
+
+		ClientStats clientStats;
+		EACOPY_ASSERT(client.process(clientLog, clientStats) == 0);
+		EACOPY_ASSERT(clientStats.netWriteFilesCount != 0);
+		EACOPY_ASSERT(i != 0 || clientStats.copyCount == fileCount);
+		EACOPY_ASSERT(i == 0 || clientStats.linkCount == fileCount);
+	}
+}
+
+EACOPY_TEST(ServerCopyCreatesDirectories)
+{
+	createTestFile(L"A\\B\\Foo.txt", 100);
+	createTestFile(L"A\\C\\Bar.txt", 200);
+	ensureDirectory((testSourceDir + L"Empty").c_str());
+
+	ServerSettings serverSettings(getDefaultServerSettings());
+	TestServer server(serverSettings, serverLog);
+	server.waitReady();
+
+	ClientSettings clientSettings(getDefaultClientSettings());
+	clientSettings.useServer = UseServer_Required;
+	clientSettings.copySubdirDepth = 100;
+	clientSettings.copyEmptySubdirectories = true;
+	Client client(clientSettings);
+
+	ClientStats clientStats;
+	EACOPY_ASSERT(client.process(clientLog, clientStats) == 0);
+	EACOPY_ASSERT(clientStats.netCreateDirCount == 1); // All directories in one command
+	EACOPY_ASSERT(isSourceEqualDest(L"A\\B\\Foo.txt"));
+	EACOPY_ASSERT(isSourceEqualDest(L"A\\C\\Bar.txt"));
+	EACOPY_ASSERT(getTestFileExists(L"Empty"));
+}
+
+EACOPY_TEST(ServerCopyPacked)
+{
+	uint fileCount = 100;
+	for (uint i=0; i!=fileCount; ++i)
+	{
+		wchar_t fileName[1024];
+		StringCbPrintfW(fileName, sizeof(fileName), L"Foo%i.txt", i);
+		createTestFile(fileName, 100 + i*10);
+	}
+
+	ServerSettings serverSettings(getDefaultServerSettings());
+	TestServer server(serverSettings, serverLog);
+	server.waitReady();
+
+	ClientSettings clientSettings(getDefaultClientSettings());
+	clientSettings.useServer = UseServer_Required;
+	clientSettings.compressionLevel = 1;
+	Client client(clientSettings);
+
+	ClientStats clientStats;
+	EACOPY_ASSERT(client.process(clientLog, clientStats) == 0);
+	EACOPY_ASSERT(clientStats.netWritePackedFilesCount != 0);
+	EACOPY_ASSERT(clientStats.copyCount == fileCount);
+	for (uint i=0; i!=fileCount; ++i)
+	{
+		wchar_t fileName[1024];
+		StringCbPrintfW(fileName, sizeof(fileName), L"Foo%i.txt", i);
+		EACOPY_ASSERT(isSourceEqualDest(fileName));
+	}
+}
+
+EACOPY_TEST(ServerCopyStriped)
+{
+	createTestFile(L"Foo.txt", NetworkTransferChunkSize*2 + 123);
+
+	ServerSettings serverSettings(getDefaultServerSettings());
+	TestServer server(serverSettings, serverLog);
+	server.waitReady();
+
+	ClientSettings clientSettings(getDefaultClientSettings());
+	clientSettings.useServer = UseServer_Required;
+	clientSettings.threadCount = 4;
+	clientSettings.stripeThreshold = 0;
+	clientSettings.stripeSize = NetworkTransferChunkSize; // Three ranges
+	Client client(clientSettings);
+
+	ClientStats clientStats;
+	EACOPY_ASSERT(client.process(clientLog, clientStats) == 0);
+	EACOPY_ASSERT(clientStats.copyCount == 1);
+	EACOPY_ASSERT(isSourceEqualDest(L"Foo.txt"));
+
+	ClientStats clientStats2;
+	EACOPY_ASSERT(client.process(clientLog, clientStats2) == 0);
+	EACOPY_ASSERT(clientStats2.skipCount == 1);
+}
+
 EACOPY_TEST(ServerCopyLink)
 {
 	createTestFile(L"Foo.txt", 10);
@@ -1519,6 +2239,34 @@ EACOPY_TEST(ServerCopyByHash)
 	EACOPY_ASSERT(clientStats3.skipCount == 1);
 }
 
+EACOPY_TEST(ServerCopyByHashMd5)
+{
+	createTestFile(L"Foo.txt", 10);
+
+	ServerSettings serverSettings(getDefaultServerSettings());
+	serverSettings.useHash = true;
+	serverSettings.hashAlgorithm = HashAlgorithm_Md5;
+	TestServer server(serverSettings, serverLog);
+	server.waitReady();
+
+	ClientSettings clientSettings(getDefaultClientSettings());
+	clientSettings.useServer = UseServer_Required;
+	Client client(clientSettings);
+
+	ClientStats clientStats1;
+	clientSettings.destDirectory = testDestDir + L"1\\";
+	EACOPY_ASSERT(client.process(clientLog, clientStats1) == 0);
+	EACOPY_ASSERT(clientStats1.copyCount == 1);
+
+	deleteFile((testSourceDir + L"\\Foo.txt").c_str(), ioStats);
+	createTestFile(L"Foo.txt", 10);
+
+	ClientStats clientStats2;
+	clientSettings.destDirectory = testDestDir + L"2\\";
+	EACOPY_ASSERT(client.process(clientLog, clientStats2) == 0);
+	EACOPY_ASSERT(clientStats2.linkCount == 1);
+}
+
 EACOPY_TEST(ServerCopySameDest)
 {
 	createTestFile(L"Foo.txt", 10);
@@ -1662,6 +2410,92 @@ EACOPY_TEST(ServerPurgeWithNoCopy)
 	EACOPY_ASSERT(getTestFileExists(L"SourceDir2") == false);
 }
 
+EACOPY_TEST(ServerPurgeInParallel)
+{
+	createTestFile(L"Foo.txt", 10);
+	createTestFile(L"A\\Foo.txt", 10);
+	createTestFile(L"A\\B\\Foo.txt", 10);
+	createTestFile(L"Bar.txt", 10, false);
+	createTestFile(L"A\\Bar.txt", 10, false);
+	createTestFile(L"A\\B\\Bar.txt", 10, false);
+	createTestFile(L"A\\B\\C\\Bar.txt", 10, false);
+	createTestFile(L"DestDir\\Boo.txt", 10, false);
+
+	ServerSettings serverSettings(getDefaultServerSettings());
+	TestServer server(serverSettings, serverLog);
+	server.waitReady();
+
+	ClientSettings clientSettings(getDefaultClientSettings());
+	clientSettings.copySubdirDepth = 3;
+	clientSettings.threadCount = 4;
+	clientSettings.purgeDestination = true;
+	clientSettings.useServer = UseServer_Required;
+	Client client(clientSettings);
+
+	ClientStats clientStats;
+	EACOPY_ASSERT(client.process(clientLog, clientStats) == 0);
+	EACOPY_ASSERT(getTestFileExists(L"Foo.txt") == true);
+	EACOPY_ASSERT(getTestFileExists(L"A\\Foo.txt") == true);
+	EACOPY_ASSERT(getTestFileExists(L"A\\B\\Foo.txt") == true);
+	EACOPY_ASSERT(getTestFileExists(L"Bar.txt") == false);
+	EACOPY_ASSERT(getTestFileExists(L"A\\Bar.txt") == false);
+	EACOPY_ASSERT(getTestFileExists(L"A\\B\\Bar.txt") == false);
+	EACOPY_ASSERT(getTestFileExists(L"A\\B\\C") == false);
+	EACOPY_ASSERT(getTestFileExists(L"DestDir") == false);
+	EACOPY_ASSERT(clientStats.purgeCount == 5);
+	EACOPY_ASSERT(clientStats.netDeletePathsCount == 3); // One command per purged directory
+}
+
+EACOPY_TEST(CopyFanOut)
+{
+	createTestFile(L"Foo.txt", 10);
+	createTestFile(L"A\\Bar.txt", 3*1024*1024 + 123);
+	createTestFile(L"FanOut\\Boo.txt", 10, false);
+
+	ClientSettings clientSettings(getDefaultClientSettings());
+	clientSettings.destDirectory = testDestDir + L"Main\\";
+	clientSettings.fanOutDirectories.push_back(testDestDir + L"FanOut\\");
+	clientSettings.copySubdirDepth = 1;
+	clientSettings.threadCount = 4;
+	clientSettings.purgeDestination = true;
+	Client client(clientSettings);
+
+	EACOPY_ASSERT(client.process(clientLog) == 0);
+	for (const wchar_t* dir : { L"Main\\", L"FanOut\\" })
+	{
+		EACOPY_ASSERT(isEqual((testSourceDir + L"Foo.txt").c_str(), (testDestDir + dir + L"Foo.txt").c_str()));
+		EACOPY_ASSERT(isEqual((testSourceDir + L"A\\Bar.txt").c_str(), (testDestDir + dir + L"A\\Bar.txt").c_str()));
+	}
+	EACOPY_ASSERT(getTestFileExists(L"FanOut\\Boo.txt") == false);
+}
+
+EACOPY_TEST(ServerFanOutCompressed)
+{
+	createTestFile(L"Foo.txt", 10);
+	createTestFile(L"A\\Bar.txt", 3*1024*1024 + 123);
+
+	ServerSettings serverSettings(getDefaultServerSettings());
+	TestServer server(serverSettings, serverLog);
+	server.waitReady();
+
+	ClientSettings clientSettings(getDefaultClientSettings());
+	clientSettings.destDirectory = testDestDir + L"Main\\";
+	clientSettings.fanOutDirectories.push_back(testDestDir + L"FanOut\\");
+	clientSettings.copySubdirDepth = 1;
+	clientSettings.compressionLevel = 3;
+	clientSettings.useServer = UseServer_Required;
+	Client client(clientSettings);
+
+	ClientStats clientStats;
+	EACOPY_ASSERT(client.process(clientLog, clientStats) == 0);
+	for (const wchar_t* dir : { L"Main\\", L"FanOut\\" })
+	{
+		EACOPY_ASSERT(isEqual((testSourceDir + L"Foo.txt").c_str(), (testDestDir + dir + L"Foo.txt").c_str()));
+		EACOPY_ASSERT(isEqual((testSourceDir + L"A\\Bar.txt").c_str(), (testDestDir + dir + L"A\\Bar.txt").c_str()));
+	}
+	EACOPY_ASSERT(clientStats.copyCount == 4);
+}
+
 EACOPY_TEST(ServerReport)
 {
 	ServerSettings serverSettings(getDefaultServerSettings());